@@ -30,6 +30,7 @@
 #import "OOMaths.h"
 #import "NSImage+FloatPixMap.h"
 #include "PTPowerManagement.h"
+#include "PlanetToolScheduler.h"
 
 
 @interface PlanetToolDocument () <PlanetToolRendererDelegate>
@@ -86,6 +87,7 @@ static void LoadProgressHandler(float proportion, void *context);
 + (void) initialize
 {
 	FPMInit();
+	SchedulerInit();
 }
 
 
@@ -198,6 +198,7 @@ static void ErrorCB(const char *message, void *context);
 {
 	SphericalPixelSinkFunction					sink = NULL;
 	SphericalPixelSourceFunction				source = NULL;
+	SphericalPixelBatchSourceFunction			batchSource = NULL;
 	void										*sourceContext = NULL;
 	RenderFlags									flags = 0;
 	
@@ -234,7 +235,7 @@ static void ErrorCB(const char *message, void *context);
 	if (self.fast)  flags |= kRenderFast;
 	if (self.jitter)  flags |= kRenderJitter;
 	
-	if (!sourceConstructor(_sourcePixMap, flags, &source, &sourceContext))
+	if (!sourceConstructor(_sourcePixMap, flags, &source, &batchSource, &sourceContext))
 	{
 		[self failRenderWithMessage:NSLocalizedString(@"Internal error: failed to set up render source.", NULL)];
 		FPMRelease(&_sourcePixMap);
@@ -245,7 +246,7 @@ static void ErrorCB(const char *message, void *context);
 	if (!OOMatrixIsIdentity(transform))
 	{
 		void *transformContext = NULL;
-		if (!MatrixTransformerSetUp(source, sourceDestructor, sourceContext, transform, &transformContext))
+		if (!MatrixTransformerSetUp(source, batchSource, sourceDestructor, sourceContext, transform, &transformContext))
 		{
 			[self failRenderWithMessage:NSLocalizedString(@"Internal error: failed to set up transformation matrix.", NULL)];
 			FPMRelease(&_sourcePixMap);
@@ -253,6 +254,7 @@ static void ErrorCB(const char *message, void *context);
 		}
 		
 		source = MatrixTransformer;
+		batchSource = MatrixTransformerBatch;
 		sourceDestructor = MatrixTransformerDestructor;
 		sourceContext = transformContext;
 	}
@@ -261,7 +263,7 @@ static void ErrorCB(const char *message, void *context);
 	_hadError = NO;
 	_cancel = NO;
 	
-	FloatPixMapRef result = sink(self.outputSize, flags, source, sourceContext, ProgressCB, ErrorCB, self);
+	FloatPixMapRef result = sink(self.outputSize, flags, NULL, source, batchSource, sourceContext, ProgressCB, ErrorCB, self);
 	if (sourceDestructor != NULL)  sourceDestructor(sourceContext);
 	
 	FPMRelease(&_sourcePixMap);
@@ -0,0 +1,514 @@
+/*
+	CoordsBatch.c
+	planettool
+	
+	
+	Copyright © 2013 Jens Ayton
+
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include "CoordsBatch.h"
+#include "FPMVector.h"
+#include <float.h>
+#include <assert.h>
+
+
+#ifndef COORDS_BATCH_AVX2
+#if FPM_USE_SSE2 && (__GNUC__ >= 5 || __clang__)
+#define COORDS_BATCH_AVX2		1
+#else
+#define COORDS_BATCH_AVX2		0
+#endif
+#endif
+
+#if COORDS_BATCH_AVX2
+#include <immintrin.h>
+#endif
+
+
+/*	Minimax polynomial for atan(t) on [0, 1], in terms of t² (as used by
+	SLEEF). Maximum error 2e-7 radians before the quadrant adjustments.
+*/
+FPM_INLINE float ATanPoly(float t) FPM_CONST;
+FPM_INLINE float ATanPoly(float t)
+{
+	float u = t * t;
+	float p = 0.00282363896258175373077393f;
+	p = p * u - 0.0159569028764963150024414f;
+	p = p * u + 0.0425049886107444763183594f;
+	p = p * u - 0.0748900920152664184570312f;
+	p = p * u + 0.106347933411598205566406f;
+	p = p * u - 0.142027363181114196777344f;
+	p = p * u + 0.199926957488059997558594f;
+	p = p * u - 0.333331018686294555664062f;
+	return t + t * u * p;
+}
+
+
+/*	Branch-free atan2(y, x). Returns 0 for (0, 0), like VectorToCoordsRad()
+	does at the poles.
+*/
+FPM_INLINE float ATan2Approx(float y, float x) FPM_CONST;
+FPM_INLINE float ATan2Approx(float y, float x)
+{
+	float ax = fabsf(x);
+	float ay = fabsf(y);
+	float mx = fmaxf(ax, ay);
+	float mn = fminf(ax, ay);
+	
+	float r = ATanPoly(mn / fmaxf(mx, FLT_MIN));
+	r = (ay > ax) ? (kPiF * 0.5f - r) : r;
+	r = (x < 0.0f) ? (kPiF - r) : r;
+	return (y < 0.0f) ? -r : r;
+}
+
+
+/*	Branch-free sine and cosine: reduce to [-π/4, π/4] by quadrant, then use
+	the Cephes single-precision polynomials.
+*/
+FPM_INLINE void SinCosApprox(float a, float *outSin, float *outCos)
+{
+	float fq = a * (2.0f / kPiF);
+	int32_t q = (int32_t)(fq + ((fq < 0.0f) ? -0.5f : 0.5f));
+	float fqi = (float)q;
+	
+	// Cody-Waite reduction.
+	float r = a - fqi * 1.5703125f;
+	r = r - fqi * 4.837512969970703125e-4f;
+	r = r - fqi * 7.549789948768648e-8f;
+	
+	float z = r * r;
+	float s = -1.9515295891e-4f;
+	s = s * z + 8.3321608736e-3f;
+	s = s * z - 1.6666654611e-1f;
+	s = s * z * r + r;
+	
+	float c = 2.443315711809948e-5f;
+	c = c * z - 1.388731625493765e-3f;
+	c = c * z + 4.166664568298827e-2f;
+	c = c * z * z - 0.5f * z + 1.0f;
+	
+	bool swap = (q & 1) != 0;
+	float sr = swap ? c : s;
+	float cr = swap ? s : c;
+	*outSin = (q & 2) ? -sr : sr;
+	*outCos = ((q + 1) & 2) ? -cr : cr;
+}
+
+
+FPM_INLINE void VectorsToCoordsRadBody(const float *restrict x, const float *restrict y, const float *restrict z, float *restrict latitude, float *restrict longitude, size_t count)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		float xi = x[i], yi = y[i], zi = z[i];
+		float h = sqrtf(xi * xi + zi * zi);
+		latitude[i] = ATan2Approx(yi, h);
+		longitude[i] = ATan2Approx(xi, zi);
+	}
+}
+
+
+FPM_INLINE void VectorsFromCoordsRadBody(const float *restrict latitude, const float *restrict longitude, float *restrict x, float *restrict y, float *restrict z, size_t count)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		float las, lac, los, loc;
+		SinCosApprox(latitude[i], &las, &lac);
+		SinCosApprox(longitude[i], &los, &loc);
+		x[i] = los * lac;
+		y[i] = las;
+		z[i] = loc * lac;
+	}
+}
+
+
+/*	SSE2 and AVX2 kernels. These do the same arithmetic as the scalar
+	functions above, in the same order, four or eight lanes at a time, with
+	the selections done by masks; any remainder is converted by the scalar
+	loops. FMA is not used, so the AVX2 kernels round as the SSE2 ones do.
+*/
+#if FPM_USE_SSE2
+
+FPM_INLINE __m128 SelectSSE2(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+
+FPM_INLINE __m128 ATanPolySSE2(__m128 t)
+{
+	__m128 u = _mm_mul_ps(t, t);
+	__m128 p = _mm_set1_ps(0.00282363896258175373077393f);
+	p = _mm_sub_ps(_mm_mul_ps(p, u), _mm_set1_ps(0.0159569028764963150024414f));
+	p = _mm_add_ps(_mm_mul_ps(p, u), _mm_set1_ps(0.0425049886107444763183594f));
+	p = _mm_sub_ps(_mm_mul_ps(p, u), _mm_set1_ps(0.0748900920152664184570312f));
+	p = _mm_add_ps(_mm_mul_ps(p, u), _mm_set1_ps(0.106347933411598205566406f));
+	p = _mm_sub_ps(_mm_mul_ps(p, u), _mm_set1_ps(0.142027363181114196777344f));
+	p = _mm_add_ps(_mm_mul_ps(p, u), _mm_set1_ps(0.199926957488059997558594f));
+	p = _mm_sub_ps(_mm_mul_ps(p, u), _mm_set1_ps(0.333331018686294555664062f));
+	return _mm_add_ps(t, _mm_mul_ps(_mm_mul_ps(t, u), p));
+}
+
+
+FPM_INLINE __m128 ATan2SSE2(__m128 y, __m128 x)
+{
+	__m128 signBit = _mm_set1_ps(-0.0f);
+	__m128 zero = _mm_setzero_ps();
+	__m128 ax = _mm_andnot_ps(signBit, x);
+	__m128 ay = _mm_andnot_ps(signBit, y);
+	__m128 mx = _mm_max_ps(ax, ay);
+	__m128 mn = _mm_min_ps(ax, ay);
+	
+	__m128 r = ATanPolySSE2(_mm_div_ps(mn, _mm_max_ps(mx, _mm_set1_ps(FLT_MIN))));
+	r = SelectSSE2(_mm_cmpgt_ps(ay, ax), _mm_sub_ps(_mm_set1_ps(kPiF * 0.5f), r), r);
+	r = SelectSSE2(_mm_cmplt_ps(x, zero), _mm_sub_ps(_mm_set1_ps(kPiF), r), r);
+	return _mm_xor_ps(r, _mm_and_ps(_mm_cmplt_ps(y, zero), signBit));
+}
+
+
+FPM_INLINE void SinCosSSE2(__m128 a, __m128 *outSin, __m128 *outCos)
+{
+	__m128 signBit = _mm_set1_ps(-0.0f);
+	__m128 fq = _mm_mul_ps(a, _mm_set1_ps(2.0f / kPiF));
+	__m128 half = _mm_or_ps(_mm_set1_ps(0.5f), _mm_and_ps(_mm_cmplt_ps(fq, _mm_setzero_ps()), signBit));
+	__m128i q = _mm_cvttps_epi32(_mm_add_ps(fq, half));
+	__m128 fqi = _mm_cvtepi32_ps(q);
+	
+	__m128 r = _mm_sub_ps(a, _mm_mul_ps(fqi, _mm_set1_ps(1.5703125f)));
+	r = _mm_sub_ps(r, _mm_mul_ps(fqi, _mm_set1_ps(4.837512969970703125e-4f)));
+	r = _mm_sub_ps(r, _mm_mul_ps(fqi, _mm_set1_ps(7.549789948768648e-8f)));
+	
+	__m128 z = _mm_mul_ps(r, r);
+	__m128 s = _mm_set1_ps(-1.9515295891e-4f);
+	s = _mm_add_ps(_mm_mul_ps(s, z), _mm_set1_ps(8.3321608736e-3f));
+	s = _mm_sub_ps(_mm_mul_ps(s, z), _mm_set1_ps(1.6666654611e-1f));
+	s = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(s, z), r), r);
+	
+	__m128 c = _mm_set1_ps(2.443315711809948e-5f);
+	c = _mm_sub_ps(_mm_mul_ps(c, z), _mm_set1_ps(1.388731625493765e-3f));
+	c = _mm_add_ps(_mm_mul_ps(c, z), _mm_set1_ps(4.166664568298827e-2f));
+	c = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_mul_ps(c, z), z), _mm_mul_ps(_mm_set1_ps(0.5f), z)), _mm_set1_ps(1.0f));
+	
+	__m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2);
+	__m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, one), one));
+	__m128 sr = SelectSSE2(swap, c, s);
+	__m128 cr = SelectSSE2(swap, s, c);
+	*outSin = _mm_xor_ps(sr, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, two), 30)));
+	*outCos = _mm_xor_ps(cr, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(q, one), two), 30)));
+}
+
+
+static size_t VectorsToCoordsRadSSE2(const float *x, const float *y, const float *z, float *latitude, float *longitude, size_t count)
+{
+	size_t i;
+	for (i = 0; i + 4 <= count; i += 4)
+	{
+		__m128 xv = _mm_loadu_ps(x + i), yv = _mm_loadu_ps(y + i), zv = _mm_loadu_ps(z + i);
+		__m128 h = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(xv, xv), _mm_mul_ps(zv, zv)));
+		_mm_storeu_ps(latitude + i, ATan2SSE2(yv, h));
+		_mm_storeu_ps(longitude + i, ATan2SSE2(xv, zv));
+	}
+	return i;
+}
+
+
+static size_t VectorsFromCoordsRadSSE2(const float *latitude, const float *longitude, float *x, float *y, float *z, size_t count)
+{
+	size_t i;
+	for (i = 0; i + 4 <= count; i += 4)
+	{
+		__m128 las, lac, los, loc;
+		SinCosSSE2(_mm_loadu_ps(latitude + i), &las, &lac);
+		SinCosSSE2(_mm_loadu_ps(longitude + i), &los, &loc);
+		_mm_storeu_ps(x + i, _mm_mul_ps(los, lac));
+		_mm_storeu_ps(y + i, las);
+		_mm_storeu_ps(z + i, _mm_mul_ps(loc, lac));
+	}
+	return i;
+}
+
+#endif	/* FPM_USE_SSE2 */
+
+
+#if COORDS_BATCH_AVX2
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+static inline __m256 SelectAVX2(__m256 mask, __m256 a, __m256 b) AVX2_TARGET;
+static inline __m256 SelectAVX2(__m256 mask, __m256 a, __m256 b)
+{
+	return _mm256_blendv_ps(b, a, mask);
+}
+
+
+static inline __m256 ATanPolyAVX2(__m256 t) AVX2_TARGET;
+static inline __m256 ATanPolyAVX2(__m256 t)
+{
+	__m256 u = _mm256_mul_ps(t, t);
+	__m256 p = _mm256_set1_ps(0.00282363896258175373077393f);
+	p = _mm256_sub_ps(_mm256_mul_ps(p, u), _mm256_set1_ps(0.0159569028764963150024414f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, u), _mm256_set1_ps(0.0425049886107444763183594f));
+	p = _mm256_sub_ps(_mm256_mul_ps(p, u), _mm256_set1_ps(0.0748900920152664184570312f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, u), _mm256_set1_ps(0.106347933411598205566406f));
+	p = _mm256_sub_ps(_mm256_mul_ps(p, u), _mm256_set1_ps(0.142027363181114196777344f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, u), _mm256_set1_ps(0.199926957488059997558594f));
+	p = _mm256_sub_ps(_mm256_mul_ps(p, u), _mm256_set1_ps(0.333331018686294555664062f));
+	return _mm256_add_ps(t, _mm256_mul_ps(_mm256_mul_ps(t, u), p));
+}
+
+
+static inline __m256 ATan2AVX2(__m256 y, __m256 x) AVX2_TARGET;
+static inline __m256 ATan2AVX2(__m256 y, __m256 x)
+{
+	__m256 signBit = _mm256_set1_ps(-0.0f);
+	__m256 zero = _mm256_setzero_ps();
+	__m256 ax = _mm256_andnot_ps(signBit, x);
+	__m256 ay = _mm256_andnot_ps(signBit, y);
+	__m256 mx = _mm256_max_ps(ax, ay);
+	__m256 mn = _mm256_min_ps(ax, ay);
+	
+	__m256 r = ATanPolyAVX2(_mm256_div_ps(mn, _mm256_max_ps(mx, _mm256_set1_ps(FLT_MIN))));
+	r = SelectAVX2(_mm256_cmp_ps(ay, ax, _CMP_GT_OQ), _mm256_sub_ps(_mm256_set1_ps(kPiF * 0.5f), r), r);
+	r = SelectAVX2(_mm256_cmp_ps(x, zero, _CMP_LT_OQ), _mm256_sub_ps(_mm256_set1_ps(kPiF), r), r);
+	return _mm256_xor_ps(r, _mm256_and_ps(_mm256_cmp_ps(y, zero, _CMP_LT_OQ), signBit));
+}
+
+
+static inline void SinCosAVX2(__m256 a, __m256 *outSin, __m256 *outCos) AVX2_TARGET;
+static inline void SinCosAVX2(__m256 a, __m256 *outSin, __m256 *outCos)
+{
+	__m256 signBit = _mm256_set1_ps(-0.0f);
+	__m256 fq = _mm256_mul_ps(a, _mm256_set1_ps(2.0f / kPiF));
+	__m256 half = _mm256_or_ps(_mm256_set1_ps(0.5f), _mm256_and_ps(_mm256_cmp_ps(fq, _mm256_setzero_ps(), _CMP_LT_OQ), signBit));
+	__m256i q = _mm256_cvttps_epi32(_mm256_add_ps(fq, half));
+	__m256 fqi = _mm256_cvtepi32_ps(q);
+	
+	__m256 r = _mm256_sub_ps(a, _mm256_mul_ps(fqi, _mm256_set1_ps(1.5703125f)));
+	r = _mm256_sub_ps(r, _mm256_mul_ps(fqi, _mm256_set1_ps(4.837512969970703125e-4f)));
+	r = _mm256_sub_ps(r, _mm256_mul_ps(fqi, _mm256_set1_ps(7.549789948768648e-8f)));
+	
+	__m256 z = _mm256_mul_ps(r, r);
+	__m256 s = _mm256_set1_ps(-1.9515295891e-4f);
+	s = _mm256_add_ps(_mm256_mul_ps(s, z), _mm256_set1_ps(8.3321608736e-3f));
+	s = _mm256_sub_ps(_mm256_mul_ps(s, z), _mm256_set1_ps(1.6666654611e-1f));
+	s = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(s, z), r), r);
+	
+	__m256 c = _mm256_set1_ps(2.443315711809948e-5f);
+	c = _mm256_sub_ps(_mm256_mul_ps(c, z), _mm256_set1_ps(1.388731625493765e-3f));
+	c = _mm256_add_ps(_mm256_mul_ps(c, z), _mm256_set1_ps(4.166664568298827e-2f));
+	c = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(c, z), z), _mm256_mul_ps(_mm256_set1_ps(0.5f), z)), _mm256_set1_ps(1.0f));
+	
+	__m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+	__m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(q, one), one));
+	__m256 sr = SelectAVX2(swap, c, s);
+	__m256 cr = SelectAVX2(swap, s, c);
+	*outSin = _mm256_xor_ps(sr, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(q, two), 30)));
+	*outCos = _mm256_xor_ps(cr, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(q, one), two), 30)));
+}
+
+
+static size_t VectorsToCoordsRadAVX2(const float *x, const float *y, const float *z, float *latitude, float *longitude, size_t count) AVX2_TARGET;
+static size_t VectorsToCoordsRadAVX2(const float *x, const float *y, const float *z, float *latitude, float *longitude, size_t count)
+{
+	size_t i;
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		__m256 xv = _mm256_loadu_ps(x + i), yv = _mm256_loadu_ps(y + i), zv = _mm256_loadu_ps(z + i);
+		__m256 h = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(xv, xv), _mm256_mul_ps(zv, zv)));
+		_mm256_storeu_ps(latitude + i, ATan2AVX2(yv, h));
+		_mm256_storeu_ps(longitude + i, ATan2AVX2(xv, zv));
+	}
+	return i;
+}
+
+
+static size_t VectorsFromCoordsRadAVX2(const float *latitude, const float *longitude, float *x, float *y, float *z, size_t count) AVX2_TARGET;
+static size_t VectorsFromCoordsRadAVX2(const float *latitude, const float *longitude, float *x, float *y, float *z, size_t count)
+{
+	size_t i;
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		__m256 las, lac, los, loc;
+		SinCosAVX2(_mm256_loadu_ps(latitude + i), &las, &lac);
+		SinCosAVX2(_mm256_loadu_ps(longitude + i), &los, &loc);
+		_mm256_storeu_ps(x + i, _mm256_mul_ps(los, lac));
+		_mm256_storeu_ps(y + i, las);
+		_mm256_storeu_ps(z + i, _mm256_mul_ps(loc, lac));
+	}
+	return i;
+}
+
+
+FPM_INLINE bool HaveAVX2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif	/* COORDS_BATCH_AVX2 */
+
+
+void VectorsToCoordsRad(const float *x, const float *y, const float *z, float *latitude, float *longitude, size_t count)
+{
+	assert(count == 0 || (x != NULL && y != NULL && z != NULL && latitude != NULL && longitude != NULL));
+	size_t done = 0;
+	
+#if COORDS_BATCH_AVX2
+	if (HaveAVX2())  done = VectorsToCoordsRadAVX2(x, y, z, latitude, longitude, count);
+#endif
+#if FPM_USE_SSE2
+	done += VectorsToCoordsRadSSE2(x + done, y + done, z + done, latitude + done, longitude + done, count - done);
+#endif
+	
+	VectorsToCoordsRadBody(x + done, y + done, z + done, latitude + done, longitude + done, count - done);
+}
+
+
+void VectorsFromCoordsRad(const float *latitude, const float *longitude, float *x, float *y, float *z, size_t count)
+{
+	assert(count == 0 || (x != NULL && y != NULL && z != NULL && latitude != NULL && longitude != NULL));
+	size_t done = 0;
+	
+#if COORDS_BATCH_AVX2
+	if (HaveAVX2())  done = VectorsFromCoordsRadAVX2(latitude, longitude, x, y, z, count);
+#endif
+#if FPM_USE_SSE2
+	done += VectorsFromCoordsRadSSE2(latitude + done, longitude + done, x + done, y + done, z + done, count - done);
+#endif
+	
+	VectorsFromCoordsRadBody(latitude + done, longitude + done, x + done, y + done, z + done, count - done);
+}
+
+
+void CoordsGetLatLongRadBatch(const Coordinates *coords, float *latitude, float *longitude, size_t count)
+{
+	float x[kMaxSourceBatchSize], y[kMaxSourceBatchSize], z[kMaxSourceBatchSize];
+	float lat[kMaxSourceBatchSize], lon[kMaxSourceBatchSize];
+	size_t index[kMaxSourceBatchSize];
+	
+	while (count != 0)
+	{
+		size_t i, vectorCount = 0, chunk = count < kMaxSourceBatchSize ? count : kMaxSourceBatchSize;
+		
+		for (i = 0; i < chunk; i++)
+		{
+			Coordinates c = coords[i];
+			switch (c.type)
+			{
+				case kCoordsVector:
+					x[vectorCount] = c.d.v.x;
+					y[vectorCount] = c.d.v.y;
+					z[vectorCount] = c.d.v.z;
+					index[vectorCount++] = i;
+					break;
+					
+				case kCoordsLLRad:
+					latitude[i] = c.d.l.lat;
+					longitude[i] = c.d.l.lon;
+					break;
+					
+				case kCoordsLLDeg:
+					latitude[i] = c.d.l.lat * kDegToRad;
+					longitude[i] = c.d.l.lon * kDegToRad;
+					break;
+			}
+		}
+		
+		if (vectorCount == chunk)
+		{
+			// Common case: all vectors, no scattering required.
+			VectorsToCoordsRad(x, y, z, latitude, longitude, chunk);
+		}
+		else if (vectorCount != 0)
+		{
+			VectorsToCoordsRad(x, y, z, lat, lon, vectorCount);
+			for (i = 0; i < vectorCount; i++)
+			{
+				latitude[index[i]] = lat[i];
+				longitude[index[i]] = lon[i];
+			}
+		}
+		
+		coords += chunk;
+		latitude += chunk;
+		longitude += chunk;
+		count -= chunk;
+	}
+}
+
+
+void CoordsGetVectorBatch(const Coordinates *coords, float *x, float *y, float *z, size_t count)
+{
+	float lat[kMaxSourceBatchSize], lon[kMaxSourceBatchSize];
+	float vx[kMaxSourceBatchSize], vy[kMaxSourceBatchSize], vz[kMaxSourceBatchSize];
+	size_t index[kMaxSourceBatchSize];
+	
+	while (count != 0)
+	{
+		size_t i, llCount = 0, chunk = count < kMaxSourceBatchSize ? count : kMaxSourceBatchSize;
+		
+		for (i = 0; i < chunk; i++)
+		{
+			Coordinates c = coords[i];
+			switch (c.type)
+			{
+				case kCoordsVector:
+					x[i] = c.d.v.x;
+					y[i] = c.d.v.y;
+					z[i] = c.d.v.z;
+					break;
+					
+				case kCoordsLLRad:
+					lat[llCount] = c.d.l.lat;
+					lon[llCount] = c.d.l.lon;
+					index[llCount++] = i;
+					break;
+					
+				case kCoordsLLDeg:
+					lat[llCount] = c.d.l.lat * kDegToRad;
+					lon[llCount] = c.d.l.lon * kDegToRad;
+					index[llCount++] = i;
+					break;
+			}
+		}
+		
+		if (llCount == chunk)
+		{
+			VectorsFromCoordsRad(lat, lon, x, y, z, chunk);
+		}
+		else if (llCount != 0)
+		{
+			VectorsFromCoordsRad(lat, lon, vx, vy, vz, llCount);
+			for (i = 0; i < llCount; i++)
+			{
+				x[index[i]] = vx[i];
+				y[index[i]] = vy[i];
+				z[index[i]] = vz[i];
+			}
+		}
+		
+		coords += chunk;
+		x += chunk;
+		y += chunk;
+		z += chunk;
+		count -= chunk;
+	}
+}
@@ -0,0 +1,79 @@
+/*
+	CoordsBatch.h
+	planettool
+	
+	Structure-of-arrays conversions between vectors and latitude/longitude,
+	for use by batched sources.
+	
+	These use polynomial approximations of atan2, sin and cos instead of the
+	C library functions, with explicit SSE2 kernels working on four lanes at
+	a time, and AVX2 kernels working on eight, chosen at runtime on
+	processors which support AVX2. Other processors use the scalar code.
+	
+	Accuracy, measured against double-precision libm over the full sphere
+	(tests/CoordsBatchTest.c checks these):
+	  VectorsToCoordsRad:    maximum error 3e-7 radians in latitude and
+	                         4e-7 radians in longitude (under 0.001 pixels
+	                         at 16384 pixels across a latlong map).
+	  VectorsFromCoordsRad:  maximum error 2.5e-7 in each vector component,
+	                         for input angles in [-2π, 2π].
+	The scalar VectorToCoordsRad() and VectorFromCoordsRad() may therefore
+	give slightly different results for the same input. Near the poles, the
+	scalar VectorToCoordsRad(), which works through asin, is the less
+	accurate of the two, by up to about 3e-4 radians in longitude.
+	
+	
+	Copyright © 2013 Jens Ayton
+
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef INCLUDED_CoordsBatch_h
+#define INCLUDED_CoordsBatch_h
+
+#include "SphericalPixelSource.h"
+
+FPM_BEGIN_EXTERN_C
+
+
+/*	VectorsToCoordsRad()
+	Convert count vectors (x[i], y[i], z[i]) to latitude and longitude in
+	radians. Vectors need not be normalized. As with VectorToCoordsRad(),
+	longitude is in [-π, π] and is 0 at the poles.
+*/
+void VectorsToCoordsRad(const float *x, const float *y, const float *z, float *latitude, float *longitude, size_t count);
+
+/*	VectorsFromCoordsRad()
+	Convert count latitude/longitude pairs in radians to unit vectors.
+*/
+void VectorsFromCoordsRad(const float *latitude, const float *longitude, float *x, float *y, float *z, size_t count);
+
+
+/*	CoordsGetLatLongRadBatch()
+	CoordsGetVectorBatch()
+	Batch equivalents of CoordsGetLatLongRad() and CoordsGetVector(). The
+	coordinates may be of mixed types; those which need conversion are
+	converted with the functions above.
+*/
+void CoordsGetLatLongRadBatch(const Coordinates *coords, float *latitude, float *longitude, size_t count);
+void CoordsGetVectorBatch(const Coordinates *coords, float *x, float *y, float *z, size_t count);
+
+
+FPM_END_EXTERN_C
+#endif	/* INCLUDED_CoordsBatch_h */
@@ -30,6 +30,7 @@
 typedef struct
 {
 	SphericalPixelSourceFunction			source;
+	SphericalPixelBatchSourceFunction		batchSource;
 	SphericalPixelSourceDestructorFunction	sourceDestructor;
 	void									*sourceContext;
 	FPMDimension							size;
@@ -38,7 +39,7 @@ typedef struct
 } CosineBlurFilterContext;
 
 
-bool CosineBlurFilterSetUp(SphericalPixelSourceFunction source, SphericalPixelSourceDestructorFunction sourceDestructor, void *sourceContext, FPMDimension size, float unmaskedScale, float maskedScale, void **context)
+bool CosineBlurFilterSetUp(SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, SphericalPixelSourceDestructorFunction sourceDestructor, void *sourceContext, FPMDimension size, float unmaskedScale, float maskedScale, void **context)
 {
 	assert(source != NULL && context != NULL);
 	
@@ -46,6 +47,7 @@ bool CosineBlurFilterSetUp(SphericalPixelSourceFunction source, SphericalPixelSo
 	if (cx == NULL)  return false;
 	
 	cx->source = source;
+	cx->batchSource = batchSource;
 	cx->sourceDestructor = sourceDestructor;
 	cx->sourceContext = sourceContext;
 	cx->size = size;
@@ -79,16 +81,46 @@ static bool IsValidColor(FPMColor c)
 }
 
 
+static void AccumulateSamples(const FPMColor *colors, const float *weights, size_t count, CosineBlurFilterContext *context, FPMColor *colorAccum, float *weightAccum)
+{
+	float scaleBias = context->scaleBias;
+	float scaleOffset = context->scaleOffset;
+	
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		FPMColor color = colors[i];
+		if (!IsValidColor(color))
+		{
+			continue;
+		}
+		float weight = weights[i];
+		float localWeight = (scaleBias + color.a * scaleOffset);
+		color = FPMColorMultiply(color, weight * localWeight);
+		
+		*colorAccum = FPMColorAdd(*colorAccum, color);
+		*weightAccum += weight;
+	}
+}
+
+
 static void SampleFace(Vector outV, Vector xv, Vector yv, Vector zv, CosineBlurFilterContext *context, RenderFlags flags, FPMColor *colorAccum, float *weightAccum)
 {
 	assert(colorAccum != NULL && weightAccum != NULL);
 	
 	FPMDimension size = context->size;
-	float scaleBias = context->scaleBias;
-	float scaleOffset = context->scaleOffset;
 	
 	float incr = 2.0f / size;
 	
+	/*	Samples with positive weight are gathered into batches, which are
+		flushed whenever they fill up and at the end of each face. The
+		accumulation order is the same as sampling one at a time.
+	*/
+	Coordinates coords[kMaxSourceBatchSize];
+	FPMColor colors[kMaxSourceBatchSize];
+	float weights[kMaxSourceBatchSize];
+	size_t count = 0;
+	
 	FPMDimension x, y;
 	for (y = 0; y < size; y++)
 	{
@@ -102,18 +134,22 @@ static void SampleFace(Vector outV, Vector xv, Vector yv, Vector zv, CosineBlurF
 			float weight = dot_product(v, outV);
 			if (weight <= 0.0f)  continue;
 			
-			FPMColor color = context->source(MakeCoordsVector(v), flags, context->sourceContext);
-			if (!IsValidColor(color))
+			coords[count] = CoordsWithFootprint(MakeCoordsVector(v), CubeFaceSampleFootprint(fx, fy, incr));
+			weights[count] = weight;
+			if (++count == kMaxSourceBatchSize)
 			{
-				continue;
+				SampleSourceBatch(context->source, context->batchSource, context->sourceContext, coords, colors, count, flags);
+				AccumulateSamples(colors, weights, count, context, colorAccum, weightAccum);
+				count = 0;
 			}
-			float localWeight = (scaleBias + color.a * scaleOffset);
-			color = FPMColorMultiply(color, weight * localWeight);
-			
-			*colorAccum = FPMColorAdd(*colorAccum, color);
-			*weightAccum += weight;
 		}
 	}
+	
+	if (count != 0)
+	{
+		SampleSourceBatch(context->source, context->batchSource, context->sourceContext, coords, colors, count, flags);
+		AccumulateSamples(colors, weights, count, context, colorAccum, weightAccum);
+	}
 }
 
 
@@ -138,3 +174,13 @@ FPMColor CosineBlurFilter(Coordinates where, RenderFlags flags, void *context)
 	
 	return colorAccum;
 }
+
+
+void CosineBlurFilterBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		colors[i] = CosineBlurFilter(where[i], flags, context);
+	}
+}
@@ -42,7 +42,8 @@
 #include "SphericalPixelSource.h"
 
 
-bool CosineBlurFilterSetUp(SphericalPixelSourceFunction source, SphericalPixelSourceDestructorFunction sourceDestructor, void *sourceContext, FPMDimension size, float unmaskedScale, float maskedScale, void **context);
+bool CosineBlurFilterSetUp(SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, SphericalPixelSourceDestructorFunction sourceDestructor, void *sourceContext, FPMDimension size, float unmaskedScale, float maskedScale, void **context);
 void CosineBlurFilterDestructor(void *context);
 
 FPMColor CosineBlurFilter(Coordinates where, RenderFlags flags, void *context);
+void CosineBlurFilterBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context);
@@ -0,0 +1,279 @@
+/*
+	DirectResample.c
+	planettool
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include "DirectResample.h"
+#include "FPMPixelFormat.h"
+#include "PlanetToolScheduler.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+
+enum
+{
+	kInitialTapsPerPosition		= 8
+};
+
+
+bool DirectResampleAxisInit(DirectResampleAxis *axis, FPMDimension count, FPMDimension sourceCount)
+{
+	assert(axis != NULL && sourceCount != 0);
+	
+	*axis = (DirectResampleAxis){ .sourceCount = sourceCount };
+	// Only possible where size_t is narrower than 64 bits.
+	if ((uint64_t)count * kInitialTapsPerPosition >= SIZE_MAX / sizeof *axis->offsets)  return false;
+	
+	axis->capacity = (size_t)count * kInitialTapsPerPosition;
+	axis->offsets = malloc(((size_t)count + 1) * sizeof *axis->offsets);
+	axis->indices = malloc(axis->capacity * sizeof *axis->indices);
+	axis->weights = malloc(axis->capacity * sizeof *axis->weights);
+	if (axis->offsets == NULL || axis->indices == NULL || axis->weights == NULL)
+	{
+		DirectResampleAxisFree(axis);
+		return false;
+	}
+	
+	axis->offsets[0] = 0;
+	return true;
+}
+
+
+void DirectResampleAxisFree(DirectResampleAxis *axis)
+{
+	if (axis == NULL)  return;
+	
+	free(axis->offsets);
+	free(axis->indices);
+	free(axis->weights);
+	*axis = (DirectResampleAxis){ 0 };
+}
+
+
+//	Add weight to the tap for index of the current position, merging it with an existing tap if there is one.
+static bool AddTap(DirectResampleAxis *axis, uint32_t index, float weight)
+{
+	if (!(weight > 0.0f))  return true;
+	
+	size_t t;
+	for (t = axis->offsets[axis->count]; t < axis->tapCount; t++)
+	{
+		if (axis->indices[t] == index)
+		{
+			axis->weights[t] += weight;
+			return true;
+		}
+	}
+	
+	if (axis->tapCount == axis->capacity)
+	{
+		size_t capacity = axis->capacity * 2;
+		uint32_t *indices = realloc(axis->indices, capacity * sizeof *indices);
+		if (indices == NULL)  return false;
+		axis->indices = indices;
+		float *weights = realloc(axis->weights, capacity * sizeof *weights);
+		if (weights == NULL)  return false;
+		axis->weights = weights;
+		axis->capacity = capacity;
+	}
+	
+	axis->indices[axis->tapCount] = index;
+	axis->weights[axis->tapCount] = weight;
+	axis->tapCount++;
+	return true;
+}
+
+
+bool DirectResampleAxisAddSample(DirectResampleAxis *axis, float position, float weight, FPMWrapMode wrap)
+{
+	assert(axis != NULL && axis->offsets != NULL);
+	
+	// Same arithmetic as FPMLinearSamplerGetTaps(), along one axis.
+	position -= 0.5f;
+	float flr = floorf(position);
+	FPMCoordinate low = flr;
+	FPMCoordinate high = FPMWrapCoordinate(low + 1, axis->sourceCount, wrap);
+	low = FPMWrapCoordinate(low, axis->sourceCount, wrap);
+	float alpha = position - flr;
+	
+	return AddTap(axis, low, weight * (1.0f - alpha)) && AddTap(axis, high, weight * alpha);
+}
+
+
+void DirectResampleAxisEndPosition(DirectResampleAxis *axis)
+{
+	assert(axis != NULL && axis->offsets != NULL);
+	
+	size_t t, start = axis->offsets[axis->count];
+	float total = 0.0f;
+	for (t = start; t < axis->tapCount; t++)  total += axis->weights[t];
+	if (total > 0.0f)
+	{
+		float scale = 1.0f / total;
+		for (t = start; t < axis->tapCount; t++)  axis->weights[t] *= scale;
+	}
+	
+	axis->offsets[++axis->count] = axis->tapCount;
+}
+
+
+typedef struct
+{
+	const DirectResampleRegion	*regions;
+	unsigned					regionCount;
+	FPMDimension				maxSourceCount;		// Largest columns.sourceCount of any region.
+	FPMStorageInfo				source;
+	FloatPixMapRef				pm;					// Current band.
+	FPMCoordinate				firstRow;			// Row of the output at the top of pm.
+} DirectResampleContext;
+
+
+static bool DirectResampleBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontext);
+static bool DirectResampleLine(size_t lineIndex, size_t lineCount, void *vcontext);
+
+
+FloatPixMapRef DirectResampleRender(uintmax_t nominalSize, FPMSize size, const DirectResampleRegion *regions, unsigned regionCount, FloatPixMapRef source, const RenderOptions *options, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+{
+	assert(source != NULL && (regionCount == 0 || regions != NULL));
+	
+	DirectResampleContext context = { .regions = regions, .regionCount = regionCount };
+	FPMGetStorageInformation(source, &context.source);
+	
+	unsigned i;
+	for (i = 0; i < regionCount; i++)
+	{
+		const DirectResampleRegion *region = &regions[i];
+		FPMDimension sourceWidth = region->transpose ? region->rows.sourceCount : region->columns.sourceCount;
+		FPMDimension sourceHeight = region->transpose ? region->columns.sourceCount : region->rows.sourceCount;
+		assert(region->columns.count == region->destination.size.width && region->rows.count == region->destination.size.height);
+		assert(region->destination.origin.x + region->destination.size.width <= size.width && region->destination.origin.y + region->destination.size.height <= size.height);
+		assert(region->sourceOrigin.x + sourceWidth <= context.source.width && region->sourceOrigin.y + sourceHeight <= context.source.height);
+		(void)sourceWidth;
+		(void)sourceHeight;
+	
+		if (region->columns.sourceCount > context.maxSourceCount)  context.maxSourceCount = region->columns.sourceCount;
+	}
+	
+	return RenderInBands(nominalSize, size.width, size.height, options, DirectResampleBand, &context, progress, error, cbContext);
+}
+
+
+static bool DirectResampleBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontext)
+{
+	DirectResampleContext *context = vcontext;
+	context->pm = band;
+	context->firstRow = firstRow;
+	
+	return ScheduleRender(DirectResampleLine, context, FPMGetHeight(band), 0, 1, progress, progressContext);
+}
+
+
+/*	Each row of the output is resampled in two passes: the source rows (or
+	columns) it is made from are summed into a single row of columnSums,
+	which is then resampled along its length.
+*/
+FPM_INLINE void ResampleLine(const DirectResampleContext *context, FPMPixelFormat format, FPMCoordinate y, FPMColor *columnSums)
+{
+	const FPMStorageInfo *source = &context->source;
+	FPMColor *outRow = FPMGetPixelPointerC(context->pm, 0, y - context->firstRow);
+	unsigned r;
+	
+	for (r = 0; r < context->regionCount; r++)
+	{
+		const DirectResampleRegion *region = &context->regions[r];
+		FPMRect dest = region->destination;
+		if (y < dest.origin.y || dest.origin.y + (FPMCoordinate)dest.size.height <= y)  continue;
+	
+		const DirectResampleAxis *columns = &region->columns;
+		const DirectResampleAxis *rows = &region->rows;
+		FPMCoordinate sx = region->sourceOrigin.x, sy = region->sourceOrigin.y;
+		FPMDimension i, count = columns->sourceCount;
+		size_t t, rowStart = rows->offsets[y - dest.origin.y], rowEnd = rows->offsets[y - dest.origin.y + 1];
+	
+		if (!region->transpose)
+		{
+			// Sum whole source rows, in memory order.
+			for (i = 0; i < count; i++)  columnSums[i] = kFPMColorClear;
+			for (t = rowStart; t < rowEnd; t++)
+			{
+				FPMCoordinate row = sy + rows->indices[t];
+				float weight = rows->weights[t];
+				for (i = 0; i < count; i++)
+				{
+					columnSums[i] = FPMColorAdd(FPMColorMultiply(FPMDecodePixel(source, format, sx + i, row), weight), columnSums[i]);
+				}
+			}
+		}
+		else
+		{
+			// Each sum is a few neighbouring pixels of one source row.
+			for (i = 0; i < count; i++)
+			{
+				FPMColor accum = kFPMColorClear;
+				for (t = rowStart; t < rowEnd; t++)
+				{
+					accum = FPMColorAdd(FPMColorMultiply(FPMDecodePixel(source, format, sx + rows->indices[t], sy + i), rows->weights[t]), accum);
+				}
+				columnSums[i] = accum;
+			}
+		}
+	
+		FPMColor *pixel = outRow + dest.origin.x;
+		FPMDimension x;
+		for (x = 0; x < dest.size.width; x++)
+		{
+			FPMColor accum = kFPMColorClear;
+			size_t end = columns->offsets[x + 1];
+			for (t = columns->offsets[x]; t < end; t++)
+			{
+				accum = FPMColorAdd(FPMColorMultiply(columnSums[columns->indices[t]], columns->weights[t]), accum);
+			}
+			*pixel++ = accum;
+		}
+	}
+}
+
+
+static bool DirectResampleLine(size_t lineIndex, size_t lineCount, void *vcontext)
+{
+	const DirectResampleContext *context = vcontext;
+	
+	FPMColor *columnSums = malloc(context->maxSourceCount * sizeof *columnSums);
+	if (columnSums == NULL)  return false;
+	
+	FPMCoordinate y = context->firstRow + lineIndex;
+	
+	// Switching on a constant here gets ResampleLine() specialised for each format.
+	switch (context->source.format)
+	{
+		case kFPMFormatRGBAFloat:	ResampleLine(context, kFPMFormatRGBAFloat, y, columnSums);  break;
+		case kFPMFormatRGBA8:		ResampleLine(context, kFPMFormatRGBA8, y, columnSums);  break;
+		case kFPMFormatRGBA16:		ResampleLine(context, kFPMFormatRGBA16, y, columnSums);  break;
+		case kFPMFormatRGBAHalf:	ResampleLine(context, kFPMFormatRGBAHalf, y, columnSums);  break;
+	}
+	
+	free(columnSums);
+	return true;
+}
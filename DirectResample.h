@@ -0,0 +1,132 @@
+/*
+	DirectResample.h
+	planettool
+	
+	Separable resampling, for conversions whose geometry lines up with the
+	source image’s pixel grid.
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef INCLUDED_DirectResample_h
+#define INCLUDED_DirectResample_h
+
+#include "SphericalPixelSource.h"
+#include "FPMImageOperations.h"
+
+FPM_BEGIN_EXTERN_C
+
+
+/*	Some conversions map each row of the output to a row (or column) of the
+	source, and each column to a column (or row): latlong to latlong when
+	the transform only turns or mirrors the planet around its axis, and cube
+	to cube when it only swaps and flips axes. Every sample a sink takes in
+	a pixel then has the same source x for each row of the sample grid, and
+	the same source y for each column, so the sink’s filter and the
+	source’s bilinear interpolation together come down to a weighted sum of
+	source columns followed by a weighted sum of source rows. Direct sinks
+	precompute those weights for each output row and column, and render
+	with no coordinate conversions at all.
+	
+	The sample grid and weights are the same as the ordinary sinks’, so the
+	results match them closely. They differ where ordinary rendering would
+	sample across the source’s edges: across cube face borders, which
+	direct rendering clamps to the face, and across the poles of latlong
+	images, which it clamps to the top and bottom rows.
+*/
+typedef enum
+{
+	kDirectLayoutNone,				// Source can't be resampled directly.
+	kDirectLayoutLatLong,
+	kDirectLayoutCube,
+	kDirectLayoutCubeCross
+} DirectResampleLayout;
+
+
+/*	Direct sink functions render like sinks (see SphericalPixelSinkFunction),
+	from a source image in the given layout seen through transform, which
+	must have been accepted by the corresponding supported function. With
+	kRenderFast, the ordinary sinks’ fast sample grid is used;
+	kRenderSharedSamples makes no difference, and kRenderJitter,
+	kRenderAdaptive and kRenderPrefiltered aren’t supported.
+*/
+typedef bool (*DirectResampleSupportedFunction)(DirectResampleLayout sourceLayout, OOMatrix transform);
+typedef FloatPixMapRef (*DirectResampleSinkFunction)(uintmax_t size, RenderFlags flags, const RenderOptions *options, FloatPixMapRef source, DirectResampleLayout sourceLayout, OOMatrix transform, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+
+
+/*	A DirectResampleAxis holds the taps for each of the positions (columns
+	or rows) along one axis of the output: which positions along an axis of
+	the source it is made from, and their weights, which add up to 1.
+	
+	Positions are built in order: each sample taken for a position is added
+	with DirectResampleAxisAddSample(), at its position in the source (with
+	pixel centres at .5, as for FPMSampleLinear()) and with its weight in
+	the sink’s filter, and the position is then finished with
+	DirectResampleAxisEndPosition().
+*/
+typedef struct
+{
+	FPMDimension			sourceCount;	// Taps are positions 0 to sourceCount - 1 of the source.
+	FPMDimension			count;			// Positions finished so far.
+	uint32_t				*offsets;		// Taps of position i are [offsets[i], offsets[i + 1]).
+	uint32_t				*indices;
+	float					*weights;
+	size_t					tapCount;
+	size_t					capacity;
+} DirectResampleAxis;
+
+
+bool DirectResampleAxisInit(DirectResampleAxis *axis, FPMDimension count, FPMDimension sourceCount);
+void DirectResampleAxisFree(DirectResampleAxis *axis);
+
+bool DirectResampleAxisAddSample(DirectResampleAxis *axis, float position, float weight, FPMWrapMode wrap);
+void DirectResampleAxisEndPosition(DirectResampleAxis *axis);
+
+
+/*	A region of the output, resampled from a rectangle of the source.
+	columns has a position for each column of destination and rows for each
+	row. Normally columns map to source columns and rows to source rows; if
+	transpose is set, columns map to source rows and rows to source columns.
+	The source rectangle starts at sourceOrigin, and its size is given by
+	the axes’ source counts.
+*/
+typedef struct
+{
+	FPMRect					destination;
+	FPMPoint				sourceOrigin;
+	DirectResampleAxis		columns;
+	DirectResampleAxis		rows;
+	bool					transpose;
+} DirectResampleRegion;
+
+
+/*	DirectResampleRender()
+	Render an output of size pixels (nominalSize as for ValidatePixMapSize())
+	made up of regionCount regions resampled from source. Parts of the output
+	not covered by a region are left clear. Works like a sink, including
+	streaming with RenderOptions.rowOutput.
+*/
+FloatPixMapRef DirectResampleRender(uintmax_t nominalSize, FPMSize size, const DirectResampleRegion *regions, unsigned regionCount, FloatPixMapRef source, const RenderOptions *options, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+
+
+FPM_END_EXTERN_C
+#endif	/* INCLUDED_DirectResample_h */
@@ -57,6 +57,7 @@
 #define FPM_FORCE_INLINE
 #endif
 #define FPM_NON_NULL_ALL __attribute__((nonnull))
+#define FPM_FLATTEN __attribute__((flatten))
 #define FPM_GCC_PREFETCH __builtin_prefetch
 #define FPM_EXPECT(x)  __builtin_expect((x), 1)
 #define FPM_EXPECT_NOT(x)  __builtin_expect((x), 0)
@@ -65,6 +66,7 @@
 #define FPM_CONST
 #define FPM_FORCE_INLINE
 #define FPM_NON_NULL_ALL
+#define FPM_FLATTEN
 #define FPM_GCC_PREFETCH(...) do {} while (0)
 #define FPM_EXPECT(x)  (x)
 #define FPM_EXPECT_NOT(x)  (x)
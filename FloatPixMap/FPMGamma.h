@@ -44,20 +44,42 @@ extern const FPMGammaFactor kFPMGammaTraditionalMac;	// 1.8f (standard for Mac s
 
 /*	FPMApplyGamma()
 	Apply gamma transformation to pixels, i.e. raise each colour component
-	to the power desiredGamma/currentGamma. Alpha components are unaffected.
+	to the power currentGamma/desiredGamma. Alpha components are unaffected.
 	
-	To avoid taking years to process, a lookup table may be used. The steps
-	parameter defines the size of the table. Table entries are distributed
-	evenly between 0 and 1 in the source space.
+	The power function is a polynomial approximation whose relative error
+	is well below a 16-bit quantisation step; see FPMGamma.c for the bound.
+	Rows are processed in parallel with FPMRunParallel(). The steps
+	parameter used to set the size of a lookup table, and is now ignored.
 	
-	The use of the lookup table is not guaranteed, so relying on its
-	quantising effect would be a bad idea.
-	
-	The effect on values outside the range 0..1 is undefined. If necessary,
-	clamp or scale data before calling FPMApplyGamma().
+	Zero, negative values, infinities and NaN give the same results as
+	powf(). Accuracy outside the range 0..1 is not guaranteed; if
+	necessary, clamp or scale data before calling FPMApplyGamma().
 */
 void FPMApplyGamma(FloatPixMapRef pm, FPMGammaFactor currentGamma, FPMGammaFactor desiredGamma, unsigned steps);
 
 
+/*	FPMLinearToSRGB()
+	FPMSRGBToLinear()
+	Convert colour components between linear values and the exact sRGB
+	transfer curve, with its linear segment near black, rather than the
+	kFPMGammaSRGB approximation. Alpha components are unaffected. As with
+	FPMApplyGamma(), the effect on values outside 0..1 is undefined.
+*/
+void FPMLinearToSRGB(FloatPixMapRef pm);
+void FPMSRGBToLinear(FloatPixMapRef pm);
+
+
+/*	FPMApplyGammaToPixels()
+	FPMLinearToSRGBPixels()
+	FPMSRGBToLinearPixels()
+	The kernels used by the functions above, for code which processes rows
+	of pixels itself. They work in place on count consecutive pixels, are
+	reentrant, and run on the calling thread. gamma is the power to apply,
+	i.e. currentGamma/desiredGamma.
+*/
+void FPMApplyGammaToPixels(FPMColor *pixels, size_t count, FPMGammaFactor gamma);
+void FPMLinearToSRGBPixels(FPMColor *pixels, size_t count);
+void FPMSRGBToLinearPixels(FPMColor *pixels, size_t count);
+
 FPM_END_EXTERN_C
 #endif	/* INCLUDED_FPMGamma_h */
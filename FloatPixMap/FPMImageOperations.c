@@ -25,6 +25,7 @@
 */
 
 #include "FPMImageOperations.h"
+#include "FPMPixelFormat.h"
 #include "FPMVector.h"
 #include <assert.h>
 
@@ -243,100 +244,245 @@ void FPMNormalize(FloatPixMapRef pm, bool retainZero, bool perChannel, bool norm
 }
 
 
-FPM_INLINE FPMCoordinate Wrap(FPMCoordinate coord, FPMCoordinate max, FPMWrapMode mode)
+/*	The samplers are written once and instantiated for each pixel format, so
+	compact formats are converted to floats as they're loaded without slowing
+	down the plain float case. The instantiations are too big for the
+	compiler to inline on its own, hence FPM_FLATTEN on the public functions.
+*/
+FPM_INLINE FPMColor SampleLinear(const FPMStorageInfo *info, FPMPixelFormat format, float x, float y, FPMWrapMode wrapx, FPMWrapMode wrapy)
 {
-	/*	NOTE: max is FPMCoordinate rather than FMPDimension because it needs
-		to be signed in various places.
+	x -= 0.5f;
+	y -= 0.5f;
+	
+	float flrx = floorf(x);
+	float flry = floorf(y);
+	
+	FPMCoordinate lowx = flrx;
+	FPMCoordinate lowy = flry;
+	FPMCoordinate highx = lowx + 1;
+	FPMCoordinate highy = lowy + 1;
+	
+	lowx = FPMWrapCoordinate(lowx, info->width, wrapx);
+	highx = FPMWrapCoordinate(highx, info->width, wrapx);
+	lowy = FPMWrapCoordinate(lowy, info->height, wrapy);
+	highy = FPMWrapCoordinate(highy, info->height, wrapy);
+	
+	// No range checking in FPMDecodePixel(), that's FPMWrapCoordinate()'s job.
+	FPMColor ll = FPMDecodePixel(info, format, lowx, lowy);
+	FPMColor lh = FPMDecodePixel(info, format, lowx, highy);
+	FPMColor hl = FPMDecodePixel(info, format, highx, lowy);
+	FPMColor hh = FPMDecodePixel(info, format, highx, highy);
+	
+	float alphax = x - flrx;
+	float alphay = y - flry;
+	ll = FPMColorBlend(hl, ll, alphax);
+	hl = FPMColorBlend(hh, lh, alphax);
+	return FPMColorBlend(hl, ll, alphay);
+}
+
+
+FPM_FLATTEN FPMColor FPMSampleLinear(FloatPixMapRef pm, float x, float y, FPMWrapMode wrapx, FPMWrapMode wrapy)
+{
+	if (pm != NULL)
+	{
+		FPMStorageInfo info;
+		FPMGetStorageInformation(pm, &info);
 		
-		Optimization note: some conditionals could be removed/avoided, but
-		profiling shows that avoding the %s is a win.
-	*/
-	FPMDimension umax = max;
-	if (FPM_EXPECT(0 <= coord))
+		switch (info.format)
+		{
+			case kFPMFormatRGBAFloat:	return SampleLinear(&info, kFPMFormatRGBAFloat, x, y, wrapx, wrapy);
+			case kFPMFormatRGBA8:		return SampleLinear(&info, kFPMFormatRGBA8, x, y, wrapx, wrapy);
+			case kFPMFormatRGBA16:		return SampleLinear(&info, kFPMFormatRGBA16, x, y, wrapx, wrapy);
+			case kFPMFormatRGBAHalf:	return SampleLinear(&info, kFPMFormatRGBAHalf, x, y, wrapx, wrapy);
+		}
+	}
+	return kFPMColorInvalid;
+}
+
+
+/*	Linear samplers.
+	
+	Each sampling function is SampleLinear() instantiated for a pixel format
+	and pair of wrap modes, with the storage information cached in the
+	sampler. The batch functions for floating-point pixmaps work out the
+	taps and weights of four points at a time with SSE2, with the same
+	arithmetic as SampleLinear(), then gather the taps and blend them as
+	vectors. FloorVector() matches floorf(), including for values too large
+	to have a fractional part and non-finite ones, so that alpha comes out
+	the same.
+*/
+#if FPM_USE_SSE2
+
+FPM_INLINE __m128 FloorVector(__m128 v)
+{
+	__m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+	__m128 floored = _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, v), _mm_set1_ps(1.0f)));
+	
+	__m128 magnitude = _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+	__m128 integral = _mm_cmpnlt_ps(magnitude, _mm_set1_ps(8388608.0f));	// 2^23, or NaN.
+	return _mm_or_ps(_mm_and_ps(integral, v), _mm_andnot_ps(integral, floored));
+}
+
+
+FPM_INLINE __m128 BlendVector(__m128 a, __m128 b, __m128 fraction)
+{
+	// As FPMColorBlend().
+	return _mm_add_ps(b, _mm_mul_ps(fraction, _mm_sub_ps(a, b)));
+}
+
+#endif
+
+
+FPM_INLINE void SampleLinearBatch(const FPMStorageInfo *info, FPMPixelFormat format, const float *x, const float *y, FPMColor *colors, size_t count, FPMWrapMode wrapx, FPMWrapMode wrapy)
+{
+	size_t i = 0;
+	
+#if FPM_USE_SSE2
+	if (format == kFPMFormatRGBAFloat)
 	{
-		FPMDimension ucoord = coord;
-		if (FPM_EXPECT(ucoord < umax))  return coord;
+		const uint8_t *buffer = info->buffer;
+		__m128 half = _mm_set1_ps(0.5f);
 		
-		// If we get here, we have an overflow.
-		switch (mode)
+		for (; i + 4 <= count; i += 4)
 		{
-			case kFPMWrapClamp:
-				return max - 1;
+			__m128 xv = _mm_sub_ps(_mm_loadu_ps(x + i), half);
+			__m128 yv = _mm_sub_ps(_mm_loadu_ps(y + i), half);
+			__m128 flrx = FloorVector(xv);
+			__m128 flry = FloorVector(yv);
+			
+			float alphax[4], alphay[4];
+			int32_t lowx[4], lowy[4];
+			_mm_storeu_ps(alphax, _mm_sub_ps(xv, flrx));
+			_mm_storeu_ps(alphay, _mm_sub_ps(yv, flry));
+			_mm_storeu_si128((__m128i *)lowx, _mm_cvttps_epi32(flrx));
+			_mm_storeu_si128((__m128i *)lowy, _mm_cvttps_epi32(flry));
+			
+			unsigned j;
+			for (j = 0; j < 4; j++)
+			{
+				FPMCoordinate lx = FPMWrapCoordinate(lowx[j], info->width, wrapx);
+				FPMCoordinate hx = FPMWrapCoordinate(lowx[j] + 1, info->width, wrapx);
+				FPMCoordinate ly = FPMWrapCoordinate(lowy[j], info->height, wrapy);
+				FPMCoordinate hy = FPMWrapCoordinate(lowy[j] + 1, info->height, wrapy);
 				
-			case kFPMWrapRepeat:
-				return ucoord % umax;
+				const FPMColor *lowRow = (const FPMColor *)(buffer + ly * info->rowBytes);
+				const FPMColor *highRow = (const FPMColor *)(buffer + hy * info->rowBytes);
+				__m128 ll = _mm_loadu_ps(&lowRow[lx].r);
+				__m128 lh = _mm_loadu_ps(&highRow[lx].r);
+				__m128 hl = _mm_loadu_ps(&lowRow[hx].r);
+				__m128 hh = _mm_loadu_ps(&highRow[hx].r);
 				
-			case kFPMWrapMirror:
-				umax -= 1;
-				coord = coord % (umax << 1);
-				if (ucoord >= umax)  return (umax << 1) - ucoord;
-				return coord;
+				__m128 ax = _mm_set1_ps(alphax[j]);
+				ll = BlendVector(hl, ll, ax);
+				hl = BlendVector(hh, lh, ax);
+				_mm_storeu_ps(&colors[i + j].r, BlendVector(hl, ll, _mm_set1_ps(alphay[j])));
+			}
 		}
 	}
+#endif
 	
-	switch (mode)
+	for (; i < count; i++)
 	{
-		case kFPMWrapClamp:  return 0;
-		case kFPMWrapRepeat:
-			if (FPM_EXPECT(coord > -max))  return max + coord;
-			return ((FPMDimension)(coord % max + max)) % umax;
-			
-		case kFPMWrapMirror:
-			max -= 1;
-			coord = coord % (max << 1);
-			if (coord < -max)  return coord + (max << 1);
-			return -coord;
+		colors[i] = SampleLinear(info, format, x[i], y[i], wrapx, wrapy);
 	}
-	
-	assert(0);
-	return 0;
 }
 
 
-FPM_INLINE FPMColor Sample(FPMColor *buffer, size_t rowCount, size_t x, size_t y)
+#define LINEAR_SAMPLER_FUNCTIONS(name, format, wrapx, wrapy) \
+	static FPM_FLATTEN FPMColor LinearSample##name(const FPMLinearSampler *sampler, float x, float y) \
+	{ \
+		return SampleLinear(&sampler->info, format, x, y, wrapx, wrapy); \
+	} \
+	static FPM_FLATTEN void LinearSampleBatch##name(const FPMLinearSampler *sampler, const float *x, const float *y, FPMColor *colors, size_t count) \
+	{ \
+		SampleLinearBatch(&sampler->info, format, x, y, colors, count, wrapx, wrapy); \
+	}
+
+#define LINEAR_SAMPLERS_FOR_FORMAT(name, format) \
+	LINEAR_SAMPLER_FUNCTIONS(name##ClampClamp, format, kFPMWrapClamp, kFPMWrapClamp) \
+	LINEAR_SAMPLER_FUNCTIONS(name##RepeatClamp, format, kFPMWrapRepeat, kFPMWrapClamp) \
+	LINEAR_SAMPLER_FUNCTIONS(name##AnyWrap, format, sampler->wrapx, sampler->wrapy)
+
+LINEAR_SAMPLERS_FOR_FORMAT(Float, kFPMFormatRGBAFloat)
+LINEAR_SAMPLERS_FOR_FORMAT(RGBA8, kFPMFormatRGBA8)
+LINEAR_SAMPLERS_FOR_FORMAT(RGBA16, kFPMFormatRGBA16)
+LINEAR_SAMPLERS_FOR_FORMAT(Half, kFPMFormatRGBAHalf)
+
+
+enum
+{
+	kSamplerClampClamp,
+	kSamplerRepeatClamp,
+	kSamplerAnyWrap,
+	kSamplerWrapVariantCount
+};
+
+
+#define LINEAR_SAMPLER_ENTRIES(name) \
+	{ \
+		{ LinearSample##name##ClampClamp, LinearSampleBatch##name##ClampClamp }, \
+		{ LinearSample##name##RepeatClamp, LinearSampleBatch##name##RepeatClamp }, \
+		{ LinearSample##name##AnyWrap, LinearSampleBatch##name##AnyWrap } \
+	}
+
+static const struct
+{
+	FPMLinearSampleFunction			sample;
+	FPMLinearSampleBatchFunction	sampleBatch;
+} kLinearSamplers[][kSamplerWrapVariantCount] =
+{
+	// Indexed by FPMPixelFormat.
+	LINEAR_SAMPLER_ENTRIES(Float),
+	LINEAR_SAMPLER_ENTRIES(RGBA8),
+	LINEAR_SAMPLER_ENTRIES(RGBA16),
+	LINEAR_SAMPLER_ENTRIES(Half)
+};
+
+
+bool FPMMakeLinearSampler(FloatPixMapRef pm, FPMWrapMode wrapx, FPMWrapMode wrapy, FPMLinearSampler *sampler)
 {
-	// No range checking here, that's Wrap's job.
-	return buffer[x + y * rowCount];
+	assert(sampler != NULL);
+	if (pm == NULL)  return false;
+	
+	FPMGetStorageInformation(pm, &sampler->info);
+	sampler->wrapx = wrapx;
+	sampler->wrapy = wrapy;
+	
+	unsigned variant = kSamplerAnyWrap;
+	if (wrapx == kFPMWrapClamp && wrapy == kFPMWrapClamp)  variant = kSamplerClampClamp;
+	else if (wrapx == kFPMWrapRepeat && wrapy == kFPMWrapClamp)  variant = kSamplerRepeatClamp;
+	
+	sampler->sample = kLinearSamplers[sampler->info.format][variant].sample;
+	sampler->sampleBatch = kLinearSamplers[sampler->info.format][variant].sampleBatch;
+	return true;
 }
 
 
-FPMColor FPMSampleLinear(FloatPixMapRef pm, float x, float y, FPMWrapMode wrapx, FPMWrapMode wrapy)
+void FPMLinearSamplerGetTaps(const FPMLinearSampler *sampler, float x, float y, FPMLinearTaps *taps)
 {
-	if (pm != NULL)
-	{
-		x -= 0.5f;
-		y -= 0.5f;
-		FPMColor *buffer;
-		FPMDimension width, height;
-		size_t rowCount;
-		FPMGetIterationInformation(pm, &buffer, &width, &height, &rowCount);
-		rowCount += width;	// Undo optimization not useful in this particular case.
-		
-		float flrx = floorf(x);
-		float flry = floorf(y);
-		
-		FPMCoordinate lowx = flrx;
-		FPMCoordinate lowy = flry;
-		FPMCoordinate highx = lowx + 1;
-		FPMCoordinate highy = lowy + 1;
-		
-		lowx = Wrap(lowx, width, wrapx);
-		highx = Wrap(highx, width, wrapx);
-		lowy = Wrap(lowy, height, wrapy);
-		highy = Wrap(highy, height, wrapy);
-		
-		FPMColor ll = Sample(buffer, rowCount, lowx, lowy);
-		FPMColor lh = Sample(buffer, rowCount, lowx, highy);
-		FPMColor hl = Sample(buffer, rowCount, highx, lowy);
-		FPMColor hh = Sample(buffer, rowCount, highx, highy);
-		
-		float alphax = x - flrx;
-		float alphay = y - flry;
-		ll = FPMColorBlend(hl, ll, alphax);
-		hl = FPMColorBlend(hh, lh, alphax);
-		return FPMColorBlend(hl, ll, alphay);
-	}
-	return kFPMColorInvalid;
+	assert(sampler != NULL && taps != NULL);
+	
+	// Same arithmetic as SampleLinear().
+	x -= 0.5f;
+	y -= 0.5f;
+	
+	float flrx = floorf(x);
+	float flry = floorf(y);
+	
+	FPMCoordinate lowx = flrx;
+	FPMCoordinate lowy = flry;
+	FPMCoordinate highx = FPMWrapCoordinate(lowx + 1, sampler->info.width, sampler->wrapx);
+	FPMCoordinate highy = FPMWrapCoordinate(lowy + 1, sampler->info.height, sampler->wrapy);
+	lowx = FPMWrapCoordinate(lowx, sampler->info.width, sampler->wrapx);
+	lowy = FPMWrapCoordinate(lowy, sampler->info.height, sampler->wrapy);
+	
+	float alphax = x - flrx;
+	float alphay = y - flry;
+	
+	taps->x[0] = lowx;  taps->y[0] = lowy;  taps->weight[0] = (1.0f - alphax) * (1.0f - alphay);
+	taps->x[1] = highx;  taps->y[1] = lowy;  taps->weight[1] = alphax * (1.0f - alphay);
+	taps->x[2] = lowx;  taps->y[2] = highy;  taps->weight[2] = (1.0f - alphax) * alphay;
+	taps->x[3] = highx;  taps->y[3] = highy;  taps->weight[3] = alphax * alphay;
 }
 
 
@@ -346,41 +492,51 @@ FPM_INLINE float Cubic(float f)
 }
 
 
-FPMColor FPMSampleCubicHermite(FloatPixMapRef pm, float x, float y, FPMWrapMode wrapx, FPMWrapMode wrapy)
+FPM_INLINE FPMColor SampleCubicHermite(const FPMStorageInfo *info, FPMPixelFormat format, float x, float y, FPMWrapMode wrapx, FPMWrapMode wrapy)
+{
+	x -= 0.5;
+	y -= 0.5;
+	
+	float flrx = floorf(x);
+	float flry = floorf(y);
+	
+	FPMCoordinate lowx = flrx;
+	FPMCoordinate lowy = flry;
+	FPMCoordinate highx = lowx + 1;
+	FPMCoordinate highy = lowy + 1;
+	
+	lowx = FPMWrapCoordinate(lowx, info->width, wrapx);
+	highx = FPMWrapCoordinate(highx, info->width, wrapy);
+	lowy = FPMWrapCoordinate(lowy, info->height, wrapy);
+	highy = FPMWrapCoordinate(highy, info->height, wrapy);
+	
+	FPMColor ll = FPMDecodePixel(info, format, lowx, lowy);
+	FPMColor lh = FPMDecodePixel(info, format, lowx, highy);
+	FPMColor hl = FPMDecodePixel(info, format, highx, lowy);
+	FPMColor hh = FPMDecodePixel(info, format, highx, highy);
+	
+	float alphax = Cubic(x - flrx);
+	float alphay = Cubic(y - flry);
+	ll = FPMColorBlend(hl, ll, alphax);
+	hl = FPMColorBlend(hh, lh, alphax);
+	return FPMColorBlend(hl, ll, alphay);
+}
+
+
+FPM_FLATTEN FPMColor FPMSampleCubicHermite(FloatPixMapRef pm, float x, float y, FPMWrapMode wrapx, FPMWrapMode wrapy)
 {
 	if (pm != NULL)
 	{
-		x -= 0.5;
-		y -= 0.5;
-		FPMColor *buffer;
-		FPMDimension width, height;
-		size_t rowCount;
-		FPMGetIterationInformation(pm, &buffer, &width, &height, &rowCount);
-		rowCount += width;	// Undo optimization not useful in this particular case.
-		
-		float flrx = floorf(x);
-		float flry = floorf(y);
+		FPMStorageInfo info;
+		FPMGetStorageInformation(pm, &info);
 		
-		FPMCoordinate lowx = flrx;
-		FPMCoordinate lowy = flry;
-		FPMCoordinate highx = lowx + 1;
-		FPMCoordinate highy = lowy + 1;
-		
-		lowx = Wrap(lowx, width, wrapx);
-		highx = Wrap(highx, width, wrapy);
-		lowy = Wrap(lowy, height, wrapy);
-		highy = Wrap(highy, height, wrapy);
-		
-		FPMColor ll = Sample(buffer, rowCount, lowx, lowy);
-		FPMColor lh = Sample(buffer, rowCount, lowx, highy);
-		FPMColor hl = Sample(buffer, rowCount, highx, lowy);
-		FPMColor hh = Sample(buffer, rowCount, highx, highy);
-		
-		float alphax = Cubic(x - flrx);
-		float alphay = Cubic(y - flry);
-		ll = FPMColorBlend(hl, ll, alphax);
-		hl = FPMColorBlend(hh, lh, alphax);
-		return FPMColorBlend(hl, ll, alphay);
+		switch (info.format)
+		{
+			case kFPMFormatRGBAFloat:	return SampleCubicHermite(&info, kFPMFormatRGBAFloat, x, y, wrapx, wrapy);
+			case kFPMFormatRGBA8:		return SampleCubicHermite(&info, kFPMFormatRGBA8, x, y, wrapx, wrapy);
+			case kFPMFormatRGBA16:		return SampleCubicHermite(&info, kFPMFormatRGBA16, x, y, wrapx, wrapy);
+			case kFPMFormatRGBAHalf:	return SampleCubicHermite(&info, kFPMFormatRGBAHalf, x, y, wrapx, wrapy);
+		}
 	}
 	return kFPMColorInvalid;
 }
@@ -0,0 +1,247 @@
+/*
+	FPMMipmap.c
+	FloatPixMap
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include "FPMMipmap.h"
+#include "FPMPixelFormat.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+
+enum
+{
+	kMaxLevels					= 24,
+	kReduceBandPixels			= 1 << 16	// Reduction is split into bands of about this many output pixels for FPMRunParallel().
+};
+
+
+struct FPMMipmap
+{
+	size_t					retainCount;
+	unsigned				levelCount;
+	FloatPixMapRef			levels[kMaxLevels];
+	FPMLinearSampler		samplers[kMaxLevels];
+	float					scales[kMaxLevels];		// Size of each level relative to level 0.
+};
+
+
+typedef struct
+{
+	FPMStorageInfo			src;
+	FPMStorageInfo			dst;
+	FPMDimension			bandRows;
+} ReduceJob;
+
+
+/*	Each pixel of dst is the mean of the 2×2 block of src it covers. Pixels
+	are decoded to linear floats for averaging, so compact formats are
+	reduced correctly.
+*/
+FPM_INLINE void ReduceRows(const ReduceJob *job, FPMPixelFormat format, FPMDimension y, FPMDimension end)
+{
+	FPMDimension x;
+	for (; y < end; y++)
+	{
+		for (x = 0; x < job->dst.width; x++)
+		{
+			FPMColor sum = FPMDecodePixel(&job->src, format, x * 2, y * 2);
+			sum = FPMColorAdd(sum, FPMDecodePixel(&job->src, format, x * 2 + 1, y * 2));
+			sum = FPMColorAdd(sum, FPMDecodePixel(&job->src, format, x * 2, y * 2 + 1));
+			sum = FPMColorAdd(sum, FPMDecodePixel(&job->src, format, x * 2 + 1, y * 2 + 1));
+			FPMEncodePixel(&job->dst, format, x, y, FPMColorMultiply(sum, 0.25f));
+		}
+	}
+}
+
+
+static bool ReduceBand(size_t index, size_t count, void *context)
+{
+	const ReduceJob *job = context;
+	FPMDimension y = index * job->bandRows;
+	FPMDimension end = (job->dst.height - y > job->bandRows) ? y + job->bandRows : job->dst.height;
+	
+	// Switching on a constant here gets ReduceRows() specialised for each format.
+	switch (job->src.format)
+	{
+		case kFPMFormatRGBAFloat:	ReduceRows(job, kFPMFormatRGBAFloat, y, end);  break;
+		case kFPMFormatRGBA8:		ReduceRows(job, kFPMFormatRGBA8, y, end);  break;
+		case kFPMFormatRGBA16:		ReduceRows(job, kFPMFormatRGBA16, y, end);  break;
+		case kFPMFormatRGBAHalf:	ReduceRows(job, kFPMFormatRGBAHalf, y, end);  break;
+	}
+	
+	return true;
+}
+
+
+FPMMipmapRef FPMMipmapCreate(FloatPixMapRef pm, FPMWrapMode wrapx, FPMWrapMode wrapy)
+{
+	if (pm == NULL)  return NULL;
+	
+	FPMMipmapRef mipmap = calloc(1, sizeof *mipmap);
+	if (mipmap == NULL)  return NULL;
+	mipmap->retainCount = 1;
+	
+	mipmap->levels[0] = FPMRetain(pm);
+	mipmap->scales[0] = 1.0f;
+	if (!FPMMakeLinearSampler(pm, wrapx, wrapy, &mipmap->samplers[0]))  goto FAIL;
+	mipmap->levelCount = 1;
+	
+	while (mipmap->levelCount < kMaxLevels)
+	{
+		unsigned index = mipmap->levelCount;
+		FPMSize size = FPMGetSize(mipmap->levels[index - 1]);
+		if (size.width < 2 || size.height < 2 || size.width % 2 != 0 || size.height % 2 != 0)  break;
+	
+		ReduceJob job;
+		FPMGetStorageInformation(mipmap->levels[index - 1], &job.src);
+		mipmap->levels[index] = FPMCreateWithFormat(FPMMakeSize(size.width / 2, size.height / 2), job.src.format, job.src.storageGamma);
+		if (mipmap->levels[index] == NULL)  goto FAIL;
+		FPMGetStorageInformation(mipmap->levels[index], &job.dst);
+	
+		job.bandRows = kReduceBandPixels / job.dst.width;
+		if (job.bandRows == 0)  job.bandRows = 1;
+		if (!FPMRunParallel(ReduceBand, &job, (job.dst.height + job.bandRows - 1) / job.bandRows))  goto FAIL;
+	
+		if (!FPMMakeLinearSampler(mipmap->levels[index], wrapx, wrapy, &mipmap->samplers[index]))  goto FAIL;
+		mipmap->scales[index] = mipmap->scales[index - 1] * 0.5f;
+		mipmap->levelCount++;
+	}
+	
+	return mipmap;
+	
+FAIL:
+	FPMMipmapRelease(&mipmap);
+	return NULL;
+}
+
+
+FPMMipmapRef FPMMipmapRetain(FPMMipmapRef mipmap)
+{
+	if (mipmap != NULL)
+	{
+		assert(mipmap->retainCount < SIZE_MAX);
+		mipmap->retainCount++;
+	}
+	return mipmap;
+}
+
+
+void FPMMipmapRelease(FPMMipmapRef *mipmap)
+{
+	if (mipmap != NULL && *mipmap != NULL)
+	{
+		assert((*mipmap)->retainCount > 0);
+		if (--(*mipmap)->retainCount == 0)
+		{
+			unsigned i;
+			for (i = 0; i < kMaxLevels; i++)  FPMRelease(&(*mipmap)->levels[i]);
+			free(*mipmap);
+		}
+		*mipmap = NULL;
+	}
+}
+
+
+unsigned FPMMipmapGetLevelCount(FPMMipmapRef mipmap)
+{
+	return (mipmap != NULL) ? mipmap->levelCount : 0;
+}
+
+
+FPM_INLINE FPMColor SampleLevel(FPMMipmapRef mipmap, unsigned level, float x, float y)
+{
+	// Level 0 is sampled directly, so that results match FPMSampleLinear() exactly.
+	if (level == 0)  return FPMLinearSamplerSample(&mipmap->samplers[0], x, y);
+	
+	/*	As for FPMSampleLinear(), pixel i of each level covers i..i+1, so the
+		edges of the levels line up and coordinates simply scale. (The
+		sampler puts pixel centres at i + 0.5 itself.)
+	*/
+	float scale = mipmap->scales[level];
+	return FPMLinearSamplerSample(&mipmap->samplers[level], x * scale, y * scale);
+}
+
+
+FPM_INLINE FPMColor SampleTrilinear(FPMMipmapRef mipmap, float x, float y, float lod)
+{
+	unsigned maxLevel = mipmap->levelCount - 1;
+	if (!(lod > 0.0f))  return SampleLevel(mipmap, 0, x, y);
+	if (!(lod < (float)maxLevel))  return SampleLevel(mipmap, maxLevel, x, y);
+	
+	unsigned level = lod;
+	float fraction = lod - (float)level;
+	FPMColor fine = SampleLevel(mipmap, level, x, y);
+	FPMColor coarse = SampleLevel(mipmap, level + 1, x, y);
+	return FPMColorBlend(coarse, fine, fraction);
+}
+
+
+FPMColor FPMMipmapSample(FPMMipmapRef mipmap, float x, float y, float footprintX, float footprintY)
+{
+	assert(mipmap != NULL);
+	
+	bool alongX = footprintX > footprintY;
+	float major = alongX ? footprintX : footprintY;
+	float minor = alongX ? footprintY : footprintX;
+	
+	// Footprints more elongated than the probes can cover are widened.
+	if (minor * (float)kFPMMipmapMaxAnisotropy < major)  minor = major * (1.0f / (float)kFPMMipmapMaxAnisotropy);
+	
+	float lod = (minor > 1.0f) ? log2f(minor) : 0.0f;
+	
+	// Probes are spaced a level pixel apart, and never closer than level 0 pixels.
+	float ratio = major / fmaxf(minor, 1.0f);
+	if (!(ratio > 1.0f))  return SampleTrilinear(mipmap, x, y, lod);
+	
+	unsigned i, probes = ceilf(ratio);
+	if (probes > kFPMMipmapMaxAnisotropy)  probes = kFPMMipmapMaxAnisotropy;
+	float step = major / (float)probes;
+	float offset = (step - major) * 0.5f;
+	FPMColor sum = kFPMColorClear;
+	
+	for (i = 0; i < probes; i++)
+	{
+		FPMColor probe;
+		if (alongX)  probe = SampleTrilinear(mipmap, x + offset, y, lod);
+		else  probe = SampleTrilinear(mipmap, x, y + offset, lod);
+		sum = FPMColorAdd(sum, probe);
+		offset += step;
+	}
+	
+	return FPMColorMultiply(sum, 1.0f / (float)probes);
+}
+
+
+void FPMMipmapSampleBatch(FPMMipmapRef mipmap, const float *x, const float *y, const float *footprintX, const float *footprintY, FPMColor *colors, size_t count)
+{
+	assert(mipmap != NULL);
+	
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		colors[i] = FPMMipmapSample(mipmap, x[i], y[i], footprintX[i], footprintY[i]);
+	}
+}
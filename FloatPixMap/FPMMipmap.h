@@ -0,0 +1,95 @@
+/*
+	FPMMipmap.h
+	FloatPixMap
+	
+	Prefiltered image pyramids, for sampling an image at lower resolutions
+	without aliasing.
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef INCLUDED_FPMMipmap_h
+#define INCLUDED_FPMMipmap_h
+
+#include "FPMImageOperations.h"
+
+FPM_BEGIN_EXTERN_C
+
+
+/*	An FPMMipmap holds a pixmap and a chain of copies of it, each half the
+	width and height of the one before, with each pixel the mean of the four
+	it covers. Levels are added as long as both dimensions are even, so that
+	every pixel of every level covers the same part of the original exactly;
+	an image whose size is a power of two times a small odd number gets its
+	full pyramid. The reduced levels use the original’s pixel format and
+	storage gamma, so they take up about a third as much memory again.
+*/
+typedef struct FPMMipmap *FPMMipmapRef;
+
+
+enum
+{
+	kFPMMipmapMaxAnisotropy			= 8		// Most probes taken by FPMMipmapSample().
+};
+
+
+/*	FPMMipmapCreate()
+	Build the pyramid for a pixmap, which is retained and must not be
+	modified while the mipmap exists. The wrap modes are used for all
+	sampling. The reduced levels are built in parallel with FPMRunParallel().
+	Returns NULL on failure.
+*/
+FPMMipmapRef FPMMipmapCreate(FloatPixMapRef pm, FPMWrapMode wrapx, FPMWrapMode wrapy);
+
+FPMMipmapRef FPMMipmapRetain(FPMMipmapRef mipmap);
+void FPMMipmapRelease(FPMMipmapRef *mipmap);
+
+unsigned FPMMipmapGetLevelCount(FPMMipmapRef mipmap);
+
+
+/*	FPMMipmapSample()
+	Sample the pixmap at x, y (in the coordinates of the original, as for
+	FPMSampleLinear()), filtered over an area footprintX pixels wide and
+	footprintY pixels high.
+	
+	The level is chosen so that its pixels are as large as the smaller of
+	the two footprint dimensions, and sampled with trilinear interpolation
+	(bilinear interpolation in the two nearest levels, blended). If the
+	footprint is elongated, up to kFPMMipmapMaxAnisotropy such samples are
+	taken spaced along its longer dimension and averaged; beyond that
+	ratio, a coarser level is used instead.
+	
+	A footprint of no more than one pixel each way only uses the original,
+	and gives the same result as FPMSampleLinear(). Coarser levels are
+	sampled at the same point scaled to their size, so filtering softens
+	detail but doesn't move it.
+	
+	FPMMipmapSampleBatch() samples count points at once, with a footprint
+	for each.
+*/
+FPMColor FPMMipmapSample(FPMMipmapRef mipmap, float x, float y, float footprintX, float footprintY);
+void FPMMipmapSampleBatch(FPMMipmapRef mipmap, const float *x, const float *y, const float *footprintX, const float *footprintY, FPMColor *colors, size_t count);
+
+
+FPM_END_EXTERN_C
+#endif	/* INCLUDED_FPMMipmap_h */
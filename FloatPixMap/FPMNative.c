@@ -0,0 +1,347 @@
+/*
+	FPMNative.c
+	FloatPixMap
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include "FPMNative.h"
+#include "FPMPixelFormat.h"
+#include <assert.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifndef _WIN32
+#define FPM_NATIVE_USE_MMAP		1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#define FPM_NATIVE_USE_MMAP		0
+#endif
+
+
+#if FPM_EXTRA_VALIDATION
+/*	FPM_INTERNAL_ASSERT()
+	Used only to assert preconditions of internal, static functions
+	(generally, pm != NULL). Plain assert() is used to check public
+	functions where relevant.
+*/
+#define FPM_INTERNAL_ASSERT(x) assert(x)
+#else
+#define FPM_INTERNAL_ASSERT(x) do {} while (0)
+#endif
+
+
+enum
+{
+	kNativeVersion				= 1,
+	kNativeRowAlignment			= 64,
+	kNativeByteOrderMark		= 0x01020304,
+	kChecksumChunkSize			= 1 << 30	// zlib's crc32() takes a 32-bit length.
+};
+
+static const char kNativeMagic[8] = { 'F', 'P', 'M', 'N', 'A', 'T', 'V', '\n' };
+
+
+typedef struct
+{
+	char						magic[8];
+	uint32_t					byteOrderMark;
+	uint32_t					version;
+	uint32_t					headerSize;		// sizeof (NativeHeader), the offset of the first row.
+	uint32_t					format;			// FPMPixelFormat.
+	uint32_t					width;
+	uint32_t					height;
+	uint64_t					rowBytes;		// Multiple of kNativeRowAlignment.
+	float						storageGamma;
+	uint32_t					checksum;		// CRC-32 of all rows, including padding.
+	uint32_t					reserved[4];
+} NativeHeader;
+
+
+typedef struct
+{
+	void						*base;
+	size_t						length;
+} NativeMapping;
+
+
+static NativeMapping *MapFile(const char *path, const char **error);
+static void UnmapFile(NativeMapping *mapping);
+static void ReleaseMapping(void *storage, void *releaseContext);
+static const char *ValidateHeader(const NativeHeader *header, size_t fileSize);
+static uint32_t UpdateChecksum(uint32_t checksum, const void *bytes, size_t length);
+
+
+bool FPMIsNativeFile(const char *path)
+{
+	if (path == NULL)  return false;
+	
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)  return false;
+	
+	char magic[sizeof kNativeMagic];
+	bool result = fread(magic, sizeof magic, 1, file) == 1 && memcmp(magic, kNativeMagic, sizeof magic) == 0;
+	fclose(file);
+	return result;
+}
+
+
+FloatPixMapRef FPMCreateWithNative(const char *path, FPMNativeReadFlags flags, FPMNativeErrorHandler errorHandler, void *callbackContext)
+{
+	if (path == NULL)  return NULL;
+	
+	const char *error = NULL;
+	NativeMapping *mapping = NULL;
+	FloatPixMapRef result = NULL;
+	NativeHeader header;
+	
+	mapping = MapFile(path, &error);
+	if (mapping == NULL)  goto FAIL;
+	
+	if (mapping->length < sizeof header)
+	{
+		error = "not a native FloatPixMap file.";
+		goto FAIL;
+	}
+	memcpy(&header, mapping->base, sizeof header);
+	
+	error = ValidateHeader(&header, mapping->length);
+	if (error != NULL)  goto FAIL;
+	
+	uint8_t *rows = (uint8_t *)mapping->base + header.headerSize;
+	if ((flags & kFPMNativeVerifyChecksum) && UpdateChecksum(0, rows, header.rowBytes * header.height) != header.checksum)
+	{
+		error = "checksum does not match, the file is damaged.";
+		goto FAIL;
+	}
+	
+	size_t bytesPerPixel = FPMPixelFormatBytesPerPixel(header.format);
+	result = FPMCreateWithStorage(FPMMakeSize(header.width, header.height), header.rowBytes / bytesPerPixel, header.format, header.storageGamma, rows, ReleaseMapping, mapping);
+	if (result == NULL)
+	{
+		error = "could not create pixmap.";
+		goto FAIL;
+	}
+	
+	return result;
+	
+FAIL:
+	if (errorHandler != NULL && error != NULL)  errorHandler(error, true, callbackContext);
+	UnmapFile(mapping);
+	return NULL;
+}
+
+
+bool FPMWriteNative(FloatPixMapRef pm, const char *path, FPMNativeErrorHandler errorHandler, void *callbackContext)
+{
+	if (pm == NULL || path == NULL)  return false;
+	
+	FPMStorageInfo info;
+	FPMGetStorageInformation(pm, &info);
+	if (info.buffer == NULL)
+	{
+		if (errorHandler != NULL)  errorHandler("cannot write an empty pixmap.", true, callbackContext);
+		return false;
+	}
+	
+	static const uint8_t padding[kNativeRowAlignment] = { 0 };
+	size_t usedBytes = (size_t)info.width * FPMPixelFormatBytesPerPixel(info.format);
+	size_t rowBytes = (usedBytes + kNativeRowAlignment - 1) & ~(size_t)(kNativeRowAlignment - 1);
+	size_t paddingBytes = rowBytes - usedBytes;
+	
+	NativeHeader header =
+	{
+		.byteOrderMark = kNativeByteOrderMark,
+		.version = kNativeVersion,
+		.headerSize = sizeof header,
+		.format = info.format,
+		.width = info.width,
+		.height = info.height,
+		.rowBytes = rowBytes,
+		.storageGamma = info.storageGamma
+	};
+	memcpy(header.magic, kNativeMagic, sizeof header.magic);
+	
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		if (errorHandler != NULL)  errorHandler("could not create file.", true, callbackContext);
+		return false;
+	}
+	
+	// Write a placeholder header, then the rows, then the header again with the checksum filled in.
+	bool OK = fwrite(&header, sizeof header, 1, file) == 1;
+	
+	uint32_t checksum = 0;
+	FPMDimension y;
+	for (y = 0; y < info.height && OK; y++)
+	{
+		const uint8_t *row = (const uint8_t *)info.buffer + y * info.rowBytes;
+		OK = fwrite(row, 1, usedBytes, file) == usedBytes && fwrite(padding, 1, paddingBytes, file) == paddingBytes;
+		checksum = UpdateChecksum(checksum, row, usedBytes);
+		checksum = UpdateChecksum(checksum, padding, paddingBytes);
+	}
+	
+	header.checksum = checksum;
+	OK = OK && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof header, 1, file) == 1;
+	OK = (fclose(file) == 0) && OK;
+	
+	if (!OK)
+	{
+		if (errorHandler != NULL)  errorHandler("could not write file.", true, callbackContext);
+		remove(path);
+	}
+	return OK;
+}
+
+
+static const char *ValidateHeader(const NativeHeader *header, size_t fileSize)
+{
+	FPM_INTERNAL_ASSERT(header != NULL && fileSize >= sizeof *header);
+	
+	if (memcmp(header->magic, kNativeMagic, sizeof header->magic) != 0)  return "not a native FloatPixMap file.";
+	if (header->byteOrderMark != kNativeByteOrderMark)  return "file was written on a machine with a different byte order.";
+	if (header->version != kNativeVersion || header->headerSize != sizeof *header)  return "unsupported native FloatPixMap file version.";
+	
+	size_t bytesPerPixel = FPMPixelFormatBytesPerPixel(header->format);
+	if (bytesPerPixel == 0 ||
+		header->width == 0 ||
+		header->height == 0 ||
+		header->rowBytes < (uint64_t)header->width * bytesPerPixel ||
+		header->rowBytes % kNativeRowAlignment != 0 ||
+		header->rowBytes / bytesPerPixel > UINT32_MAX)
+	{
+		return "invalid header.";
+	}
+	
+	if (header->rowBytes > (fileSize - sizeof *header) / header->height)  return "file is truncated.";
+	
+	return NULL;
+}
+
+
+static uint32_t UpdateChecksum(uint32_t checksum, const void *bytes, size_t length)
+{
+	const Bytef *next = bytes;
+	while (length > 0)
+	{
+		uInt chunk = (length > kChecksumChunkSize) ? kChecksumChunkSize : length;
+		checksum = crc32(checksum, next, chunk);
+		next += chunk;
+		length -= chunk;
+	}
+	return checksum;
+}
+
+
+static NativeMapping *MapFile(const char *path, const char **error)
+{
+	FPM_INTERNAL_ASSERT(path != NULL && error != NULL);
+	
+	NativeMapping *mapping = calloc(1, sizeof *mapping);
+	if (mapping == NULL)
+	{
+		*error = "out of memory.";
+		return NULL;
+	}
+	
+#if FPM_NATIVE_USE_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		*error = "file not found.";
+		goto FAIL;
+	}
+	
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size <= 0 || (uintmax_t)info.st_size > SIZE_MAX)
+	{
+		*error = "could not read file.";
+		close(fd);
+		goto FAIL;
+	}
+	mapping->length = info.st_size;
+	
+	/*	A private mapping, so that the pixmap can be modified like any other
+		without writing to the file. Untouched pages stay shared with the page
+		cache, and with other processes using the same file.
+	*/
+	mapping->base = mmap(NULL, mapping->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping->base == MAP_FAILED)
+	{
+		mapping->base = NULL;
+		*error = "could not map file.";
+		goto FAIL;
+	}
+#else
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		*error = "file not found.";
+		goto FAIL;
+	}
+	
+	long length = -1;
+	if (fseek(file, 0, SEEK_END) == 0)  length = ftell(file);
+	if (length > 0 && fseek(file, 0, SEEK_SET) == 0)
+	{
+		mapping->length = length;
+		mapping->base = malloc(mapping->length);
+	}
+	if (mapping->base == NULL || fread(mapping->base, mapping->length, 1, file) != 1)
+	{
+		*error = "could not read file.";
+		fclose(file);
+		goto FAIL;
+	}
+	fclose(file);
+#endif
+	
+	return mapping;
+	
+FAIL:
+	UnmapFile(mapping);
+	return NULL;
+}
+
+
+static void UnmapFile(NativeMapping *mapping)
+{
+	if (mapping == NULL)  return;
+	
+#if FPM_NATIVE_USE_MMAP
+	if (mapping->base != NULL)  munmap(mapping->base, mapping->length);
+#else
+	free(mapping->base);
+#endif
+	free(mapping);
+}
+
+
+static void ReleaseMapping(void *storage, void *releaseContext)
+{
+	UnmapFile(releaseContext);
+}
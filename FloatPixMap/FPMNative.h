@@ -0,0 +1,83 @@
+/*
+	FPMNative.h
+	FloatPixMap
+	
+	Native, memory-mappable file format for FloatPixMap.
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef INCLUDED_FPMNative_h
+#define INCLUDED_FPMNative_h
+
+#include "FloatPixMap.h"
+
+FPM_BEGIN_EXTERN_C
+
+
+/*	The native format is a 64-byte header followed by the pixel rows exactly
+	as they are held in memory, each padded to a multiple of 64 bytes, so a
+	file can be mapped and used as a pixmap's storage without decoding or
+	copying anything. Any FPMPixelFormat may be stored. Files are written in
+	the writer's byte order and are only readable on machines with the same
+	byte order; they are intended as caches, not for interchange.
+	
+	The header includes a CRC-32 of the pixel data, which is checked on load
+	if kFPMNativeVerifyChecksum is set. Checking touches every page of the
+	file, so it isn't free, but it is much cheaper than decoding a PNG.
+*/
+enum
+{
+	kFPMNativeVerifyChecksum	= 0x00000001
+};
+typedef uint32_t FPMNativeReadFlags;
+
+
+/*	Callback type for error handling. Native files only produce errors, so
+	isError is always true; the signature matches FPMPNGErrorHandler.
+*/
+typedef void FPMNativeErrorHandler(const char *message, bool isError, void *callbackContext);
+
+
+/*	FPMIsNativeFile()
+	Returns true if the file at path starts with a native format header.
+*/
+bool FPMIsNativeFile(const char *path);
+
+
+/*	FPMCreateWithNative()
+	Map a native format file as the storage of a new pixmap. The mapping is
+	private, so writing to the pixmap does not modify the file. On systems
+	without mmap(), the file is read into memory instead.
+*/
+FloatPixMapRef FPMCreateWithNative(const char *path, FPMNativeReadFlags flags, FPMNativeErrorHandler errorHandler, void *callbackContext);
+
+
+/*	FPMWriteNative()
+	Write a pixmap of any format to the specified path in native format.
+*/
+bool FPMWriteNative(FloatPixMapRef pm, const char *path, FPMNativeErrorHandler errorHandler, void *callbackContext);
+
+
+FPM_END_EXTERN_C
+#endif	/* INCLUDED_FPMNative_h */
@@ -25,7 +25,12 @@
 */
 
 #include "FPMPNG.h"
+#include "FPMPixelFormat.h"
 #include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <zlib.h>
 
 
 #if FPM_EXTRA_VALIDATION
@@ -44,13 +49,11 @@ static void PNGReadFile(png_structp png, png_bytep bytes, png_size_t size);
 static void PNGWriteFile(png_structp png, png_bytep bytes, png_size_t size);
 static void PNGError(png_structp png, png_const_charp message);
 static void PNGWarning(png_structp png, png_const_charp message);
-FloatPixMapRef ConvertPNGData(void *data, size_t width, size_t height, size_t rowBytes, uint8_t depth, uint8_t colorType);
-static FloatPixMapRef ConvertPNGDataRGBA8(FloatPixMapRef pm, uint8_t *data, size_t width, size_t height, size_t rowBytes);
-static FloatPixMapRef ConvertPNGDataRGBA16(FloatPixMapRef pm, uint8_t *data, size_t width, size_t height, size_t rowBytes);
-static FloatPixMapRef ConvertPNGDataRGB16(FloatPixMapRef pm, uint8_t *data, size_t width, size_t height, size_t rowBytes);
-typedef void (*RowTransformer)(void *data, size_t width);
-static void TransformRow16(void *data, size_t width);
-static void TransformRow8(void *data, size_t width);
+static bool ReadCompactRows(FPMPNGReaderRef reader, FloatPixMapRef pm);
+static bool ReadRawRows(FPMPNGReaderRef reader, png_bytep buffer, size_t rowBytes, FPMDimension rowCount);
+static void ConvertRow8(void *data, size_t width);
+static void ConvertRow16(void *data, size_t width);
+static bool EncodeRows(FPMPNGWriterRef writer, FloatPixMapRef pm);
 
 
 typedef struct
@@ -62,146 +65,444 @@ typedef struct
 
 FloatPixMapRef FPMCreateWithPNG(const char *path, FPMGammaFactor desiredGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext)
 {
-	if (path != NULL)
+	return FPMCreateWithPNGReader(FPMPNGReaderCreate(path, desiredGamma, errorHandler, progressHandler, callbackContext), kFPMFormatRGBAFloat);
+}
+
+
+FloatPixMapRef FPMCreateWithPNGCustom(png_voidp ioPtr, png_rw_ptr readDataFn, FPMGammaFactor desiredGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext)
+{
+	return FPMCreateWithPNGReader(FPMPNGReaderCreateCustom(ioPtr, readDataFn, desiredGamma, errorHandler, progressHandler, callbackContext), kFPMFormatRGBAFloat);
+}
+
+
+struct FPMPNGReader
+{
+	png_structp				png;
+	png_infop				pngInfo;
+	png_infop				pngEndInfo;
+	ErrorInfo				errInfo;
+	FILE					*file;			// NULL for custom I/O.
+	
+	FPMGammaFactor			fileGamma;
+	FPMGammaFactor			desiredGamma;
+	
+	FPMDimension			width;
+	FPMDimension			height;
+	FPMDimension			rowsRead;
+	unsigned				bitsPerChannel;
+	unsigned				passCount;
+	bool					failed;
+	
+	FPMPNGProgressHandler	*progressHandler;
+	void					*callbackContext;
+};
+
+
+FloatPixMapRef FPMCreateWithPNGReader(FPMPNGReaderRef reader, FPMPixelFormat format)
+{
+	if (reader == NULL)  return NULL;
+	
+	/*	Integer formats keep the file's gamma, so that the raw rows can be
+		used as they are, except that sixteen-bit files squeezed into eight
+		bits are stored as sRGB to make the best use of the levels.
+	*/
+	FPMGammaFactor storageGamma = reader->fileGamma;
+	if (format == kFPMFormatRGBA8 && reader->bitsPerChannel == 16)  storageGamma = kFPMGammaSRGB;
+	
+	FloatPixMapRef result = FPMCreateWithFormat(FPMPNGReaderGetSize(reader), format, storageGamma / reader->desiredGamma);
+	if (result == NULL)
 	{
-		// Attempt to open file.
-		FILE *file = fopen(path, "rb");
-		if (file == NULL)
-		{
-			if (errorHandler != NULL)  errorHandler("file not found.", true, callbackContext);
-			return NULL;
-		}
-		
-		png_byte bytes[8];
-		if (fread(bytes, 8, 1, file) < 1)
-		{
-			if (errorHandler != NULL)  errorHandler("could not read file.", true, callbackContext);
-			return NULL;
-		}
-		if (png_sig_cmp(bytes, 0, 8) != 0)
-		{
-			if (errorHandler != NULL)  errorHandler("not a PNG.", true, callbackContext);
-			return NULL;
-		}
-		
-		if (fseek(file, 0, SEEK_SET) != 0)
-		{
-			if (errorHandler != NULL)  errorHandler("could not read file.", true, callbackContext);
-			return NULL;
-		}
-		
-		FloatPixMapRef result = FPMCreateWithPNGCustom(file, PNGReadFile, desiredGamma, errorHandler, progressHandler, callbackContext);
+		if (reader->errInfo.errorCB != NULL)  reader->errInfo.errorCB("Could not convert PNG data to native representation.", true, reader->errInfo.errorCBContext);
+		FPMPNGReaderAbort(reader);
+		return NULL;
+	}
+	
+	bool OK = (format == kFPMFormatRGBAFloat) ? FPMPNGReaderReadRows(reader, result) : ReadCompactRows(reader, result);
+	if (!OK)
+	{
+		FPMPNGReaderAbort(reader);
+		FPMRelease(&result);
+		return NULL;
+	}
+	
+	if (!FPMPNGReaderFinish(reader))  FPMRelease(&result);
+	return result;
+}
+
+
+FPMPNGReaderRef FPMPNGReaderCreate(const char *path, FPMGammaFactor desiredGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext)
+{
+	if (path == NULL)  return NULL;
+	
+	// Attempt to open file.
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		if (errorHandler != NULL)  errorHandler("file not found.", true, callbackContext);
+		return NULL;
+	}
+	
+	png_byte bytes[8];
+	const char *error = NULL;
+	if (fread(bytes, 8, 1, file) < 1)  error = "could not read file.";
+	else if (png_sig_cmp(bytes, 0, 8) != 0)  error = "not a PNG.";
+	else if (fseek(file, 0, SEEK_SET) != 0)  error = "could not read file.";
+	
+	if (error != NULL)
+	{
+		if (errorHandler != NULL)  errorHandler(error, true, callbackContext);
 		fclose(file);
-		return result;
+		return NULL;
 	}
-	else
+	
+	FPMPNGReaderRef reader = FPMPNGReaderCreateCustom(file, PNGReadFile, desiredGamma, errorHandler, progressHandler, callbackContext);
+	if (reader == NULL)
 	{
+		fclose(file);
 		return NULL;
 	}
+	
+	reader->file = file;
+	return reader;
 }
 
 
-FloatPixMapRef FPMCreateWithPNGCustom(png_voidp ioPtr, png_rw_ptr readDataFn, FPMGammaFactor desiredGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext)
+FPMPNGReaderRef FPMPNGReaderCreateCustom(png_voidp ioPtr, png_rw_ptr readDataFn, FPMGammaFactor desiredGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext)
 {
-	png_structp			png = NULL;
-	png_infop			pngInfo = NULL;
-	png_infop			pngEndInfo = NULL;
-	FloatPixMapRef		result = NULL;
-	png_uint_32			i, width, height, rowBytes;
+	png_uint_32			width, height;
 	int					depth, colorType;
-	void				*data = NULL;
-	ErrorInfo			errInfo = { errorHandler, callbackContext };
 	
-	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &errInfo, PNGError, PNGWarning);
-	if (png == NULL)  goto FAIL;
+	// volatile because it's used after libpng longjmp()s to FAIL.
+	FPMPNGReaderRef volatile reader = calloc(1, sizeof *reader);
+	if (reader == NULL)  return NULL;
+	
+	reader->errInfo = (ErrorInfo){ errorHandler, callbackContext };
+	reader->desiredGamma = desiredGamma;
+	reader->progressHandler = progressHandler;
+	reader->callbackContext = callbackContext;
 	
-	pngInfo = png_create_info_struct(png);
-	if (pngInfo == NULL)  goto FAIL;
+	reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &reader->errInfo, PNGError, PNGWarning);
+	if (reader->png == NULL)  goto FAIL;
 	
-	pngEndInfo = png_create_info_struct(png);
-	if (pngEndInfo == NULL)  goto FAIL;
+	reader->pngInfo = png_create_info_struct(reader->png);
+	if (reader->pngInfo == NULL)  goto FAIL;
 	
-	if (setjmp(png_jmpbuf(png)))
+	reader->pngEndInfo = png_create_info_struct(reader->png);
+	if (reader->pngEndInfo == NULL)  goto FAIL;
+	
+	if (setjmp(png_jmpbuf(reader->png)))
 	{
 		// libpng will jump here on error.
 		goto FAIL;
 	}
 	
-	png_set_read_fn(png, ioPtr, readDataFn);
+	png_set_read_fn(reader->png, ioPtr, readDataFn);
 	
-	png_read_info(png, pngInfo);
-	if (!png_get_IHDR(png, pngInfo, &width, &height, &depth, &colorType, NULL, NULL, NULL))  goto FAIL;
+	png_read_info(reader->png, reader->pngInfo);
+	if (!png_get_IHDR(reader->png, reader->pngInfo, &width, &height, &depth, &colorType, NULL, NULL, NULL))  goto FAIL;
 	
+	/*	Whatever the file format, ask libpng for RGBA rows with eight or
+		sixteen bits per channel, in native byte order.
+	*/
 #if FPM_LITTLE_ENDIAN
-	if (depth == 16)  png_set_swap(png);
+	if (depth == 16)  png_set_swap(reader->png);
 #endif
-	if (depth <= 8 && !(colorType & PNG_COLOR_MASK_ALPHA))
+	if (!(colorType & PNG_COLOR_MASK_ALPHA))
 	{
-		png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+		png_set_filler(reader->png, (depth == 16) ? 0xFFFF : 0xFF, PNG_FILLER_AFTER);
 	}
-	png_set_gray_to_rgb(png);
+	png_set_gray_to_rgb(reader->png);
 	if (depth < 8)
 	{
-		png_set_packing(png);
-		png_set_expand(png);
+		png_set_packing(reader->png);
+		png_set_expand(reader->png);
 	}
 	
 	if (colorType & PNG_COLOR_MASK_PALETTE)
 	{
-		png_set_palette_to_rgb(png);
+		png_set_palette_to_rgb(reader->png);
+	}
+	
+	reader->passCount = png_set_interlace_handling(reader->png);
+	
+	png_read_update_info(reader->png, reader->pngInfo);
+	
+	reader->width = width;
+	reader->height = height;
+	reader->bitsPerChannel = png_get_bit_depth(reader->png, reader->pngInfo);
+	
+	// Libpng transformations should have given us one of these formats.
+	if ((reader->bitsPerChannel != 8 && reader->bitsPerChannel != 16) || png_get_rowbytes(reader->png, reader->pngInfo) != (size_t)width * reader->bitsPerChannel / 2)
+	{
+		if (errorHandler != NULL)  errorHandler("Could not convert PNG data to native representation.", true, callbackContext);
+		goto FAIL;
+	}
+	
+	double invGamma = 1.0/kFPMGammaSRGB;
+	png_get_gAMA(reader->png, reader->pngInfo, &invGamma);
+	reader->fileGamma = 1.0/invGamma;
+	
+	return reader;
+	
+FAIL:
+	FPMPNGReaderAbort(reader);
+	return NULL;
+}
+
+
+FPMSize FPMPNGReaderGetSize(FPMPNGReaderRef reader)
+{
+	if (reader == NULL)  return FPMMakeSize(0, 0);
+	return FPMMakeSize(reader->width, reader->height);
+}
+
+
+unsigned FPMPNGReaderGetBitsPerChannel(FPMPNGReaderRef reader)
+{
+	if (reader == NULL)  return 0;
+	return reader->bitsPerChannel;
+}
+
+
+FPMGammaFactor FPMPNGReaderGetFileGamma(FPMPNGReaderRef reader)
+{
+	if (reader == NULL)  return kFPMGammaSRGB;
+	return reader->fileGamma;
+}
+
+
+bool FPMPNGReaderReadRows(FPMPNGReaderRef reader, FloatPixMapRef pm)
+{
+	if (reader == NULL || pm == NULL || FPMGetPixelFormat(pm) != kFPMFormatRGBAFloat)  return false;
+	
+	FPMDimension width = FPMGetWidth(pm);
+	FPMDimension height = FPMGetHeight(pm);
+	if (width != reader->width)
+	{
+		if (reader->errInfo.errorCB != NULL)  reader->errInfo.errorCB("rows do not fit the image being read.", true, reader->errInfo.errorCBContext);
+		reader->failed = true;
+		return false;
 	}
 	
-	int j, passCount = png_set_interlace_handling(png);
+	/*	A float row is always large enough to hold the corresponding PNG row,
+		so the PNG data is read straight into the pixmap and expanded in place.
+		This way, no second copy of the image is ever needed.
+	*/
+	if (!ReadRawRows(reader, (png_bytep)FPMGetBufferPointer(pm), FPMGetRowByteCount(pm), height))  return false;
 	
-	png_read_update_info(png, pngInfo);
-	rowBytes = png_get_rowbytes(png, pngInfo);
+	size_t i;
+	for (i = 0; i < height; i++)
+	{
+		void *row = FPMGetPixelPointerC(pm, 0, i);
+		FPM_INTERNAL_ASSERT(row != NULL);
 	
-	data = malloc(rowBytes * height);
-	if (data == NULL)  goto FAIL;
+		if (reader->bitsPerChannel == 16)  ConvertRow16(row, width);
+		else  ConvertRow8(row, width);
+	}
+	
+	FPMApplyGamma(pm, reader->fileGamma, reader->desiredGamma, (reader->bitsPerChannel == 16) ? 65536 : 256);
+	return true;
+}
+
+
+bool FPMPNGReaderReadRawRows(FPMPNGReaderRef reader, void *buffer, size_t rowBytes, FPMDimension rowCount)
+{
+	if (reader == NULL || buffer == NULL)  return false;
 	
-	// Read image data.
-	float progressNumerator = 0.0f, progressDenominator = passCount * height;
-	for (j = 0; j < passCount; j++)
+	if (rowBytes < (size_t)reader->width * reader->bitsPerChannel / 2)
 	{
-		for (i = 0; i < height; i++)
+		if (reader->errInfo.errorCB != NULL)  reader->errInfo.errorCB("rows do not fit the image being read.", true, reader->errInfo.errorCBContext);
+		reader->failed = true;
+		return false;
+	}
+	
+	return ReadRawRows(reader, buffer, rowBytes, rowCount);
+}
+
+
+static bool ReadRawRows(FPMPNGReaderRef reader, png_bytep buffer, size_t rowBytes, FPMDimension rowCount)
+{
+	FPM_INTERNAL_ASSERT(reader != NULL && buffer != NULL);
+	
+	if (reader->failed)  return false;
+	
+	const char *error = NULL;
+	if (rowCount > reader->height - reader->rowsRead)  error = "rows do not fit the image being read.";
+	else if (reader->passCount > 1 && rowCount != reader->height)  error = "interlaced PNG images must be read in one piece.";
+	if (error != NULL)
+	{
+		if (reader->errInfo.errorCB != NULL)  reader->errInfo.errorCB(error, true, reader->errInfo.errorCBContext);
+		reader->failed = true;
+		return false;
+	}
+	
+	if (setjmp(png_jmpbuf(reader->png)))
+	{
+		// libpng will jump here on error.
+		reader->failed = true;
+		return false;
+	}
+	
+	size_t i;
+	unsigned j;
+	float progressNumerator = reader->rowsRead, progressDenominator = (float)reader->passCount * (float)reader->height;
+	for (j = 0; j < reader->passCount; j++)
+	{
+		for (i = 0; i < rowCount; i++)
 		{
-			png_read_row(png, (png_bytep)data + i * rowBytes, NULL);
-			
-			if (progressHandler)
+			png_read_row(reader->png, buffer + i * rowBytes, NULL);
+	
+			if (reader->progressHandler)
 			{
 				progressNumerator++;
-				progressHandler(progressNumerator / progressDenominator, callbackContext);
+				reader->progressHandler(progressNumerator / progressDenominator, reader->callbackContext);
 			}
 		}
 	}
 	
-	png_read_end(png, pngEndInfo);
+	reader->rowsRead += rowCount;
+	return true;
+}
+
+
+/*	ReadCompactRows()
+	Read the whole image into a pixmap with a compact pixel format. If that
+	is the file's own raw format, rows are read straight into the pixmap;
+	otherwise, bands of rows (or, for interlaced files, the whole image) are
+	read into a scratch buffer and converted.
+*/
+enum { kCompactReadBandHeight = 64 };
+
+static bool ReadCompactRows(FPMPNGReaderRef reader, FloatPixMapRef pm)
+{
+	FPM_INTERNAL_ASSERT(reader != NULL && pm != NULL);
 	
-	result = ConvertPNGData(data, width, height, rowBytes, png_get_bit_depth(png, pngInfo), png_get_color_type(png, pngInfo));
+	FPMStorageInfo info;
+	FPMGetStorageInformation(pm, &info);
+	bool sixteenBit = (reader->bitsPerChannel == 16);
 	
-	if (result != NULL)
+	if (info.format == (sixteenBit ? kFPMFormatRGBA16 : kFPMFormatRGBA8))
 	{
-		double invGamma = 1.0/kFPMGammaSRGB;
-		png_get_gAMA(png, pngInfo, &invGamma);
-		FPMApplyGamma(result, 1.0/invGamma, desiredGamma, png_get_bit_depth(png, pngInfo) == 16 ? 65536 : 256);
+		return ReadRawRows(reader, info.buffer, info.rowBytes, reader->height);
 	}
-	else
+	
+	float *table = NULL;
+	uint8_t *band = NULL;
+	
+	/*	Decoding table for raw values, with the same arithmetic as
+		FPMPNGReaderReadRows(): ConvertRow8()/ConvertRow16() scaling, then the
+		FPMApplyGamma() kernel, applied to a chunk of pixels at a time.
+	*/
+	enum { kTableChunk = 256 };
+	size_t i, j, count = sixteenBit ? 65536 : 256;
+	FPMGammaFactor gamma = reader->fileGamma / reader->desiredGamma;
+	table = malloc(count * sizeof *table);
+	if (table == NULL)  goto FAIL;
+	for (i = 0; i < count; i += kTableChunk)
 	{
-		if (errorHandler != NULL)  errorHandler("Could not convert PNG data to native representation.", true, callbackContext);
+		FPMColor chunk[kTableChunk];
+		for (j = 0; j < kTableChunk; j++)
+		{
+			float value = sixteenBit ? (float)(i + j) * 1.0f/65535.0f : (float)(i + j) * 1.0f/255.0f;
+			chunk[j] = FPMMakeColor(value, value, value, 1.0f);
+		}
+		if (reader->fileGamma != reader->desiredGamma)  FPMApplyGammaToPixels(chunk, kTableChunk, gamma);
+		for (j = 0; j < kTableChunk; j++)  table[i + j] = chunk[j].r;
 	}
-
 	
-	png_destroy_read_struct(&png, &pngInfo, &pngEndInfo);
-	free(data);
+	FPMDimension bandHeight = (reader->passCount > 1) ? reader->height : kCompactReadBandHeight;
+	size_t rawRowBytes = (size_t)reader->width * reader->bitsPerChannel / 2;
+	if (rawRowBytes > SIZE_MAX / bandHeight)  goto FAIL;
+	band = malloc(rawRowBytes * bandHeight);
+	if (band == NULL)  goto FAIL;
 	
-	return result;
+	FPMDimension x, y, row;
+	for (y = 0; y < reader->height; y += bandHeight)
+	{
+		FPMDimension rowCount = reader->height - y;
+		if (rowCount > bandHeight)  rowCount = bandHeight;
+		if (!ReadRawRows(reader, band, rawRowBytes, rowCount))  goto FAIL;
+	
+		for (row = 0; row < rowCount; row++)
+		{
+			const uint8_t *src8 = band + row * rawRowBytes;
+			const uint16_t *src16 = (const uint16_t *)src8;
+	
+			if (!sixteenBit && info.format == kFPMFormatRGBA16)
+			{
+				// Same gamma encoding, so widening is exact.
+				uint16_t *dst = (uint16_t *)((uint8_t *)info.buffer + (y + row) * info.rowBytes);
+				for (x = 0; x < reader->width * 4; x++)  dst[x] = src8[x] * 257;
+				continue;
+			}
+	
+			for (x = 0; x < reader->width; x++)
+			{
+				FPMColor color;
+				if (sixteenBit)
+				{
+					color = FPMMakeColor(table[src16[0]], table[src16[1]], table[src16[2]], (float)src16[3] * 1.0f/65535.0f);
+					src16 += 4;
+				}
+				else
+				{
+					color = FPMMakeColor(table[src8[0]], table[src8[1]], table[src8[2]], (float)src8[3] * 1.0f/255.0f);
+					src8 += 4;
+				}
+				FPMEncodePixel(&info, info.format, x, y + row, color);
+			}
+		}
+	}
+	
+	free(table);
+	free(band);
+	return true;
 	
 FAIL:
-	FPMRelease(&result);
-	if (png != NULL)  png_destroy_read_struct(&png, &pngInfo, &pngEndInfo);
-	free(data);
+	if (reader->errInfo.errorCB != NULL && !reader->failed)  reader->errInfo.errorCB("Could not convert PNG data to native representation.", true, reader->errInfo.errorCBContext);
+	reader->failed = true;
+	free(table);
+	free(band);
+	return false;
+}
+
+
+bool FPMPNGReaderFinish(FPMPNGReaderRef reader)
+{
+	if (reader == NULL)  return false;
 	
-	return NULL;
+	bool success = !reader->failed;
+	if (success && reader->rowsRead != reader->height)
+	{
+		if (reader->errInfo.errorCB != NULL)  reader->errInfo.errorCB("not all rows of the image were read.", true, reader->errInfo.errorCBContext);
+		success = false;
+	}
+	
+	if (success)
+	{
+		if (setjmp(png_jmpbuf(reader->png)))
+		{
+			// libpng will jump here on error.
+			success = false;
+		}
+		else
+		{
+			png_read_end(reader->png, reader->pngEndInfo);
+		}
+	}
+	
+	FPMPNGReaderAbort(reader);
+	return success;
+}
+
+
+void FPMPNGReaderAbort(FPMPNGReaderRef reader)
+{
+	if (reader == NULL)  return;
+	
+	if (reader->png != NULL)  png_destroy_read_struct(&reader->png, &reader->pngInfo, &reader->pngEndInfo);
+	if (reader->file != NULL)  fclose(reader->file);
+	free(reader);
 }
 
 
@@ -228,91 +529,36 @@ bool FPMWritePNG(FloatPixMapRef pm, const char *path, FPMWritePNGFlags options,
 }
 
 
+enum
+{
+	kWriteBandRows			= 256
+};
+
+
 bool FPMWritePNGCustom(FloatPixMapRef srcPM, png_voidp ioPtr, png_rw_ptr writeDataFn, png_flush_ptr flushDataFn, FPMWritePNGFlags options, FPMGammaFactor sourceGamma, FPMGammaFactor fileGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext)
 {
 	if (srcPM != NULL)
 	{
-		bool				success = false;
-		png_structp			png = NULL;
-		png_infop			pngInfo = NULL;
-		FloatPixMapRef		pm = NULL;
-		ErrorInfo			errInfo = { errorHandler, callbackContext };
+		FPMPNGWriterRef writer = FPMPNGWriterCreateCustom(ioPtr, writeDataFn, flushDataFn, FPMGetSize(srcPM), options, sourceGamma, fileGamma, errorHandler, progressHandler, callbackContext);
+		if (writer == NULL)  return false;
 		
-		// Prepare data.
-		FPMDimension width = FPMGetWidth(srcPM);
-		FPMDimension height = FPMGetHeight(srcPM);
-		if (width > UINT32_MAX || height > UINT32_MAX)
+		// Pass the image a band at a time, to bound the writer's buffers.
+		FPMDimension y, width = FPMGetWidth(srcPM), height = FPMGetHeight(srcPM);
+		bool success = true;
+		for (y = 0; y < height && success; y += kWriteBandRows)
 		{
-			if (errorHandler != NULL)  errorHandler("image is too large for PNG format.", true, callbackContext);
-			return false;
-		}
-		
-		pm = FPMCopy(srcPM);
-		if (pm == NULL)  return false;
-		
-		unsigned steps = (options & kFPMWritePNG16BPC) ? 0x10000 : 0x100;
-		FPMApplyGamma(pm, sourceGamma, fileGamma, steps);
-		FPMQuantize(pm, 0.0f, 1.0f, 0.0f, steps - 1, steps, (options & kFPMQuantizeDither & kFPMQuantizeJitter) | kFMPQuantizeClip | kFMPQuantizeAlpha);
-		
-		png = png_create_write_struct(PNG_LIBPNG_VER_STRING, &errInfo, PNGError, PNGWarning);
-		if (png == NULL)  goto FAIL;
-		
-		pngInfo = png_create_info_struct(png);
-		if (pngInfo == NULL)  goto FAIL;
-		
-		if (setjmp(png_jmpbuf(png)))
-		{
-			// libpng will jump here on error.
-			goto FAIL;
-		}
-		
-		png_set_write_fn(png, ioPtr, writeDataFn, flushDataFn);
-		
-		png_set_IHDR(png, pngInfo, width, height, (options & kFPMWritePNG16BPC) ? 16 : 8,PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-		
-		if (fileGamma == kFPMGammaSRGB)
-		{
-			png_set_sRGB_gAMA_and_cHRM(png, pngInfo, PNG_sRGB_INTENT_PERCEPTUAL);
-		}
-		else
-		{
-			png_set_gAMA(png, pngInfo, fileGamma);
-		}
-		
-		/*	Select function used to transform a row of data to PNG-friendly
-			format. NOTE: these work in place,and overwrite the data in pm,
-			which is OK since we copied it.
-		*/
-		RowTransformer transformer = NULL;
-		if (options & kFPMWritePNG16BPC)
-		{
-			transformer = TransformRow16;
-		}
-		else
-		{
-			transformer = TransformRow8;
-		}
-		
-		png_write_info(png, pngInfo);
-		
-		size_t i;
-		size_t rowOffset = FPMGetRowByteCount(pm);
-		png_bytep row = (png_bytep)FPMGetBufferPointer(pm);
-		for (i = 0; i < height; i++)
-		{
-			transformer(row, width);
-			png_write_row(png, row);
-			row += rowOffset;
-			if (progressHandler)  progressHandler((float)(i + 1) / (float)height, callbackContext);
+			FPMDimension rowCount = height - y;
+			if (rowCount > kWriteBandRows)  rowCount = kWriteBandRows;
+			
+			FloatPixMapRef pm = FPMCreateSubC(srcPM, 0, y, width, rowCount);
+			success = pm != NULL && FPMPNGWriterAppendRows(writer, pm);
+			FPMRelease(&pm);
 		}
-		png_write_end(png, pngInfo);
-		success = true;
 		
-	FAIL:
-		if (png != NULL)  png_destroy_write_struct(&png, &pngInfo);
-		FPMRelease(&pm);
+		if (success)  return FPMPNGWriterFinish(writer);
 		
-		return success;
+		FPMPNGWriterAbort(writer);
+		return false;
 	}
 	else
 	{
@@ -321,176 +567,602 @@ bool FPMWritePNGCustom(FloatPixMapRef srcPM, png_voidp ioPtr, png_rw_ptr writeDa
 }
 
 
-static void PNGReadFile(png_structp png, png_bytep bytes, png_size_t size)
+enum
 {
-	FILE *file = png_get_io_ptr(png);
-	if (fread(bytes, size, 1, file) < 1)
+	kStripBytes				= 256 << 10,	// Uncompressed image data per strip, roughly.
+	kDeflateWindowSize		= 32 << 10
+};
+
+
+struct FPMPNGWriter
+{
+	png_structp				png;
+	png_infop				pngInfo;
+	ErrorInfo				errInfo;
+	FILE					*file;			// NULL for custom I/O.
+	png_flush_ptr			flushDataFn;
+	
+	FPMWritePNGFlags		options;
+	FPMGammaFactor			sourceGamma;
+	FPMGammaFactor			fileGamma;
+	
+	FPMDimension			width;
+	FPMDimension			height;
+	FPMDimension			rowsWritten;
+	bool					failed;
+	
+	// State carried between bands by the strip encoder.
+	int						compressionLevel;
+	size_t					rowBytes;		// Unfiltered.
+	size_t					bytesPerPixel;
+	uint8_t					*previousRow;	// Last unfiltered row written.
+	uint8_t					*window;		// The last kDeflateWindowSize bytes of filtered data written, or all of it if less.
+	size_t					windowLength;
+	uLong					adler;			// Of all filtered data.
+	
+	FPMPNGProgressHandler	*progressHandler;
+	void					*callbackContext;
+};
+
+
+FPMPNGWriterRef FPMPNGWriterCreate(const char *path, FPMSize size, FPMWritePNGFlags options, FPMGammaFactor sourceGamma, FPMGammaFactor fileGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext)
+{
+	if (path == NULL)  return NULL;
+	
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
 	{
-		png_error(png, "read failed.");
+		if (errorHandler != NULL)  errorHandler("file could not be opened for writing.", true, callbackContext);
+		return NULL;
 	}
+	
+	FPMPNGWriterRef writer = FPMPNGWriterCreateCustom(file, PNGWriteFile, NULL, size, options, sourceGamma, fileGamma, errorHandler, progressHandler, callbackContext);
+	if (writer == NULL)
+	{
+		fclose(file);
+		return NULL;
+	}
+	
+	writer->file = file;
+	return writer;
 }
 
 
-static void PNGWriteFile(png_structp png, png_bytep bytes, png_size_t size)
+FPMPNGWriterRef FPMPNGWriterCreateCustom(png_voidp ioPtr, png_rw_ptr writeDataFn, png_flush_ptr flushDataFn, FPMSize size, FPMWritePNGFlags options, FPMGammaFactor sourceGamma, FPMGammaFactor fileGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext)
 {
-	FILE *file = png_get_io_ptr(png);
-	if (fwrite(bytes, size, 1, file) < 1)
+	if (size.width > UINT32_MAX || size.height > UINT32_MAX)
 	{
-		png_error(png, "write failed.");
+		if (errorHandler != NULL)  errorHandler("image is too large for PNG format.", true, callbackContext);
+		return NULL;
+	}
+	
+	// volatile because it's used after libpng longjmp()s to FAIL.
+	FPMPNGWriterRef volatile writer = calloc(1, sizeof *writer);
+	if (writer == NULL)  return NULL;
+	
+	writer->errInfo = (ErrorInfo){ errorHandler, callbackContext };
+	writer->options = options;
+	writer->sourceGamma = sourceGamma;
+	writer->fileGamma = fileGamma;
+	writer->width = size.width;
+	writer->height = size.height;
+	writer->progressHandler = progressHandler;
+	writer->callbackContext = callbackContext;
+	writer->flushDataFn = flushDataFn;
+	
+	unsigned level = (options & kFPMWritePNGCompressionMask) >> 20;
+	writer->compressionLevel = (level != 0) ? (int)level - 1 : Z_DEFAULT_COMPRESSION;
+	writer->bytesPerPixel = (options & kFPMWritePNG16BPC) ? 8 : 4;
+	writer->rowBytes = (size_t)size.width * writer->bytesPerPixel;
+	writer->adler = adler32(0, NULL, 0);
+	writer->previousRow = malloc(writer->rowBytes);
+	writer->window = malloc(kDeflateWindowSize);
+	if (writer->previousRow == NULL || writer->window == NULL)  goto FAIL;
+	
+	writer->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, &writer->errInfo, PNGError, PNGWarning);
+	if (writer->png == NULL)  goto FAIL;
+	
+	writer->pngInfo = png_create_info_struct(writer->png);
+	if (writer->pngInfo == NULL)  goto FAIL;
+	
+	if (setjmp(png_jmpbuf(writer->png)))
+	{
+		// libpng will jump here on error.
+		goto FAIL;
+	}
+	
+	png_set_write_fn(writer->png, ioPtr, writeDataFn, flushDataFn);
+	
+	png_set_IHDR(writer->png, writer->pngInfo, size.width, size.height, (options & kFPMWritePNG16BPC) ? 16 : 8,PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	
+	if (fileGamma == kFPMGammaSRGB)
+	{
+		png_set_sRGB_gAMA_and_cHRM(writer->png, writer->pngInfo, PNG_sRGB_INTENT_PERCEPTUAL);
 	}
+	else
+	{
+		png_set_gAMA(writer->png, writer->pngInfo, fileGamma);
+	}
+	
+	png_write_info(writer->png, writer->pngInfo);
+	return writer;
+	
+FAIL:
+	FPMPNGWriterAbort(writer);
+	return NULL;
 }
 
 
-static void PNGError(png_structp png, png_const_charp message)
+bool FPMPNGWriterAppendRows(FPMPNGWriterRef writer, FloatPixMapRef pm)
 {
-	ErrorInfo *errorInfo = png_get_error_ptr(png);
-	if (errorInfo != NULL && errorInfo->errorCB != NULL)
+	if (writer == NULL || pm == NULL || writer->failed || FPMGetPixelFormat(pm) != kFPMFormatRGBAFloat)  return false;
+	
+	FPMDimension width = FPMGetWidth(pm);
+	FPMDimension height = FPMGetHeight(pm);
+	if (width != writer->width || height > writer->height - writer->rowsWritten)
 	{
-		errorInfo->errorCB(message, true, errorInfo->errorCBContext);
+		if (writer->errInfo.errorCB != NULL)  writer->errInfo.errorCB("rows do not fit the image being written.", true, writer->errInfo.errorCBContext);
+		writer->failed = true;
+		return false;
 	}
+	
+	if (!EncodeRows(writer, pm))
+	{
+		writer->failed = true;
+		return false;
+	}
+	
+	return true;
 }
 
 
-static void PNGWarning(png_structp png, png_const_charp message)
+bool FPMPNGWriterFinish(FPMPNGWriterRef writer)
 {
-	ErrorInfo *errorInfo = png_get_error_ptr(png);
-	if (errorInfo != NULL && errorInfo->errorCB != NULL)
+	if (writer == NULL)  return false;
+	
+	bool success = !writer->failed;
+	if (success && writer->rowsWritten != writer->height)
 	{
-		errorInfo->errorCB(message, false, errorInfo->errorCBContext);
+		if (writer->errInfo.errorCB != NULL)  writer->errInfo.errorCB("not all rows of the image were written.", true, writer->errInfo.errorCBContext);
+		success = false;
+	}
+	
+	if (success)
+	{
+		if (setjmp(png_jmpbuf(writer->png)))
+		{
+			// libpng will jump here on error.
+			success = false;
+		}
+		else
+		{
+			// The image data was written as raw IDAT chunks, so libpng doesn't know it's there and png_write_end() would fail.
+			png_write_chunk(writer->png, (png_const_bytep)"IEND", NULL, 0);
+			if (writer->flushDataFn != NULL)  writer->flushDataFn(writer->png);
+		}
 	}
+	
+	if (writer->file != NULL && fclose(writer->file) != 0)  success = false;
+	writer->file = NULL;
+	
+	FPMPNGWriterAbort(writer);
+	return success;
 }
 
 
-FloatPixMapRef ConvertPNGData(void *data, size_t width, size_t height, size_t rowBytes, uint8_t depth, uint8_t colorType)
+void FPMPNGWriterAbort(FPMPNGWriterRef writer)
 {
-	FloatPixMapRef result = FPMCreateC(width, height);
-	if (result == NULL)  return NULL;
+	if (writer == NULL)  return;
 	
-	// Libpng transformations should have given us one of these formats.
-	if (depth == 8 && (colorType == PNG_COLOR_TYPE_RGB_ALPHA || colorType == PNG_COLOR_TYPE_RGB))
+	if (writer->png != NULL)  png_destroy_write_struct(&writer->png, &writer->pngInfo);
+	if (writer->file != NULL)  fclose(writer->file);
+	free(writer->previousRow);
+	free(writer->window);
+	free(writer);
+}
+
+
+/*	Strip encoder.
+	
+	Each band of rows passed to FPMPNGWriterAppendRows() is divided into
+	strips of about kStripBytes of image data, which are encoded in three
+	passes. Strips within a pass are independent, so each pass may be run in
+	parallel (see FPMSetParallelFunction()):
+	1. Gamma-correct, quantize, dither and pack each row into a buffer of
+	   PNG pixel data, with FPMQuantizeRow().
+	2. Filter each row, choosing the filter type for each row with the usual
+	   minimum sum of absolute differences heuristic.
+	3. Deflate each strip into a raw deflate stream of its own, primed with
+	   the kDeflateWindowSize bytes of filtered data before it, as pigz does.
+	   Each stream ends with a sync flush, except the last strip of the image
+	   which finishes it, so the concatenated strips form a single valid
+	   zlib stream.
+	The strips are then written in order, each as an IDAT chunk.
+*/
+typedef struct
+{
+	FPMDimension			firstRow;		// Within the band.
+	FPMDimension			rowCount;
+	uLong					adler;			// Of the strip's filtered data.
+	uint8_t					*compressed;
+	size_t					compressedLength;
+} EncodeStrip;
+
+
+typedef struct
+{
+	FPMPNGWriterRef			writer;
+	FloatPixMapRef			pm;
+	uint8_t					*packed;		// rowBytes per row.
+	uint8_t					*filtered;		// (rowBytes + 1) per row.
+	EncodeStrip				*strips;
+	size_t					stripCount;
+	bool					firstBand;
+	bool					lastBand;
+} EncodeBand;
+
+
+FPM_INLINE uint8_t *PackedRow(const EncodeBand *band, FPMDimension y)
+{
+	return band->packed + y * band->writer->rowBytes;
+}
+
+
+static bool PackStrip(size_t index, size_t count, void *context)
+{
+	EncodeBand *band = context;
+	FPMPNGWriterRef writer = band->writer;
+	const EncodeStrip *strip = &band->strips[index];
+	
+	FPMGammaFactor gamma = writer->sourceGamma / writer->fileGamma;
+	bool sixteenBit = writer->options & kFPMWritePNG16BPC;
+	FPMQuantizeFlags quantizeOptions = writer->options & (kFPMWritePNGDither | kFPMWritePNGJitter);
+	FPMDimension y;
+	
+	for (y = strip->firstRow; y < strip->firstRow + strip->rowCount; y++)
 	{
-		return ConvertPNGDataRGBA8(result, data, width, height, rowBytes);
+		const FPMColor *row = FPMGetPixelPointerC(band->pm, 0, y);
+		FPMQuantizeRow(row, writer->width, 0, writer->rowsWritten + y, gamma, sixteenBit, quantizeOptions, PackedRow(band, y));
 	}
-	if (depth == 16 && colorType == PNG_COLOR_TYPE_RGB_ALPHA)
+	
+	return true;
+}
+
+
+FPM_INLINE unsigned Paeth(unsigned a, unsigned b, unsigned c)
+{
+	int p = (int)a + (int)b - (int)c;
+	unsigned pa = abs(p - (int)a), pb = abs(p - (int)b), pc = abs(p - (int)c);
+	
+	if (pa <= pb && pa <= pc)  return a;
+	if (pb <= pc)  return b;
+	return c;
+}
+
+
+FPM_INLINE unsigned FilterCost(uint8_t value)
+{
+	return (value < 128) ? value : 256 - value;
+}
+
+
+/*	FilterRow()
+	Write the filter type byte and filtered data for a row to out. previous
+	is the unfiltered row above, or NULL for the first row of the image.
+*/
+static void FilterRow(const uint8_t *row, const uint8_t *previous, size_t rowBytes, size_t bpp, uint8_t *out)
+{
+	size_t i;
+	unsigned cost[5] = { 0 };
+	
+	for (i = 0; i < rowBytes; i++)
 	{
-		return ConvertPNGDataRGBA16(result, data, width, height, rowBytes);
+		unsigned a = (i >= bpp) ? row[i - bpp] : 0;
+		unsigned b = (previous != NULL) ? previous[i] : 0;
+		unsigned c = (i >= bpp && previous != NULL) ? previous[i - bpp] : 0;
+		unsigned x = row[i];
+		
+		cost[PNG_FILTER_VALUE_NONE] += FilterCost(x);
+		cost[PNG_FILTER_VALUE_SUB] += FilterCost(x - a);
+		cost[PNG_FILTER_VALUE_UP] += FilterCost(x - b);
+		cost[PNG_FILTER_VALUE_AVG] += FilterCost(x - ((a + b) >> 1));
+		cost[PNG_FILTER_VALUE_PAETH] += FilterCost(x - Paeth(a, b, c));
 	}
-	if (depth == 16 && colorType == PNG_COLOR_TYPE_RGB)
+	
+	unsigned filter, best = PNG_FILTER_VALUE_NONE;
+	for (filter = PNG_FILTER_VALUE_SUB; filter <= PNG_FILTER_VALUE_PAETH; filter++)
 	{
-		return ConvertPNGDataRGB16(result, data, width, height, rowBytes);
+		if (cost[filter] < cost[best])  best = filter;
 	}
 	
-	fprintf(stderr, "Unexpected PNG depth/colorType combination: %u, 0x%X\n", depth, colorType);
-	FPMRelease(&result);
-	return NULL;
+	*out++ = best;
+	for (i = 0; i < rowBytes; i++)
+	{
+		unsigned a = (i >= bpp) ? row[i - bpp] : 0;
+		unsigned b = (previous != NULL) ? previous[i] : 0;
+		unsigned c = (i >= bpp && previous != NULL) ? previous[i - bpp] : 0;
+		unsigned predictor = 0;
+		
+		switch (best)
+		{
+			case PNG_FILTER_VALUE_SUB:		predictor = a; break;
+			case PNG_FILTER_VALUE_UP:		predictor = b; break;
+			case PNG_FILTER_VALUE_AVG:		predictor = (a + b) >> 1; break;
+			case PNG_FILTER_VALUE_PAETH:	predictor = Paeth(a, b, c); break;
+		}
+		out[i] = row[i] - predictor;
+	}
 }
 
 
-static FloatPixMapRef ConvertPNGDataRGBA8(FloatPixMapRef pm, uint8_t *data, size_t width, size_t height, size_t rowBytes)
+static bool FilterStrip(size_t index, size_t count, void *context)
 {
-	uint8_t				*src = NULL;
-	float				*dst = NULL;
-	size_t				x, y;
+	EncodeBand *band = context;
+	FPMPNGWriterRef writer = band->writer;
+	EncodeStrip *strip = &band->strips[index];
+	size_t stride = writer->rowBytes + 1;
+	FPMDimension y;
 	
-	for (y = 0; y < height; y++)
+	for (y = strip->firstRow; y < strip->firstRow + strip->rowCount; y++)
 	{
-		src = data + rowBytes * y;
-		dst = (float *)FPMGetPixelPointerC(pm, 0, y);
-		FPM_INTERNAL_ASSERT(src != NULL && dst != NULL);
+		const uint8_t *previous = NULL;
+		if (y != 0)  previous = PackedRow(band, y - 1);
+		else if (!band->firstBand)  previous = writer->previousRow;
 		
-		for (x = 0; x < width * 4; x++)
-		{
-			*dst++ = (float)*src++ * 1.0f/255.0f;
-		}
+		FilterRow(PackedRow(band, y), previous, writer->rowBytes, writer->bytesPerPixel, band->filtered + y * stride);
 	}
 	
-	return pm;
+	strip->adler = adler32(0, NULL, 0);
+	strip->adler = adler32(strip->adler, band->filtered + strip->firstRow * stride, strip->rowCount * stride);
+	return true;
 }
 
 
-static FloatPixMapRef ConvertPNGDataRGBA16(FloatPixMapRef pm, uint8_t *data, size_t width, size_t height, size_t rowBytes)
+static bool CompressStrip(size_t index, size_t count, void *context)
 {
-	uint16_t			*src = NULL;
-	float				*dst = NULL;
-	size_t				x, y;
+	EncodeBand *band = context;
+	FPMPNGWriterRef writer = band->writer;
+	EncodeStrip *strip = &band->strips[index];
+	size_t stride = writer->rowBytes + 1;
+	bool first = band->firstBand && index == 0;
+	bool last = band->lastBand && index == count - 1;
+	
+	const uint8_t *data = band->filtered + strip->firstRow * stride;
+	size_t length = strip->rowCount * stride;
 	
-	for (y = 0; y < height; y++)
+	z_stream stream = { .zalloc = Z_NULL };
+	int strategy = (writer->compressionLevel == 0) ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	if (deflateInit2(&stream, writer->compressionLevel, Z_DEFLATED, -15, 8, strategy) != Z_OK)  return false;
+	
+	// Prime the compressor with the data before this strip: the previous bands' window, then this band's data.
+	uint8_t *dictionary = NULL;
+	size_t bandOffset = strip->firstRow * stride;
+	bool OK = true;
+	if (bandOffset >= kDeflateWindowSize)
+	{
+		OK = deflateSetDictionary(&stream, data - kDeflateWindowSize, kDeflateWindowSize) == Z_OK;
+	}
+	else if (bandOffset + writer->windowLength != 0)
 	{
-		src = (uint16_t *)(data + rowBytes * y);
-		dst = (float *)FPMGetPixelPointerC(pm, 0, y);
-		FPM_INTERNAL_ASSERT(src != NULL && dst != NULL);
+		size_t fromWindow = writer->windowLength;
+		if (fromWindow > kDeflateWindowSize - bandOffset)  fromWindow = kDeflateWindowSize - bandOffset;
+		dictionary = malloc(fromWindow + bandOffset);
+		OK = dictionary != NULL;
+		if (OK)
+		{
+			memcpy(dictionary, writer->window + writer->windowLength - fromWindow, fromWindow);
+			memcpy(dictionary + fromWindow, band->filtered, bandOffset);
+			OK = deflateSetDictionary(&stream, dictionary, fromWindow + bandOffset) == Z_OK;
+		}
+	}
+	
+	// Room for the zlib header, the sync flush marker and the trailer.
+	size_t capacity = deflateBound(&stream, length) + 16;
+	strip->compressed = OK ? malloc(capacity) : NULL;
+	if (strip->compressed != NULL)
+	{
+		uint8_t *out = strip->compressed;
+		if (first)
+		{
+			// zlib header: deflate with a 32 KiB window, and the compression level hint.
+			int level = writer->compressionLevel;
+			unsigned levelHint = (level < 0 || level == 6) ? 2 : (level < 2) ? 0 : (level < 6) ? 1 : 3;
+			unsigned header = (0x78 << 8) | (levelHint << 6);
+			header += 31 - header % 31;
+			*out++ = header >> 8;
+			*out++ = header & 0xFF;
+		}
+		
+		stream.next_in = (Bytef *)data;
+		stream.avail_in = length;
+		stream.next_out = out;
+		stream.avail_out = capacity - (out - strip->compressed) - 4;
+		int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+		OK = (status == (last ? Z_STREAM_END : Z_OK)) && stream.avail_in == 0;
+		out = stream.next_out;
 		
-		for (x = 0; x < width * 4; x++)
+		if (last)
 		{
-			*dst++ = (float)*src++ * 1.0f/65535.0f;
+			uLong adler = writer->adler;
+			*out++ = adler >> 24;
+			*out++ = (adler >> 16) & 0xFF;
+			*out++ = (adler >> 8) & 0xFF;
+			*out++ = adler & 0xFF;
 		}
+		strip->compressedLength = out - strip->compressed;
 	}
+	else  OK = false;
 	
-	return pm;
+	deflateEnd(&stream);
+	free(dictionary);
+	return OK;
 }
 
 
-static FloatPixMapRef ConvertPNGDataRGB16(FloatPixMapRef pm, uint8_t *data, size_t width, size_t height, size_t rowBytes)
+static bool EncodeRows(FPMPNGWriterRef writer, FloatPixMapRef pm)
 {
-	uint16_t			*src = NULL;
-	float				*dst = NULL;
-	size_t				x, y;
+	FPMDimension height = FPMGetHeight(pm);
+	if (height == 0)  return true;
 	
-	for (y = 0; y < height; y++)
+	size_t i, stride = writer->rowBytes + 1;
+	EncodeBand band =
 	{
-		src = (uint16_t *)(data + rowBytes * y);
-		dst = (float *)FPMGetPixelPointerC(pm, 0, y);
-		FPM_INTERNAL_ASSERT(src != NULL && dst != NULL);
-		
-		for (x = 0; x < width * 3; x++)
-		{
-			*dst++ = (float)*src++ * 1.0f/65535.0f;
-		}
+		.writer = writer,
+		.pm = pm,
+		.firstBand = writer->rowsWritten == 0,
+		.lastBand = writer->rowsWritten + height == writer->height
+	};
+	const char *message = "could not encode image data.";
+	
+	size_t stripRows = kStripBytes / writer->rowBytes;
+	if (stripRows == 0)  stripRows = 1;
+	band.stripCount = (height + stripRows - 1) / stripRows;
+	band.strips = calloc(band.stripCount, sizeof *band.strips);
+	band.packed = malloc(height * writer->rowBytes);
+	band.filtered = malloc(height * stride);
+	if (band.strips == NULL || band.packed == NULL || band.filtered == NULL)  goto FAIL;
+	
+	for (i = 0; i < band.stripCount; i++)
+	{
+		band.strips[i].firstRow = i * stripRows;
+		band.strips[i].rowCount = (i == band.stripCount - 1) ? height - i * stripRows : stripRows;
+	}
+	
+	if (!FPMRunParallel(PackStrip, &band, band.stripCount))  goto FAIL;
+	if (!FPMRunParallel(FilterStrip, &band, band.stripCount))  goto FAIL;
+	
+	// The last strip's trailer needs the checksum of everything.
+	for (i = 0; i < band.stripCount; i++)
+	{
+		writer->adler = adler32_combine(writer->adler, band.strips[i].adler, band.strips[i].rowCount * stride);
+	}
+	
+	if (!FPMRunParallel(CompressStrip, &band, band.stripCount))  goto FAIL;
+	
+	if (setjmp(png_jmpbuf(writer->png)))
+	{
+		// libpng will jump here on error.
+		message = NULL;
+		goto FAIL;
 	}
 	
-	return pm;
+	for (i = 0; i < band.stripCount; i++)
+	{
+		png_write_chunk(writer->png, (png_const_bytep)"IDAT", band.strips[i].compressed, band.strips[i].compressedLength);
+		writer->rowsWritten += band.strips[i].rowCount;
+		if (writer->progressHandler)  writer->progressHandler((float)writer->rowsWritten / (float)writer->height, writer->callbackContext);
+	}
+	
+	// Keep what the next band needs: the last unfiltered row, and the deflate window.
+	memcpy(writer->previousRow, PackedRow(&band, height - 1), writer->rowBytes);
+	size_t filteredLength = height * stride;
+	if (filteredLength >= kDeflateWindowSize)
+	{
+		memcpy(writer->window, band.filtered + filteredLength - kDeflateWindowSize, kDeflateWindowSize);
+		writer->windowLength = kDeflateWindowSize;
+	}
+	else
+	{
+		size_t keep = writer->windowLength;
+		if (keep > kDeflateWindowSize - filteredLength)  keep = kDeflateWindowSize - filteredLength;
+		memmove(writer->window, writer->window + writer->windowLength - keep, keep);
+		memcpy(writer->window + keep, band.filtered, filteredLength);
+		writer->windowLength = keep + filteredLength;
+	}
+	
+	for (i = 0; i < band.stripCount; i++)  free(band.strips[i].compressed);
+	free(band.strips);
+	free(band.packed);
+	free(band.filtered);
+	return true;
+	
+FAIL:
+	if (message != NULL && writer->errInfo.errorCB != NULL)  writer->errInfo.errorCB(message, true, writer->errInfo.errorCBContext);
+	if (band.strips != NULL)
+	{
+		for (i = 0; i < band.stripCount; i++)  free(band.strips[i].compressed);
+	}
+	free(band.strips);
+	free(band.packed);
+	free(band.filtered);
+	return false;
+}
+
+
+static void PNGReadFile(png_structp png, png_bytep bytes, png_size_t size)
+{
+	FILE *file = png_get_io_ptr(png);
+	if (fread(bytes, size, 1, file) < 1)
+	{
+		png_error(png, "read failed.");
+	}
 }
 
 
-static void TransformRow16(void *data, size_t width)
+static void PNGWriteFile(png_structp png, png_bytep bytes, png_size_t size)
+{
+	FILE *file = png_get_io_ptr(png);
+	if (fwrite(bytes, size, 1, file) < 1)
+	{
+		png_error(png, "write failed.");
+	}
+}
+
+
+static void PNGError(png_structp png, png_const_charp message)
 {
-	assert(data != NULL);
+	ErrorInfo *errorInfo = png_get_error_ptr(png);
+	if (errorInfo != NULL && errorInfo->errorCB != NULL)
+	{
+		errorInfo->errorCB(message, true, errorInfo->errorCBContext);
+	}
+}
+
+
+static void PNGWarning(png_structp png, png_const_charp message)
+{
+	ErrorInfo *errorInfo = png_get_error_ptr(png);
+	if (errorInfo != NULL && errorInfo->errorCB != NULL)
+	{
+		errorInfo->errorCB(message, false, errorInfo->errorCBContext);
+	}
+}
+
+
+/*	ConvertRow8()
+	ConvertRow16()
+	Expand a row of RGBA PNG data to floats in place. The float components
+	are larger than the source ones, so the conversion works backwards from
+	the end of the row.
+*/
+static void ConvertRow8(void *data, size_t width)
+{
+	FPM_INTERNAL_ASSERT(data != NULL);
 	
-	float *src = (float *)data;
-#if FPM_LITTLE_ENDIAN
-	uint8_t *dst = (uint8_t *)data;
-#elif FPM_BIG_ENDIAN
-	uint16_t *dst = (uint16_t *)data;
-#endif
+	uint8_t *src = (uint8_t *)data;
+	float *dst = (float *)data;
 	
 	size_t count = width * 4;
 	while (count--)
 	{
-		// value should already be scaled to appropriate range.
-		uint16_t value = *src++;
-		
-#if FPM_LITTLE_ENDIAN
-		*dst++ = value >> 8;
-		*dst++ = value & 0xFF;
-#elif FPM_BIG_ENDIAN
-		*dst++ = value;
-#endif
+		dst[count] = (float)src[count] * 1.0f/255.0f;
 	}
 }
 
 
-static void TransformRow8(void *data, size_t width)
+static void ConvertRow16(void *data, size_t width)
 {
-	assert(data != NULL);
+	FPM_INTERNAL_ASSERT(data != NULL);
 	
-	float *src = (float *)data;
-	uint8_t *dst = (uint8_t *)data;
+	uint8_t *src = (uint8_t *)data;
+	float *dst = (float *)data;
 	
 	size_t count = width * 4;
 	while (count--)
 	{
-		// value should already be scaled to appropriate range.
-		uint8_t value = *src++;
-		*dst++ = value;
+		// memcpy() rather than a uint16_t pointer, since the buffer is also accessed as floats.
+		uint16_t value;
+		memcpy(&value, src + count * 2, sizeof value);
+		dst[count] = (float)value * 1.0f/65535.0f;
 	}
 }
@@ -40,13 +40,25 @@ FPM_BEGIN_EXTERN_C
 
 enum
 {
-	kFPMWritePNGDither			= kFPMQuantizeDither,	// If set, error-diffusion dither is used when converting to output format. [UNIMPLEMENTED]
-	kFPMWritePNGJitter			= kFPMQuantizeJitter,	// If set, jitter is used in dithering.
+	kFPMWritePNGDither			= kFPMQuantizeDither,	// If set, ordered dither is used when converting to output format; see FPMQuantizeRow().
+	kFPMWritePNGJitter			= kFPMQuantizeJitter,	// If set, dithering uses an irregular pattern instead.
 	kFPMWritePNG16BPC			= 0x00010000,			// If set, output will use sixteen bits per channel; if clear, eight bits per channel are used.
+	kFPMWritePNGCompressionMask	= 0x00F00000			// Compression level; see FPMWritePNGCompressionLevel().
 };
 typedef uint32_t FPMWritePNGFlags;
 
 
+/*	FPMWritePNGCompressionLevel()
+	Flags selecting a zlib compression level from 0 (none) to 9 (smallest).
+	Without them, zlib's default level is used.
+*/
+FPM_INLINE FPMWritePNGFlags FPMWritePNGCompressionLevel(unsigned level)
+{
+	if (level > 9)  level = 9;
+	return (level + 1) << 20;
+}
+
+
 /*	Callback type for PNG error handling. if isError is true, it's a libpng
 	or FPMPNG error; if it's false, it's a libpng warning.
 */
@@ -71,6 +83,45 @@ FloatPixMapRef FPMCreateWithPNG(const char *path, FPMGammaFactor desiredGamma, F
 FloatPixMapRef FPMCreateWithPNGCustom(png_voidp ioPtr, png_rw_ptr readDataFn, FPMGammaFactor desiredGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext);
 
 
+/*	Incremental PNG reader.
+	For reading an image a band of rows at a time, either as floats or in the
+	file's own compact form.
+
+	FPMPNGReaderCreate() opens the file and reads the PNG header; the
+	parameters are as for FPMCreateWithPNG().
+	FPMPNGReaderReadRows() reads, converts and gamma-corrects as many rows as
+	pm is high, which must be as wide as the image.
+	FPMPNGReaderReadRawRows() reads rowCount rows without converting them.
+	Raw rows are always RGBA, with FPMPNGReaderGetBitsPerChannel() (8 or 16)
+	bits per channel in native byte order, and gamma FPMPNGReaderGetFileGamma().
+	Either read function may be called repeatedly with successive bands of
+	rows, except that interlaced images must be read in a single call.
+	FPMPNGReaderFinish() reads the end of the file and frees the reader. It
+	returns false if anything failed or not all rows were read.
+	FPMPNGReaderAbort() frees the reader without finishing the file.
+*/
+typedef struct FPMPNGReader *FPMPNGReaderRef;
+
+FPMPNGReaderRef FPMPNGReaderCreate(const char *path, FPMGammaFactor desiredGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext);
+FPMPNGReaderRef FPMPNGReaderCreateCustom(png_voidp ioPtr, png_rw_ptr readDataFn, FPMGammaFactor desiredGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext);
+FPMSize FPMPNGReaderGetSize(FPMPNGReaderRef reader);
+unsigned FPMPNGReaderGetBitsPerChannel(FPMPNGReaderRef reader);
+FPMGammaFactor FPMPNGReaderGetFileGamma(FPMPNGReaderRef reader);
+bool FPMPNGReaderReadRows(FPMPNGReaderRef reader, FloatPixMapRef pm);
+bool FPMPNGReaderReadRawRows(FPMPNGReaderRef reader, void *buffer, size_t rowBytes, FPMDimension rowCount);
+bool FPMPNGReaderFinish(FPMPNGReaderRef reader);
+void FPMPNGReaderAbort(FPMPNGReaderRef reader);
+
+
+/*	FPMCreateWithPNGReader()
+	Read the whole of an image from a reader into a new pixmap of the given
+	pixel format, then finish and free the reader. Integer formats keep the
+	file's gamma (or sRGB, for sixteen-bit files stored in eight bits), so
+	a file read in its own format is not converted at all.
+*/
+FloatPixMapRef FPMCreateWithPNGReader(FPMPNGReaderRef reader, FPMPixelFormat format);
+
+
 /*	FPMWritePNG()
 	Write an image to the specified path in PNG format.
 	SourceGamma should usually be kFPMGammaLinear.
@@ -83,6 +134,28 @@ bool FPMWritePNG(FloatPixMapRef pm, const char *path, FPMWritePNGFlags options,
 bool FPMWritePNGCustom(FloatPixMapRef pm, png_voidp ioPtr, png_rw_ptr writeDataFn, png_flush_ptr flushDataFn, FPMWritePNGFlags options, FPMGammaFactor sourceGamma, FPMGammaFactor fileGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext);
 
 
+/*	Streaming PNG writer.
+	For writing an image a band of rows at a time, so that it never needs to
+	be in memory all at once.
+	
+	FPMPNGWriterCreate() opens the file and writes the PNG header for an
+	image of the specified size; the parameters are as for FPMWritePNG().
+	FPMPNGWriterAppendRows() converts and writes all rows of pm, which must be
+	as wide as the image. pm is not modified.
+	It may be called repeatedly with successive bands of rows.
+	FPMPNGWriterFinish() writes the end of the file and frees the writer. It
+	returns false if anything failed or not all rows were written.
+	FPMPNGWriterAbort() frees the writer without finishing the file.
+*/
+typedef struct FPMPNGWriter *FPMPNGWriterRef;
+
+FPMPNGWriterRef FPMPNGWriterCreate(const char *path, FPMSize size, FPMWritePNGFlags options, FPMGammaFactor sourceGamma, FPMGammaFactor fileGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext);
+FPMPNGWriterRef FPMPNGWriterCreateCustom(png_voidp ioPtr, png_rw_ptr writeDataFn, png_flush_ptr flushDataFn, FPMSize size, FPMWritePNGFlags options, FPMGammaFactor sourceGamma, FPMGammaFactor fileGamma, FPMPNGErrorHandler errorHandler, FPMPNGProgressHandler progressHandler, void *callbackContext);
+bool FPMPNGWriterAppendRows(FPMPNGWriterRef writer, FloatPixMapRef pm);
+bool FPMPNGWriterFinish(FPMPNGWriterRef writer);
+void FPMPNGWriterAbort(FPMPNGWriterRef writer);
+
+
 /*	FPMWritePNGSimple()
 	Call FPMWritePNG() with the most common options: eight-bit data, dithering,
 	linear source gamma, sRGB file gamma.
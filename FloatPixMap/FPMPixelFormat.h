@@ -0,0 +1,231 @@
+/*
+	FPMPixelFormat.h
+	FloatPixMap
+	
+	Access to the storage of pixmaps in any pixel format, and conversion of
+	pixels to and from the compact formats.
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef INCLUDED_FPMPixelFormat_h
+#define INCLUDED_FPMPixelFormat_h
+
+#include "FloatPixMap.h"
+
+FPM_BEGIN_EXTERN_C
+
+
+/*	FPMGetStorageInformation()
+	Quick accessor to get information needed to read or write pixels of any
+	format. buffer points to the top left pixel, and rowBytes is the offset
+	between rows. decodeTable maps stored colour components of the integer
+	formats to (linear) floats, and is NULL for other formats. storageGamma
+	is as passed to FPMCreateWithFormat(). If pm is NULL, info describes an
+	empty float pixmap.
+*/
+typedef struct FPMStorageInfo
+{
+	void					*buffer;
+	size_t					rowBytes;
+	FPMDimension			width;
+	FPMDimension			height;
+	FPMPixelFormat			format;
+	float					storageGamma;
+	const float				*decodeTable;
+} FPMStorageInfo;
+
+void FPMGetStorageInformation(FloatPixMapRef pm, FPMStorageInfo *info);
+
+
+FPM_INLINE size_t FPMPixelFormatBytesPerPixel(FPMPixelFormat format) FPM_CONST;
+FPM_INLINE size_t FPMPixelFormatBytesPerPixel(FPMPixelFormat format)
+{
+	switch (format)
+	{
+		case kFPMFormatRGBAFloat:	return sizeof (FPMColor);
+		case kFPMFormatRGBA8:		return 4;
+		case kFPMFormatRGBA16:		return 8;
+		case kFPMFormatRGBAHalf:	return 8;
+	}
+	return 0;
+}
+
+
+/*	FPMHalfToFloat()
+	FPMFloatToHalf()
+	Convert between float and IEEE half-precision (binary16) representation.
+	FPMFloatToHalf() rounds to nearest even, and maps out-of-range values to
+	infinity.
+*/
+FPM_INLINE float FPMHalfToFloat(uint16_t half) FPM_CONST;
+FPM_INLINE float FPMHalfToFloat(uint16_t half)
+{
+	union { uint32_t u; float f; } result, magic = { 113 << 23 };
+	const uint32_t shiftedExponent = 0x7C00 << 13;
+	
+	result.u = (half & 0x7FFF) << 13;
+	uint32_t exponent = result.u & shiftedExponent;
+	result.u += (127 - 15) << 23;
+	
+	if (exponent == shiftedExponent)
+	{
+		// Infinity or NaN.
+		result.u += (128 - 16) << 23;
+	}
+	else if (exponent == 0)
+	{
+		// Zero or subnormal; renormalize.
+		result.u += 1 << 23;
+		result.f -= magic.f;
+	}
+	
+	result.u |= (uint32_t)(half & 0x8000) << 16;
+	return result.f;
+}
+
+
+FPM_INLINE uint16_t FPMFloatToHalf(float value) FPM_CONST;
+FPM_INLINE uint16_t FPMFloatToHalf(float value)
+{
+	union { uint32_t u; float f; } bits = { .f = value }, subnormalMagic = { ((127 - 15) + (23 - 10) + 1) << 23 };
+	uint32_t sign = bits.u & 0x80000000;
+	uint16_t result;
+	
+	bits.u ^= sign;
+	if (bits.u >= (127 + 16) << 23)
+	{
+		// Too large, infinity or NaN.
+		result = (bits.u > 0x7F800000) ? 0x7E00 : 0x7C00;
+	}
+	else if (bits.u < 113 << 23)
+	{
+		// Subnormal or zero; let float addition do the rounding.
+		bits.f += subnormalMagic.f;
+		result = bits.u - subnormalMagic.u;
+	}
+	else
+	{
+		uint32_t mantissaOdd = (bits.u >> 13) & 1;
+		bits.u += ((uint32_t)(15 - 127) << 23) + 0xFFF + mantissaOdd;
+		result = bits.u >> 13;
+	}
+	
+	return result | (sign >> 16);
+}
+
+
+/*	FPMDecodePixel()
+	FPMEncodePixel()
+	Read or write the pixel at x, y, which must be in range. format must be
+	info->format; it is passed separately so that callers which switch on it
+	get code specialized for each format.
+*/
+FPM_INLINE FPMColor FPMDecodePixel(const FPMStorageInfo *info, FPMPixelFormat format, FPMDimension x, FPMDimension y)
+{
+	const uint8_t *row = (const uint8_t *)info->buffer + y * info->rowBytes;
+	const float *table = info->decodeTable;
+	
+	switch (format)
+	{
+		case kFPMFormatRGBAFloat:
+			return ((const FPMColor *)row)[x];
+			
+		case kFPMFormatRGBA8:
+		{
+			const uint8_t *px = row + x * 4;
+			return FPMMakeColor(table[px[0]], table[px[1]], table[px[2]], (float)px[3] * 1.0f/255.0f);
+		}
+			
+		case kFPMFormatRGBA16:
+		{
+			const uint16_t *px = (const uint16_t *)row + x * 4;
+			return FPMMakeColor(table[px[0]], table[px[1]], table[px[2]], (float)px[3] * 1.0f/65535.0f);
+		}
+			
+		case kFPMFormatRGBAHalf:
+		{
+			const uint16_t *px = (const uint16_t *)row + x * 4;
+			return FPMMakeColor(FPMHalfToFloat(px[0]), FPMHalfToFloat(px[1]), FPMHalfToFloat(px[2]), FPMHalfToFloat(px[3]));
+		}
+	}
+	
+	return kFPMColorInvalid;
+}
+
+
+FPM_INLINE unsigned FPMEncodeComponent(float value, float invGamma, float max)
+{
+	if (!(value > 0.0f))  return 0;
+	if (value >= 1.0f)  return max;
+	if (invGamma != 1.0f)  value = powf(value, invGamma);
+	return value * max + 0.5f;
+}
+
+
+FPM_INLINE void FPMEncodePixel(const FPMStorageInfo *info, FPMPixelFormat format, FPMDimension x, FPMDimension y, FPMColor color)
+{
+	uint8_t *row = (uint8_t *)info->buffer + y * info->rowBytes;
+	float invGamma = 1.0f / info->storageGamma;
+	
+	switch (format)
+	{
+		case kFPMFormatRGBAFloat:
+			((FPMColor *)row)[x] = color;
+			break;
+			
+		case kFPMFormatRGBA8:
+		{
+			uint8_t *px = row + x * 4;
+			px[0] = FPMEncodeComponent(color.r, invGamma, 255.0f);
+			px[1] = FPMEncodeComponent(color.g, invGamma, 255.0f);
+			px[2] = FPMEncodeComponent(color.b, invGamma, 255.0f);
+			px[3] = FPMEncodeComponent(color.a, 1.0f, 255.0f);
+			break;
+		}
+			
+		case kFPMFormatRGBA16:
+		{
+			uint16_t *px = (uint16_t *)row + x * 4;
+			px[0] = FPMEncodeComponent(color.r, invGamma, 65535.0f);
+			px[1] = FPMEncodeComponent(color.g, invGamma, 65535.0f);
+			px[2] = FPMEncodeComponent(color.b, invGamma, 65535.0f);
+			px[3] = FPMEncodeComponent(color.a, 1.0f, 65535.0f);
+			break;
+		}
+			
+		case kFPMFormatRGBAHalf:
+		{
+			uint16_t *px = (uint16_t *)row + x * 4;
+			px[0] = FPMFloatToHalf(color.r);
+			px[1] = FPMFloatToHalf(color.g);
+			px[2] = FPMFloatToHalf(color.b);
+			px[3] = FPMFloatToHalf(color.a);
+			break;
+		}
+	}
+}
+
+
+FPM_END_EXTERN_C
+#endif	/* INCLUDED_FPMPixelFormat_h */
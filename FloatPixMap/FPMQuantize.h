@@ -37,8 +37,8 @@ FPM_BEGIN_EXTERN_C
 
 enum
 {
-	kFPMQuantizeDither			= 0x00000001,	// If set, error-diffusion dither is used. [UNIMPLEMENTED]
-	kFPMQuantizeJitter			= 0x00000002,	// If set, jitter is used in dithering. Ignored if not dithering. [UNIMPLEMENTED]
+	kFPMQuantizeDither			= 0x00000001,	// If set, colour components are dithered with a 16×16 ordered (Bayer) pattern.
+	kFPMQuantizeJitter			= 0x00000002,	// If set, dithering uses an irregular, blue-noise-like pattern instead. Ignored if not dithering.
 	kFMPQuantizeClip			= 0x00000004,	// If set, out-of-range values are clipped, otherwise they're scaled by the same amount as in-range values.
 	kFMPQuantizeAlpha			= 0x00000008,	// If set, alpha channel is quantized too.
 };
@@ -62,5 +62,20 @@ typedef uint32_t FPMQuantizeFlags;
 void FPMQuantize(FloatPixMapRef pm, float srcMin, float srcMax, float targetMin, float targetMax, unsigned steps, FPMQuantizeFlags options);
 
 
+/*	FPMQuantizeRow()
+	Convert count pixels of a row straight to packed integers for writing to
+	a file, in a single pass: raise the colour components to the power gamma
+	(as FPMApplyGammaToPixels()), clip all components to 0..1, scale them to
+	0..255 or 0..65535 and round, dithering colour components as selected by
+	kFPMQuantizeDither and kFPMQuantizeJitter; other options are ignored.
+	Components are written to out in r, g, b, a order, as bytes or as big-
+	endian sixteen-bit values (as used by PNG). x and y are the position of
+	the first pixel in the image, which selects the dither thresholds so that
+	rows and parts of rows converted separately fit together. pixels is not
+	modified.
+*/
+void FPMQuantizeRow(const FPMColor *pixels, size_t count, FPMDimension x, FPMDimension y, float gamma, bool sixteenBit, FPMQuantizeFlags options, void *out);
+
+
 FPM_END_EXTERN_C
 #endif	/* INCLUDED_FPMQuantize_h */
@@ -24,6 +24,8 @@
 */
 
 #include "FloatPixMap.h"
+#include "FPMPixelFormat.h"
+#include "FPMGamma.h"
 #include <assert.h>
 #include <string.h>
 
@@ -61,7 +63,13 @@ typedef struct FloatPixMap
 	size_t					width;
 	size_t					height;
 	size_t					rowCount;
-	FPMColor				*pixels;
+	FPMColor				*pixels;		// NULL unless format is kFPMFormatRGBAFloat.
+	void					*storage;		// Pixel data in any format.
+	FPMPixelFormat			format;
+	float					storageGamma;
+	float					*decodeTable;	// Shared with, and owned by, the master pixmap.
+	FPMStorageReleaseFunction	releaseStorage;	// Only used by the master.
+	void					*releaseContext;
 	FloatPixMapRef			master;
 } FloatPixMap;
 
@@ -92,6 +100,14 @@ static off_t PixelIndex(FloatPixMapRef pm, FPMPoint pt)
 }
 
 
+static void *StoragePointer(FloatPixMapRef pm, FPMPoint pt)
+{
+	FPM_INTERNAL_ASSERT(pm != NULL);
+	
+	return (uint8_t *)pm->storage + PixelIndex(pm, pt) * FPMPixelFormatBytesPerPixel(pm->format);
+}
+
+
 static size_t GetPixelCount(FloatPixMapRef pm)
 {
 	FPM_INTERNAL_ASSERT(pm != NULL);
@@ -101,23 +117,29 @@ static size_t GetPixelCount(FloatPixMapRef pm)
 
 
 /*	NOTE: the Clang Static Analyzer claims callers of this function are leaking
-	the “pixels” parameter. This is untrue, but there doesn’t seem to be a way
+	the “storage” parameter. This is untrue, but there doesn’t seem to be a way
 	to annotate functions as consuming a parameter outside of ObjC or
 	CoreFoundation code.
 */
-static FloatPixMapRef MakeFPM(FPMSize size, FPMDimension rowCount, FPMColor *pixels, FloatPixMapRef master)
+static FloatPixMapRef MakeFPM(FPMSize size, FPMDimension rowCount, FPMPixelFormat format, void *storage, FloatPixMapRef master)
 {
 	FloatPixMapRef result = malloc(sizeof (FloatPixMap));
 	if (result != NULL)
 	{
-		FPM_INTERNAL_ASSERT(FPMSizeArea(size) == 0 || pixels != NULL);
+		FPM_INTERNAL_ASSERT(FPMSizeArea(size) == 0 || storage != NULL);
 		FPM_INTERNAL_ASSERT(size.width <= rowCount);
 		
 		result->retainCount = 1;
 		result->width = size.width;
 		result->height = size.height;
 		result->rowCount = rowCount;
-		result->pixels = pixels;
+		result->pixels = (format == kFPMFormatRGBAFloat) ? storage : NULL;
+		result->storage = storage;
+		result->format = format;
+		result->storageGamma = (master != NULL) ? master->storageGamma : 1.0f;
+		result->decodeTable = (master != NULL) ? master->decodeTable : NULL;
+		result->releaseStorage = NULL;
+		result->releaseContext = NULL;
 		result->master = FPMRetain(master);
 	}
 	
@@ -125,9 +147,46 @@ static FloatPixMapRef MakeFPM(FPMSize size, FPMDimension rowCount, FPMColor *pix
 }
 
 
+static void FreeStorage(void *storage, void *releaseContext)
+{
+	free(storage);
+}
+
+
 static FloatPixMapRef MakeEmptyFPM(FPMSize nominalSize)
 {
-	return MakeFPM(nominalSize, nominalSize.width, NULL, NULL);
+	return MakeFPM(nominalSize, nominalSize.width, kFPMFormatRGBAFloat, NULL, NULL);
+}
+
+
+/*	MakeDecodeTable()
+	Entries are calculated the same way FPMPNG converts and gamma-corrects
+	pixels, with the FPMApplyGammaToPixels() kernel applied to a chunk of
+	values at a time, so an image loaded in an integer format samples
+	identically to one loaded as floats.
+*/
+static float *MakeDecodeTable(FPMPixelFormat format, float storageGamma)
+{
+	FPM_INTERNAL_ASSERT(format == kFPMFormatRGBA8 || format == kFPMFormatRGBA16);
+	
+	enum { kTableChunk = 256 };
+	size_t i, j, count = (format == kFPMFormatRGBA16) ? 65536 : 256;
+	float *table = malloc(count * sizeof *table);
+	if (table == NULL)  return NULL;
+	
+	for (i = 0; i < count; i += kTableChunk)
+	{
+		FPMColor chunk[kTableChunk];
+		for (j = 0; j < kTableChunk; j++)
+		{
+			float value = (format == kFPMFormatRGBA16) ? (float)(i + j) * 1.0f/65535.0f : (float)(i + j) * 1.0f/255.0f;
+			chunk[j] = FPMMakeColor(value, value, value, 1.0f);
+		}
+		if (storageGamma != 1.0f)  FPMApplyGammaToPixels(chunk, kTableChunk, storageGamma);
+		for (j = 0; j < kTableChunk; j++)  table[i + j] = chunk[j].r;
+	}
+	
+	return table;
 }
 
 
@@ -145,10 +204,88 @@ FloatPixMapRef FPMCreate(FPMSize size)
 		return NULL;
 	}
 	
+	/*	calloc() rather than malloc() and clearing: large allocations come
+		zeroed from the OS, and their pages are only allocated when first
+		written, so they end up on the NUMA node of the thread which fills
+		them in.
+	*/
 	pixels = calloc(area, sizeof *pixels);
 	if (pixels == NULL)  return NULL;
 	
-	return MakeFPM(size, size.width, pixels, NULL);
+	FloatPixMapRef result = MakeFPM(size, size.width, kFPMFormatRGBAFloat, pixels, NULL);
+	if (result != NULL)  result->releaseStorage = FreeStorage;
+	else  free(pixels);
+	return result;
+}
+
+
+FloatPixMapRef FPMCreateWithFormat(FPMSize size, FPMPixelFormat format, float storageGamma)
+{
+	assert(sInited);
+	
+	if (format == kFPMFormatRGBAFloat)  return FPMCreate(size);
+	
+	// Calculate area and check for overflow.
+	uintmax_t area = FPMSizeArea(size);
+	size_t bytesPerPixel = FPMPixelFormatBytesPerPixel(format);
+	if (area == 0 || bytesPerPixel == 0 || area > SIZE_MAX / bytesPerPixel)
+	{
+		return NULL;
+	}
+	
+	void *storage = NULL;
+	float *decodeTable = NULL;
+	FloatPixMapRef result = NULL;
+	
+	storage = calloc(area, bytesPerPixel);
+	if (storage == NULL)  goto FAIL;
+	
+	if (format == kFPMFormatRGBA8 || format == kFPMFormatRGBA16)
+	{
+		decodeTable = MakeDecodeTable(format, storageGamma);
+		if (decodeTable == NULL)  goto FAIL;
+	}
+	
+	result = MakeFPM(size, size.width, format, storage, NULL);
+	if (result == NULL)  goto FAIL;
+	
+	result->storageGamma = storageGamma;
+	result->decodeTable = decodeTable;
+	result->releaseStorage = FreeStorage;
+	return result;
+	
+FAIL:
+	free(storage);
+	free(decodeTable);
+	return NULL;
+}
+
+
+FloatPixMapRef FPMCreateWithStorage(FPMSize size, FPMDimension rowCount, FPMPixelFormat format, float storageGamma, void *storage, FPMStorageReleaseFunction releaseFunction, void *releaseContext)
+{
+	assert(sInited);
+	
+	if (FPMSizeArea(size) == 0 || storage == NULL || rowCount < size.width || FPMPixelFormatBytesPerPixel(format) == 0)  return NULL;
+	
+	float *decodeTable = NULL;
+	if (format == kFPMFormatRGBA8 || format == kFPMFormatRGBA16)
+	{
+		decodeTable = MakeDecodeTable(format, storageGamma);
+		if (decodeTable == NULL)  return NULL;
+	}
+	
+	FloatPixMapRef result = MakeFPM(size, rowCount, format, storage, NULL);
+	if (result == NULL)
+	{
+		free(decodeTable);
+		return NULL;
+	}
+	
+	result->storageGamma = storageGamma;
+	result->decodeTable = decodeTable;
+	result->releaseStorage = releaseFunction;
+	result->releaseContext = releaseContext;
+	return result;
 }
 
 
@@ -171,7 +308,8 @@ static void Destroy(FloatPixMapRef pm)
 	// Only "masterless" FPMs own their pixels.
 	if (pm->master == NULL)
 	{
-		free(pm->pixels);
+		if (pm->releaseStorage != NULL)  pm->releaseStorage(pm->storage, pm->releaseContext);
+		free(pm->decodeTable);
 	}
 	else
 	{
@@ -213,40 +351,40 @@ FloatPixMapRef FPMCopy(FloatPixMapRef pm)
 {
 	if (pm != NULL)
 	{
-		size_t byteCount = GetPixelCount(pm) * sizeof (FPMColor);
-		if (byteCount == 0)
+		if (GetPixelCount(pm) == 0)
 		{
 			// One empty pixmap of a given size is the same as another, so we'll stick with the one instead of making another.
-			assert(pm->pixels == NULL);
+			assert(pm->storage == NULL);
 			return FPMRetain(pm);
 		}
 		
-		assert(pm->pixels != NULL);
+		assert(pm->storage != NULL);
 		
-		void *pixels = malloc(byteCount);
-		if (pixels == NULL)  return NULL;
+		FloatPixMapRef result = FPMCreateWithFormat(FPMMakeSize(pm->width, pm->height), pm->format, pm->storageGamma);
+		if (result == NULL)  return NULL;
 		
+		size_t bytesPerPixel = FPMPixelFormatBytesPerPixel(pm->format);
 		if (pm->rowCount == pm->width)
 		{
 			// No padding to skip.
-			memcpy(pixels, pm->pixels, byteCount);
+			memcpy(result->storage, pm->storage, GetPixelCount(pm) * bytesPerPixel);
 		}
 		else
 		{
 			// Original is padded, copy row by row.
-			FPMColor *srcPx = pm->pixels;
-			FPMColor *dstPx = pixels;
+			uint8_t *srcPx = pm->storage;
+			uint8_t *dstPx = result->storage;
 			size_t count = pm->height;
 			
 			do
 			{
-				memcpy(dstPx, srcPx, sizeof (FPMColor) * pm->width);
-				srcPx += pm->rowCount;
-				dstPx += pm->width;
+				memcpy(dstPx, srcPx, bytesPerPixel * pm->width);
+				srcPx += bytesPerPixel * pm->rowCount;
+				dstPx += bytesPerPixel * pm->width;
 			} while (--count);
 		}
 		
-		return MakeFPM(FPMMakeSize(pm->width, pm->height), pm->width, pixels, NULL);
+		return result;
 	}
 	else
 	{
@@ -263,7 +401,7 @@ FloatPixMapRef FPMCreateSub(FloatPixMapRef pm, FPMRect rect)
 		if (FPMRectArea(rect) != 0)
 		{
 			// Build sub-pixmap
-			return MakeFPM(rect.size, pm->rowCount, FPMGetPixelPointer(pm, rect.origin), pm);
+			return MakeFPM(rect.size, pm->rowCount, pm->format, StoragePointer(pm, rect.origin), pm);
 		}
 		else
 		{
@@ -369,9 +507,13 @@ FPMColor FPMGetPixel(FloatPixMapRef pm, FPMPoint pt)
 {
 	if (pm != NULL && PointInRange(pm, pt))
 	{
-		assert(pm->pixels != NULL);
+		assert(pm->storage != NULL);
+		
+		if (FPM_EXPECT(pm->pixels != NULL))  return pm->pixels[PixelIndex(pm, pt)];
 		
-		return pm->pixels[PixelIndex(pm, pt)];
+		FPMStorageInfo info;
+		FPMGetStorageInformation(pm, &info);
+		return FPMDecodePixel(&info, info.format, pt.x, pt.y);
 	}
 	else
 	{
@@ -384,19 +526,26 @@ void FPMSetPixel(FloatPixMapRef pm, FPMPoint pt, FPMColor px)
 {
 	if (pm != NULL && PointInRange(pm, pt))
 	{
-		assert(pm->pixels != NULL);
+		assert(pm->storage != NULL);
 		
-		pm->pixels[PixelIndex(pm, pt)] = px;
+		if (FPM_EXPECT(pm->pixels != NULL))
+		{
+			pm->pixels[PixelIndex(pm, pt)] = px;
+		}
+		else
+		{
+			FPMStorageInfo info;
+			FPMGetStorageInformation(pm, &info);
+			FPMEncodePixel(&info, info.format, pt.x, pt.y, px);
+		}
 	}
 }
 
 
 FPMColor *FPMGetPixelPointer(FloatPixMapRef pm, FPMPoint pt)
 {
-	if (pm != NULL && PointInRange(pm, pt))
+	if (pm != NULL && pm->pixels != NULL && PointInRange(pm, pt))
 	{
-		assert(pm->pixels != NULL);
-		
 		return pm->pixels + PixelIndex(pm, pt);
 	}
 	else
@@ -423,7 +572,7 @@ void FPMGetIterationInformation(FloatPixMapRef pm, FPMColor **bufferStart, FPMDi
 {
 	assert(bufferStart != NULL && width != NULL && height != NULL && rowOffset != NULL);
 	
-	if (pm != NULL)
+	if (pm != NULL && pm->format == kFPMFormatRGBAFloat)
 	{
 		assert(pm->pixels != NULL || pm->width == 0 || pm->height == 0);
 		
@@ -442,6 +591,70 @@ void FPMGetIterationInformation(FloatPixMapRef pm, FPMColor **bufferStart, FPMDi
 }
 
 
+static FPMParallelFunction sParallelFunction = NULL;
+static void *sParallelContext = NULL;
+
+
+void FPMSetParallelFunction(FPMParallelFunction function, void *parallelContext)
+{
+	sParallelFunction = function;
+	sParallelContext = parallelContext;
+}
+
+
+bool FPMRunParallel(FPMWorkFunction work, void *workContext, size_t count)
+{
+	assert(work != NULL);
+	
+	if (sParallelFunction != NULL && count > 1)
+	{
+		return sParallelFunction(work, workContext, count, sParallelContext);
+	}
+	
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		if (!work(i, count, workContext))  return false;
+	}
+	return true;
+}
+
+
+FPMPixelFormat FPMGetPixelFormat(FloatPixMapRef pm)
+{
+	if (pm != NULL)
+	{
+		return pm->format;
+	}
+	else
+	{
+		return kFPMFormatRGBAFloat;
+	}
+}
+
+
+void FPMGetStorageInformation(FloatPixMapRef pm, FPMStorageInfo *info)
+{
+	assert(info != NULL);
+	
+	if (pm != NULL)
+	{
+		info->buffer = pm->storage;
+		info->rowBytes = pm->rowCount * FPMPixelFormatBytesPerPixel(pm->format);
+		info->width = pm->width;
+		info->height = pm->height;
+		info->format = pm->format;
+		info->storageGamma = pm->storageGamma;
+		info->decodeTable = pm->decodeTable;
+	}
+	else
+	{
+		memset(info, 0, sizeof *info);
+		info->storageGamma = 1.0f;
+	}
+}
+
+
 FPMRect FPMMakeRectWithPoints(FPMPoint a, FPMPoint b)
 {
 	FPMCoordinate minX = fminf(a.x, b.x);
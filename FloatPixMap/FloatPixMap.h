@@ -63,6 +63,41 @@ FPM_INLINE FloatPixMapRef FPMCreateC(FPMDimension width, FPMDimension height)
 	return FPMCreate(FPMMakeSize(width, height));
 }
 
+/*	FPMCreateWithFormat()
+	Create a pixmap which stores its pixels in a more compact format than
+	FPMColor. Pixels are converted as they are read or written, so
+	FPMGetPixel(), FPMSetPixel() and the sampling functions in
+	FPMImageOperations.h work as for any other pixmap, but operations which
+	work on the pixel buffer directly (FPMGetPixelPointer() and everything
+	based on FPMGetIterationInformation()) only support kFPMFormatRGBAFloat.
+	
+	The colour components of the integer formats are stored gamma-encoded:
+	a stored value v (scaled to 0..1) represents pow(v, storageGamma). Alpha
+	is always stored linearly. storageGamma is ignored for the floating-point
+	formats.
+*/
+typedef enum
+{
+	kFPMFormatRGBAFloat,		// FPMColor; 16 bytes per pixel.
+	kFPMFormatRGBA8,			// Eight bits per channel; 4 bytes per pixel. With storageGamma kFPMGammaSRGB, this is the usual 8-bit sRGB format.
+	kFPMFormatRGBA16,			// Sixteen bits per channel; 8 bytes per pixel.
+	kFPMFormatRGBAHalf			// IEEE half-precision floats; 8 bytes per pixel.
+} FPMPixelFormat;
+
+FloatPixMapRef FPMCreateWithFormat(FPMSize size, FPMPixelFormat format, float storageGamma);
+FPMPixelFormat FPMGetPixelFormat(FloatPixMapRef pm) FPM_PURE;
+
+/*	FPMCreateWithStorage()
+	Create a pixmap using existing pixel data, such as a memory-mapped file.
+	rowCount is the distance between rows, in pixels. When the pixmap is
+	destroyed, releaseFunction (if not NULL) is called with storage and
+	releaseContext; if it is NULL, the caller must keep storage valid for the
+	life of the pixmap and anything derived from it, and free it afterwards.
+*/
+typedef void (*FPMStorageReleaseFunction)(void *storage, void *releaseContext);
+
+FloatPixMapRef FPMCreateWithStorage(FPMSize size, FPMDimension rowCount, FPMPixelFormat format, float storageGamma, void *storage, FPMStorageReleaseFunction releaseFunction, void *releaseContext);
+
 FloatPixMapRef FPMRetain(FloatPixMapRef pm);
 void FPMRelease(FloatPixMapRef *pm);
 uintptr_t FPMGetRetainCount(FloatPixMapRef pm);
@@ -121,6 +156,7 @@ FPM_INLINE void FPMSetPixelCV(FloatPixMapRef pm, FPMCoordinate x, FPMCoordinate
 	Get a pointer to pixel data. NOTE: when iterating over pixel data, you
 	MUST take FPMGetRowComponentCount() into account. ALSO NOTE: if the pixmap
 	is empty, i.e. width or height are 0, FPMGetBufferPointer() may be NULL.
+	These return NULL for pixmaps whose format isn't kFPMFormatRGBAFloat.
 */
 FPMColor *FPMGetPixelPointer(FloatPixMapRef pm, FPMPoint pt) FPM_PURE;
 FPM_INLINE FPMColor *FPMGetPixelPointerC(FloatPixMapRef pm, FPMCoordinate x, FPMCoordinate y) FPM_PURE;
@@ -149,9 +185,29 @@ FPM_INLINE size_t FPMGetRowByteCount(FloatPixMapRef pm)  { return FPMGetRowCompo
 	empty, i.e. width or height are 0, bufferStart may be NULL.
 	width and height are set to the dimensions of the pixmap.
 	rowOffset is set to width - rowCount.
+	Pixmaps whose format isn't kFPMFormatRGBAFloat appear empty.
 */
 void FPMGetIterationInformation(FloatPixMapRef pm, FPMColor **bufferStart, FPMDimension *width, FPMDimension *height, size_t *rowOffset) FPM_NON_NULL_ALL;
 
 
+/*** Parallelism ***/
+
+/*	FPMSetParallelFunction()
+	FPMRunParallel()
+	Bulk operations, such as FPMApplyGamma() and PNG writing, divide their
+	work into independent pieces and pass them to FPMRunParallel(). If a
+	parallel function is set, it is called to process the pieces
+	concurrently. It must call work once with each index from 0 to count - 1,
+	in any order and on any threads, and return false if any call did. The
+	default is NULL, which processes the pieces in order on the calling
+	thread. This should be set before any such work starts.
+*/
+typedef bool (*FPMWorkFunction)(size_t index, size_t count, void *workContext);
+typedef bool (*FPMParallelFunction)(FPMWorkFunction work, void *workContext, size_t count, void *parallelContext);
+
+void FPMSetParallelFunction(FPMParallelFunction function, void *parallelContext);
+bool FPMRunParallel(FPMWorkFunction work, void *workContext, size_t count);
+
+
 FPM_END_EXTERN_C
 #endif	// INCLUDED_FloatPixMap_h
@@ -41,7 +41,7 @@ static const FPMColor kLonGridSouthColor = { 0, 1, 0, 1 };
 #define kBackgroundColor kFPMColorWhite
 
 
-static FPMColor LatLongGridGenerator(Coordinates where, RenderFlags flags, void *context)
+FPM_INLINE FPMColor LatLongGridGeneratorOne(Coordinates where)
 {
 	// Grid spacing in degrees.
 	const float kInterval	= 10.0f;
@@ -84,8 +84,25 @@ static FPMColor LatLongGridGenerator(Coordinates where, RenderFlags flags, void
 }
 
 
-bool LatLongGridGeneratorConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, void **context)
+static FPMColor LatLongGridGenerator(Coordinates where, RenderFlags flags, void *context)
+{
+	return LatLongGridGeneratorOne(where);
+}
+
+
+static void LatLongGridGeneratorBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		colors[i] = LatLongGridGeneratorOne(where[i]);
+	}
+}
+
+
+bool LatLongGridGeneratorConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context)
 {
 	*source = LatLongGridGenerator;
+	if (batchSource != NULL)  *batchSource = LatLongGridGeneratorBatch;
 	return true;
 }
@@ -28,4 +28,4 @@
 #include "SphericalPixelSource.h"
 
 
-bool LatLongGridGeneratorConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, void **context);
+bool LatLongGridGeneratorConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context);
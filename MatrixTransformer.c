@@ -25,18 +25,20 @@
 */
 
 #include "MatrixTransformer.h"
+#include "CoordsBatch.h"
 
 
 typedef struct
 {
 	SphericalPixelSourceFunction			source;
+	SphericalPixelBatchSourceFunction		batchSource;
 	SphericalPixelSourceDestructorFunction	sourceDestructor;
 	void									*sourceContext;
 	OOMatrix								transform;
 } MatrixTransformerContext;
 
 
-bool MatrixTransformerSetUp(SphericalPixelSourceFunction source, SphericalPixelSourceDestructorFunction sourceDestructor, void *sourceContext, OOMatrix transform, void **context)
+bool MatrixTransformerSetUp(SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, SphericalPixelSourceDestructorFunction sourceDestructor, void *sourceContext, OOMatrix transform, void **context)
 {
 	assert(source != NULL && context != NULL);
 	
@@ -44,6 +46,7 @@ bool MatrixTransformerSetUp(SphericalPixelSourceFunction source, SphericalPixelS
 	if (cx == NULL)  return false;
 	
 	cx->source = source;
+	cx->batchSource = batchSource;
 	cx->sourceDestructor = sourceDestructor;
 	cx->sourceContext = sourceContext;
 	cx->transform = transform;
@@ -74,7 +77,52 @@ FPMColor MatrixTransformer(Coordinates where, RenderFlags flags, void *context)
 	
 	Vector v = CoordsGetVector(where);
 	v = OOVectorMultiplyMatrix(v, cx->transform);
-	where = MakeCoordsVector(v);
+	// The transform is a rotation, so the footprint is unchanged.
+	where = CoordsWithFootprint(MakeCoordsVector(v), CoordsGetFootprint(where));
 	
 	return cx->source(where, flags, cx->sourceContext);
 }
+
+
+void MatrixTransformCoordsBatch(const Coordinates *where, Coordinates *transformed, size_t count, OOMatrix transform)
+{
+	assert(count <= kMaxSourceBatchSize);
+	float x[kMaxSourceBatchSize], y[kMaxSourceBatchSize], z[kMaxSourceBatchSize];
+	const float (*m)[4] = transform.m;
+	size_t i;
+	
+	CoordsGetVectorBatch(where, x, y, z, count);
+	
+	// Same arithmetic as OOVectorMultiplyMatrix(), in a vectorizable loop.
+	for (i = 0; i < count; i++)
+	{
+		float vx = x[i], vy = y[i], vz = z[i];
+		float tw = 1.0f / (vx * m[0][3] + vy * m[1][3] + vz * m[2][3] + m[3][3]);
+		x[i] = (vx * m[0][0] + vy * m[1][0] + vz * m[2][0] + m[3][0]) * tw;
+		y[i] = (vx * m[0][1] + vy * m[1][1] + vz * m[2][1] + m[3][1]) * tw;
+		z[i] = (vx * m[0][2] + vy * m[1][2] + vz * m[2][2] + m[3][2]) * tw;
+	}
+	
+	for (i = 0; i < count; i++)
+	{
+		transformed[i] = CoordsWithFootprint(MakeCoordsVector(make_vector(x[i], y[i], z[i])), CoordsGetFootprint(where[i]));
+	}
+}
+
+
+void MatrixTransformerBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context)
+{
+	MatrixTransformerContext *cx = context;
+	Coordinates transformed[kMaxSourceBatchSize];
+	
+	while (count != 0)
+	{
+		size_t chunk = count < kMaxSourceBatchSize ? count : kMaxSourceBatchSize;
+		MatrixTransformCoordsBatch(where, transformed, chunk, cx->transform);
+		SampleSourceBatch(cx->source, cx->batchSource, cx->sourceContext, transformed, colors, chunk, flags);
+		
+		where += chunk;
+		colors += chunk;
+		count -= chunk;
+	}
+}
@@ -32,7 +32,14 @@
 #include "SphericalPixelSource.h"
 
 
-bool MatrixTransformerSetUp(SphericalPixelSourceFunction source, SphericalPixelSourceDestructorFunction sourceDestructor, void *sourceContext, OOMatrix transform, void **context);
+bool MatrixTransformerSetUp(SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, SphericalPixelSourceDestructorFunction sourceDestructor, void *sourceContext, OOMatrix transform, void **context);
 void MatrixTransformerDestructor(void *context);
 
 FPMColor MatrixTransformer(Coordinates where, RenderFlags flags, void *context);
+void MatrixTransformerBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context);
+
+/*	MatrixTransformCoordsBatch()
+	Transform up to kMaxSourceBatchSize coordinates exactly as
+	MatrixTransformerBatch() does.
+*/
+void MatrixTransformCoordsBatch(const Coordinates *where, Coordinates *transformed, size_t count, OOMatrix transform);
@@ -27,111 +27,593 @@
 */
 
 
+#if __linux__ && !defined _GNU_SOURCE
+#define _GNU_SOURCE		// For sched_getaffinity() and pthread_setaffinity_np().
+#endif
+
 #include "PlanetToolScheduler.h"
+#include "TileOrder.h"
 #include <pthread.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+
+#if __linux__
+#include <sched.h>
+#endif
 
 #ifdef __WIN32__
 #include <windows.h>
 #endif
 
 
-typedef struct PlanetToolSchedulerContext
+/*	Work is done by a pool of threads which lives for the lifetime of the
+	process, started by SchedulerInit() (or the first render).
+	
+	A set of jobs is treated as one range of work item indices (lines, or
+	tiles in Hilbert order), which is split evenly between the workers. Each
+	worker claims a few items at a time from the front of its own range; a
+	worker which runs out steals the back half of another worker's remaining
+	range. Ranges are packed into 64-bit words and updated with
+	compare-and-swap, so claiming work never takes a lock.
+	The pool mutex is only used to start a job set and to wait for the
+	workers to finish. Job sets submitted by concurrent tasks (see
+	ScheduleConcurrentTasks()) take turns on the submit lock, except that
+	ScheduleSideWork() never waits for it.
+	
+	Completed items are counted with an atomic counter. The thread which
+	called ScheduleRender() polls it at the progress report interval, rather
+	than being woken for each item.
+	
+	NUMA placement relies on first touch. Large pixmaps are calloc()ed, so
+	their pages are not faulted in until a worker writes its first pixel to
+	them. Since each worker starts with a contiguous run of items (a compact
+	area, for tiled jobs) and steals contiguous runs, with thread pinning
+	enabled most pages end up on the node of the worker which renders them.
+*/
+
+typedef uint64_t PackedRange;	// Next index in the high 32 bits, end index in the low 32 bits.
+
+enum
 {
-	RenderCallback				renderCB;
-	void						*renderContext;
-	size_t						lineCount;
-	size_t						subRenderIndex;
-	size_t						subRenderCount;
+	kCacheLineSize			= 64,
+	kMaxItemsPerClaim		= 8
+};
+
+
+typedef struct WorkerState
+{
+	volatile PackedRange		range;
+	uint8_t						padding[kCacheLineSize - sizeof (PackedRange)];	// Keep ranges on separate cache lines.
+	pthread_t					thread;
+	unsigned					index;
+} WorkerState;
+
+
+typedef struct SchedulerPool
+{
+	unsigned					workerCount;
+	WorkerState					*workers;
 	
-	pthread_mutex_t				indexLock;
-	volatile size_t				index;
+	pthread_mutex_t				submitLock;		// Held for the duration of a job set.
 	
-	pthread_mutex_t				notificationMutex;
-	pthread_cond_t				notificationCond;
+	pthread_mutex_t				lock;			// Protects the following three fields.
+	pthread_cond_t				workCond;		// Signalled when a job set is started.
+	pthread_cond_t				doneCond;		// Signalled when a worker goes idle.
+	unsigned					generation;
+	unsigned					busyWorkers;
 	
-	size_t						progressNumerator;
-	size_t						progressDenominator;
-	ProgressCallbackFunction	progressCB;
-	void						*cbContext;
+	// Current job set. Constant while workers are busy.
+	const RenderJob				*jobs;
+	const size_t				*jobStarts;
+	uint32_t * const			*tileOrders;	// Per job; NULL for line jobs.
+	size_t						jobCount;
 	
-	volatile bool				stop;
-} PlanetToolSchedulerContext;
+	// Accessed atomically.
+	size_t						itemsDone;
+	bool						stop;
+	
+	unsigned					progressInterval;	// Milliseconds.
+} SchedulerPool;
+
+
+enum
+{
+	kDefaultProgressInterval	= 100
+};
+
 
+static SchedulerPool sPool = { .progressInterval = kDefaultProgressInterval };
+static pthread_once_t sPoolOnce = PTHREAD_ONCE_INIT;
+static bool sPoolOK = false;
 
-static bool RunRenderTask(PlanetToolSchedulerContext *context);
-static void *RenderThreadTask(void *vcontext);
+// Configuration used by InitPool().
+static unsigned sRequestedThreadCount = 0;
+static bool sPinThreads = false;
+
+
+static void InitPool(void);
+static bool BuildTileOrders(const RenderJob *jobs, size_t jobCount, uint32_t **tileOrders);
+static struct timespec NextProgressDeadline(void);
+static bool RunJobs(const RenderJob *jobs, size_t jobCount, size_t progressNumerator, size_t progressDenominator, ProgressCallbackFunction progressCB, void *cbContext);
+static bool RunLockedJobs(const RenderJob *jobs, size_t jobCount, const size_t *jobStarts, uint32_t * const *tileOrders, size_t totalItems, size_t progressNumerator, size_t progressDenominator, ProgressCallbackFunction progressCB, void *cbContext);
+static void *WorkerThread(void *vworker);
 static unsigned ThreadCount(void);
+static unsigned ProcessorCount(void);
+static unsigned EnvironmentThreadCount(void);
+static void PinCurrentThread(unsigned index);
+
+
+FPM_INLINE PackedRange MakePackedRange(uint32_t next, uint32_t end)
+{
+	return ((uint64_t)next << 32) | end;
+}
+
+
+FPM_INLINE PackedRange LoadRange(volatile PackedRange *range)
+{
+	return __atomic_load_n(range, __ATOMIC_ACQUIRE);
+}
+
+
+FPM_INLINE void StoreRange(volatile PackedRange *range, PackedRange value)
+{
+	__atomic_store_n(range, value, __ATOMIC_RELEASE);
+}
+
+
+FPM_INLINE bool ShouldStop(void)
+{
+	return __atomic_load_n(&sPool.stop, __ATOMIC_ACQUIRE);
+}
+
+
+FPM_INLINE void RequestStop(void)
+{
+	__atomic_store_n(&sPool.stop, true, __ATOMIC_RELEASE);
+}
+
+
+FPM_INLINE uint32_t RangeNext(PackedRange range)
+{
+	return range >> 32;
+}
+
+
+FPM_INLINE uint32_t RangeEnd(PackedRange range)
+{
+	return (uint32_t)range;
+}
+
+
+bool SchedulerInit(void)
+{
+	pthread_once(&sPoolOnce, InitPool);
+	return sPoolOK;
+}
+
+
+void SchedulerSetThreadCount(unsigned count)
+{
+	sRequestedThreadCount = count;
+}
+
+
+void SchedulerSetThreadPinning(bool pin)
+{
+	sPinThreads = pin;
+}
+
+
+void SchedulerSetProgressInterval(unsigned milliseconds)
+{
+	if (milliseconds < 1)  milliseconds = 1;
+	__atomic_store_n(&sPool.progressInterval, milliseconds, __ATOMIC_RELAXED);
+}
 
 
 bool ScheduleRender(RenderCallback renderCB, void *renderContext, size_t lineCount, size_t subRenderIndex, size_t subRenderCount, ProgressCallbackFunction progressCB, void *cbContext)
 {
-	PlanetToolSchedulerContext threadContext =
+	RenderJob job =
 	{
 		.renderCB = renderCB,
 		.renderContext = renderContext,
-		.lineCount = lineCount,
-		.subRenderIndex = subRenderIndex,
-		.subRenderCount = subRenderCount,
-		.indexLock = PTHREAD_MUTEX_INITIALIZER,
-		.index = 0,
-		.notificationCond = PTHREAD_COND_INITIALIZER,
-		.notificationMutex = PTHREAD_MUTEX_INITIALIZER,
-		.progressNumerator = subRenderIndex * lineCount,
-		.progressDenominator = subRenderCount * lineCount,
-		.progressCB = NULL,
-		.cbContext = cbContext,
-		.stop = false
+		.lineCount = lineCount
 	};
 	
-	bool result = false;
+	return RunJobs(&job, 1, subRenderIndex * lineCount, subRenderCount * lineCount, progressCB, cbContext);
+}
+
+
+bool ScheduleRenderJobs(const RenderJob *jobs, size_t jobCount, ProgressCallbackFunction progressCB, void *cbContext)
+{
+	size_t i, totalItems = 0;
+	for (i = 0; i < jobCount; i++)  totalItems += RenderJobItemCount(&jobs[i]);
+	
+	return RunJobs(jobs, jobCount, 0, totalItems, progressCB, cbContext);
+}
+
+
+static bool RunJobs(const RenderJob *jobs, size_t jobCount, size_t progressNumerator, size_t progressDenominator, ProgressCallbackFunction progressCB, void *cbContext)
+{
+	assert(jobs != NULL || jobCount == 0);
+	
+	if (!SchedulerInit())  return false;
+	
+	size_t i, totalItems = 0;
+	size_t jobStarts[jobCount + 1];
+	for (i = 0; i < jobCount; i++)
+	{
+		if (jobs[i].renderCB == NULL && jobs[i].renderTileCB == NULL)  return false;
+		jobStarts[i] = totalItems;
+		totalItems += RenderJobItemCount(&jobs[i]);
+	}
+	jobStarts[jobCount] = totalItems;
+	
+	if (totalItems == 0)  return true;
+	if (totalItems > UINT32_MAX)
+	{
+		fprintf(stderr, "Too many lines or tiles to render in one job set.\n");
+		return false;
+	}
+	
+	uint32_t *tileOrders[jobCount];
+	if (!BuildTileOrders(jobs, jobCount, tileOrders))  return false;
 	
-	if (pthread_mutex_init(&threadContext.indexLock, NULL) == 0)
+	pthread_mutex_lock(&sPool.submitLock);
+	bool result = RunLockedJobs(jobs, jobCount, jobStarts, tileOrders, totalItems, progressNumerator, progressDenominator, progressCB, cbContext);
+	pthread_mutex_unlock(&sPool.submitLock);
+	
+	for (i = 0; i < jobCount; i++)  free(tileOrders[i]);
+	
+	if (result && progressCB != NULL)  progressCB(progressNumerator + totalItems, progressDenominator, cbContext);
+	return result;
+}
+
+
+//	Run a job set on the pool. The caller must hold the submit lock.
+static bool RunLockedJobs(const RenderJob *jobs, size_t jobCount, const size_t *jobStarts, uint32_t * const *tileOrders, size_t totalItems, size_t progressNumerator, size_t progressDenominator, ProgressCallbackFunction progressCB, void *cbContext)
+{
+	size_t i;
+	
+	// Give each worker an equal share of the work.
+	unsigned workerCount = sPool.workerCount;
+	for (i = 0; i < workerCount; i++)
 	{
-		if (pthread_mutex_init(&threadContext.notificationMutex, NULL) == 0)
+		uint32_t start = (uint64_t)totalItems * i / workerCount;
+		uint32_t end = (uint64_t)totalItems * (i + 1) / workerCount;
+		StoreRange(&sPool.workers[i].range, MakePackedRange(start, end));
+	}
+	
+	sPool.jobs = jobs;
+	sPool.jobStarts = jobStarts;
+	sPool.tileOrders = tileOrders;
+	sPool.jobCount = jobCount;
+	__atomic_store_n(&sPool.itemsDone, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&sPool.stop, false, __ATOMIC_RELAXED);
+	
+	pthread_mutex_lock(&sPool.lock);
+	sPool.busyWorkers = workerCount;
+	sPool.generation++;
+	pthread_cond_broadcast(&sPool.workCond);
+	
+	size_t lastReported = 0;
+	struct timespec deadline = NextProgressDeadline();
+	while (sPool.busyWorkers != 0)
+	{
+		if (progressCB == NULL)
+		{
+			pthread_cond_wait(&sPool.doneCond, &sPool.lock);
+			continue;
+		}
+		
+		// Wake up at the reporting interval, or when a worker finishes.
+		if (pthread_cond_timedwait(&sPool.doneCond, &sPool.lock, &deadline) != ETIMEDOUT)  continue;
+		deadline = NextProgressDeadline();
+		
+		size_t itemsDone = __atomic_load_n(&sPool.itemsDone, __ATOMIC_RELAXED);
+		if (itemsDone != lastReported && !ShouldStop())
 		{
-			if (pthread_cond_init(&threadContext.notificationCond, NULL) == 0)
+			lastReported = itemsDone;
+			pthread_mutex_unlock(&sPool.lock);
+			if (EXPECT_NOT(!progressCB(progressNumerator + itemsDone, progressDenominator, cbContext)))
 			{
-				threadContext.progressCB = progressCB;
+				RequestStop();
 			}
+			pthread_mutex_lock(&sPool.lock);
+		}
+	}
+	
+	pthread_mutex_unlock(&sPool.lock);
+	
+	bool result = !ShouldStop();
+	sPool.jobs = NULL;
+	sPool.jobStarts = NULL;
+	sPool.tileOrders = NULL;
+	
+	return result;
+}
+
+
+typedef struct
+{
+	RenderCallback				workCB;
+	void						*workContext;
+	size_t						first;
+	size_t						count;
+} SideWorkRemainder;
+
+
+static bool RunSideWorkItem(size_t index, size_t count, void *context)
+{
+	SideWorkRemainder *remainder = context;
+	return remainder->workCB(remainder->first + index, remainder->count, remainder->workContext);
+}
+
+
+/*	Items are done on the calling thread while another job set has the
+	pool, and whatever is left is handed to the pool as soon as the submit
+	lock is free.
+*/
+bool ScheduleSideWork(RenderCallback workCB, void *workContext, size_t count)
+{
+	if (workCB == NULL)  return false;
+	if (!SchedulerInit())  return false;
+	if (count > UINT32_MAX)  return ScheduleRender(workCB, workContext, count, 0, 1, NULL, NULL);
+	
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		if (pthread_mutex_trylock(&sPool.submitLock) == 0)
+		{
+			SideWorkRemainder remainder = { workCB, workContext, i, count };
+			RenderJob job = { .renderCB = RunSideWorkItem, .renderContext = &remainder, .lineCount = count - i };
+			size_t jobStarts[2] = { 0, count - i };
+			uint32_t *tileOrders[1] = { NULL };
+			
+			bool result = RunLockedJobs(&job, 1, jobStarts, tileOrders, count - i, 0, 0, NULL, NULL);
+			pthread_mutex_unlock(&sPool.submitLock);
+			return result;
 		}
 		
-		result = RunRenderTask(&threadContext);
+		if (EXPECT_NOT(!workCB(i, count, workContext)))  return false;
+	}
+	
+	return true;
+}
+
+
+typedef struct
+{
+	SchedulerTaskFunction		task;
+	void						*context;
+	bool						result;
+} TaskThreadContext;
+
+
+static void *TaskThread(void *vcontext)
+{
+	TaskThreadContext *context = vcontext;
+	context->result = context->task(context->context);
+	return NULL;
+}
+
+
+/*	Each task but the first gets a thread of its own; the first runs on the
+	calling thread. These threads spend most of their time waiting for their
+	job sets, so they don't compete with the render threads for processors.
+*/
+bool ScheduleConcurrentTasks(SchedulerTaskFunction task, void * const *contexts, size_t count)
+{
+	if (count == 0)  return true;
+	if (!SchedulerInit())  return false;
+	
+	TaskThreadContext taskContexts[count];
+	pthread_t threads[count];
+	bool started[count];
+	size_t i;
+	
+	for (i = 0; i < count; i++)
+	{
+		taskContexts[i] = (TaskThreadContext){ task, contexts[i], false };
+		started[i] = false;
+	}
+	
+	for (i = 1; i < count; i++)
+	{
+		started[i] = pthread_create(&threads[i], NULL, TaskThread, &taskContexts[i]) == 0;
+	}
+	
+	TaskThread(&taskContexts[0]);
+	
+	// Tasks whose threads couldn't be started are run here once the others are under way.
+	for (i = 1; i < count; i++)
+	{
+		if (!started[i])  TaskThread(&taskContexts[i]);
+	}
+	
+	bool OK = true;
+	for (i = 0; i < count; i++)
+	{
+		if (started[i])  pthread_join(threads[i], NULL);
+		if (!taskContexts[i].result)  OK = false;
+	}
+	
+	return OK;
+}
+
+
+/*	The two ends of a pipeline wait for each other on a condition variable.
+	Items are expected to be few and large, such as bands of output, so
+	this costs nothing noticeable.
+*/
+typedef struct
+{
+	SchedulerStageFunction		consumeCB;
+	void						*context;
+	size_t						count;
+	
+	pthread_mutex_t				lock;		// Protects the following three fields.
+	pthread_cond_t				cond;		// Signalled when any of them changes.
+	size_t						produced;
+	size_t						consumed;
+	bool						failed;
+} PipelineState;
+
+
+//	Record the outcome of one stage, and return whether to go on.
+static bool PipelineStageDone(PipelineState *state, size_t *counter, size_t index, bool OK)
+{
+	pthread_mutex_lock(&state->lock);
+	if (OK)  *counter = index + 1;
+	else  state->failed = true;
+	pthread_cond_broadcast(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+	
+		return OK;
+}
+
+
+static void *PipelineConsumerThread(void *vstate)
+{
+	PipelineState *state = vstate;
+	size_t i;
+	
+	for (i = 0; i < state->count; i++)
+	{
+		pthread_mutex_lock(&state->lock);
+		while (state->produced <= i && !state->failed)  pthread_cond_wait(&state->cond, &state->lock);
+		bool failed = state->failed;
+		pthread_mutex_unlock(&state->lock);
 		
-		if (threadContext.progressCB != NULL)
+		if (failed || !PipelineStageDone(state, &state->consumed, i, state->consumeCB(i, state->context)))  break;
+	}
+	
+	return NULL;
+}
+
+
+bool SchedulePipeline(SchedulerStageFunction produceCB, SchedulerStageFunction consumeCB, void *context, size_t count, size_t slots)
+{
+	if (count == 0)  return true;
+	if (slots == 0)  slots = 1;
+	
+	PipelineState state = { .consumeCB = consumeCB, .context = context, .count = count };
+	pthread_t consumer;
+	bool haveLock = pthread_mutex_init(&state.lock, NULL) == 0;
+	bool haveCond = haveLock && pthread_cond_init(&state.cond, NULL) == 0;
+	bool started = haveCond && pthread_create(&consumer, NULL, PipelineConsumerThread, &state) == 0;
+	
+	size_t i;
+	bool OK = true;
+	if (started)
+	{
+		for (i = 0; i < count; i++)
 		{
-			pthread_cond_destroy(&threadContext.notificationCond);
-			pthread_mutex_destroy(&threadContext.notificationMutex);
+			pthread_mutex_lock(&state.lock);
+			while (i >= state.consumed + slots && !state.failed)  pthread_cond_wait(&state.cond, &state.lock);
+			bool failed = state.failed;
+			pthread_mutex_unlock(&state.lock);
+			
+			if (failed || !PipelineStageDone(&state, &state.produced, i, produceCB(i, context)))  break;
 		}
 		
-		pthread_mutex_destroy(&threadContext.indexLock);
+		pthread_join(consumer, NULL);
+		OK = !state.failed;
 	}
 	else
 	{
-		fprintf(stderr, "Failed to create work item indexing mutex.\n");
+		// Without a consumer thread, produce and consume each item in turn.
+		for (i = 0; i < count && OK; i++)
+		{
+			OK = produceCB(i, context) && consumeCB(i, context);
+		}
 	}
 	
-	return result;
+	if (haveCond)  pthread_cond_destroy(&state.cond);
+	if (haveLock)  pthread_mutex_destroy(&state.lock);
+	return OK;
+}
+
+
+static bool BuildTileOrders(const RenderJob *jobs, size_t jobCount, uint32_t **tileOrders)
+{
+	size_t i;
+	for (i = 0; i < jobCount; i++)
+	{
+		tileOrders[i] = NULL;
+		if (jobs[i].renderTileCB == NULL)  continue;
+		
+		tileOrders[i] = malloc(RenderJobItemCount(&jobs[i]) * sizeof *tileOrders[i]);
+		if (tileOrders[i] == NULL)
+		{
+			fprintf(stderr, "Failed to allocate tile order.\n");
+			while (i--)  free(tileOrders[i]);
+			return false;
+		}
+		BuildHilbertTileOrder(RenderJobTilesAcross(&jobs[i]), RenderJobTilesDown(&jobs[i]), tileOrders[i]);
+	}
+	
+	return true;
 }
 
 
-static bool RunRenderTask(PlanetToolSchedulerContext *context)
+static struct timespec NextProgressDeadline(void)
 {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	
+	unsigned interval = __atomic_load_n(&sPool.progressInterval, __ATOMIC_RELAXED);
+	long long usec = (long long)now.tv_usec + interval * 1000LL;
+	
+	struct timespec deadline =
+	{
+		.tv_sec = now.tv_sec + usec / 1000000,
+		.tv_nsec = (usec % 1000000) * 1000
+	};
+	return deadline;
+}
+
+
+static void InitPool(void)
+{
+	if (pthread_mutex_init(&sPool.submitLock, NULL) != 0 ||
+		pthread_mutex_init(&sPool.lock, NULL) != 0 ||
+		pthread_cond_init(&sPool.workCond, NULL) != 0 ||
+		pthread_cond_init(&sPool.doneCond, NULL) != 0)
+	{
+		fprintf(stderr, "Failed to create scheduler synchronization objects.\n");
+		return;
+	}
+	
 	unsigned i, threadCount = ThreadCount();
-	if (threadCount > context->lineCount)  threadCount = context->lineCount;	// Prepare for the mega-manycore monsters of the mfuture!
-	assert(threadCount > 0);
+	if (threadCount < 1)  threadCount = 1;
+	
+	sPool.workers = calloc(threadCount, sizeof *sPool.workers);
+	if (sPool.workers == NULL)
+	{
+		fprintf(stderr, "Failed to allocate work thread state.\n");
+		return;
+	}
 	
-	pthread_t threads[threadCount];
-	int err = 0;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 	
 	for (i = 0; i < threadCount; i++)
 	{
-		err = pthread_create(&threads[i], NULL, RenderThreadTask, context);
+		sPool.workers[i].index = i;
+		StoreRange(&sPool.workers[i].range, MakePackedRange(0, 0));
+		
+		int err = pthread_create(&sPool.workers[i].thread, &attr, WorkerThread, &sPool.workers[i]);
 		if (err != 0)
 		{
 			if (i == 0)
 			{
 				fprintf(stderr, "Failed to create work threads.\n");
-				return false;
+				pthread_attr_destroy(&attr);
+				return;
 			}
 			else
 			{
@@ -141,67 +623,143 @@ static bool RunRenderTask(PlanetToolSchedulerContext *context)
 		}
 	}
 	
-	// Receive progress notifications if relevant.
-	if (context->progressCB != NULL)
+	pthread_attr_destroy(&attr);
+	
+	sPool.workerCount = threadCount;
+	sPoolOK = true;
+}
+
+
+//	Claim up to kMaxItemsPerClaim items from the front of a worker's own range.
+static bool ClaimItems(WorkerState *worker, uint32_t *outStart, uint32_t *outEnd)
+{
+	for (;;)
 	{
-		while (context->index < context->lineCount && !context->stop)
+		PackedRange range = LoadRange(&worker->range);
+		uint32_t next = RangeNext(range), end = RangeEnd(range);
+		if (next >= end)  return false;
+		
+		uint32_t count = (end - next) / kMaxItemsPerClaim;
+		if (count < 1)  count = 1;
+		if (count > kMaxItemsPerClaim)  count = kMaxItemsPerClaim;
+		
+		if (__sync_bool_compare_and_swap(&worker->range, range, MakePackedRange(next + count, end)))
 		{
-			pthread_mutex_lock(&context->notificationMutex);
-			pthread_cond_wait(&context->notificationCond, &context->notificationMutex);
-			pthread_mutex_unlock(&context->notificationMutex);
+			*outStart = next;
+			*outEnd = next + count;
+			return true;
+		}
+	}
+}
+
+
+/*	Take the back half of another worker's remaining items and make them the
+	thief's own range. Only called when the thief's range is empty, so no
+	other thread will be modifying it.
+*/
+static bool StealItems(WorkerState *thief)
+{
+	unsigned i, workerCount = sPool.workerCount;
+	for (i = 1; i < workerCount; i++)
+	{
+		WorkerState *victim = &sPool.workers[(thief->index + i) % workerCount];
+		
+		for (;;)
+		{
+			PackedRange range = LoadRange(&victim->range);
+			uint32_t next = RangeNext(range), end = RangeEnd(range);
+			if (next >= end)  break;
 			
-			if (context->index <= context->lineCount)
+			uint32_t split = end - (end - next + 1) / 2;
+			if (__sync_bool_compare_and_swap(&victim->range, range, MakePackedRange(next, split)))
 			{
-				if (EXPECT_NOT(!context->progressCB(context->progressNumerator + context->index, context->progressDenominator, context->cbContext)))
+				PackedRange old = LoadRange(&thief->range);
+				while (!__sync_bool_compare_and_swap(&thief->range, old, MakePackedRange(split, end)))
 				{
-					context->stop = true;
+					old = LoadRange(&thief->range);
 				}
+				return true;
 			}
 		}
-		
-		if (!context->stop)  context->progressCB(context->progressNumerator + context->lineCount, context->progressDenominator, context->cbContext);
 	}
 	
-	// Wait for completion.
-	for (i = 0; i < threadCount; i++)
+	return false;
+}
+
+
+static bool RenderOneItem(size_t index, size_t *jobHint)
+{
+	const size_t *jobStarts = sPool.jobStarts;
+	size_t job = *jobHint;
+	
+	if (index < jobStarts[job])  job = 0;
+	while (index >= jobStarts[job + 1])  job++;
+	*jobHint = job;
+	
+	const RenderJob *renderJob = &sPool.jobs[job];
+	size_t item = index - jobStarts[job];
+	
+	if (renderJob->renderTileCB == NULL)
 	{
-		void *junk = NULL;
-		err = pthread_join(threads[i], &junk);
-		if (err != 0)
-		{
-			fprintf(stderr, "\nThread join error: %i\n", err);
-			abort();
-		}
+		return renderJob->renderCB(item, renderJob->lineCount, renderJob->renderContext);
+	}
+	else
+	{
+		FPMRect tile = RenderJobTileRect(renderJob, sPool.tileOrders[job][item]);
+		return renderJob->renderTileCB(tile, renderJob->renderContext);
 	}
-	
-	return !context->stop;
 }
 
 
-static void *RenderThreadTask(void *vcontext)
+static void *WorkerThread(void *vworker)
 {
-	PlanetToolSchedulerContext *context = vcontext;
+	WorkerState *worker = vworker;
+	unsigned seenGeneration = 0;
+	
+	if (sPinThreads)  PinCurrentThread(worker->index);
 	
 	for (;;)
 	{
-		// Select an index.
-		pthread_mutex_lock(&context->indexLock);
-		size_t idx = context->index++;
-		pthread_mutex_unlock(&context->indexLock);
+		pthread_mutex_lock(&sPool.lock);
+		while (sPool.generation == seenGeneration)
+		{
+			pthread_cond_wait(&sPool.workCond, &sPool.lock);
+		}
+		seenGeneration = sPool.generation;
+		pthread_mutex_unlock(&sPool.lock);
 		
-		if (idx < context->lineCount && !context->stop)
+		size_t jobHint = 0;
+		uint32_t start, end;
+		
+		while (!ShouldStop())
 		{
-			bool success = context->renderCB(idx, context->lineCount, context->renderContext);
-			if (EXPECT_NOT(!success))  context->stop = true;
+			if (!ClaimItems(worker, &start, &end))
+			{
+				if (StealItems(worker))  continue;
+				break;
+			}
 			
-			// If there's a progress callback, signal main thread to update.
-			if (context->progressCB != NULL)
+			uint32_t idx;
+			for (idx = start; idx < end && !ShouldStop(); idx++)
 			{
-				pthread_cond_signal(&context->notificationCond);
+				bool success = RenderOneItem(idx, &jobHint);
+				if (EXPECT_NOT(!success))  RequestStop();
 			}
+			
+			__atomic_fetch_add(&sPool.itemsDone, idx - start, __ATOMIC_RELAXED);
 		}
 		
-		if (idx >= context->lineCount || context->stop)  break;
+		// Abandon any remaining work after a stop.
+		PackedRange old = LoadRange(&worker->range);
+		while (!__sync_bool_compare_and_swap(&worker->range, old, MakePackedRange(0, 0)))
+		{
+			old = LoadRange(&worker->range);
+		}
+		
+		pthread_mutex_lock(&sPool.lock);
+		sPool.busyWorkers--;
+		pthread_cond_signal(&sPool.doneCond);
+		pthread_mutex_unlock(&sPool.lock);
 	}
 	
 	return NULL;
@@ -212,16 +770,88 @@ static void *RenderThreadTask(void *vcontext)
 
 #if FORCE_SINGLE_THREAD
 
-static unsigned ThreadCount(void)
+static unsigned ProcessorCount(void)
 {
 	// For debugging.
 	return 1;
 }
 
+#elif __linux__
+
+static unsigned CGroupCPUQuota(void);
+
+
+/*	Processors this process may run on, rather than the number in the
+	machine: those in its affinity mask (as set by taskset or a container
+	runtime), further limited by its cgroup CPU quota if it has one.
+*/
+static unsigned ProcessorCount(void)
+{
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned count = (online > 0) ? online : 1;
+	
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof allowed, &allowed) == 0)
+	{
+		unsigned allowedCount = CPU_COUNT(&allowed);
+		if (0 < allowedCount && allowedCount < count)  count = allowedCount;
+	}
+	
+	unsigned quota = CGroupCPUQuota();
+	if (0 < quota && quota < count)  count = quota;
+	
+	return count;
+}
+
+
+static bool ReadLongLong(const char *path, long long *value)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL)  return false;
+	
+	bool OK = fscanf(file, "%lld", value) == 1;
+	fclose(file);
+	return OK;
+}
+
+
+/*	Returns the CPU quota of the process's cgroup in whole processors, or 0
+	if there is none. Only the cgroup mounted at /sys/fs/cgroup is checked,
+	which in a container is the container's own.
+*/
+static unsigned CGroupCPUQuota(void)
+{
+	long long quota = -1, period = 0;
+	
+	FILE *file = fopen("/sys/fs/cgroup/cpu.max", "r");
+	if (file != NULL)
+	{
+		// cgroup v2: "<quota> <period>", where quota may be "max".
+		char quotaString[32];
+		if (fscanf(file, "%31s %lld", quotaString, &period) == 2 && strcmp(quotaString, "max") != 0)
+		{
+			quota = strtoll(quotaString, NULL, 10);
+		}
+		fclose(file);
+	}
+	else
+	{
+		// cgroup v1: quota is -1 if unlimited.
+		if (!ReadLongLong("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", &quota) ||
+			!ReadLongLong("/sys/fs/cgroup/cpu/cpu.cfs_period_us", &period))
+		{
+			return 0;
+		}
+	}
+	
+	if (quota <= 0 || period <= 0)  return 0;
+	return (quota + period - 1) / period;
+}
+
 #elif __APPLE__
 #include <sys/sysctl.h>
 
-static unsigned ThreadCount(void)
+static unsigned ProcessorCount(void)
 {
 	int		value = 0;
 	size_t	size = sizeof value;
@@ -240,14 +870,14 @@ static unsigned ThreadCount(void)
 
 #elif defined _SC_NPROCESSORS_ONLN
 
-static unsigned ThreadCount(void)
+static unsigned ProcessorCount(void)
 {
 	return sysconf(_SC_NPROCESSORS_ONLN);
 }
 
 #elif defined __WIN32__
 
-static unsigned ThreadCount(void)
+static unsigned ProcessorCount(void)
 {
 	SYSTEM_INFO	sysInfo;
 	
@@ -259,9 +889,97 @@ static unsigned ThreadCount(void)
 
 #warning Cannot determine number of processors on this system, rendering will be single-threaded.
 
-static unsigned ThreadCount(void)
+static unsigned ProcessorCount(void)
 {
 	return 1;
 }
 
 #endif
+
+
+static unsigned ThreadCount(void)
+{
+	unsigned available = ProcessorCount();
+	unsigned requested = sRequestedThreadCount;
+	if (requested == 0)  requested = EnvironmentThreadCount();
+	
+	if (requested != 0 && requested < available)  return requested;
+	return available;
+}
+
+
+static unsigned EnvironmentThreadCount(void)
+{
+	const char *string = getenv("PLANETTOOL_THREADS");
+	if (string == NULL || *string == '\0')  return 0;
+	
+	char *end = NULL;
+	unsigned long count = strtoul(string, &end, 10);
+	if (*end != '\0' || count > UINT_MAX)
+	{
+		fprintf(stderr, "Ignoring PLANETTOOL_THREADS value \"%s\", which is not a thread count.\n", string);
+		return 0;
+	}
+	return count;
+}
+
+
+#if __linux__
+
+//	Bind the calling thread to the index-th processor it is allowed to run on.
+static void PinCurrentThread(unsigned index)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof allowed, &allowed) != 0)  return;
+	
+	unsigned allowedCount = CPU_COUNT(&allowed);
+	if (allowedCount == 0)  return;
+	
+	unsigned cpu, remaining = index % allowedCount;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (!CPU_ISSET(cpu, &allowed))  continue;
+		if (remaining-- == 0)
+		{
+			cpu_set_t pinned;
+			CPU_ZERO(&pinned);
+			CPU_SET(cpu, &pinned);
+			pthread_setaffinity_np(pthread_self(), sizeof pinned, &pinned);
+			return;
+		}
+	}
+}
+
+#elif defined __WIN32__
+
+static void PinCurrentThread(unsigned index)
+{
+	DWORD_PTR processMask, systemMask;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) || processMask == 0)  return;
+	
+	unsigned allowedCount = 0, bit;
+	for (bit = 0; bit < sizeof processMask * 8; bit++)
+	{
+		if (processMask & ((DWORD_PTR)1 << bit))  allowedCount++;
+	}
+	
+	unsigned remaining = index % allowedCount;
+	for (bit = 0; bit < sizeof processMask * 8; bit++)
+	{
+		if (!(processMask & ((DWORD_PTR)1 << bit)))  continue;
+		if (remaining-- == 0)
+		{
+			SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << bit);
+			return;
+		}
+	}
+}
+
+#else
+
+static void PinCurrentThread(unsigned index)
+{
+	// Thread pinning is not supported on this system (Mac OS X only offers affinity hints).
+}
+
+#endif
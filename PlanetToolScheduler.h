@@ -50,6 +50,14 @@
 typedef bool (*RenderCallback)(size_t lineIndex, size_t lineCount, void *context);
 
 
+/*	Type for tile render callback.
+	The callback is called for each tile of a tiled job (see RenderJob),
+	with the tile's bounds in the job's output area. The same rules apply as
+	for RenderCallback.
+*/
+typedef bool (*RenderTileCallback)(FPMRect tile, void *context);
+
+
 /*	Scheduler interface.
 	
 	renderCB is the function to call for each line.
@@ -67,11 +75,172 @@ typedef bool (*RenderCallback)(size_t lineIndex, size_t lineCount, void *context
 	will be the same for each invocation; if not, the caller will have to
 	provide an intermediate progress callback to translate.
 	
-	progressCB is called for each line to report progress.
+	progressCB is called periodically to report progress, at most once per
+	progress interval (see SchedulerSetProgressInterval()), and once more when
+	rendering completes. It is called on the thread which called
+	ScheduleRender(). If it returns false, rendering stops as soon as the
+	lines currently being rendered are finished.
 	
 	cbContext is an arbitrary parameter to the progress callback.
 */
 bool ScheduleRender(RenderCallback renderCB, void *renderContext, size_t lineCount, size_t subRenderIndex, size_t subRenderCount, ProgressCallbackFunction progressCB, void *cbContext);
 
 
+/*	Multiple-job and tiled interface.
+	
+	Renders several independent jobs (for instance, the six faces of a cube
+	map) as a single unit of work, so that threads which finish one job can
+	help with another instead of waiting for it.
+	
+	A job is either line-based, like ScheduleRender(), or tiled. A tiled job
+	has a renderTileCB; its width by lineCount pixel area is divided into
+	tiles of tileSize pixels square (kDefaultRenderTileSize if 0), which are
+	handed out in Hilbert curve order (see TileOrder.h). Each thread then
+	works on a compact area of the output, and for most projections reads a
+	compact area of the source, instead of long stripes of it. renderCB is
+	ignored for tiled jobs.
+	
+	Progress is reported in work items (lines or tiles) over the total for
+	all jobs.
+*/
+typedef struct RenderJob
+{
+	RenderCallback				renderCB;
+	void						*renderContext;
+	size_t						lineCount;
+	
+	RenderTileCallback			renderTileCB;
+	size_t						width;
+	size_t						tileSize;
+} RenderJob;
+
+enum
+{
+	kDefaultRenderTileSize		= 64
+};
+
+
+//	Helpers for scheduler implementations.
+FPM_INLINE size_t RenderJobTileSize(const RenderJob *job)
+{
+	return (job->tileSize != 0) ? job->tileSize : kDefaultRenderTileSize;
+}
+
+FPM_INLINE size_t RenderJobTilesAcross(const RenderJob *job)
+{
+	size_t tileSize = RenderJobTileSize(job);
+	return (job->width + tileSize - 1) / tileSize;
+}
+
+FPM_INLINE size_t RenderJobTilesDown(const RenderJob *job)
+{
+	size_t tileSize = RenderJobTileSize(job);
+	return (job->lineCount + tileSize - 1) / tileSize;
+}
+
+FPM_INLINE size_t RenderJobItemCount(const RenderJob *job)
+{
+	if (job->renderTileCB == NULL)  return job->lineCount;
+	return RenderJobTilesAcross(job) * RenderJobTilesDown(job);
+}
+
+//	Bounds of a tile, given its row-major index.
+FPM_INLINE FPMRect RenderJobTileRect(const RenderJob *job, size_t tileIndex)
+{
+	size_t tileSize = RenderJobTileSize(job);
+	size_t tilesAcross = RenderJobTilesAcross(job);
+	size_t x = (tileIndex % tilesAcross) * tileSize;
+	size_t y = (tileIndex / tilesAcross) * tileSize;
+	size_t width = job->width - x, height = job->lineCount - y;
+	if (width > tileSize)  width = tileSize;
+	if (height > tileSize)  height = tileSize;
+	
+	return FPMMakeRectC(x, y, width, height);
+}
+
+bool ScheduleRenderJobs(const RenderJob *jobs, size_t jobCount, ProgressCallbackFunction progressCB, void *cbContext);
+
+
+/*	Concurrent task interface.
+	
+	Runs count independent tasks at the same time, calling task once with
+	each element of contexts, and returns when all have finished. Tasks may
+	call ScheduleRender() and ScheduleRenderJobs(); job sets from different
+	tasks share the render threads a job set at a time, so while one task is
+	doing serial work, such as writing a file, the others keep the render
+	threads busy. Progress callbacks are called on the submitting task's
+	thread, so may be called concurrently for different tasks.
+	
+	Returns true if every task returned true. Single-threaded schedulers run
+	the tasks one after another.
+*/
+typedef bool (*SchedulerTaskFunction)(void *context);
+
+bool ScheduleConcurrentTasks(SchedulerTaskFunction task, void * const *contexts, size_t count);
+
+
+/*	Side work interface.
+	
+	Does count items of work, like ScheduleRender() without progress
+	reporting, for short bulk operations such as PNG strip compression.
+	Unlike ScheduleRender(), it never waits for a job set submitted by
+	another task: while the render threads are busy, items are done on the
+	calling thread, and the rest are handed to the render threads once they
+	are free. This way, a task writing a file keeps working while another
+	renders. Must not be called from a render callback.
+*/
+bool ScheduleSideWork(RenderCallback workCB, void *workContext, size_t count);
+
+
+/*	Pipeline interface.
+	
+	Calls produceCB for items 0 to count - 1 on the calling thread, and
+	consumeCB for each item, in order, once it has been produced. Consuming
+	runs on a single thread of its own which lives for the whole pipeline,
+	so items are produced and consumed at the same time. produceCB is not
+	called for an item until consumeCB has finished with the item slots
+	places before it, so items can be kept in slots buffers used in turn.
+	
+	produceCB may call ScheduleRender() and ScheduleRenderJobs(); consumeCB
+	may call ScheduleSideWork(). If either returns false, the pipeline stops
+	as soon as the items under way are finished, and returns false.
+	Single-threaded schedulers produce and consume each item in turn.
+*/
+typedef bool (*SchedulerStageFunction)(size_t index, void *context);
+	
+bool SchedulePipeline(SchedulerStageFunction produceCB, SchedulerStageFunction consumeCB, void *context, size_t count, size_t slots);
+
+
+/*	Set up scheduler resources, such as worker threads, ahead of the first
+	render. Calling this is optional, but should be done at start-up, right
+	after FPMInit(). Returns false if the scheduler can't work.
+*/
+bool SchedulerInit(void);
+
+
+/*	Thread configuration. These only take effect if called before
+	SchedulerInit() (or the first render).
+	
+	SchedulerSetThreadCount() sets the number of render threads. 0, the
+	default, means automatic: the PLANETTOOL_THREADS environment variable is
+	used if set, otherwise one thread per processor. Either way, the count is
+	limited to the processors the process may actually use; on Linux, this
+	takes account of the affinity mask and cgroup CPU quotas.
+	
+	SchedulerSetThreadPinning() binds each render thread to one processor,
+	so that on NUMA systems the pages of output it touches first are
+	allocated on its own node.
+	
+	Single-threaded schedulers ignore both.
+*/
+void SchedulerSetThreadCount(unsigned count);
+void SchedulerSetThreadPinning(bool pin);
+
+
+/*	Set the minimum time between progress callbacks. The default is 100 ms.
+	Schedulers which report progress synchronously may ignore this.
+*/
+void SchedulerSetProgressInterval(unsigned milliseconds);
+
+
 #endif	/* INCLUDED_PlanetToolScheduler_h */
@@ -26,11 +26,22 @@
 
 #include "ReadCube.h"
 #include "FPMImageOperations.h"
+#include "FPMMipmap.h"
+#include "CoordsBatch.h"
+
+
+enum
+{
+	kFacePX, kFaceNX, kFacePY, kFaceNY, kFacePZ, kFaceNZ,
+	kFaceCount
+};
 
 
 typedef struct
 {
 	FloatPixMapRef		pm;
+	SourceTileCacheRef	tiles;		// Used instead of pm for tiled sources.
+	FPMLinearSampler	sampler;	// For pm.
 	FPMSize				faceSize;
 	float				halfWidth;
 	float				halfHeight;
@@ -43,86 +54,130 @@ typedef struct
 	FPMPoint			nyPos;
 	FPMPoint			pzPos;
 	FPMPoint			nzPos;
+	// With kRenderPrefiltered, a mipmap of each face of pm, in the order above.
+	FPMMipmapRef		faceMipmaps[kFaceCount];
 } ReadCubeContext;
 
 
 static FPMColor ReadCube(Coordinates where, RenderFlags flags, void *context);
+static void ReadCubeBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context);
+static FPMColor ReadCubePrefiltered(Coordinates where, RenderFlags flags, void *context);
+static void ReadCubePrefilteredBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context);
 static FPMColor ReadCubeEdge(ReadCubeContext *context, float x, float y, Vector coordinates);
 
 
-bool ReadCubeConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, void **context)
+static bool SetUpReadCube(FloatPixMapRef pm, SourceTileCacheRef tiles, FPMSize totalSize, bool cross, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context)
 {
-	if (sourceImage == NULL || context == NULL)  return false;
+	if (!cross && totalSize.height % 6 != 0)
+	{
+		fprintf(stderr, "Cube map height must be a multiple of six pixels.\n");
+		return false;
+	}
+	if (cross && (totalSize.width % 4 != 0 || totalSize.height % 3 != 0))
+	{
+		fprintf(stderr, "Cross cube map width must be a multiple of four pixels and height must be a multiple of three pixels.\n");
+		return false;
+	}
 	
-	ReadCubeContext *cx = malloc(sizeof (ReadCubeContext));
+	ReadCubeContext *cx = calloc(1, sizeof (ReadCubeContext));
 	if (cx == NULL)  return false;
 	
-	cx->pm = FPMRetain(sourceImage);
+	cx->pm = FPMRetain(pm);
+	cx->tiles = SourceTileCacheRetain(tiles);
+	if (pm != NULL)  FPMMakeLinearSampler(pm, kFPMWrapClamp, kFPMWrapClamp, &cx->sampler);
 	
-	FPMSize totalSize = FPMGetSize(sourceImage);
-	if (totalSize.height % 6 != 0)
+	if (!cross)
 	{
-		fprintf(stderr, "Cube map height must be a multiple of six pixels.\n");
-		free(cx);
-		FPMRelease(&sourceImage);
-		return false;
+		cx->faceSize.width = totalSize.width;
+		cx->faceSize.height = totalSize.height / 6;
+	}
+	else
+	{
+		cx->faceSize.width = totalSize.width / 4;
+		cx->faceSize.height = totalSize.height / 3;
 	}
-	
-	cx->faceSize.width = totalSize.width;
-	cx->faceSize.height = totalSize.height / 6;
 	cx->halfWidth = (float)cx->faceSize.width / 2.0f;
 	cx->halfHeight = (float)cx->faceSize.height / 2.0f;
 	cx->maxX = (float)cx->faceSize.width - 1.0f;
 	cx->maxY = (float)cx->faceSize.height - 1.0f;
 	
-	cx->pxPos = (FPMPoint){ 0, 0 * cx->faceSize.height };
-	cx->nxPos = (FPMPoint){ 0, 1 * cx->faceSize.height };
-	cx->pyPos = (FPMPoint){ 0, 2 * cx->faceSize.height };
-	cx->nyPos = (FPMPoint){ 0, 3 * cx->faceSize.height };
-	cx->pzPos = (FPMPoint){ 0, 4 * cx->faceSize.height };
-	cx->nzPos = (FPMPoint){ 0, 5 * cx->faceSize.height };
+	if (!cross)
+	{
+		cx->pxPos = (FPMPoint){ 0, 0 * cx->faceSize.height };
+		cx->nxPos = (FPMPoint){ 0, 1 * cx->faceSize.height };
+		cx->pyPos = (FPMPoint){ 0, 2 * cx->faceSize.height };
+		cx->nyPos = (FPMPoint){ 0, 3 * cx->faceSize.height };
+		cx->pzPos = (FPMPoint){ 0, 4 * cx->faceSize.height };
+		cx->nzPos = (FPMPoint){ 0, 5 * cx->faceSize.height };
+	}
+	else
+	{
+		cx->pxPos = (FPMPoint){ 2 * cx->faceSize.width, 1 * cx->faceSize.height };
+		cx->nxPos = (FPMPoint){ 0 * cx->faceSize.width, 1 * cx->faceSize.height };
+		cx->pyPos = (FPMPoint){ 1 * cx->faceSize.width, 0 * cx->faceSize.height };
+		cx->nyPos = (FPMPoint){ 1 * cx->faceSize.width, 2 * cx->faceSize.height };
+		cx->pzPos = (FPMPoint){ 1 * cx->faceSize.width, 1 * cx->faceSize.height };
+		cx->nzPos = (FPMPoint){ 3 * cx->faceSize.width, 1 * cx->faceSize.height };
+	}
 	
 	*context = cx;
 	*source = ReadCube;
+	if (batchSource != NULL)  *batchSource = ReadCubeBatch;
+	
+	if ((flags & kRenderPrefiltered) && !(flags & kRenderFast) && pm != NULL)
+	{
+		// Each face gets its own mipmap, so that filtering doesn't bleed into the neighbouring faces of the image.
+		const FPMPoint *facePositions[kFaceCount] = { &cx->pxPos, &cx->nxPos, &cx->pyPos, &cx->nyPos, &cx->pzPos, &cx->nzPos };
+		unsigned i;
+		for (i = 0; i < kFaceCount; i++)
+		{
+			FloatPixMapRef face = FPMCreateSub(pm, FPMMakeRect(*facePositions[i], cx->faceSize));
+			cx->faceMipmaps[i] = FPMMipmapCreate(face, kFPMWrapClamp, kFPMWrapClamp);
+			FPMRelease(&face);
+			if (cx->faceMipmaps[i] == NULL)
+			{
+				ReadCubeDestructor(cx);
+				return false;
+			}
+		}
+		
+		*source = ReadCubePrefiltered;
+		if (batchSource != NULL)  *batchSource = ReadCubePrefilteredBatch;
+	}
+	
 	return true;
 }
 
 
-bool ReadCubeCrossConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, void **context)
+bool ReadCubeConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context)
 {
 	if (sourceImage == NULL || context == NULL)  return false;
 	
-	ReadCubeContext *cx = malloc(sizeof (ReadCubeContext));
-	if (cx == NULL)  return false;
-	
-	cx->pm = FPMRetain(sourceImage);
-	
-	FPMSize totalSize = FPMGetSize(sourceImage);
-	if (totalSize.width % 4 != 0 || totalSize.height % 3 != 0)
-	{
-		fprintf(stderr, "Cross cube map width must be a multiple of four pixels and height must be a multiple of three pixels.\n");
-		free(cx);
-		FPMRelease(&sourceImage);
-		return false;
-	}
+	return SetUpReadCube(sourceImage, NULL, FPMGetSize(sourceImage), false, flags, source, batchSource, context);
+}
+
+
+bool ReadCubeCrossConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context)
+{
+	if (sourceImage == NULL || context == NULL)  return false;
 	
-	cx->faceSize.width = totalSize.width / 4;
-	cx->faceSize.height = totalSize.height / 3;
-	cx->halfWidth = (float)cx->faceSize.width / 2.0;
-	cx->halfHeight = (float)cx->faceSize.height / 2.0;
-	cx->maxX = (float)cx->faceSize.width - 1.0f;
-	cx->maxY = (float)cx->faceSize.height - 1.0f;
+	return SetUpReadCube(sourceImage, NULL, FPMGetSize(sourceImage), true, flags, source, batchSource, context);
+}
+
+
+bool ReadCubeTiledConstructor(SourceTileCacheRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context)
+{
+	if (sourceImage == NULL || context == NULL)  return false;
 	
-	cx->pxPos = (FPMPoint){ 2 * cx->faceSize.width, 1 * cx->faceSize.height };
-	cx->nxPos = (FPMPoint){ 0 * cx->faceSize.width, 1 * cx->faceSize.height };
-	cx->pyPos = (FPMPoint){ 1 * cx->faceSize.width, 0 * cx->faceSize.height };
-	cx->nyPos = (FPMPoint){ 1 * cx->faceSize.width, 2 * cx->faceSize.height };
-	cx->pzPos = (FPMPoint){ 1 * cx->faceSize.width, 1 * cx->faceSize.height };
-	cx->nzPos = (FPMPoint){ 3 * cx->faceSize.width, 1 * cx->faceSize.height };
+	return SetUpReadCube(NULL, sourceImage, SourceTileCacheGetSize(sourceImage), false, flags, source, batchSource, context);
+}
+
+
+bool ReadCubeCrossTiledConstructor(SourceTileCacheRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context)
+{
+	if (sourceImage == NULL || context == NULL)  return false;
 	
-	*context = cx;
-	*source = ReadCube;
-	return true;
+	return SetUpReadCube(NULL, sourceImage, SourceTileCacheGetSize(sourceImage), true, flags, source, batchSource, context);
 }
 
 
@@ -132,21 +187,33 @@ void ReadCubeDestructor(void *context)
 	ReadCubeContext *cx = context;
 	
 	FPMRelease(&cx->pm);
+	SourceTileCacheRelease(&cx->tiles);
+	unsigned i;
+	for (i = 0; i < kFaceCount; i++)  FPMMipmapRelease(&cx->faceMipmaps[i]);
 	free(cx);
 }
 
 
-static FPMColor ReadCube(Coordinates where, RenderFlags flags, void *context)
+FPM_INLINE FPMColor SampleCube(ReadCubeContext *cx, float x, float y)
+{
+	if (cx->tiles != NULL)  return SourceTileCacheSampleLinear(cx->tiles, x, y, kFPMWrapClamp, kFPMWrapClamp);
+	return FPMLinearSamplerSample(&cx->sampler, x, y);
+}
+
+
+/*	CubeFacePosition()
+	Find the face a direction points at, returning the position of the face
+	in the source image and setting x and y to the position within it and
+	face to its index.
+*/
+FPM_INLINE FPMPoint CubeFacePosition(Vector coords, ReadCubeContext *cx, float *outX, float *outY, unsigned *outFace)
 {
-	assert(context != NULL);
-	ReadCubeContext *cx = context;
-	
 	// The largest coordinate component determines which face we’re looking at.
-	Vector coords = CoordsGetVector(where);
 	float ax = fabsf(coords.x);
 	float ay = fabsf(coords.y);
 	float az = fabsf(coords.z);
 	FPMPoint faceOffset;
+	unsigned face;
 	float x, y;
 	
 	assert(ax != 0.0f || ay != 0.0f || az != 0.0f);
@@ -159,10 +226,12 @@ static FPMColor ReadCube(Coordinates where, RenderFlags flags, void *context)
 		{
 			x = -x;
 			faceOffset = cx->pxPos;
+			face = kFacePX;
 		}
 		else
 		{
 			faceOffset = cx->nxPos;
+			face = kFaceNX;
 		}
 	}
 	else if (ay > ax && ay > az)
@@ -172,11 +241,13 @@ static FPMColor ReadCube(Coordinates where, RenderFlags flags, void *context)
 		if (0 < coords.y)
 		{
 			faceOffset = cx->pyPos;
+			face = kFacePY;
 		}
 		else
 		{
 			y = -y;
 			faceOffset = cx->nyPos;
+			face = kFaceNY;
 		}
 	}
 	else
@@ -186,11 +257,13 @@ static FPMColor ReadCube(Coordinates where, RenderFlags flags, void *context)
 		if (0 < coords.z)
 		{
 			faceOffset = cx->pzPos;
+			face = kFacePZ;
 		}
 		else
 		{
 			x = -x;
 			faceOffset = cx->nzPos;
+			face = kFaceNZ;
 		}
 	}
 	
@@ -201,9 +274,22 @@ static FPMColor ReadCube(Coordinates where, RenderFlags flags, void *context)
 	if (x < 0.0 || x > (cx->halfWidth * 2.0 - 1.0))  printf("x: %g (width: %g)\n", x, cx->halfWidth * 2.0);
 	if (y < 0.0 || y > (cx->halfHeight * 2.0 - 1.0))  printf("y: %g (height: %g)\n", y, cx->halfHeight * 2.0);
 #endif
+	*outX = x;
+	*outY = y;
+	*outFace = face;
+	return faceOffset;
+}
+
+
+FPM_INLINE FPMColor ReadCubeOne(Vector coords, ReadCubeContext *cx)
+{
+	float x, y;
+	unsigned face;
+	FPMPoint faceOffset = CubeFacePosition(coords, cx, &x, &y, &face);
+	
 	if (1)//(1 <= x && x <= cx->maxX && 1 <= y && y <= cx->maxY)
 	{
-		FPMColor result = FPMSampleLinearClamp(cx->pm, x + faceOffset.x, y + faceOffset.y);
+		FPMColor result = SampleCube(cx, x + faceOffset.x, y + faceOffset.y);
 		return result;
 	}
 	else
@@ -214,6 +300,131 @@ static FPMColor ReadCube(Coordinates where, RenderFlags flags, void *context)
 }
 
 
+static FPMColor ReadCube(Coordinates where, RenderFlags flags, void *context)
+{
+	assert(context != NULL);
+	return ReadCubeOne(CoordsGetVector(where), context);
+}
+
+
+static void ReadCubeBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context)
+{
+	assert(context != NULL);
+	ReadCubeContext *cx = context;
+	float x[kMaxSourceBatchSize], y[kMaxSourceBatchSize], z[kMaxSourceBatchSize];
+	
+	while (count != 0)
+	{
+		size_t i, chunk = count < kMaxSourceBatchSize ? count : kMaxSourceBatchSize;
+		CoordsGetVectorBatch(where, x, y, z, chunk);
+		
+		if (cx->tiles == NULL)
+		{
+			// Map the whole chunk to image positions, then sample them together. (ReadCubeOne()’s edge handling is disabled, so this matches it.)
+			for (i = 0; i < chunk; i++)
+			{
+				float fx, fy;
+				unsigned face;
+				FPMPoint faceOffset = CubeFacePosition(make_vector(x[i], y[i], z[i]), cx, &fx, &fy, &face);
+				x[i] = fx + faceOffset.x;
+				y[i] = fy + faceOffset.y;
+			}
+			FPMLinearSamplerSampleBatch(&cx->sampler, x, y, colors, chunk);
+		}
+		else
+		{
+			for (i = 0; i < chunk; i++)
+			{
+				colors[i] = ReadCubeOne(make_vector(x[i], y[i], z[i]), cx);
+			}
+		}
+		
+		where += chunk;
+		colors += chunk;
+		count -= chunk;
+	}
+}
+
+
+
+//	Positions are found exactly as by ReadCubeBatch().
+void ReadCubeGetTaps(const Coordinates *where, FPMLinearTaps *taps, size_t count, void *context)
+{
+	assert(context != NULL);
+	ReadCubeContext *cx = context;
+	assert(cx->tiles == NULL);
+	float x[kMaxSourceBatchSize], y[kMaxSourceBatchSize], z[kMaxSourceBatchSize];
+	
+	while (count != 0)
+	{
+		size_t i, chunk = count < kMaxSourceBatchSize ? count : kMaxSourceBatchSize;
+		CoordsGetVectorBatch(where, x, y, z, chunk);
+	
+		for (i = 0; i < chunk; i++)
+		{
+			float fx, fy;
+			unsigned face;
+			FPMPoint faceOffset = CubeFacePosition(make_vector(x[i], y[i], z[i]), cx, &fx, &fy, &face);
+			FPMLinearSamplerGetTaps(&cx->sampler, fx + faceOffset.x, fy + faceOffset.y, &taps[i]);
+		}
+	
+		where += chunk;
+		taps += chunk;
+		count -= chunk;
+	}
+}
+
+/*	With kRenderPrefiltered, faces are sampled in their own mipmaps. Face
+	pixels cover smaller angles away from the centre of the face: at
+	(u, v), with r = √(1 + u² + v²), they are r² times smaller radially and
+	r times smaller tangentially. The footprint is scaled by r^1.5 as a
+	compromise, the inverse of CubeFaceSampleFootprint().
+*/
+FPM_INLINE FPMColor ReadCubePrefilteredOne(Vector coords, float footprint, ReadCubeContext *cx)
+{
+	float x, y;
+	unsigned face;
+	CubeFacePosition(coords, cx, &x, &y, &face);
+	
+	float u = x / cx->halfWidth - 1.0f;
+	float v = y / cx->halfHeight - 1.0f;
+	float r = sqrtf(1.0f + u * u + v * v);
+	float scale = footprint * r * sqrtf(r);
+	
+	return FPMMipmapSample(cx->faceMipmaps[face], x, y, scale * cx->halfWidth, scale * cx->halfHeight);
+}
+
+
+static FPMColor ReadCubePrefiltered(Coordinates where, RenderFlags flags, void *context)
+{
+	assert(context != NULL);
+	return ReadCubePrefilteredOne(CoordsGetVector(where), CoordsGetFootprint(where), context);
+}
+
+
+static void ReadCubePrefilteredBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context)
+{
+	assert(context != NULL);
+	ReadCubeContext *cx = context;
+	float x[kMaxSourceBatchSize], y[kMaxSourceBatchSize], z[kMaxSourceBatchSize];
+	
+	while (count != 0)
+	{
+		size_t i, chunk = count < kMaxSourceBatchSize ? count : kMaxSourceBatchSize;
+		CoordsGetVectorBatch(where, x, y, z, chunk);
+		
+		for (i = 0; i < chunk; i++)
+		{
+			colors[i] = ReadCubePrefilteredOne(make_vector(x[i], y[i], z[i]), CoordsGetFootprint(where[i]), cx);
+		}
+		
+		where += chunk;
+		colors += chunk;
+		count -= chunk;
+	}
+}
+
+
 static FPMColor ReadCubeEdge(ReadCubeContext *context, float x, float y, Vector coordinates)
 {
 	if (x < 2)  return (FPMColor){ 0, 0, 10, 1 };
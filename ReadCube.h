@@ -25,8 +25,15 @@
 */
 
 #include "SphericalPixelSource.h"
+#include "SourceTileCache.h"
+#include "ResamplingMap.h"
 
 
-bool ReadCubeConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, void **context);
-bool ReadCubeCrossConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, void **context);
+bool ReadCubeConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context);
+bool ReadCubeCrossConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context);
+bool ReadCubeTiledConstructor(SourceTileCacheRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context);
+bool ReadCubeCrossTiledConstructor(SourceTileCacheRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context);
 void ReadCubeDestructor(void *context);
+
+//	SphericalPixelSourceTapsFunction for untiled sources, for recording resampling maps.
+void ReadCubeGetTaps(const Coordinates *where, FPMLinearTaps *taps, size_t count, void *context);
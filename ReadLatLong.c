@@ -26,12 +26,18 @@
 
 #include "ReadLatLong.h"
 #include "FPMImageOperations.h"
+#include "FPMMipmap.h"
+#include "CoordsBatch.h"
 
 
 typedef struct
 {
 	FloatPixMapRef		pm;
+	SourceTileCacheRef	tiles;		// Used instead of pm for tiled sources.
+	FPMLinearSampler	sampler;	// For pm.
+	FPMMipmapRef		mipmap;		// For pm, with kRenderPrefiltered.
 	size_t				pwidth;
+	FPMDimension		pheight;
 	float				width;
 	float				height;
 } ReadLatLongContext;
@@ -39,59 +45,257 @@ typedef struct
 
 static FPMColor ReadLatLong(Coordinates where, RenderFlags flags, void *context);
 static FPMColor ReadLatLongFast(Coordinates where, RenderFlags flags, void *context);
+static void ReadLatLongBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context);
+static void ReadLatLongFastBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context);
+static FPMColor ReadLatLongPrefiltered(Coordinates where, RenderFlags flags, void *context);
+static void ReadLatLongPrefilteredBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context);
 
 
-bool ReadLatLongConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, void **context)
+static bool SetUpReadLatLong(FloatPixMapRef pm, SourceTileCacheRef tiles, FPMSize size, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context)
 {
-	if (sourceImage == NULL || context == NULL)  return false;
-	
 	ReadLatLongContext *cx = malloc(sizeof (ReadLatLongContext));
 	if (cx == NULL)  return false;
 	
-	cx->pm = FPMRetain(sourceImage);
-	cx->pwidth = FPMGetWidth(sourceImage);
+	cx->pm = FPMRetain(pm);
+	cx->tiles = SourceTileCacheRetain(tiles);
+	if (pm != NULL)  FPMMakeLinearSampler(pm, kFPMWrapRepeat, kFPMWrapClamp, &cx->sampler);
+	cx->mipmap = NULL;
+	cx->pwidth = size.width;
+	cx->pheight = size.height;
 	cx->width = (float)cx->pwidth / (2.0f * kPiF);
-	cx->height = (float)FPMGetHeight(sourceImage) / kPiF;
+	cx->height = (float)size.height / kPiF;
 	
-	if (flags & kRenderFast)  *source = ReadLatLongFast;
-	else  *source = ReadLatLong;
+	if (flags & kRenderFast)
+	{
+		*source = ReadLatLongFast;
+		if (batchSource != NULL)  *batchSource = ReadLatLongFastBatch;
+	}
+	else if ((flags & kRenderPrefiltered) && pm != NULL)
+	{
+		cx->mipmap = FPMMipmapCreate(pm, kFPMWrapRepeat, kFPMWrapClamp);
+		if (cx->mipmap == NULL)
+		{
+			ReadLatLongDestructor(cx);
+			return false;
+		}
+		
+		*source = ReadLatLongPrefiltered;
+		if (batchSource != NULL)  *batchSource = ReadLatLongPrefilteredBatch;
+	}
+	else
+	{
+		*source = ReadLatLong;
+		if (batchSource != NULL)  *batchSource = ReadLatLongBatch;
+	}
 	
 	*context = cx;
 	return true;
 }
 
 
+bool ReadLatLongConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context)
+{
+	if (sourceImage == NULL || context == NULL)  return false;
+	
+	return SetUpReadLatLong(sourceImage, NULL, FPMGetSize(sourceImage), flags, source, batchSource, context);
+}
+
+
+bool ReadLatLongTiledConstructor(SourceTileCacheRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context)
+{
+	if (sourceImage == NULL || context == NULL)  return false;
+	
+	return SetUpReadLatLong(NULL, sourceImage, SourceTileCacheGetSize(sourceImage), flags, source, batchSource, context);
+}
+
+
 void ReadLatLongDestructor(void *context)
 {
 	assert(context != NULL);
 	ReadLatLongContext *cx = context;
 	
 	FPMRelease(&cx->pm);
+	SourceTileCacheRelease(&cx->tiles);
+	FPMMipmapRelease(&cx->mipmap);
 	free(cx);
 }
 
 
+FPM_INLINE FPMColor SampleLatLong(ReadLatLongContext *cx, float lon, float lat)
+{
+	if (cx->tiles != NULL)  return SourceTileCacheSampleLinear(cx->tiles, lon, lat, kFPMWrapRepeat, kFPMWrapClamp);
+	return FPMLinearSamplerSample(&cx->sampler, lon, lat);
+}
+
+
+FPM_INLINE FPMColor GetLatLongPixel(ReadLatLongContext *cx, FPMCoordinate x, FPMCoordinate y)
+{
+	if (cx->tiles != NULL)  return SourceTileCacheGetPixel(cx->tiles, x, y);
+	return FPMGetPixelC(cx->pm, x, y);
+}
+
+
+FPM_INLINE FPMColor ReadLatLongOne(Coordinates where, ReadLatLongContext *cx)
+{
+	float rlon, rlat, lon, lat;
+	CoordsGetLatLongRad(where, &rlat, &rlon);
+	lon = (rlon + kPiF) * cx->width;
+	lat = (kPiF / 2.0f - rlat) * cx->height;
+	
+	return SampleLatLong(cx, lon, lat);
+}
+
+
 static FPMColor ReadLatLong(Coordinates where, RenderFlags flags, void *context)
 {
+	return ReadLatLongOne(where, context);
+}
+
+
+static void ReadLatLongBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context)
+{
+	ReadLatLongContext *cx = context;
+	float rlat[kMaxSourceBatchSize], rlon[kMaxSourceBatchSize];
+	
+	while (count != 0)
+	{
+		size_t i, chunk = count < kMaxSourceBatchSize ? count : kMaxSourceBatchSize;
+		CoordsGetLatLongRadBatch(where, rlat, rlon, chunk);
+		
+		// Convert to pixel coordinates in place, then sample them all at once.
+		for (i = 0; i < chunk; i++)
+		{
+			rlon[i] = (rlon[i] + kPiF) * cx->width;
+			rlat[i] = (kPiF / 2.0f - rlat[i]) * cx->height;
+		}
+		
+		if (cx->tiles == NULL)
+		{
+			FPMLinearSamplerSampleBatch(&cx->sampler, rlon, rlat, colors, chunk);
+		}
+		else
+		{
+			for (i = 0; i < chunk; i++)  colors[i] = SampleLatLong(cx, rlon[i], rlat[i]);
+		}
+		
+		where += chunk;
+		colors += chunk;
+		count -= chunk;
+	}
+}
+
+
+
+//	Positions are found exactly as by ReadLatLongBatch().
+void ReadLatLongGetTaps(const Coordinates *where, FPMLinearTaps *taps, size_t count, void *context)
+{
+	assert(context != NULL);
 	ReadLatLongContext *cx = context;
+	assert(cx->tiles == NULL);
+	float rlat[kMaxSourceBatchSize], rlon[kMaxSourceBatchSize];
+	
+	while (count != 0)
+	{
+		size_t i, chunk = count < kMaxSourceBatchSize ? count : kMaxSourceBatchSize;
+		CoordsGetLatLongRadBatch(where, rlat, rlon, chunk);
+	
+		for (i = 0; i < chunk; i++)
+		{
+			rlon[i] = (rlon[i] + kPiF) * cx->width;
+			rlat[i] = (kPiF / 2.0f - rlat[i]) * cx->height;
+			FPMLinearSamplerGetTaps(&cx->sampler, rlon[i], rlat[i], &taps[i]);
+		}
 	
+		where += chunk;
+		taps += chunk;
+		count -= chunk;
+	}
+}
+
+
+FPM_INLINE FPMColor ReadLatLongFastOne(Coordinates where, ReadLatLongContext *cx)
+{
 	float rlon, rlat, lon, lat;
 	CoordsGetLatLongRad(where, &rlat, &rlon);
 	lon = (rlon + kPiF) * cx->width;
 	lat = (kPiF / 2.0f - rlat) * cx->height;
 	
-	return FPMSampleLinear(cx->pm, lon, lat, kFPMWrapRepeat, kFPMWrapClamp);
+	// The south pole maps to lat == height, one row past the end.
+	FPMCoordinate y = lat;
+	if (y >= (FPMCoordinate)cx->pheight)  y = cx->pheight - 1;
+	
+	return GetLatLongPixel(cx, (size_t)lon % cx->pwidth, y);
 }
 
 
 static FPMColor ReadLatLongFast(Coordinates where, RenderFlags flags, void *context)
+{
+	return ReadLatLongFastOne(where, context);
+}
+
+
+/*	Nearest-pixel sampling picks a different pixel for any change in
+	position across a pixel boundary, however small, so the fast batch
+	source uses the same conversions as ReadLatLongFast() rather than those
+	in CoordsBatch.h.
+*/
+static void ReadLatLongFastBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context)
 {
 	ReadLatLongContext *cx = context;
+	size_t i;
 	
-	float rlon, rlat, lon, lat;
+	for (i = 0; i < count; i++)
+	{
+		colors[i] = ReadLatLongFastOne(where[i], cx);
+	}
+}
+
+
+/*	The footprint is cx->height pixels per radian high, and wider by
+	1/cos(latitude) away from the equator (limited near the poles, where
+	FPMMipmapSample() limits the anisotropy anyway).
+*/
+FPM_INLINE void GetPrefilteredFootprint(ReadLatLongContext *cx, float footprint, float rlat, float *footprintX, float *footprintY)
+{
+	*footprintY = footprint * cx->height;
+	*footprintX = footprint * cx->width / fmaxf(cosf(rlat), 1e-4f);
+}
+
+
+static FPMColor ReadLatLongPrefiltered(Coordinates where, RenderFlags flags, void *context)
+{
+	ReadLatLongContext *cx = context;
+	float rlon, rlat, footprintX, footprintY;
 	CoordsGetLatLongRad(where, &rlat, &rlon);
-	lon = (rlon + kPiF) * cx->width;
-	lat = (kPiF / 2.0f - rlat) * cx->height;
+	GetPrefilteredFootprint(cx, CoordsGetFootprint(where), rlat, &footprintX, &footprintY);
+	
+	return FPMMipmapSample(cx->mipmap, (rlon + kPiF) * cx->width, (kPiF / 2.0f - rlat) * cx->height, footprintX, footprintY);
+}
+
+
+static void ReadLatLongPrefilteredBatch(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context)
+{
+	ReadLatLongContext *cx = context;
+	float rlat[kMaxSourceBatchSize], rlon[kMaxSourceBatchSize];
+	float footprintX[kMaxSourceBatchSize], footprintY[kMaxSourceBatchSize];
 	
-	return FPMGetPixelC(cx->pm, (size_t)lon % cx->pwidth, lat);
+	while (count != 0)
+	{
+		size_t i, chunk = count < kMaxSourceBatchSize ? count : kMaxSourceBatchSize;
+		CoordsGetLatLongRadBatch(where, rlat, rlon, chunk);
+		
+		// As in ReadLatLongBatch(), coordinates are converted to pixels in place.
+		for (i = 0; i < chunk; i++)
+		{
+			GetPrefilteredFootprint(cx, CoordsGetFootprint(where[i]), rlat[i], &footprintX[i], &footprintY[i]);
+			rlon[i] = (rlon[i] + kPiF) * cx->width;
+			rlat[i] = (kPiF / 2.0f - rlat[i]) * cx->height;
+		}
+		
+		FPMMipmapSampleBatch(cx->mipmap, rlon, rlat, footprintX, footprintY, colors, chunk);
+		
+		where += chunk;
+		colors += chunk;
+		count -= chunk;
+	}
 }
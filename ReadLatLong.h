@@ -25,7 +25,13 @@
 */
 
 #include "SphericalPixelSource.h"
+#include "SourceTileCache.h"
+#include "ResamplingMap.h"
 
 
-bool ReadLatLongConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, void **context);
+bool ReadLatLongConstructor(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context);
+bool ReadLatLongTiledConstructor(SourceTileCacheRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context);
 void ReadLatLongDestructor(void *context);
+
+//	SphericalPixelSourceTapsFunction for untiled sources, for recording resampling maps.
+void ReadLatLongGetTaps(const Coordinates *where, FPMLinearTaps *taps, size_t count, void *context);
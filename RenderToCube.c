@@ -27,6 +27,7 @@
 #include "RenderToCube.h"
 #include "FPMImageOperations.h"
 #include "PlanetToolScheduler.h"
+#include "ResamplingMap.h"
 
 
 #define SAMPLE_GRID_SIZE_FAST	3	// Should be odd.
@@ -34,112 +35,132 @@
 
 #define SAMPLE_WIDTH				1.2f
 
+#define DIRECT_TOLERANCE			1e-5f	// How far transform matrix elements may be from 0 or ±1 for RenderToCubeDirect().
 
-static bool RenderCubeFace(FloatPixMapRef pm, size_t size, unsigned xoff, unsigned yoff, Vector outVector, Vector downVector, RenderFlags flags, unsigned sampleGridSize, float *weights, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progressCB, void *cbContext, uint8_t faceIndex);
-static bool RenderCubeFaceLine(size_t lineIndex, size_t lineCount, void *vcontext);
 
+/*	The sample grid of a pixel is at the same position on every face, and
+	the face coordinates of its columns for pixel column i are those of its
+	rows for pixel row i. So one table of sample positions, along with the
+	weight of each sample of the grid, serves all six faces.
+*/
+typedef struct
+{
+	float							*positions;		// Face coordinates of the samples of pixel column or row i, at [i * sampleGridSize].
+	float							*sampleWeights;	// Weight of each sample of the grid, row by row.
+	float							normalization;	// 1 / sum of sampleWeights.
+} CubeFaceSampleTable;
 
-FloatPixMapRef RenderToCube(uintmax_t size, RenderFlags flags, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+
+typedef struct RenderCubeFaceContext
 {
-	FloatPixMapRef pm = ValidateAndCreatePixMap(size, size, size * 6, error, cbContext);
-	if (pm == NULL)  return NULL;
+	FloatPixMapRef					pm;				// Part of the current band covered by the face.
+	FPMCoordinate					firstRow;		// Row of the face at the top of pm.
 	
-	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : SAMPLE_GRID_SIZE_HIGHQ;
-	float weights[sampleGridSize];
-	BuildGaussTable(sampleGridSize, weights);
+	size_t							size;
+	unsigned						xoff, yoff;		// Position of the face in the output, in faces.
 	
-	uint8_t faceIndex = 0;
-	bool OK = true;
+	SphericalPixelSourceFunction	source;
+	SphericalPixelBatchSourceFunction	batchSource;
+	void							*sourceContext;
 	
-	// Render faces:
-	// +x
-	OK = OK && RenderCubeFace(pm, size, 0, 0, kBasisXVector, vector_flip(kBasisYVector), flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
-	// -x
-	OK = OK && RenderCubeFace(pm, size, 0, 1, vector_flip(kBasisXVector), vector_flip(kBasisYVector), flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
-	// +y
-	OK = OK && RenderCubeFace(pm, size, 0, 2, kBasisYVector, kBasisZVector, flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
-	// -y
-	OK = OK && RenderCubeFace(pm, size, 0, 3, vector_flip(kBasisYVector), vector_flip(kBasisZVector), flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
-	// +z
-	OK = OK && RenderCubeFace(pm, size, 0, 4, kBasisZVector, vector_flip(kBasisYVector), flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
-	// -z
-	OK = OK && RenderCubeFace(pm, size, 0, 5, vector_flip(kBasisZVector), vector_flip(kBasisYVector), flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
+	unsigned						sampleGridSize;
+	float							*weights;
+	const CubeFaceSampleTable		*sampleTable;
+	
+	float							fdiff;
+	float							scale;
+	Vector							rightVector;
+	Vector							downVector;
+	Vector							outVector;
+	
+	RenderFlags						flags;
+	float							adaptiveThreshold;
+	RenderStatistics				*statistics;
+	ResamplingMapRecorderRef		mapRecorder;
+} RenderCubeFaceContext;
+
+
+static void SetUpCubeFaces(RenderCubeFaceContext contexts[6], bool cross, size_t size, RenderFlags flags, const RenderOptions *options, unsigned sampleGridSize, float *weights, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext);
+static void SetUpCubeFace(RenderCubeFaceContext *contexts, uint8_t faceIndex, size_t size, unsigned xoff, unsigned yoff, Vector outVector, Vector downVector, RenderFlags flags, const RenderOptions *options, unsigned sampleGridSize, float *weights, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext);
+static bool SetUpCubeFaceSampleTable(CubeFaceSampleTable *table, RenderCubeFaceContext contexts[6], ErrorCallbackFunction error, void *cbContext);
+static void FreeCubeFaceSampleTable(CubeFaceSampleTable *table);
+static bool RenderCubeBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontexts);
+static bool RenderCubeFaceTile(FPMRect tile, void *vcontext);
+static void RenderCubeFaceSpan(RenderCubeFaceContext *context, FPMCoordinate row, FPMCoordinate xStart, FPMCoordinate xEnd);
+
+
+FloatPixMapRef RenderToCube(uintmax_t size, RenderFlags flags, const RenderOptions *options, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+{
+	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : (flags & kRenderPrefiltered) ? kPrefilteredSampleGridSize : SAMPLE_GRID_SIZE_HIGHQ;
+	float weights[sampleGridSize];
+	BuildGaussTable(sampleGridSize, weights);
 	
-	(void)faceIndex;
+	RenderCubeFaceContext contexts[6] = {{ NULL }};
+	SetUpCubeFaces(contexts, false, size, flags, options, sampleGridSize, weights, source, batchSource, sourceContext);
 	
-	if (!OK)  FPMRelease(&pm);
+	CubeFaceSampleTable sampleTable;
+	if (!SetUpCubeFaceSampleTable(&sampleTable, contexts, error, cbContext))  return NULL;
 	
+	FloatPixMapRef pm = RenderInBands(size, size, size * 6, options, RenderCubeBand, contexts, progress, error, cbContext);
+	FreeCubeFaceSampleTable(&sampleTable);
 	return pm;
 }
 
 
-FloatPixMapRef RenderToCubeCross(uintmax_t size, RenderFlags flags, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+FloatPixMapRef RenderToCubeCross(uintmax_t size, RenderFlags flags, const RenderOptions *options, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
 {
-	FloatPixMapRef pm = ValidateAndCreatePixMap(size, size * 4, size * 3, error, cbContext);
-	if (pm == NULL)  return NULL;
-	
-	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : SAMPLE_GRID_SIZE_HIGHQ;
+	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : (flags & kRenderPrefiltered) ? kPrefilteredSampleGridSize : SAMPLE_GRID_SIZE_HIGHQ;
 	float weights[sampleGridSize];
 	BuildGaussTable(sampleGridSize, weights);
 	
+	RenderCubeFaceContext contexts[6] = {{ NULL }};
+	SetUpCubeFaces(contexts, true, size, flags, options, sampleGridSize, weights, source, batchSource, sourceContext);
+	
+	CubeFaceSampleTable sampleTable;
+	if (!SetUpCubeFaceSampleTable(&sampleTable, contexts, error, cbContext))  return NULL;
+	
+	FloatPixMapRef pm = RenderInBands(size, size * 4, size * 3, options, RenderCubeBand, contexts, progress, error, cbContext);
+	FreeCubeFaceSampleTable(&sampleTable);
+	return pm;
+}
+
+
+/*	Set up the six faces, in the order +x, -x, +y, -y, +z, -z, laid out in
+	a vertical strip or (if cross is set) a cross, as ReadCube expects.
+*/
+static void SetUpCubeFaces(RenderCubeFaceContext contexts[6], bool cross, size_t size, RenderFlags flags, const RenderOptions *options, unsigned sampleGridSize, float *weights, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext)
+{
 	uint8_t faceIndex = 0;
-	bool OK = true;
 	
-	// Render faces:
 	// +x
-	OK = OK && RenderCubeFace(pm, size, 2, 1, kBasisXVector, vector_flip(kBasisYVector), flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
+	SetUpCubeFace(contexts, faceIndex++, size, cross ? 2 : 0, cross ? 1 : 0, kBasisXVector, vector_flip(kBasisYVector), flags, options, sampleGridSize, weights, source, batchSource, sourceContext);
 	// -x
-	OK = OK && RenderCubeFace(pm, size, 0, 1, vector_flip(kBasisXVector), vector_flip(kBasisYVector), flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
+	SetUpCubeFace(contexts, faceIndex++, size, 0, 1, vector_flip(kBasisXVector), vector_flip(kBasisYVector), flags, options, sampleGridSize, weights, source, batchSource, sourceContext);
 	// +y
-	OK = OK && RenderCubeFace(pm, size, 1, 0, kBasisYVector, kBasisZVector, flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
+	SetUpCubeFace(contexts, faceIndex++, size, cross ? 1 : 0, cross ? 0 : 2, kBasisYVector, kBasisZVector, flags, options, sampleGridSize, weights, source, batchSource, sourceContext);
 	// -y
-	OK = OK && RenderCubeFace(pm, size, 1, 2, vector_flip(kBasisYVector), vector_flip(kBasisZVector), flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
+	SetUpCubeFace(contexts, faceIndex++, size, cross ? 1 : 0, cross ? 2 : 3, vector_flip(kBasisYVector), vector_flip(kBasisZVector), flags, options, sampleGridSize, weights, source, batchSource, sourceContext);
 	// +z
-	OK = OK && RenderCubeFace(pm, size, 1, 1, kBasisZVector, vector_flip(kBasisYVector), flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
+	SetUpCubeFace(contexts, faceIndex++, size, cross ? 1 : 0, cross ? 1 : 4, kBasisZVector, vector_flip(kBasisYVector), flags, options, sampleGridSize, weights, source, batchSource, sourceContext);
 	// -z
-	OK = OK && RenderCubeFace(pm, size, 3, 1, vector_flip(kBasisZVector), vector_flip(kBasisYVector), flags, sampleGridSize, weights, source, sourceContext, progress, cbContext, faceIndex++);
-	
-	(void)faceIndex;
-	
-	if (!OK)  FPMRelease(&pm);
-	
-	return pm;
+	SetUpCubeFace(contexts, faceIndex++, size, cross ? 3 : 0, cross ? 1 : 5, vector_flip(kBasisZVector), vector_flip(kBasisYVector), flags, options, sampleGridSize, weights, source, batchSource, sourceContext);
 }
 
 
-typedef struct RenderCubeFaceContext
-{
-	FloatPixMapRef					pm;
-	FPMDimension					width;
-	
-	SphericalPixelSourceFunction	source;
-	void							*sourceContext;
-	
-	unsigned						sampleGridSize;
-	float							*weights;
-	
-	float							fdiff;
-	float							scale;
-	Vector							rightVector;
-	Vector							downVector;
-	Vector							outVector;
-	
-	RenderFlags						flags;
-} RenderCubeFaceContext;
-
-
-static bool RenderCubeFace(FloatPixMapRef pm, size_t size, unsigned xoff, unsigned yoff, Vector outVector, Vector downVector, RenderFlags flags, unsigned sampleGridSize, float *weights, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progressCB, void *cbContext, uint8_t faceIndex)
+static void SetUpCubeFace(RenderCubeFaceContext *contexts, uint8_t faceIndex, size_t size, unsigned xoff, unsigned yoff, Vector outVector, Vector downVector, RenderFlags flags, const RenderOptions *options, unsigned sampleGridSize, float *weights, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext)
 {
-	FloatPixMapRef subPM = FPMCreateSubC(pm, size * xoff, size * yoff, size, size);
 	Vector rightVector = cross_product(outVector, downVector);
 	float scale = 2.0f / (float)size;
 	float fdiff = (2.0f * SAMPLE_WIDTH / (float)sampleGridSize) * scale;
 	
-	RenderCubeFaceContext context =
+	RenderCubeFaceContext *context = &contexts[faceIndex];
+	*context = (RenderCubeFaceContext)
 	{
-		.pm = subPM,
-		.width = FPMGetWidth(subPM),
+		.size = size,
+		.xoff = xoff,
+		.yoff = yoff,
 		.source = source,
+		.batchSource = batchSource,
 		.sourceContext = sourceContext,
 		.sampleGridSize = sampleGridSize,
 		.weights = weights,
@@ -148,22 +169,147 @@ static bool RenderCubeFace(FloatPixMapRef pm, size_t size, unsigned xoff, unsign
 		.rightVector = rightVector,
 		.downVector = downVector,
 		.outVector = outVector,
-		.flags = flags
+		.flags = flags,
+		.adaptiveThreshold = (options != NULL) ? options->adaptiveThreshold : 0.0f,
+		.statistics = (options != NULL) ? options->statistics : NULL,
+		.mapRecorder = (options != NULL) ? options->mapRecorder : NULL
 	};
+}
+
+
+/*	Build the sample table for the faces’ size and sample grid, and give it
+	to all six.
+*/
+static bool SetUpCubeFaceSampleTable(CubeFaceSampleTable *table, RenderCubeFaceContext contexts[6], ErrorCallbackFunction error, void *cbContext)
+{
+	const RenderCubeFaceContext *face = &contexts[0];
+	size_t size = face->size;
+	unsigned sampleGridSize = face->sampleGridSize;
+	const float *weights = face->weights;
+	
+	table->positions = malloc(size * sampleGridSize * sizeof *table->positions);
+	table->sampleWeights = malloc(sampleGridSize * sampleGridSize * sizeof *table->sampleWeights);
+	if (table->positions == NULL || table->sampleWeights == NULL)
+	{
+		FreeCubeFaceSampleTable(table);
+		CallErrorCallbackWithFormat(error, cbContext, "Not enough memory for %zu sample positions.\n", size * sampleGridSize);
+		return false;
+	}
+	
+	size_t i, si = 0;
+	unsigned sx, sy;
+	for (i = 0; i < size; i++)
+	{
+		float f = ((float)i - SAMPLE_WIDTH) * face->scale - 1.0f;
+		for (sx = 0; sx < sampleGridSize; sx++)
+		{
+			table->positions[si++] = f;
+			f += face->fdiff;
+		}
+	}
+	
+	float totalWeight = 0.0f;
+	si = 0;
+	for (sy = 0; sy < sampleGridSize; sy++)
+	{
+		for (sx = 0; sx < sampleGridSize; sx++)
+		{
+			float weight = weights[sy] * weights[sx];
+			table->sampleWeights[si++] = weight;
+			totalWeight += weight;
+		}
+	}
+	table->normalization = 1.0f / totalWeight;
 	
-	return ScheduleRender(RenderCubeFaceLine, &context, size, faceIndex, 6, progressCB, cbContext);
+	for (i = 0; i < 6; i++)  contexts[i].sampleTable = table;
+	return true;
+}
+
+
+static void FreeCubeFaceSampleTable(CubeFaceSampleTable *table)
+{
+	free(table->positions);
+	free(table->sampleWeights);
+	table->positions = NULL;
+	table->sampleWeights = NULL;
 }
 
 
-static bool RenderCubeFaceLine(size_t lineIndex, size_t lineCount, void *vcontext)
+/*	Render the parts of the faces which fall within a band of the output.
+	All six are scheduled together, so no threads go idle between faces.
+*/
+static bool RenderCubeBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontexts)
 {
-	RenderCubeFaceContext *context = vcontext;
+	RenderCubeFaceContext *contexts = vcontexts;
+	FPMCoordinate bandEnd = firstRow + FPMGetHeight(band);
+	RenderJob jobs[6];
+	unsigned i, jobCount = 0;
+	bool OK = true;
 	
+	for (i = 0; i < 6; i++)
+	{
+		RenderCubeFaceContext *context = &contexts[i];
+		size_t size = context->size;
+		FPMCoordinate faceTop = context->yoff * size;
+		FPMCoordinate top = (firstRow > faceTop) ? firstRow : faceTop;
+		FPMCoordinate bottom = (bandEnd < faceTop + (FPMCoordinate)size) ? bandEnd : faceTop + (FPMCoordinate)size;
+		if (top >= bottom || !OK)  continue;
+	
+		context->pm = FPMCreateSubC(band, context->xoff * size, top - firstRow, size, bottom - top);
+		if (context->pm == NULL)
+		{
+			OK = false;
+			continue;
+		}
+		context->firstRow = top - faceTop;
+	
+		jobs[jobCount++] = (RenderJob)
+		{
+			.renderTileCB = RenderCubeFaceTile,
+			.renderContext = context,
+			.lineCount = bottom - top,
+			.width = size
+		};
+	}
+	
+	OK = OK && ScheduleRenderJobs(jobs, jobCount, progress, progressContext);
+	
+	for (i = 0; i < 6; i++)
+	{
+		FPMRelease(&contexts[i].pm);
+	}
+	
+	return OK;
+}
+
+
+static bool RenderCubeFaceTile(FPMRect tile, void *vcontext)
+{
+	FPMCoordinate row;
+	for (row = tile.origin.y; row < tile.origin.y + (FPMCoordinate)tile.size.height; row++)
+	{
+		RenderCubeFaceSpan(vcontext, row, tile.origin.x, tile.origin.x + tile.size.width);
+	}
+	return true;
+}
+
+
+//	Render pixels [xStart, xEnd) of row row of the current band.
+static void RenderCubeFaceSpan(RenderCubeFaceContext *context, FPMCoordinate row, FPMCoordinate xStart, FPMCoordinate xEnd)
+{
 	SphericalPixelSourceFunction source = context->source;
+	SphericalPixelBatchSourceFunction batchSource = context->batchSource;
 	void *sourceContext = context->sourceContext;
 	
 	unsigned sampleGridSize = context->sampleGridSize;
 	float *weights = context->weights;
+	const CubeFaceSampleTable *sampleTable = context->sampleTable;
+	
+	unsigned sampleCount = sampleGridSize * sampleGridSize;
+	Coordinates coords[sampleCount];
+	FPMColor samples[sampleCount];
+	float jitterWeights[sampleCount];
+	Vector rowVectors[sampleGridSize];
 	
 	float fdiff = context->fdiff;
 	float scale = context->scale;
@@ -173,74 +319,280 @@ static bool RenderCubeFaceLine(size_t lineIndex, size_t lineCount, void *vcontex
 	
 	RenderFlags flags = context->flags;
 	bool jitter = flags & kRenderJitter;
+	bool adaptive = flags & kRenderAdaptive;
+	float adaptiveThreshold = context->adaptiveThreshold;
+	uintmax_t refinedCount = 0;
 	
-	FPMColor *pixel = FPMGetPixelPointerC(context->pm, 0, lineIndex);
-	FPMDimension x, y = lineIndex;
+	FPMColor *pixel = FPMGetPixelPointerC(context->pm, xStart, row);
+	FPMCoordinate x, y = context->firstRow + row;
+	unsigned sx, sy, si;
+	
+	/*	Without jitter, each sample row contributes the same part of every
+		sample direction in the span. (outVector is added last, as with
+		jitter, so that zero components keep their signs.)
+	*/
+	if (!jitter)
+	{
+		const float *rowPositions = &sampleTable->positions[y * sampleGridSize];
+		for (sy = 0; sy < sampleGridSize; sy++)
+		{
+			rowVectors[sy] = vector_multiply_scalar(downVector, rowPositions[sy]);
+		}
+	}
 	
 	/*	FIXME: combining fast (i.e., small sampleGridSize) and jitter cuts off
 		part of each face.
 	*/
 	
-	for (x = 0; x < context->width; x++)
+	for (x = xStart; x < xEnd; x++)
 	{
 		float fx = x;
 		float fy = y;
-		float fminx, fminy;
+		float footprint = CubeFaceSampleFootprint(fx * scale - 1.0f, fy * scale - 1.0f, fdiff);
+		const float *sampleWeights;
+		float normalization;
+	
+		si = 0;
 		if (!jitter)
 		{
-			fminx = (fx - SAMPLE_WIDTH) * scale - 1.0f;
-			fminy = (fy - SAMPLE_WIDTH) * scale - 1.0f;
+			const float *columnPositions = &sampleTable->positions[x * sampleGridSize];
+			for (sy = 0; sy < sampleGridSize; sy++)
+			{
+				Vector rowVector = rowVectors[sy];
+				for (sx = 0; sx < sampleGridSize; sx++)
+				{
+					Vector coordv = vector_add(vector_multiply_scalar(rightVector, columnPositions[sx]), rowVector);
+					coordv = vector_add(coordv, outVector);
+					coords[si++] = CoordsWithFootprint(MakeCoordsVector(coordv), footprint);
+				}
+			}
+	
+			sampleWeights = sampleTable->sampleWeights;
+			normalization = sampleTable->normalization;
 		}
 		else
 		{
-			fminx = fx * scale - 1.0f;
-			fminy = fy * scale - 1.0f;
-		}
-		
-		FPMColor accum = kFPMColorClear;
-		float totalWeight = 0.0f;
-		float weight, yw;
-		unsigned sx, sy;
-		
-		fy = fminy;
-		for (sy = 0; sy < sampleGridSize; sy++)
-		{
-			fx = fminx;
-			yw = weights[sy];
-			for (sx = 0; sx < sampleGridSize; sx++)
+			float fminx = fx * scale - 1.0f;
+			float fminy = fy * scale - 1.0f;
+			float totalWeight = 0.0f;
+	
+			for (sy = 0; sy < sampleGridSize; sy++)
 			{
-				if (!jitter){} else
+				for (sx = 0; sx < sampleGridSize; sx++)
 				{
 					fx = fminx + RandF2() * SAMPLE_WIDTH * 0.5f * scale;
 					fy = fminy + RandF2() * SAMPLE_WIDTH * 0.5f * scale;
+	
+					Vector coordv = vector_multiply_scalar(rightVector, fx);
+					coordv = vector_add(coordv, vector_multiply_scalar(downVector, fy));
+					coordv = vector_add(coordv, outVector);
+	
+					coords[si] = CoordsWithFootprint(MakeCoordsVector(coordv), footprint);
+	
+					float weight = GaussTableLookup2D(fx, fminx, fy, fminy, SAMPLE_WIDTH * 0.5f, sampleGridSize, weights);
+					jitterWeights[si++] = weight;
+					totalWeight += weight;
 				}
-				
-				Vector coordv = vector_multiply_scalar(rightVector, fx);
-				coordv = vector_add(coordv, vector_multiply_scalar(downVector, fy));
-				coordv = vector_add(coordv, outVector);
-				
-				Coordinates coord = MakeCoordsVector(coordv);
-				
-				FPMColor sample = source(coord, flags, sourceContext);
-				
-				if (!jitter)
-				{
-					weight = yw * weights[sx];
-					fx += fdiff;
-				}
-				else
-				{
-					weight = GaussTableLookup2D(fx, fminx, fy, fminy, SAMPLE_WIDTH * 0.5f, sampleGridSize, weights);
-				}
-				
-				
-				accum = FPMColorAdd(FPMColorMultiply(sample, weight), accum);
-				totalWeight += weight;
 			}
-			fy += fdiff;
+	
+			sampleWeights = jitterWeights;
+			normalization = 1.0f / totalWeight;
+		}
+	
+		if (adaptive)
+		{
+			if (SampleAdaptiveProbe(source, batchSource, sourceContext, coords, weights, sampleGridSize, flags, adaptiveThreshold, samples, pixel))
+			{
+				pixel++;
+				continue;
+			}
+			refinedCount++;
 		}
-		*pixel++ = FPMColorMultiply(accum, 1.0f / totalWeight);
+	
+		if (context->mapRecorder != NULL)  ResamplingMapRecordPixel(context->mapRecorder, context->xoff * context->size + x, context->yoff * context->size + y, coords, weights, sampleGridSize);
+		if (!adaptive)  SampleSourceBatch(source, batchSource, sourceContext, coords, samples, sampleCount, flags);
+	
+		FPMColor accum = kFPMColorClear;
+		for (si = 0; si < sampleCount; si++)
+		{
+			accum = FPMColorAdd(FPMColorMultiply(samples[si], sampleWeights[si]), accum);
+		}
+		*pixel++ = FPMColorMultiply(accum, normalization);
 	}	
 	
+	RenderStatisticsAdd(context->statistics, xEnd - xStart, refinedCount);
+}
+
+
+/*	Transforms the cube direct sink supports map each axis to an axis,
+	possibly reversed: each row and column of the 3×3 part of the matrix has
+	a single element of ±1, and the rest are 0.
+*/
+static bool TransformPermutesAxes(OOMatrix transform)
+{
+	const float (*m)[4] = transform.m;
+	unsigned i, j, columnsUsed = 0;
+	
+	if (fabsf(m[3][3] - 1.0f) > DIRECT_TOLERANCE)  return false;
+	for (i = 0; i < 3; i++)
+	{
+		if (fabsf(m[i][3]) > DIRECT_TOLERANCE || fabsf(m[3][i]) > DIRECT_TOLERANCE)  return false;
+	
+		for (j = 0; j < 3; j++)
+		{
+			float element = fabsf(m[i][j]);
+			if (fabsf(element - 1.0f) <= DIRECT_TOLERANCE)
+			{
+				if (columnsUsed & (1 << j))  return false;
+				columnsUsed |= 1 << j;
+			}
+			else if (element > DIRECT_TOLERANCE)  return false;
+		}
+	}
+	
+	return columnsUsed == 7;
+}
+
+
+bool CanRenderToCubeDirect(DirectResampleLayout sourceLayout, OOMatrix transform)
+{
+	return (sourceLayout == kDirectLayoutCube || sourceLayout == kDirectLayoutCubeCross) && TransformPermutesAxes(transform);
+}
+
+
+/*	Build the axis for the columns or rows of a face which map to sourceCount
+	pixels of a source face, with the face coordinate negated if sign is
+	negative. Samples are placed on the face by the faces’ sample table, as
+	for RenderCubeFaceSpan(), and in the source face as ReadCube places them.
+*/
+static bool SetUpDirectFaceAxis(DirectResampleAxis *axis, const RenderCubeFaceContext *face, float sign, FPMDimension sourceCount)
+{
+	if (!DirectResampleAxisInit(axis, face->size, sourceCount))  return false;
+	
+	float half = (float)sourceCount / 2.0f;
+	const float *positions = face->sampleTable->positions;
+	FPMDimension i;
+	unsigned s;
+	for (i = 0; i < face->size; i++)
+	{
+		for (s = 0; s < face->sampleGridSize; s++)
+		{
+			float f = *positions++;
+			if (!DirectResampleAxisAddSample(axis, (f * sign) * half + half, face->weights[s], kFPMWrapClamp))  return false;
+		}
+		DirectResampleAxisEndPosition(axis);
+	}
+	
 	return true;
 }
+
+
+/*	The transform turns each face of the output onto a face of the source.
+	The face’s right vector then lies along the source face’s right or down
+	vector, and its down vector along the other; in the second case the
+	face is transposed.
+*/
+static bool SetUpDirectFace(DirectResampleRegion *region, const RenderCubeFaceContext *face, const RenderCubeFaceContext sourceFaces[6], FPMSize sourceFaceSize, OOMatrix transform)
+{
+	Vector outVector = OOVectorMultiplyMatrix(face->outVector, transform);
+	Vector rightVector = OOVectorMultiplyMatrix(face->rightVector, transform);
+	Vector downVector = OOVectorMultiplyMatrix(face->downVector, transform);
+	
+	const RenderCubeFaceContext *sourceFace = NULL;
+	unsigned i;
+	for (i = 0; i < 6; i++)
+	{
+		if (dot_product(outVector, sourceFaces[i].outVector) > 0.5f)  sourceFace = &sourceFaces[i];
+	}
+	assert(sourceFace != NULL);
+	
+	bool transpose = fabsf(dot_product(rightVector, sourceFace->rightVector)) < 0.5f;
+	float rightSign, downSign;
+	FPMDimension rightCount, downCount;
+	if (!transpose)
+	{
+		rightSign = dot_product(rightVector, sourceFace->rightVector);
+		downSign = dot_product(downVector, sourceFace->downVector);
+		rightCount = sourceFaceSize.width;
+		downCount = sourceFaceSize.height;
+	}
+	else
+	{
+		rightSign = dot_product(rightVector, sourceFace->downVector);
+		downSign = dot_product(downVector, sourceFace->rightVector);
+		rightCount = sourceFaceSize.height;
+		downCount = sourceFaceSize.width;
+	}
+	
+	region->destination = FPMMakeRectC(face->xoff * face->size, face->yoff * face->size, face->size, face->size);
+	region->sourceOrigin = FPMMakePoint(sourceFace->xoff * sourceFaceSize.width, sourceFace->yoff * sourceFaceSize.height);
+	region->transpose = transpose;
+	
+	return SetUpDirectFaceAxis(&region->columns, face, (rightSign > 0.0f) ? 1.0f : -1.0f, rightCount) &&
+		   SetUpDirectFaceAxis(&region->rows, face, (downSign > 0.0f) ? 1.0f : -1.0f, downCount);
+}
+
+
+static FloatPixMapRef RenderCubeDirect(uintmax_t size, bool cross, RenderFlags flags, const RenderOptions *options, FloatPixMapRef source, DirectResampleLayout sourceLayout, OOMatrix transform, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+{
+	assert(CanRenderToCubeDirect(sourceLayout, transform) && !(flags & (kRenderJitter | kRenderAdaptive | kRenderPrefiltered)));
+	
+	FPMSize outSize = cross ? FPMMakeSize(size * 4, size * 3) : FPMMakeSize(size, size * 6);
+	if (!ValidatePixMapSize(size, outSize.width, outSize.height, error, cbContext))  return NULL;
+	
+	bool sourceCross = sourceLayout == kDirectLayoutCubeCross;
+	FPMSize sourceSize = FPMGetSize(source);
+	FPMSize sourceFaceSize = sourceCross ? FPMMakeSize(sourceSize.width / 4, sourceSize.height / 3) : FPMMakeSize(sourceSize.width, sourceSize.height / 6);
+	if (sourceFaceSize.width == 0 || sourceFaceSize.height == 0)
+	{
+		CallErrorCallbackWithFormat(error, cbContext, "The input image is too small to be a cube map.\n");
+		return NULL;
+	}
+	
+	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : SAMPLE_GRID_SIZE_HIGHQ;
+	float weights[sampleGridSize];
+	BuildGaussTable(sampleGridSize, weights);
+	
+	// Only the layouts and face vectors of sourceFaces are used.
+	RenderCubeFaceContext faces[6] = {{ NULL }}, sourceFaces[6] = {{ NULL }};
+	SetUpCubeFaces(faces, cross, size, flags, options, sampleGridSize, weights, NULL, NULL, NULL);
+	SetUpCubeFaces(sourceFaces, sourceCross, sourceFaceSize.width, flags, NULL, sampleGridSize, weights, NULL, NULL, NULL);
+	
+	CubeFaceSampleTable sampleTable;
+	if (!SetUpCubeFaceSampleTable(&sampleTable, faces, error, cbContext))  return NULL;
+	
+	DirectResampleRegion regions[6] = {{ .transpose = false }};
+	FloatPixMapRef pm = NULL;
+	unsigned i;
+	for (i = 0; i < 6; i++)
+	{
+		if (!SetUpDirectFace(&regions[i], &faces[i], sourceFaces, sourceFaceSize, transform))
+		{
+			CallErrorCallbackWithFormat(error, cbContext, "Not enough memory to set up direct rendering.\n");
+			goto END;
+		}
+	}
+	
+	pm = DirectResampleRender(size, outSize, regions, 6, source, options, progress, error, cbContext);
+	
+END:
+	for (i = 0; i < 6; i++)
+	{
+		DirectResampleAxisFree(&regions[i].columns);
+		DirectResampleAxisFree(&regions[i].rows);
+	}
+	FreeCubeFaceSampleTable(&sampleTable);
+	return pm;
+}
+
+
+FloatPixMapRef RenderToCubeDirect(uintmax_t size, RenderFlags flags, const RenderOptions *options, FloatPixMapRef source, DirectResampleLayout sourceLayout, OOMatrix transform, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+{
+	return RenderCubeDirect(size, false, flags, options, source, sourceLayout, transform, progress, error, cbContext);
+}
+
+
+FloatPixMapRef RenderToCubeCrossDirect(uintmax_t size, RenderFlags flags, const RenderOptions *options, FloatPixMapRef source, DirectResampleLayout sourceLayout, OOMatrix transform, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+{
+	return RenderCubeDirect(size, true, flags, options, source, sourceLayout, transform, progress, error, cbContext);
+}
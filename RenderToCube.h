@@ -26,8 +26,17 @@
 
 
 #include "SphericalPixelSource.h"
+#include "DirectResample.h"
 
 
-FloatPixMapRef RenderToCube(uintmax_t size, RenderFlags flags, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+FloatPixMapRef RenderToCube(uintmax_t size, RenderFlags flags, const RenderOptions *options, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
 
-FloatPixMapRef RenderToCubeCross(uintmax_t size, RenderFlags flags, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+FloatPixMapRef RenderToCubeCross(uintmax_t size, RenderFlags flags, const RenderOptions *options, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+
+/*	Direct rendering from cube maps in either layout, for transforms which only
+	swap and flip axes, so that each face is a face of the source turned by a
+	multiple of 90 degrees and/or mirrored; see DirectResample.h.
+*/
+bool CanRenderToCubeDirect(DirectResampleLayout sourceLayout, OOMatrix transform);
+FloatPixMapRef RenderToCubeDirect(uintmax_t size, RenderFlags flags, const RenderOptions *options, FloatPixMapRef source, DirectResampleLayout sourceLayout, OOMatrix transform, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+FloatPixMapRef RenderToCubeCrossDirect(uintmax_t size, RenderFlags flags, const RenderOptions *options, FloatPixMapRef source, DirectResampleLayout sourceLayout, OOMatrix transform, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
@@ -27,6 +27,7 @@
 #include "RenderToGallPeters.h"
 #include "FPMImageOperations.h"
 #include "PlanetToolScheduler.h"
+#include "ResamplingMap.h"
 
 
 FPM_INLINE void GetLatLong(float x, float y, float width, float heightF, float *lat, float *lon)
@@ -42,12 +43,14 @@ FPM_INLINE void GetLatLong(float x, float y, float width, float heightF, float *
 #define HALF_WIDTH			0.5f
 
 
+static bool RenderGallPetersBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontext);
 static bool RenderGallPetersLine(size_t lineIndex, size_t lineCount, void *vcontext);
 
 
 typedef struct RenderGallPetersContext
 {
-	FloatPixMapRef					pm;
+	FloatPixMapRef					pm;				// Current band.
+	FPMCoordinate					firstRow;		// Row of the output at the top of pm.
 	size_t							width;
 	float							widthF;
 	float							heightF;
@@ -56,42 +59,51 @@ typedef struct RenderGallPetersContext
 	float							*weights;
 	
 	SphericalPixelSourceFunction	source;
+	SphericalPixelBatchSourceFunction	batchSource;
 	void							*sourceContext;
 	
 	RenderFlags						flags;
+	float							adaptiveThreshold;
+	RenderStatistics				*statistics;
+	ResamplingMapRecorderRef		mapRecorder;
 	
 } RenderGallPetersContext;
 
 
-FloatPixMapRef RenderToGallPeters(uintmax_t size, RenderFlags flags, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+FloatPixMapRef RenderToGallPeters(uintmax_t size, RenderFlags flags, const RenderOptions *options, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
 {
 	size_t height = 1.0f / kPiF * 2 * size;
-	FloatPixMapRef pm = ValidateAndCreatePixMap(size, size, height, error, cbContext);
-	if (pm == NULL)  return NULL;
-	
-	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : SAMPLE_GRID_SIZE_HIGHQ;
+	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : (flags & kRenderPrefiltered) ? kPrefilteredSampleGridSize : SAMPLE_GRID_SIZE_HIGHQ;
 	float weights[sampleGridSize];
 	BuildGaussTable(sampleGridSize, weights);
 	
 	RenderGallPetersContext context =
 	{
-		.pm = pm,
 		.width = size,
 		.widthF = size / 2.0f,
 		.heightF = -2.0f / height,
 		.sampleGridSize = sampleGridSize,
 		.weights = weights,
 		.source = source,
+		.batchSource = batchSource,
 		.sourceContext = sourceContext,
-		.flags = flags
+		.flags = flags,
+		.adaptiveThreshold = (options != NULL) ? options->adaptiveThreshold : 0.0f,
+		.statistics = (options != NULL) ? options->statistics : NULL,
+		.mapRecorder = (options != NULL) ? options->mapRecorder : NULL
 	};
 	
-	if (!ScheduleRender(RenderGallPetersLine, &context, height, 0, 1, progress, cbContext))
-	{
-		FPMRelease(&pm);
-	}
+	return RenderInBands(size, size, height, options, RenderGallPetersBand, &context, progress, error, cbContext);
+}
+
+
+static bool RenderGallPetersBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontext)
+{
+	RenderGallPetersContext *context = vcontext;
+	context->pm = band;
+	context->firstRow = firstRow;
 	
-	return pm;
+	return ScheduleRender(RenderGallPetersLine, context, FPMGetHeight(band), 0, 1, progress, progressContext);
 }
 
 
@@ -103,15 +115,23 @@ static bool RenderGallPetersLine(size_t lineIndex, size_t lineCount, void *vcont
 	float heightF = context->heightF;
 	
 	SphericalPixelSourceFunction source = context->source;
+	SphericalPixelBatchSourceFunction batchSource = context->batchSource;
 	void *sourceContext = context->sourceContext;
 	
 	unsigned sampleGridSize = context->sampleGridSize;
 	float *weights = context->weights;
 	
+	unsigned sampleCount = sampleGridSize * sampleGridSize;
+	Coordinates coords[sampleCount];
+	FPMColor samples[sampleCount];
+	
 	RenderFlags flags = context->flags;
+	bool adaptive = flags & kRenderAdaptive;
+	float adaptiveThreshold = context->adaptiveThreshold;
+	uintmax_t refinedCount = 0;
 	
 	FPMColor *pixel = FPMGetPixelPointerC(context->pm, 0, lineIndex);
-	FPMDimension x, y = lineIndex;
+	FPMDimension x, y = context->firstRow + lineIndex;
 	
 	size_t width = context->width;
 	for (x = 0; x < width; x++)
@@ -124,32 +144,55 @@ static bool RenderGallPetersLine(size_t lineIndex, size_t lineCount, void *vcont
 		lonDiff = lonMax - lonMin;
 		float latStep = latDiff * 1.0f / (float)(sampleGridSize - 1);
 		float lonStep = lonDiff * 1.0f / (float)(sampleGridSize - 1);
+		float footprint = LatLongSampleFootprint(0.5f * (latMin + latMax), latStep, lonStep);
 		
 		FPMColor accum = kFPMColorClear;
 		float totalWeight = 0.0f;
 		float lat = latMin, lon;
 		float weight, yw;
-		unsigned sx, sy;
+		unsigned sx, sy, si;
 		
+		si = 0;
 		for (sy = 0; sy < sampleGridSize; sy++)
 		{
 			lon = lonMin;
+			for (sx = 0; sx < sampleGridSize; sx++)
+			{
+				coords[si++] = CoordsWithFootprint(MakeCoordsLatLongRad(lat, lon), footprint);
+				lon += lonStep;
+			}
+			lat += latStep;
+		}
+		
+		if (adaptive)
+		{
+			if (SampleAdaptiveProbe(source, batchSource, sourceContext, coords, weights, sampleGridSize, flags, adaptiveThreshold, samples, pixel))
+			{
+				pixel++;
+				continue;
+			}
+			refinedCount++;
+		}
+		
+		if (context->mapRecorder != NULL)  ResamplingMapRecordPixel(context->mapRecorder, x, y, coords, weights, sampleGridSize);
+		if (!adaptive)  SampleSourceBatch(source, batchSource, sourceContext, coords, samples, sampleCount, flags);
+		
+		si = 0;
+		for (sy = 0; sy < sampleGridSize; sy++)
+		{
 			yw = weights[sy];
 			for (sx = 0; sx < sampleGridSize; sx++)
 			{
-				FPMColor sample = source(MakeCoordsLatLongRad(lat, lon), flags, sourceContext);
 				weight = yw * weights[sx];
 				
-				accum = FPMColorAdd(FPMColorMultiply(sample, weight), accum);
+				accum = FPMColorAdd(FPMColorMultiply(samples[si++], weight), accum);
 				totalWeight += weight;
-				
-				lon += lonStep;
 			}
-			lat += latStep;
 		}
 		
 		*pixel++ = FPMColorMultiply(accum, 1.0f / totalWeight);
 	}
 	
+	RenderStatisticsAdd(context->statistics, width, refinedCount);
 	return true;
 }
@@ -27,4 +27,4 @@
 #include "SphericalPixelSource.h"
 
 
-FloatPixMapRef RenderToGallPeters(uintmax_t size, RenderFlags flags, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+FloatPixMapRef RenderToGallPeters(uintmax_t size, RenderFlags flags, const RenderOptions *options, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
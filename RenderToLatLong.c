@@ -27,6 +27,7 @@
 #include "RenderToLatLong.h"
 #include "FPMImageOperations.h"
 #include "PlanetToolScheduler.h"
+#include "ResamplingMap.h"
 
 
 FPM_INLINE void GetLatLong(float x, float y, float size, float *lat, float *lon)
@@ -41,73 +42,174 @@ FPM_INLINE void GetLatLong(float x, float y, float size, float *lat, float *lon)
 
 #define HALF_WIDTH			0.5f
 
+#define SHARED_SPAN_PIXELS	64	// Pixels rendered together by RenderLatLongSpanShared().
 
-static bool RenderLatLongLine(size_t lineIndex, size_t lineCount, void *vcontext);
+#define DIRECT_TOLERANCE	1e-5f	// How far transform matrix elements may be from 0 or ±1 for RenderToLatLongDirect().
 
 
-typedef struct RenderLatLongContext
+typedef struct RenderLatLongContext RenderLatLongContext;
+
+//	Render pixels [xStart, xEnd) of row row of the current band.
+typedef void (*RenderLatLongSpanFunction)(RenderLatLongContext *context, FPMCoordinate row, FPMCoordinate xStart, FPMCoordinate xEnd);
+
+static bool RenderLatLongBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontext);
+static bool RenderLatLongTile(FPMRect tile, void *vcontext);
+static void RenderLatLongSpan(RenderLatLongContext *context, FPMCoordinate row, FPMCoordinate xStart, FPMCoordinate xEnd);
+static void RenderLatLongSpanShared(RenderLatLongContext *context, FPMCoordinate row, FPMCoordinate xStart, FPMCoordinate xEnd);
+
+
+struct RenderLatLongContext
 {
-	FloatPixMapRef					pm;
+	FloatPixMapRef					pm;				// Current band.
+	FPMCoordinate					firstRow;		// Row of the output at the top of pm.
 	size_t							size;
+	RenderLatLongSpanFunction		renderSpan;
 	
 	unsigned						sampleGridSize;
 	float							*weights;
 	
+	// Used by RenderLatLongSpanShared() only.
+	float							*lonTable;
+	float							normalization;
+	
 	SphericalPixelSourceFunction	source;
+	SphericalPixelBatchSourceFunction	batchSource;
 	void							*sourceContext;
 	
 	RenderFlags						flags;
+	float							adaptiveThreshold;
+	RenderStatistics				*statistics;
+	ResamplingMapRecorderRef		mapRecorder;
 	
-} RenderLatLongContext;
+};
 
 
-FloatPixMapRef RenderToLatLong(uintmax_t size, RenderFlags flags, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+FloatPixMapRef RenderToLatLong(uintmax_t size, RenderFlags flags, const RenderOptions *options, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
 {
-	FloatPixMapRef pm = ValidateAndCreatePixMap(size, size * 2, size, error, cbContext);
-	if (pm == NULL)  return NULL;
+	if (!ValidatePixMapSize(size, size * 2, size, error, cbContext))  return NULL;
 	
-	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : SAMPLE_GRID_SIZE_HIGHQ;
+	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : (flags & kRenderPrefiltered) ? kPrefilteredSampleGridSize : SAMPLE_GRID_SIZE_HIGHQ;
 	float weights[sampleGridSize];
 	BuildGaussTable(sampleGridSize, weights);
 	
 	RenderLatLongContext context =
 	{
-		.pm = pm,
 		.size = size,
+		.renderSpan = RenderLatLongSpan,
 		.sampleGridSize = sampleGridSize,
 		.weights = weights,
 		.source = source,
+		.batchSource = batchSource,
 		.sourceContext = sourceContext,
-		.flags = flags
+		.flags = flags,
+		.adaptiveThreshold = (options != NULL) ? options->adaptiveThreshold : 0.0f,
+		.statistics = (options != NULL) ? options->statistics : NULL,
+		.mapRecorder = (options != NULL) ? options->mapRecorder : NULL
 	};
 	
-	if (!ScheduleRender(RenderLatLongLine, &context, size, 0, 1, progress, cbContext))
+	if ((flags & kRenderSharedSamples) && !(flags & kRenderAdaptive))
 	{
-		FPMRelease(&pm);
+		/*	Longitudes of the sample columns are the same for every line, and
+			the last column of each pixel is the first column of the next, so
+			they are computed once here.
+		*/
+		size_t columnCount = size * 2 * (sampleGridSize - 1) + 1;
+		context.lonTable = malloc(columnCount * sizeof *context.lonTable);
+		if (context.lonTable == NULL)
+		{
+			CallErrorCallbackWithFormat(error, cbContext, "Not enough memory for %zu sample positions.\n", columnCount);
+			return NULL;
+		}
+		
+		size_t column = 0;
+		FPMDimension x;
+		for (x = 0; x < size * 2; x++)
+		{
+			float latMin, lonMin, latMax, lonMax;
+			GetLatLong((float)x - HALF_WIDTH + 0.5f, 0.0f, size, &latMin, &lonMin);
+			GetLatLong((float)x + HALF_WIDTH + 0.5f, 0.0f, size, &latMax, &lonMax);
+			float lonStep = (lonMax - lonMin) * 1.0f / (float)(sampleGridSize - 1);
+			
+			float lon = lonMin;
+			unsigned sx;
+			for (sx = 0; sx < sampleGridSize - 1; sx++)
+			{
+				context.lonTable[column++] = lon;
+				lon += lonStep;
+			}
+			if (x == size * 2 - 1)  context.lonTable[column++] = lon;
+		}
+		assert(column == columnCount);
+		
+		float weightSum = 0.0f;
+		unsigned i;
+		for (i = 0; i < sampleGridSize; i++)  weightSum += weights[i];
+		context.normalization = 1.0f / (weightSum * weightSum);
+		
+		context.renderSpan = RenderLatLongSpanShared;
 	}
 	
+	FloatPixMapRef pm = RenderInBands(size, size * 2, size, options, RenderLatLongBand, &context, progress, error, cbContext);
+	
+	free(context.lonTable);
 	return pm;
 }
 
 
-static bool RenderLatLongLine(size_t lineIndex, size_t lineCount, void *vcontext)
+static bool RenderLatLongBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontext)
 {
 	RenderLatLongContext *context = vcontext;
+	context->pm = band;
+	context->firstRow = firstRow;
 	
+	RenderJob job =
+	{
+		.renderTileCB = RenderLatLongTile,
+		.renderContext = context,
+		.lineCount = FPMGetHeight(band),
+		.width = FPMGetWidth(band)
+	};
+	return ScheduleRenderJobs(&job, 1, progress, progressContext);
+}
+
+
+static bool RenderLatLongTile(FPMRect tile, void *vcontext)
+{
+	RenderLatLongContext *context = vcontext;
+	
+	FPMCoordinate row;
+	for (row = tile.origin.y; row < tile.origin.y + (FPMCoordinate)tile.size.height; row++)
+	{
+		context->renderSpan(context, row, tile.origin.x, tile.origin.x + tile.size.width);
+	}
+	return true;
+}
+
+
+static void RenderLatLongSpan(RenderLatLongContext *context, FPMCoordinate row, FPMCoordinate xStart, FPMCoordinate xEnd)
+{
 	size_t size = context->size;
 	
 	SphericalPixelSourceFunction source = context->source;
+	SphericalPixelBatchSourceFunction batchSource = context->batchSource;
 	void *sourceContext = context->sourceContext;
 	
 	unsigned sampleGridSize = context->sampleGridSize;
 	float *weights = context->weights;
 	
+	unsigned sampleCount = sampleGridSize * sampleGridSize;
+	Coordinates coords[sampleCount];
+	FPMColor samples[sampleCount];
+	
 	RenderFlags flags = context->flags;
+	bool adaptive = flags & kRenderAdaptive;
+	float adaptiveThreshold = context->adaptiveThreshold;
+	uintmax_t refinedCount = 0;
 	
-	FPMColor *pixel = FPMGetPixelPointerC(context->pm, 0, lineIndex);
-	FPMDimension x, y = lineIndex;
+	FPMColor *pixel = FPMGetPixelPointerC(context->pm, xStart, row);
+	FPMCoordinate x, y = context->firstRow + row;
 	
-	for (x = 0; x < size * 2; x++)
+	for (x = xStart; x < xEnd; x++)
 	{
 		float latMin, lonMin, latMax, lonMax, latDiff, lonDiff;
 		GetLatLong((float)x - HALF_WIDTH + 0.5f, (float)y - HALF_WIDTH + 0.5f, size, &latMin, &lonMin);
@@ -117,32 +219,258 @@ static bool RenderLatLongLine(size_t lineIndex, size_t lineCount, void *vcontext
 		lonDiff = lonMax - lonMin;
 		float latStep = latDiff * 1.0f / (float)(sampleGridSize - 1);
 		float lonStep = lonDiff * 1.0f / (float)(sampleGridSize - 1);
+		float footprint = LatLongSampleFootprint(0.5f * (latMin + latMax), latStep, lonStep);
 		
 		FPMColor accum = kFPMColorClear;
 		float totalWeight = 0.0f;
 		float lat = latMin, lon;
 		float weight, yw;
-		unsigned sx, sy;
+		unsigned sx, sy, si;
 		
+		si = 0;
 		for (sy = 0; sy < sampleGridSize; sy++)
 		{
 			lon = lonMin;
+			for (sx = 0; sx < sampleGridSize; sx++)
+			{
+				coords[si++] = CoordsWithFootprint(MakeCoordsLatLongRad(lat, lon), footprint);
+				lon += lonStep;
+			}
+			lat += latStep;
+		}
+		
+		if (adaptive)
+		{
+			if (SampleAdaptiveProbe(source, batchSource, sourceContext, coords, weights, sampleGridSize, flags, adaptiveThreshold, samples, pixel))
+			{
+				pixel++;
+				continue;
+			}
+			refinedCount++;
+		}
+		
+		if (context->mapRecorder != NULL)  ResamplingMapRecordPixel(context->mapRecorder, x, y, coords, weights, sampleGridSize);
+		if (!adaptive)  SampleSourceBatch(source, batchSource, sourceContext, coords, samples, sampleCount, flags);
+		
+		si = 0;
+		for (sy = 0; sy < sampleGridSize; sy++)
+		{
 			yw = weights[sy];
 			for (sx = 0; sx < sampleGridSize; sx++)
 			{
-				FPMColor sample = source(MakeCoordsLatLongRad(lat, lon), flags, sourceContext);
 				weight = yw * weights[sx];
 				
-				accum = FPMColorAdd(FPMColorMultiply(sample, weight), accum);
+				accum = FPMColorAdd(FPMColorMultiply(samples[si++], weight), accum);
 				totalWeight += weight;
-				
-				lon += lonStep;
 			}
-			lat += latStep;
 		}
 		
 		*pixel++ = FPMColorMultiply(accum, 1.0f / totalWeight);
 	}
 	
+	RenderStatisticsAdd(context->statistics, xEnd - xStart, refinedCount);
+}
+
+
+/*	Alternative span renderer for kRenderSharedSamples. The sample grid is
+	the same as RenderLatLongSpan()’s, but sampled a span of pixels at a time
+	with samples on pixel boundaries shared by both neighbours, and filtered
+	separably: each row of samples is weighted horizontally into per-pixel
+	sums, which are then weighted vertically.
+*/
+static void RenderLatLongSpanShared(RenderLatLongContext *context, FPMCoordinate row, FPMCoordinate xStart, FPMCoordinate xEnd)
+{
+	size_t size = context->size;
+	
+	SphericalPixelSourceFunction source = context->source;
+	SphericalPixelBatchSourceFunction batchSource = context->batchSource;
+	void *sourceContext = context->sourceContext;
+	RenderFlags flags = context->flags;
+	
+	unsigned sampleGridSize = context->sampleGridSize;
+	unsigned columnsPerPixel = sampleGridSize - 1;
+	float *weights = context->weights;
+	const float *lonTable = context->lonTable;
+	float normalization = context->normalization;
+	
+	Coordinates coords[SHARED_SPAN_PIXELS * columnsPerPixel + 1];
+	FPMColor samples[SHARED_SPAN_PIXELS * columnsPerPixel + 1];
+	FPMColor accum[SHARED_SPAN_PIXELS];
+	float lats[sampleGridSize];
+	
+	float latMin, lonMin, latMax, lonMax;
+	FPMCoordinate y = context->firstRow + row;
+	GetLatLong(0.0f, (float)y - HALF_WIDTH + 0.5f, size, &latMin, &lonMin);
+	GetLatLong(0.0f, (float)y + HALF_WIDTH + 0.5f, size, &latMax, &lonMax);
+	float latStep = (latMax - latMin) * 1.0f / (float)(sampleGridSize - 1);
+	// Sample columns are as far apart in longitude as rows are in latitude.
+	float footprint = LatLongSampleFootprint(0.5f * (latMin + latMax), latStep, latStep);
+	float lat = latMin;
+	unsigned sx, sy;
+	for (sy = 0; sy < sampleGridSize; sy++)
+	{
+		lats[sy] = lat;
+		lat += latStep;
+	}
+	
+	FPMColor *pixel = FPMGetPixelPointerC(context->pm, xStart, row);
+	size_t spanStart, i;
+	
+	for (spanStart = xStart; spanStart < (size_t)xEnd; spanStart += SHARED_SPAN_PIXELS)
+	{
+		size_t spanCount = xEnd - spanStart;
+		if (spanCount > SHARED_SPAN_PIXELS)  spanCount = SHARED_SPAN_PIXELS;
+		size_t columnCount = spanCount * columnsPerPixel + 1;
+		const float *spanLons = lonTable + spanStart * columnsPerPixel;
+		
+		for (i = 0; i < spanCount; i++)  accum[i] = kFPMColorClear;
+		
+		for (sy = 0; sy < sampleGridSize; sy++)
+		{
+			for (i = 0; i < columnCount; i++)
+			{
+				coords[i] = CoordsWithFootprint(MakeCoordsLatLongRad(lats[sy], spanLons[i]), footprint);
+			}
+			
+			SampleSourceBatch(source, batchSource, sourceContext, coords, samples, columnCount, flags);
+			
+			float yw = weights[sy];
+			const FPMColor *pixelSamples = samples;
+			for (i = 0; i < spanCount; i++)
+			{
+				FPMColor rowAccum = kFPMColorClear;
+				for (sx = 0; sx < sampleGridSize; sx++)
+				{
+					rowAccum = FPMColorAdd(FPMColorMultiply(pixelSamples[sx], weights[sx]), rowAccum);
+				}
+				accum[i] = FPMColorAdd(FPMColorMultiply(rowAccum, yw), accum[i]);
+				pixelSamples += columnsPerPixel;
+			}
+		}
+		
+		for (i = 0; i < spanCount; i++)
+		{
+			*pixel++ = FPMColorMultiply(accum[i], normalization);
+		}
+	}
+	
+	RenderStatisticsAdd(context->statistics, xEnd - xStart, 0);
+}
+
+
+/*	Transforms the latlong direct sink supports leave the polar axis on the
+	polar axis, so latitudes are kept or negated, and turn and/or mirror the
+	planet around it, so longitudes are offset and/or negated.
+*/
+static bool PolarTransformParameters(OOMatrix transform, float *latSign, float *lonSign, float *lonOffset)
+{
+	const float (*m)[4] = transform.m;
+	
+	if (fabsf(m[0][3]) > DIRECT_TOLERANCE || fabsf(m[1][3]) > DIRECT_TOLERANCE || fabsf(m[2][3]) > DIRECT_TOLERANCE || fabsf(m[3][3] - 1.0f) > DIRECT_TOLERANCE)  return false;
+	if (fabsf(m[3][0]) > DIRECT_TOLERANCE || fabsf(m[3][1]) > DIRECT_TOLERANCE || fabsf(m[3][2]) > DIRECT_TOLERANCE)  return false;
+	if (fabsf(m[0][1]) > DIRECT_TOLERANCE || fabsf(m[2][1]) > DIRECT_TOLERANCE || fabsf(m[1][0]) > DIRECT_TOLERANCE || fabsf(m[1][2]) > DIRECT_TOLERANCE)  return false;
+	if (fabsf(fabsf(m[1][1]) - 1.0f) > DIRECT_TOLERANCE)  return false;
+	
+	/*	Find what happens to longitudes by transforming two points on the
+		equator. VectorToCoordsRad() is imprecise near ±90°, hence atan2f().
+	*/
+	Vector v0 = OOVectorMultiplyMatrix(CoordsGetVector(MakeCoordsLatLongRad(0.0f, 0.0f)), transform);
+	Vector v1 = OOVectorMultiplyMatrix(CoordsGetVector(MakeCoordsLatLongRad(0.0f, kPiF * 0.5f)), transform);
+	float lon0 = atan2f(v0.x, v0.z);
+	float lon1 = atan2f(v1.x, v1.z);
+	float turn = lon1 - lon0;
+	if (turn > kPiF)  turn -= 2.0f * kPiF;
+	if (turn < -kPiF)  turn += 2.0f * kPiF;
+	
+	*latSign = (m[1][1] > 0.0f) ? 1.0f : -1.0f;
+	*lonSign = (turn > 0.0f) ? 1.0f : -1.0f;
+	*lonOffset = lon0;
 	return true;
 }
+
+
+bool CanRenderToLatLongDirect(DirectResampleLayout sourceLayout, OOMatrix transform)
+{
+	float latSign, lonSign, lonOffset;
+	return sourceLayout == kDirectLayoutLatLong && PolarTransformParameters(transform, &latSign, &lonSign, &lonOffset);
+}
+
+
+/*	Each output column’s sample longitudes, and each row’s sample latitudes,
+	are found as RenderLatLongSpan() finds them, and placed in the source
+	as ReadLatLong does.
+*/
+FloatPixMapRef RenderToLatLongDirect(uintmax_t size, RenderFlags flags, const RenderOptions *options, FloatPixMapRef source, DirectResampleLayout sourceLayout, OOMatrix transform, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+{
+	assert(CanRenderToLatLongDirect(sourceLayout, transform) && !(flags & (kRenderJitter | kRenderAdaptive | kRenderPrefiltered)));
+	
+	if (!ValidatePixMapSize(size, size * 2, size, error, cbContext))  return NULL;
+	
+	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : SAMPLE_GRID_SIZE_HIGHQ;
+	float weights[sampleGridSize];
+	BuildGaussTable(sampleGridSize, weights);
+	
+	float latSign, lonSign, lonOffset;
+	PolarTransformParameters(transform, &latSign, &lonSign, &lonOffset);
+	
+	FPMSize sourceSize = FPMGetSize(source);
+	float pixelsPerLon = (float)sourceSize.width / (2.0f * kPiF);
+	float pixelsPerLat = (float)sourceSize.height / kPiF;
+	
+	DirectResampleRegion region =
+	{
+		.destination = FPMMakeRectC(0, 0, size * 2, size),
+		.sourceOrigin = { 0, 0 }
+	};
+	FloatPixMapRef pm = NULL;
+	FPMDimension x, y;
+	unsigned s;
+	
+	if (!DirectResampleAxisInit(&region.columns, size * 2, sourceSize.width))  goto FAIL;
+	if (!DirectResampleAxisInit(&region.rows, size, sourceSize.height))  goto FAIL;
+	
+	for (x = 0; x < size * 2; x++)
+	{
+		float latMin, lonMin, latMax, lonMax;
+		GetLatLong((float)x - HALF_WIDTH + 0.5f, 0.0f, size, &latMin, &lonMin);
+		GetLatLong((float)x + HALF_WIDTH + 0.5f, 0.0f, size, &latMax, &lonMax);
+		float lonStep = (lonMax - lonMin) * 1.0f / (float)(sampleGridSize - 1);
+		
+		float lon = lonMin;
+		for (s = 0; s < sampleGridSize; s++)
+		{
+			float rlon = lon * lonSign + lonOffset;
+			if (!DirectResampleAxisAddSample(&region.columns, (rlon + kPiF) * pixelsPerLon, weights[s], kFPMWrapRepeat))  goto FAIL;
+			lon += lonStep;
+		}
+		DirectResampleAxisEndPosition(&region.columns);
+	}
+	
+	for (y = 0; y < size; y++)
+	{
+		float latMin, lonMin, latMax, lonMax;
+		GetLatLong(0.0f, (float)y - HALF_WIDTH + 0.5f, size, &latMin, &lonMin);
+		GetLatLong(0.0f, (float)y + HALF_WIDTH + 0.5f, size, &latMax, &lonMax);
+		float latStep = (latMax - latMin) * 1.0f / (float)(sampleGridSize - 1);
+		
+		float lat = latMin;
+		for (s = 0; s < sampleGridSize; s++)
+		{
+			float rlat = lat * latSign;
+			if (!DirectResampleAxisAddSample(&region.rows, (kPiF / 2.0f - rlat) * pixelsPerLat, weights[s], kFPMWrapClamp))  goto FAIL;
+			lat += latStep;
+		}
+		DirectResampleAxisEndPosition(&region.rows);
+	}
+	
+	pm = DirectResampleRender(size, FPMMakeSize(size * 2, size), &region, 1, source, options, progress, error, cbContext);
+	DirectResampleAxisFree(&region.columns);
+	DirectResampleAxisFree(&region.rows);
+	return pm;
+	
+FAIL:
+	CallErrorCallbackWithFormat(error, cbContext, "Not enough memory to set up direct rendering.\n");
+	DirectResampleAxisFree(&region.columns);
+	DirectResampleAxisFree(&region.rows);
+	return NULL;
+}
@@ -25,6 +25,14 @@
 */
 
 #include "SphericalPixelSource.h"
+#include "DirectResample.h"
 
 
-FloatPixMapRef RenderToLatLong(uintmax_t size, RenderFlags flags, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+FloatPixMapRef RenderToLatLong(uintmax_t size, RenderFlags flags, const RenderOptions *options, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+
+/*	Direct rendering from latlong images, for transforms which turn the planet
+	around its axis, turn it upside down and/or mirror it; see
+	DirectResample.h.
+*/
+bool CanRenderToLatLongDirect(DirectResampleLayout sourceLayout, OOMatrix transform);
+FloatPixMapRef RenderToLatLongDirect(uintmax_t size, RenderFlags flags, const RenderOptions *options, FloatPixMapRef source, DirectResampleLayout sourceLayout, OOMatrix transform, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
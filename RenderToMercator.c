@@ -27,6 +27,7 @@
 #include "RenderToMercator.h"
 #include "FPMImageOperations.h"
 #include "PlanetToolScheduler.h"
+#include "ResamplingMap.h"
 
 
 FPM_INLINE void GetLatLong(float x, float y, float size, float *lat, float *lon)
@@ -43,51 +44,62 @@ FPM_INLINE void GetLatLong(float x, float y, float size, float *lat, float *lon)
 #define HALF_WIDTH			0.5f
 
 
+static bool RenderMercatorBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontext);
 static bool RenderMercatorLine(size_t lineIndex, size_t lineCount, void *vcontext);
 
 
 typedef struct RenderMercatorContext
 {
-	FloatPixMapRef					pm;
+	FloatPixMapRef					pm;				// Current band.
+	FPMCoordinate					firstRow;		// Row of the output at the top of pm.
 	size_t							size;
 	
 	unsigned						sampleGridSize;
 	float							*weights;
 	
 	SphericalPixelSourceFunction	source;
+	SphericalPixelBatchSourceFunction	batchSource;
 	void							*sourceContext;
 	
 	RenderFlags						flags;
+	float							adaptiveThreshold;
+	RenderStatistics				*statistics;
+	ResamplingMapRecorderRef		mapRecorder;
 	
 } RenderMercatorContext;
 
 
-FloatPixMapRef RenderToMercator(uintmax_t size, RenderFlags flags, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+FloatPixMapRef RenderToMercator(uintmax_t size, RenderFlags flags, const RenderOptions *options, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
 {
-	FloatPixMapRef pm = ValidateAndCreatePixMap(size, size, size, error, cbContext);
-	if (pm == NULL)  return NULL;
-	
-	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : SAMPLE_GRID_SIZE_HIGHQ;
+	unsigned sampleGridSize = (flags & kRenderFast) ? SAMPLE_GRID_SIZE_FAST : (flags & kRenderPrefiltered) ? kPrefilteredSampleGridSize : SAMPLE_GRID_SIZE_HIGHQ;
 	float weights[sampleGridSize];
 	BuildGaussTable(sampleGridSize, weights);
 	
 	RenderMercatorContext context =
 	{
-		.pm = pm,
 		.size = size,
 		.sampleGridSize = sampleGridSize,
 		.weights = weights,
 		.source = source,
+		.batchSource = batchSource,
 		.sourceContext = sourceContext,
-		.flags = flags
+		.flags = flags,
+		.adaptiveThreshold = (options != NULL) ? options->adaptiveThreshold : 0.0f,
+		.statistics = (options != NULL) ? options->statistics : NULL,
+		.mapRecorder = (options != NULL) ? options->mapRecorder : NULL
 	};
 	
-	if (!ScheduleRender(RenderMercatorLine, &context, size, 0, 1, progress, cbContext))
-	{
-		FPMRelease(&pm);
-	}
+	return RenderInBands(size, size, size, options, RenderMercatorBand, &context, progress, error, cbContext);
+}
+
+
+static bool RenderMercatorBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontext)
+{
+	RenderMercatorContext *context = vcontext;
+	context->pm = band;
+	context->firstRow = firstRow;
 	
-	return pm;
+	return ScheduleRender(RenderMercatorLine, context, FPMGetHeight(band), 0, 1, progress, progressContext);
 }
 
 
@@ -98,15 +110,23 @@ static bool RenderMercatorLine(size_t lineIndex, size_t lineCount, void *vcontex
 	size_t size = context->size;
 	
 	SphericalPixelSourceFunction source = context->source;
+	SphericalPixelBatchSourceFunction batchSource = context->batchSource;
 	void *sourceContext = context->sourceContext;
 	
 	unsigned sampleGridSize = context->sampleGridSize;
 	float *weights = context->weights;
 	
+	unsigned sampleCount = sampleGridSize * sampleGridSize;
+	Coordinates coords[sampleCount];
+	FPMColor samples[sampleCount];
+	
 	RenderFlags flags = context->flags;
+	bool adaptive = flags & kRenderAdaptive;
+	float adaptiveThreshold = context->adaptiveThreshold;
+	uintmax_t refinedCount = 0;
 	
 	FPMColor *pixel = FPMGetPixelPointerC(context->pm, 0, lineIndex);
-	FPMDimension x, y = lineIndex;
+	FPMDimension x, y = context->firstRow + lineIndex;
 	
 	for (x = 0; x < size; x++)
 	{
@@ -118,32 +138,55 @@ static bool RenderMercatorLine(size_t lineIndex, size_t lineCount, void *vcontex
 		lonDiff = lonMax - lonMin;
 		float latStep = latDiff * 1.0f / (float)(sampleGridSize - 1);
 		float lonStep = lonDiff * 1.0f / (float)(sampleGridSize - 1);
+		float footprint = LatLongSampleFootprint(0.5f * (latMin + latMax), latStep, lonStep);
 		
 		FPMColor accum = kFPMColorClear;
 		float totalWeight = 0.0f;
 		float lat = latMin, lon;
 		float weight, yw;
-		unsigned sx, sy;
+		unsigned sx, sy, si;
 		
+		si = 0;
 		for (sy = 0; sy < sampleGridSize; sy++)
 		{
 			lon = lonMin;
+			for (sx = 0; sx < sampleGridSize; sx++)
+			{
+				coords[si++] = CoordsWithFootprint(MakeCoordsLatLongRad(lat, lon), footprint);
+				lon += lonStep;
+			}
+			lat += latStep;
+		}
+		
+		if (adaptive)
+		{
+			if (SampleAdaptiveProbe(source, batchSource, sourceContext, coords, weights, sampleGridSize, flags, adaptiveThreshold, samples, pixel))
+			{
+				pixel++;
+				continue;
+			}
+			refinedCount++;
+		}
+		
+		if (context->mapRecorder != NULL)  ResamplingMapRecordPixel(context->mapRecorder, x, y, coords, weights, sampleGridSize);
+		if (!adaptive)  SampleSourceBatch(source, batchSource, sourceContext, coords, samples, sampleCount, flags);
+		
+		si = 0;
+		for (sy = 0; sy < sampleGridSize; sy++)
+		{
 			yw = weights[sy];
 			for (sx = 0; sx < sampleGridSize; sx++)
 			{
-				FPMColor sample = source(MakeCoordsLatLongRad(lat, lon), flags, sourceContext);
 				weight = yw * weights[sx];
 				
-				accum = FPMColorAdd(FPMColorMultiply(sample, weight), accum);
+				accum = FPMColorAdd(FPMColorMultiply(samples[si++], weight), accum);
 				totalWeight += weight;
-				
-				lon += lonStep;
 			}
-			lat += latStep;
 		}
 		
 		*pixel++ = FPMColorMultiply(accum, 1.0f / totalWeight);
 	}
 	
+	RenderStatisticsAdd(context->statistics, size, refinedCount);
 	return true;
 }
@@ -0,0 +1,625 @@
+/*
+	ResamplingMap.c
+	planettool
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+	
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+	
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include "ResamplingMap.h"
+#include "FPMPixelFormat.h"
+#include "PlanetToolScheduler.h"
+#include "MatrixTransformer.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#define RESAMPLING_MAP_USE_MMAP		1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#define RESAMPLING_MAP_USE_MMAP		0
+#endif
+
+
+enum
+{
+	kMapVersion					= 1,
+	kMapByteOrderMark			= 0x01020304,
+	kMapKeyAlignment			= 8,		// Keeps the offsets that follow the key aligned.
+	kMapWeightScale				= 65535		// Stored weights are fractions of this.
+};
+
+static const char kMapMagic[8] = { 'P', 'T', 'R', 'S', 'M', 'A', 'P', '\n' };
+
+
+/*	File layout: a MapHeader, the key (NUL-terminated and padded to
+	keySize bytes), then width * height + 1 uint64_t offsets, so that the taps
+	of pixel i are [offsets[i], offsets[i + 1]), then tapCount uint32_t
+	source pixel indices (y * sourceWidth + x), then tapCount uint16_t
+	weights. Each pixel's weights add up to about kMapWeightScale.
+*/
+typedef struct
+{
+	char						magic[8];
+	uint32_t					byteOrderMark;
+	uint32_t					version;
+	uint32_t					headerSize;		// sizeof (MapHeader), the offset of the key.
+	uint32_t					keySize;		// Multiple of kMapKeyAlignment.
+	uint32_t					sourceWidth;
+	uint32_t					sourceHeight;
+	uint32_t					width;
+	uint32_t					height;
+	uint64_t					tapCount;
+	uint32_t					reserved[4];
+} MapHeader;
+
+
+//	The taps of one pixel while recording: count indices, followed by count weights.
+typedef struct
+{
+	uint32_t					count;
+	uint32_t					indices[];
+} PixelTaps;
+
+FPM_INLINE uint16_t *PixelTapsWeights(PixelTaps *taps)
+{
+	return (uint16_t *)(taps->indices + taps->count);
+}
+
+
+//	Pixels which were never recorded, like the unused parts of a cube cross, get no taps and are left clear.
+FPM_INLINE size_t PixelTapCount(const PixelTaps *taps)
+{
+	return (taps != NULL) ? taps->count : 0;
+}
+
+
+struct ResamplingMapRecorder
+{
+	SphericalPixelSourceTapsFunction	getTaps;
+	void						*sourceContext;
+	FPMSize						sourceSize;
+	OOMatrix					transform;
+	bool						transformed;
+	bool						failed;			// Set if memory ran out while recording; accessed atomically.
+	FPMSize						size;
+	PixelTaps					**pixels;		// size.width * size.height, row by row.
+};
+
+
+struct ResamplingMap
+{
+	void						*base;
+	size_t						length;
+	const MapHeader				*header;
+	const char					*key;
+	const uint64_t				*offsets;
+	const uint32_t				*indices;
+	const uint16_t				*weights;
+};
+
+
+static const char *ValidateHeader(const MapHeader *header, size_t fileSize);
+static size_t MapDataSize(const MapHeader *header);
+
+
+ResamplingMapRecorderRef ResamplingMapRecorderCreate(SphericalPixelSourceTapsFunction getTaps, void *sourceContext, FPMSize sourceSize, const OOMatrix *transform)
+{
+	assert(getTaps != NULL);
+	if ((uint64_t)sourceSize.width * sourceSize.height > UINT32_MAX)  return NULL;
+	
+	ResamplingMapRecorderRef recorder = calloc(1, sizeof *recorder);
+	if (recorder == NULL)  return NULL;
+	
+	recorder->getTaps = getTaps;
+	recorder->sourceContext = sourceContext;
+	recorder->sourceSize = sourceSize;
+	if (transform != NULL)
+	{
+		recorder->transform = *transform;
+		recorder->transformed = true;
+	}
+	
+	return recorder;
+}
+
+
+static void FreePixels(ResamplingMapRecorderRef recorder)
+{
+	if (recorder->pixels == NULL)  return;
+	
+	size_t i, count = (size_t)recorder->size.width * recorder->size.height;
+	for (i = 0; i < count; i++)  free(recorder->pixels[i]);
+	free(recorder->pixels);
+	recorder->pixels = NULL;
+}
+
+
+void ResamplingMapRecorderDestroy(ResamplingMapRecorderRef *recorder)
+{
+	if (recorder == NULL || *recorder == NULL)  return;
+	
+	FreePixels(*recorder);
+	free(*recorder);
+	*recorder = NULL;
+}
+
+
+bool ResamplingMapRecorderBegin(ResamplingMapRecorderRef recorder, FPMSize size)
+{
+	assert(recorder != NULL);
+	
+	FreePixels(recorder);
+	recorder->size = size;
+	recorder->failed = false;
+	recorder->pixels = calloc((size_t)size.width * size.height, sizeof *recorder->pixels);
+	return recorder->pixels != NULL;
+}
+
+
+void ResamplingMapRecordPixel(ResamplingMapRecorderRef recorder, FPMCoordinate x, FPMCoordinate y, const Coordinates *coords, const float *weights, unsigned sampleGridSize)
+{
+	assert(recorder != NULL && recorder->pixels != NULL && coords != NULL && weights != NULL);
+	assert(0 <= x && x < (FPMCoordinate)recorder->size.width && 0 <= y && y < (FPMCoordinate)recorder->size.height);
+	
+	/*	Neighbouring samples mostly share source pixels, so taps are merged
+		through a small hash table keyed by source pixel index. Merged taps
+		stay in the order they were first seen, which follows the sample grid.
+	*/
+	unsigned sampleCount = sampleGridSize * sampleGridSize;
+	unsigned maxTaps = sampleCount * 4;
+	assert(sampleCount <= kMaxSourceBatchSize);
+	unsigned hashBits = 1;
+	while ((1u << hashBits) < maxTaps * 2)  hashBits++;
+	unsigned hashSize = 1u << hashBits;
+	int32_t slots[hashSize];
+	memset(slots, 0xFF, sizeof slots);
+	
+	uint32_t indices[maxTaps];
+	float tapWeights[maxTaps];
+	unsigned count = 0;
+	float totalWeight = 0.0f;
+	size_t sourceWidth = recorder->sourceSize.width;
+	
+	// The sink samples all of a pixel's coordinates in one batch, so they're transformed and looked up in one too.
+	Coordinates transformed[sampleCount];
+	if (recorder->transformed)
+	{
+		MatrixTransformCoordsBatch(coords, transformed, sampleCount, recorder->transform);
+		coords = transformed;
+	}
+	FPMLinearTaps sampleTaps[sampleCount];
+	recorder->getTaps(coords, sampleTaps, sampleCount, recorder->sourceContext);
+	
+	unsigned sx, sy, si = 0, i;
+	for (sy = 0; sy < sampleGridSize; sy++)
+	{
+		for (sx = 0; sx < sampleGridSize; sx++)
+		{
+			float weight = weights[sy] * weights[sx];
+			totalWeight += weight;
+	
+			const FPMLinearTaps *taps = &sampleTaps[si++];
+			for (i = 0; i < 4; i++)
+			{
+				if (!(taps->weight[i] > 0.0f))  continue;		// Also skips taps of non-finite positions.
+	
+				uint32_t index = (uint32_t)(taps->y[i] * sourceWidth + taps->x[i]);
+				// The high bits of a multiplicative hash, since taps in one column differ only in multiples of the width.
+				unsigned slot = (uint32_t)(index * 2654435761u) >> (32 - hashBits);
+				while (slots[slot] >= 0 && indices[slots[slot]] != index)  slot = (slot + 1) & (hashSize - 1);
+	
+				if (slots[slot] < 0)
+				{
+					slots[slot] = count;
+					indices[count] = index;
+					tapWeights[count] = 0.0f;
+					count++;
+				}
+				tapWeights[slots[slot]] += weight * taps->weight[i];
+			}
+		}
+	}
+	
+	// Quantize the weights, dropping any that round to zero.
+	uint16_t quantized[maxTaps];
+	unsigned kept = 0;
+	float scale = (float)kMapWeightScale / totalWeight;
+	for (i = 0; i < count; i++)
+	{
+		long weight = lrintf(tapWeights[i] * scale);
+		if (weight <= 0)  continue;
+	
+		indices[kept] = indices[i];
+		quantized[kept] = (weight < kMapWeightScale) ? weight : kMapWeightScale;
+		kept++;
+	}
+	
+	PixelTaps *pixel = malloc(sizeof *pixel + kept * (sizeof *indices + sizeof *quantized));
+	if (pixel == NULL)
+	{
+		__atomic_store_n(&recorder->failed, true, __ATOMIC_RELAXED);
+		return;
+	}
+	pixel->count = kept;
+	memcpy(pixel->indices, indices, kept * sizeof *indices);
+	memcpy(PixelTapsWeights(pixel), quantized, kept * sizeof *quantized);
+	
+	// Each pixel is recorded by one thread, so no locking is needed.
+	size_t pixelIndex = (size_t)y * recorder->size.width + x;
+	free(recorder->pixels[pixelIndex]);
+	recorder->pixels[pixelIndex] = pixel;
+}
+
+
+bool ResamplingMapRecorderWrite(ResamplingMapRecorderRef recorder, const char *path, const char *key, ErrorCallbackFunction error, void *cbContext)
+{
+	assert(recorder != NULL && path != NULL);
+	if (key == NULL)  key = "";
+	
+	if (recorder->pixels == NULL || __atomic_load_n(&recorder->failed, __ATOMIC_RELAXED))
+	{
+		CallErrorCallbackWithFormat(error, cbContext, "Not enough memory to record a resampling map.\n");
+		return false;
+	}
+	
+	size_t i, pixelCount = (size_t)recorder->size.width * recorder->size.height;
+	uint64_t tapCount = 0;
+	for (i = 0; i < pixelCount; i++)
+	{
+		tapCount += PixelTapCount(recorder->pixels[i]);
+	}
+	
+	size_t keyLength = strlen(key) + 1;
+	MapHeader header =
+	{
+		.byteOrderMark = kMapByteOrderMark,
+		.version = kMapVersion,
+		.headerSize = sizeof header,
+		.keySize = (keyLength + kMapKeyAlignment - 1) / kMapKeyAlignment * kMapKeyAlignment,
+		.sourceWidth = recorder->sourceSize.width,
+		.sourceHeight = recorder->sourceSize.height,
+		.width = recorder->size.width,
+		.height = recorder->size.height,
+		.tapCount = tapCount
+	};
+	memcpy(header.magic, kMapMagic, sizeof header.magic);
+	
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		CallErrorCallbackWithFormat(error, cbContext, "Could not create resampling map %s.\n", path);
+		return false;
+	}
+	
+	static const char padding[kMapKeyAlignment] = { 0 };
+	bool OK = fwrite(&header, sizeof header, 1, file) == 1;
+	OK = OK && fwrite(key, 1, keyLength, file) == keyLength;
+	OK = OK && fwrite(padding, 1, header.keySize - keyLength, file) == header.keySize - keyLength;
+	
+	uint64_t offset = 0;
+	for (i = 0; i < pixelCount && OK; i++)
+	{
+		OK = fwrite(&offset, sizeof offset, 1, file) == 1;
+		offset += PixelTapCount(recorder->pixels[i]);
+	}
+	OK = OK && fwrite(&offset, sizeof offset, 1, file) == 1;
+	
+	for (i = 0; i < pixelCount && OK; i++)
+	{
+		PixelTaps *pixel = recorder->pixels[i];
+		if (pixel != NULL)  OK = fwrite(pixel->indices, sizeof *pixel->indices, pixel->count, file) == pixel->count;
+	}
+	for (i = 0; i < pixelCount && OK; i++)
+	{
+		PixelTaps *pixel = recorder->pixels[i];
+		if (pixel != NULL)  OK = fwrite(PixelTapsWeights(pixel), sizeof (uint16_t), pixel->count, file) == pixel->count;
+	}
+	
+	OK = (fclose(file) == 0) && OK;
+	if (!OK)
+	{
+		CallErrorCallbackWithFormat(error, cbContext, "Could not write resampling map %s.\n", path);
+		remove(path);
+	}
+	return OK;
+}
+
+
+ResamplingMapRef ResamplingMapOpen(const char *path, ErrorCallbackFunction error, void *cbContext)
+{
+	assert(path != NULL);
+	
+	const char *problem = NULL;
+	ResamplingMapRef map = calloc(1, sizeof *map);
+	if (map == NULL)
+	{
+		problem = "out of memory.";
+		goto FAIL;
+	}
+	
+#if RESAMPLING_MAP_USE_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		problem = "file not found.";
+		goto FAIL;
+	}
+	
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size <= 0 || (uintmax_t)info.st_size > SIZE_MAX)
+	{
+		problem = "could not read file.";
+		close(fd);
+		goto FAIL;
+	}
+	map->length = info.st_size;
+	
+	// Maps are only read, so the pages are shared by every process using the same map.
+	map->base = mmap(NULL, map->length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map->base == MAP_FAILED)
+	{
+		map->base = NULL;
+		problem = "could not map file.";
+		goto FAIL;
+	}
+#else
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		problem = "file not found.";
+		goto FAIL;
+	}
+	
+	long length = -1;
+	if (fseek(file, 0, SEEK_END) == 0)  length = ftell(file);
+	if (length > 0 && fseek(file, 0, SEEK_SET) == 0)
+	{
+		map->length = length;
+		map->base = malloc(map->length);
+	}
+	if (map->base == NULL || fread(map->base, map->length, 1, file) != 1)
+	{
+		problem = "could not read file.";
+		fclose(file);
+		goto FAIL;
+	}
+	fclose(file);
+#endif
+	
+	if (map->length < sizeof (MapHeader))
+	{
+		problem = "not a resampling map.";
+		goto FAIL;
+	}
+	map->header = map->base;
+	problem = ValidateHeader(map->header, map->length);
+	if (problem != NULL)  goto FAIL;
+	
+	const MapHeader *header = map->header;
+	size_t pixelCount = (size_t)header->width * header->height;
+	map->key = (const char *)map->base + header->headerSize;
+	map->offsets = (const uint64_t *)(map->key + header->keySize);
+	map->indices = (const uint32_t *)(map->offsets + pixelCount + 1);
+	map->weights = (const uint16_t *)(map->indices + header->tapCount);
+	
+	// Offsets are checked here so rendering can't read past the taps; indices are checked as they're used.
+	size_t i;
+	for (i = 0; i < pixelCount; i++)
+	{
+		if (map->offsets[i] > map->offsets[i + 1])  break;
+	}
+	if (i != pixelCount || map->offsets[0] != 0 || map->offsets[pixelCount] != header->tapCount)
+	{
+		problem = "invalid tap offsets.";
+		goto FAIL;
+	}
+	
+	return map;
+	
+FAIL:
+	CallErrorCallbackWithFormat(error, cbContext, "Could not read resampling map %s: %s\n", path, problem);
+	ResamplingMapClose(&map);
+	return NULL;
+}
+
+
+void ResamplingMapClose(ResamplingMapRef *map)
+{
+	if (map == NULL || *map == NULL)  return;
+	
+#if RESAMPLING_MAP_USE_MMAP
+	if ((*map)->base != NULL)  munmap((*map)->base, (*map)->length);
+#else
+	free((*map)->base);
+#endif
+	free(*map);
+	*map = NULL;
+}
+
+
+static const char *ValidateHeader(const MapHeader *header, size_t fileSize)
+{
+	assert(header != NULL && fileSize >= sizeof *header);
+	
+	if (memcmp(header->magic, kMapMagic, sizeof header->magic) != 0)  return "not a resampling map.";
+	if (header->byteOrderMark != kMapByteOrderMark)  return "file was written on a machine with a different byte order.";
+	if (header->version != kMapVersion || header->headerSize != sizeof *header)  return "unsupported resampling map version.";
+	
+	if (header->sourceWidth == 0 ||
+		header->sourceHeight == 0 ||
+		header->width == 0 ||
+		header->height == 0 ||
+		header->keySize == 0 ||
+		header->keySize % kMapKeyAlignment != 0 ||
+		header->tapCount > SIZE_MAX / 8)
+	{
+		return "invalid header.";
+	}
+	
+	if (fileSize - sizeof *header < header->keySize)  return "file is truncated.";
+	const char *key = (const char *)header + header->headerSize;
+	if (key[header->keySize - 1] != '\0')  return "invalid header.";
+	
+	size_t dataSize = MapDataSize(header);
+	if (dataSize == 0 || fileSize - sizeof *header - header->keySize != dataSize)  return "file is truncated.";
+	
+	return NULL;
+}
+
+
+//	Size of the offsets, indices and weights of a map, or 0 if that would overflow.
+static size_t MapDataSize(const MapHeader *header)
+{
+	uint64_t pixelCount = (uint64_t)header->width * header->height;
+	if (pixelCount >= SIZE_MAX / sizeof (uint64_t) - 1)  return 0;
+	
+	size_t offsetsSize = (pixelCount + 1) * sizeof (uint64_t);
+	size_t tapsSize = header->tapCount * (sizeof (uint32_t) + sizeof (uint16_t));
+	if (tapsSize > SIZE_MAX - offsetsSize)  return 0;
+	
+	return offsetsSize + tapsSize;
+}
+
+
+const char *ResamplingMapGetKey(ResamplingMapRef map)
+{
+	assert(map != NULL);
+	return map->key;
+}
+
+
+FPMSize ResamplingMapGetSourceSize(ResamplingMapRef map)
+{
+	assert(map != NULL);
+	return FPMMakeSize(map->header->sourceWidth, map->header->sourceHeight);
+}
+
+
+FPMSize ResamplingMapGetSize(ResamplingMapRef map)
+{
+	assert(map != NULL);
+	return FPMMakeSize(map->header->width, map->header->height);
+}
+
+
+typedef struct
+{
+	ResamplingMapRef			map;
+	FPMStorageInfo				source;
+	FloatPixMapRef				pm;				// Current band.
+	FPMCoordinate				firstRow;		// Row of the output at the top of pm.
+} RenderMapContext;
+
+
+static bool RenderMapBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontext);
+static bool RenderMapLine(size_t lineIndex, size_t lineCount, void *vcontext);
+
+
+FloatPixMapRef ResamplingMapRender(ResamplingMapRef map, FloatPixMapRef source, const RenderOptions *options, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext)
+{
+	assert(map != NULL && source != NULL);
+	
+	FPMSize sourceSize = FPMGetSize(source);
+	FPMSize expectedSize = ResamplingMapGetSourceSize(map);
+	if (sourceSize.width != expectedSize.width || sourceSize.height != expectedSize.height)
+	{
+		CallErrorCallbackWithFormat(error, cbContext, "The input image is %llu by %llu pixels, but the resampling map is for %llu by %llu pixel images.\n", (unsigned long long)sourceSize.width, (unsigned long long)sourceSize.height, (unsigned long long)expectedSize.width, (unsigned long long)expectedSize.height);
+		return NULL;
+	}
+	
+	RenderMapContext context = { .map = map };
+	FPMGetStorageInformation(source, &context.source);
+	
+	FPMSize size = ResamplingMapGetSize(map);
+	return RenderInBands(size.height, size.width, size.height, options, RenderMapBand, &context, progress, error, cbContext);
+}
+
+
+static bool RenderMapBand(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *vcontext)
+{
+	RenderMapContext *context = vcontext;
+	context->pm = band;
+	context->firstRow = firstRow;
+	
+	return ScheduleRender(RenderMapLine, context, FPMGetHeight(band), 0, 1, progress, progressContext);
+}
+
+
+/*	Each pixel is the weighted sum of its taps, divided by the sum of the
+	weights, which differs slightly from kMapWeightScale after quantization.
+*/
+FPM_INLINE void GatherLine(const RenderMapContext *context, FPMPixelFormat format, size_t lineIndex)
+{
+	ResamplingMapRef map = context->map;
+	const FPMStorageInfo *source = &context->source;
+	size_t sourceWidth = source->width;
+	size_t sourcePixels = sourceWidth * source->height;
+	const uint32_t *indices = map->indices;
+	const uint16_t *weights = map->weights;
+	
+	size_t x, width = map->header->width;
+	const uint64_t *offsets = map->offsets + (context->firstRow + lineIndex) * width;
+	FPMColor *pixel = FPMGetPixelPointerC(context->pm, 0, lineIndex);
+	
+	for (x = 0; x < width; x++)
+	{
+		FPMColor accum = kFPMColorClear;
+		uint32_t totalWeight = 0;
+		uint64_t t, end = offsets[x + 1];
+	
+		for (t = offsets[x]; t < end; t++)
+		{
+			uint32_t index = indices[t];
+			if (index >= sourcePixels)  continue;
+	
+			FPMColor color = FPMDecodePixel(source, format, index % sourceWidth, index / sourceWidth);
+			accum = FPMColorAdd(FPMColorMultiply(color, weights[t]), accum);
+			totalWeight += weights[t];
+		}
+	
+		*pixel++ = (totalWeight != 0) ? FPMColorMultiply(accum, 1.0f / (float)totalWeight) : kFPMColorClear;
+	}
+}
+
+
+static bool RenderMapLine(size_t lineIndex, size_t lineCount, void *vcontext)
+{
+	const RenderMapContext *context = vcontext;
+	
+	// Switching on a constant here gets GatherLine() specialised for each format.
+	switch (context->source.format)
+	{
+		case kFPMFormatRGBAFloat:	GatherLine(context, kFPMFormatRGBAFloat, lineIndex);  break;
+		case kFPMFormatRGBA8:		GatherLine(context, kFPMFormatRGBA8, lineIndex);  break;
+		case kFPMFormatRGBA16:		GatherLine(context, kFPMFormatRGBA16, lineIndex);  break;
+		case kFPMFormatRGBAHalf:	GatherLine(context, kFPMFormatRGBAHalf, lineIndex);  break;
+	}
+	
+	return true;
+}
@@ -0,0 +1,113 @@
+/*
+	ResamplingMap.h
+	planettool
+	
+	Precomputed resampling maps, for repeating a conversion with the same
+	geometry over many images.
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+	
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+	
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef INCLUDED_ResamplingMap_h
+#define INCLUDED_ResamplingMap_h
+
+#include "SphericalPixelSource.h"
+#include "FPMImageOperations.h"
+
+FPM_BEGIN_EXTERN_C
+
+
+/*	A resampling map records, for each pixel of an output, the pixels of the
+	source image it is made from and their weights. Each output pixel is a
+	weighted sum of source pixels; sink filtering, coordinate conversions,
+	rotation and bilinear interpolation together only decide which pixels
+	and weights. So once a map has been recorded, any image of the same size
+	can be converted with the same geometry by gathering, with no
+	trigonometry.
+	
+	Maps are written to files with ResamplingMapRecorderWrite(), and read
+	by ResamplingMapOpen(), which maps them into memory. Tap weights are
+	stored as 16-bit fractions of each pixel's total, and taps whose weight
+	rounds to zero are dropped; the results match normal rendering to
+	within about 1/65536.
+*/
+typedef struct ResamplingMap *ResamplingMapRef;
+typedef struct ResamplingMapRecorder *ResamplingMapRecorderRef;
+
+
+/*	Function which finds the source pixels an image source blends to sample
+	at each of count coordinates, used to record maps. It must find them
+	exactly as the source's batch function would. Sources whose samples
+	aren't a bilinear blend of one image don't have one.
+*/
+typedef void (*SphericalPixelSourceTapsFunction)(const Coordinates *where, FPMLinearTaps *taps, size_t count, void *context);
+
+
+/*	ResamplingMapRecorderCreate()
+	Create a recorder for a source image of size sourceSize, sampled by
+	getTaps with sourceContext. If transform is not NULL, coordinates are
+	transformed by it first, as by MatrixTransformer. The recorder is passed
+	to a sink through RenderOptions.mapRecorder.
+	
+	ResamplingMapRecordPixel() is called by sinks for each output pixel,
+	with its sample coordinates and the Gauss table of sampleGridSize weights
+	used for both axes of the sample grid. Pixels may be recorded in any
+	order, in parallel.
+*/
+ResamplingMapRecorderRef ResamplingMapRecorderCreate(SphericalPixelSourceTapsFunction getTaps, void *sourceContext, FPMSize sourceSize, const OOMatrix *transform);
+void ResamplingMapRecorderDestroy(ResamplingMapRecorderRef *recorder);
+
+//	Called by RenderInBands() with the size of the output, before rendering.
+bool ResamplingMapRecorderBegin(ResamplingMapRecorderRef recorder, FPMSize size);
+
+void ResamplingMapRecordPixel(ResamplingMapRecorderRef recorder, FPMCoordinate x, FPMCoordinate y, const Coordinates *coords, const float *weights, unsigned sampleGridSize);
+
+/*	ResamplingMapRecorderWrite()
+	Write the recorded map to path, once the output has been rendered. Any
+	pixels the sink didn't render are left clear by the map. key is stored in the file, and should describe everything the
+	map depends on beyond the source and output sizes, so that users of the
+	map can check it matches what they want.
+*/
+bool ResamplingMapRecorderWrite(ResamplingMapRecorderRef recorder, const char *path, const char *key, ErrorCallbackFunction error, void *cbContext);
+
+
+/*	ResamplingMapOpen()
+	Map a file written by ResamplingMapRecorderWrite() into memory.
+	Returns NULL on failure.
+*/
+ResamplingMapRef ResamplingMapOpen(const char *path, ErrorCallbackFunction error, void *cbContext);
+void ResamplingMapClose(ResamplingMapRef *map);
+
+const char *ResamplingMapGetKey(ResamplingMapRef map);
+FPMSize ResamplingMapGetSourceSize(ResamplingMapRef map);
+FPMSize ResamplingMapGetSize(ResamplingMapRef map);
+
+/*	ResamplingMapRender()
+	Render the output a map was recorded from, with source as the source
+	image. Works like a sink (see SphericalPixelSinkFunction), including
+	streaming with RenderOptions.rowOutput.
+*/
+FloatPixMapRef ResamplingMapRender(ResamplingMapRef map, FloatPixMapRef source, const RenderOptions *options, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+
+
+FPM_END_EXTERN_C
+#endif	/* INCLUDED_ResamplingMap_h */
@@ -28,15 +28,13 @@
 
 
 #include "PlanetToolScheduler.h"
+#include "TileOrder.h"
 
 
-static bool ScheduleRender(RenderCallback renderCB, void *renderContext, size_t lineCount, size_t subRenderIndex, size_t subRenderCount, ProgressCallbackFunction progressCB, void *cbContext)
+static bool RunJob(RenderCallback renderCB, void *renderContext, size_t lineCount, size_t progressNumerator, size_t progressDenominator, ProgressCallbackFunction progressCB, void *cbContext)
 {
 	if (renderCB == NULL)  return false;
 	
-	size_t progressNumerator = subRenderIndex * lineCount;
-	size_t progressDenominator = subRenderCount * lineCount;
-	
 	size_t i;
 	for (i = 0; i < lineCount; i++)
 	{
@@ -50,3 +48,105 @@ static bool ScheduleRender(RenderCallback renderCB, void *renderContext, size_t
 	
 	return true;
 }
+
+
+bool ScheduleRender(RenderCallback renderCB, void *renderContext, size_t lineCount, size_t subRenderIndex, size_t subRenderCount, ProgressCallbackFunction progressCB, void *cbContext)
+{
+	return RunJob(renderCB, renderContext, lineCount, subRenderIndex * lineCount, subRenderCount * lineCount, progressCB, cbContext);
+}
+
+
+static bool RunTiledJob(const RenderJob *job, size_t progressNumerator, size_t progressDenominator, ProgressCallbackFunction progressCB, void *cbContext)
+{
+	size_t i, tileCount = RenderJobItemCount(job);
+	uint32_t *order = malloc(tileCount * sizeof *order);
+	if (order == NULL)  return false;
+	BuildHilbertTileOrder(RenderJobTilesAcross(job), RenderJobTilesDown(job), order);
+	
+	bool OK = true;
+	for (i = 0; i < tileCount && OK; i++)
+	{
+		OK = job->renderTileCB(RenderJobTileRect(job, order[i]), job->renderContext);
+		
+		if (OK && progressCB != NULL)
+		{
+			OK = progressCB(++progressNumerator, progressDenominator, cbContext);
+		}
+	}
+	
+	free(order);
+	return OK;
+}
+
+
+bool ScheduleRenderJobs(const RenderJob *jobs, size_t jobCount, ProgressCallbackFunction progressCB, void *cbContext)
+{
+	size_t i, totalItems = 0, itemsDone = 0;
+	for (i = 0; i < jobCount; i++)  totalItems += RenderJobItemCount(&jobs[i]);
+	
+	for (i = 0; i < jobCount; i++)
+	{
+		bool OK;
+		if (jobs[i].renderTileCB != NULL)  OK = RunTiledJob(&jobs[i], itemsDone, totalItems, progressCB, cbContext);
+		else  OK = RunJob(jobs[i].renderCB, jobs[i].renderContext, jobs[i].lineCount, itemsDone, totalItems, progressCB, cbContext);
+		
+		if (!OK)  return false;
+		itemsDone += RenderJobItemCount(&jobs[i]);
+	}
+	
+	return true;
+}
+
+
+bool ScheduleSideWork(RenderCallback workCB, void *workContext, size_t count)
+{
+	return RunJob(workCB, workContext, count, 0, 0, NULL, NULL);
+}
+
+
+bool SchedulePipeline(SchedulerStageFunction produceCB, SchedulerStageFunction consumeCB, void *context, size_t count, size_t slots)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		if (!produceCB(i, context) || !consumeCB(i, context))  return false;
+	}
+	
+	return true;
+}
+
+
+bool ScheduleConcurrentTasks(SchedulerTaskFunction task, void * const *contexts, size_t count)
+{
+	bool OK = true;
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		if (!task(contexts[i]))  OK = false;
+	}
+	
+	return OK;
+}
+
+
+bool SchedulerInit(void)
+{
+	return true;
+}
+
+
+void SchedulerSetThreadCount(unsigned count)
+{
+	// Always one thread.
+}
+
+
+void SchedulerSetThreadPinning(bool pin)
+{
+}
+
+
+void SchedulerSetProgressInterval(unsigned milliseconds)
+{
+	// Progress is reported after every line.
+}
@@ -0,0 +1,243 @@
+/*
+	SourceDiskCache.c
+	planettool
+	
+	
+	Copyright © 2013 Jens Ayton
+
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include "SourceDiskCache.h"
+#include "FPMNative.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+
+enum
+{
+	kHashBufferSize				= 1 << 20
+};
+
+static const char kEntrySuffix[] = ".fpmcache";
+
+
+typedef struct
+{
+	char						*name;
+	time_t						lastUse;
+	uintmax_t					size;
+} CacheEntry;
+
+
+static char *MakePath(const char *directory, const char *name, const char *suffix);
+static const char *FormatName(FPMPixelFormat format);
+static void Evict(const char *directory, const char *keepName, uintmax_t maxBytes, SourceDiskCacheStoreResult *result);
+static int CompareEntries(const void *a, const void *b);
+
+
+bool SourceDiskCacheMakeKey(const char *sourcePath, FPMPixelFormat format, FPMGammaFactor gamma, SourceDiskCacheKey *key)
+{
+	assert(sourcePath != NULL && key != NULL);
+	
+	FILE *file = fopen(sourcePath, "rb");
+	if (file == NULL)  return false;
+	
+	uint8_t *buffer = malloc(kHashBufferSize);
+	if (buffer == NULL)
+	{
+		fclose(file);
+		return false;
+	}
+	
+	// 64-bit FNV-1a.
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	size_t i, count;
+	while ((count = fread(buffer, 1, kHashBufferSize, file)) > 0)
+	{
+		for (i = 0; i < count; i++)
+		{
+			hash ^= buffer[i];
+			hash *= 0x100000001B3ULL;
+		}
+	}
+	
+	bool OK = !ferror(file);
+	fclose(file);
+	free(buffer);
+	if (!OK)  return false;
+	
+	float gammaValue = gamma;
+	uint32_t gammaBits;
+	memcpy(&gammaBits, &gammaValue, sizeof gammaBits);
+	
+	snprintf(key->name, sizeof key->name, "%016" PRIx64 "-%s-%08" PRIx32 "%s", hash, FormatName(format), gammaBits, kEntrySuffix);
+	return true;
+}
+
+
+FloatPixMapRef SourceDiskCacheLookUp(const char *directory, const SourceDiskCacheKey *key)
+{
+	assert(directory != NULL && key != NULL);
+	
+	char *path = MakePath(directory, key->name, "");
+	if (path == NULL)  return NULL;
+	
+	FloatPixMapRef result = NULL;
+	if (FPMIsNativeFile(path))
+	{
+		result = FPMCreateWithNative(path, kFPMNativeVerifyChecksum, NULL, NULL);
+		
+		// Update the modification date, which is used as the time of last use for eviction.
+		if (result != NULL)  utime(path, NULL);
+		else  remove(path);
+	}
+	
+	free(path);
+	return result;
+}
+
+
+bool SourceDiskCacheStore(const char *directory, uintmax_t maxBytes, const SourceDiskCacheKey *key, FloatPixMapRef pm, SourceDiskCacheStoreResult *result)
+{
+	assert(directory != NULL && key != NULL && pm != NULL && result != NULL);
+	
+	memset(result, 0, sizeof *result);
+	
+	// Temporary names are unique to the process and the call, since batch jobs may store concurrently.
+	static unsigned sStoreCount;
+	char tempSuffix[48];
+	snprintf(tempSuffix, sizeof tempSuffix, ".%ld-%u.tmp", (long)getpid(), __atomic_fetch_add(&sStoreCount, 1, __ATOMIC_RELAXED));
+	char *path = MakePath(directory, key->name, "");
+	char *tempPath = MakePath(directory, key->name, tempSuffix);
+	
+	mkdir(directory, 0777);
+	
+	bool OK = path != NULL && tempPath != NULL && FPMWriteNative(pm, tempPath, NULL, NULL);
+	if (OK)  OK = rename(tempPath, path) == 0;
+	if (!OK && tempPath != NULL)  remove(tempPath);
+	
+	free(path);
+	free(tempPath);
+	
+	if (OK)  Evict(directory, key->name, maxBytes, result);
+	return OK;
+}
+
+
+static void Evict(const char *directory, const char *keepName, uintmax_t maxBytes, SourceDiskCacheStoreResult *result)
+{
+	DIR *dir = opendir(directory);
+	if (dir == NULL)  return;
+	
+	CacheEntry *entries = NULL;
+	size_t count = 0, capacity = 0;
+	uintmax_t total = 0;
+	size_t suffixLength = strlen(kEntrySuffix);
+	
+	struct dirent *dirEntry;
+	while ((dirEntry = readdir(dir)) != NULL)
+	{
+		size_t length = strlen(dirEntry->d_name);
+		if (length <= suffixLength || strcmp(dirEntry->d_name + length - suffixLength, kEntrySuffix) != 0)  continue;
+		
+		char *path = MakePath(directory, dirEntry->d_name, "");
+		struct stat info;
+		bool found = path != NULL && stat(path, &info) == 0;
+		free(path);
+		if (!found)  continue;
+		
+		if (count == capacity)
+		{
+			size_t newCapacity = capacity ? capacity * 2 : 16;
+			CacheEntry *newEntries = realloc(entries, newCapacity * sizeof *entries);
+			if (newEntries == NULL)  break;
+			entries = newEntries;
+			capacity = newCapacity;
+		}
+		
+		entries[count].name = strdup(dirEntry->d_name);
+		if (entries[count].name == NULL)  break;
+		entries[count].lastUse = info.st_mtime;
+		entries[count].size = info.st_size;
+		total += info.st_size;
+		count++;
+	}
+	closedir(dir);
+	
+	// Oldest first.
+	qsort(entries, count, sizeof *entries, CompareEntries);
+	
+	size_t i;
+	for (i = 0; i < count && total > maxBytes; i++)
+	{
+		if (strcmp(entries[i].name, keepName) == 0)  continue;
+		
+		char *path = MakePath(directory, entries[i].name, "");
+		if (path != NULL && remove(path) == 0)
+		{
+			total -= entries[i].size;
+			result->evictedCount++;
+			result->evictedBytes += entries[i].size;
+		}
+		free(path);
+	}
+	result->totalBytes = total;
+	
+	for (i = 0; i < count; i++)  free(entries[i].name);
+	free(entries);
+}
+
+
+static int CompareEntries(const void *a, const void *b)
+{
+	const CacheEntry *entryA = a, *entryB = b;
+	if (entryA->lastUse < entryB->lastUse)  return -1;
+	if (entryA->lastUse > entryB->lastUse)  return 1;
+	return 0;
+}
+
+
+static char *MakePath(const char *directory, const char *name, const char *suffix)
+{
+	size_t length = strlen(directory) + 1 + strlen(name) + strlen(suffix) + 1;
+	char *result = malloc(length);
+	if (result != NULL)  snprintf(result, length, "%s/%s%s", directory, name, suffix);
+	return result;
+}
+
+
+static const char *FormatName(FPMPixelFormat format)
+{
+	switch (format)
+	{
+		case kFPMFormatRGBAFloat:	return "float";
+		case kFPMFormatRGBA8:		return "rgba8";
+		case kFPMFormatRGBA16:		return "rgba16";
+		case kFPMFormatRGBAHalf:	return "half";
+	}
+	return "unknown";
+}
@@ -0,0 +1,86 @@
+/*
+	SourceDiskCache.h
+	planettool
+	
+	On-disk cache of decoded source images, shared between runs.
+	
+	
+	Copyright © 2013 Jens Ayton
+
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef INCLUDED_SourceDiskCache_h
+#define INCLUDED_SourceDiskCache_h
+
+#include "FloatPixMap.h"
+#include "FPMGamma.h"
+
+FPM_BEGIN_EXTERN_C
+
+
+/*	The source disk cache keeps decoded source images in a directory as
+	FPMNative files, so that repeated runs on the same input can map them
+	instead of decoding the PNG again. Entries are named after a hash of
+	the source file's contents together with the gamma and storage format it
+	was decoded to, so a changed source file or different settings never
+	match a stale entry.
+	
+	The directory is kept within a size limit by deleting the least recently
+	used entries when a new one is stored; looking up an entry counts as a
+	use. Entries are written under temporary names and renamed into place,
+	so concurrent runs sharing a directory never see partial files.
+*/
+typedef struct
+{
+	char						name[64];	// File name within the cache directory.
+} SourceDiskCacheKey;
+
+
+typedef struct
+{
+	unsigned					evictedCount;
+	uintmax_t					evictedBytes;
+	uintmax_t					totalBytes;	// Size of all entries after storing and evicting.
+} SourceDiskCacheStoreResult;
+
+
+/*	SourceDiskCacheMakeKey()
+	Hash the contents of sourcePath to build a key. Returns false if the
+	file can't be read.
+*/
+bool SourceDiskCacheMakeKey(const char *sourcePath, FPMPixelFormat format, FPMGammaFactor gamma, SourceDiskCacheKey *key);
+
+
+/*	SourceDiskCacheLookUp()
+	Returns the cached image for key, or NULL if there is none (or it is
+	damaged, in which case it is deleted).
+*/
+FloatPixMapRef SourceDiskCacheLookUp(const char *directory, const SourceDiskCacheKey *key);
+
+
+/*	SourceDiskCacheStore()
+	Store pm under key, then evict least recently used entries other than
+	the new one until the directory holds at most maxBytes of entries.
+*/
+bool SourceDiskCacheStore(const char *directory, uintmax_t maxBytes, const SourceDiskCacheKey *key, FloatPixMapRef pm, SourceDiskCacheStoreResult *result);
+
+
+FPM_END_EXTERN_C
+#endif	/* INCLUDED_SourceDiskCache_h */
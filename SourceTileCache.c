@@ -0,0 +1,263 @@
+/*
+	SourceTileCache.c
+	planettool
+	
+	
+	Copyright © 2013 Jens Ayton
+
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include "SourceTileCache.h"
+#include "FPMPixelFormat.h"
+#include <assert.h>
+#include <string.h>
+
+
+enum
+{
+	kTileShift					= 5,
+	kTileSize					= 1 << kTileShift,
+	kTileMask					= kTileSize - 1,
+	kTileArea					= kTileSize * kTileSize,
+	
+	/*	Each thread caches a window of 16 x 16 tiles (512 x 512 pixels, 4 MiB)
+		in a direct-mapped table.
+	*/
+	kSlotShift					= 4,
+	kSlotMask					= (1 << kSlotShift) - 1,
+	kSlotCount					= 1 << (2 * kSlotShift)
+};
+
+
+struct SourceTileCache
+{
+	uintptr_t					retainCount;
+	uint32_t					identity;
+	FPMDimension				width;
+	FPMDimension				height;
+	size_t						tilesAcross;
+	FloatPixMapRef				pixMap;
+	FPMStorageInfo				storage;
+};
+
+
+typedef struct
+{
+	uint32_t					identity;	// Identity of the SourceTileCache the tiles belong to.
+	size_t						tags[kSlotCount];	// Tile index + 1, or 0 for empty slots.
+	FPMColor					tiles[kSlotCount][kTileArea];
+} ThreadTileCache;
+
+
+/*	Each rendering thread has its own tile cache, which is never freed since
+	the scheduler's threads live for the rest of the process.
+*/
+static __thread ThreadTileCache *sThreadCache;
+
+static uint32_t sNextIdentity = 1;
+
+
+static ThreadTileCache *GetThreadCache(SourceTileCacheRef cache);
+static void FillTile(SourceTileCacheRef cache, FPMColor *tile, size_t tileX, size_t tileY) FPM_FLATTEN;
+
+
+SourceTileCacheRef SourceTileCacheCreate(FloatPixMapRef pm)
+{
+	if (pm == NULL)  return NULL;
+	
+	SourceTileCacheRef cache = calloc(1, sizeof *cache);
+	if (cache == NULL)  return NULL;
+	
+	cache->retainCount = 1;
+	cache->identity = __atomic_fetch_add(&sNextIdentity, 1, __ATOMIC_RELAXED);
+	cache->width = FPMGetWidth(pm);
+	cache->height = FPMGetHeight(pm);
+	cache->tilesAcross = ((size_t)cache->width + kTileMask) >> kTileShift;
+	cache->pixMap = FPMRetain(pm);
+	FPMGetStorageInformation(pm, &cache->storage);
+	
+	return cache;
+}
+
+
+SourceTileCacheRef SourceTileCacheRetain(SourceTileCacheRef cache)
+{
+	if (cache != NULL)  cache->retainCount++;
+	return cache;
+}
+
+
+void SourceTileCacheRelease(SourceTileCacheRef *cache)
+{
+	if (cache == NULL || *cache == NULL)  return;
+	
+	SourceTileCacheRef theCache = *cache;
+	*cache = NULL;
+	
+	if (--theCache->retainCount == 0)
+	{
+		FPMRelease(&theCache->pixMap);
+		free(theCache);
+	}
+}
+
+
+FPMSize SourceTileCacheGetSize(SourceTileCacheRef cache)
+{
+	if (cache == NULL)  return FPMMakeSize(0, 0);
+	return FPMMakeSize(cache->width, cache->height);
+}
+
+
+FPM_INLINE const FPMColor *GetTexel(SourceTileCacheRef cache, ThreadTileCache *threadCache, FPMDimension x, FPMDimension y)
+{
+	size_t tileX = x >> kTileShift;
+	size_t tileY = y >> kTileShift;
+	unsigned slot = ((tileY & kSlotMask) << kSlotShift) | (tileX & kSlotMask);
+	size_t tag = tileY * cache->tilesAcross + tileX + 1;
+	
+	if (FPM_EXPECT_NOT(threadCache->tags[slot] != tag))
+	{
+		FillTile(cache, threadCache->tiles[slot], tileX, tileY);
+		threadCache->tags[slot] = tag;
+	}
+	
+	return &threadCache->tiles[slot][((y & kTileMask) << kTileShift) | (x & kTileMask)];
+}
+
+
+FPMColor SourceTileCacheGetPixel(SourceTileCacheRef cache, FPMCoordinate x, FPMCoordinate y)
+{
+	if (cache != NULL && (FPMDimension)x < cache->width && (FPMDimension)y < cache->height)
+	{
+		ThreadTileCache *threadCache = GetThreadCache(cache);
+		if (threadCache != NULL)  return *GetTexel(cache, threadCache, x, y);
+	}
+	
+	return kFPMColorInvalid;
+}
+
+
+FPMColor SourceTileCacheSampleLinear(SourceTileCacheRef cache, float x, float y, FPMWrapMode wrapx, FPMWrapMode wrapy)
+{
+	// Same arithmetic as FPMSampleLinear(), so results are identical.
+	ThreadTileCache *threadCache = GetThreadCache(cache);
+	if (cache != NULL && threadCache != NULL)
+	{
+		x -= 0.5f;
+		y -= 0.5f;
+		
+		float flrx = floorf(x);
+		float flry = floorf(y);
+		
+		FPMCoordinate lowx = flrx;
+		FPMCoordinate lowy = flry;
+		FPMCoordinate highx = lowx + 1;
+		FPMCoordinate highy = lowy + 1;
+		
+		lowx = FPMWrapCoordinate(lowx, cache->width, wrapx);
+		highx = FPMWrapCoordinate(highx, cache->width, wrapx);
+		lowy = FPMWrapCoordinate(lowy, cache->height, wrapy);
+		highy = FPMWrapCoordinate(highy, cache->height, wrapy);
+		
+		FPMColor ll = *GetTexel(cache, threadCache, lowx, lowy);
+		FPMColor lh = *GetTexel(cache, threadCache, lowx, highy);
+		FPMColor hl = *GetTexel(cache, threadCache, highx, lowy);
+		FPMColor hh = *GetTexel(cache, threadCache, highx, highy);
+		
+		float alphax = x - flrx;
+		float alphay = y - flry;
+		ll = FPMColorBlend(hl, ll, alphax);
+		hl = FPMColorBlend(hh, lh, alphax);
+		return FPMColorBlend(hl, ll, alphay);
+	}
+	return kFPMColorInvalid;
+}
+
+
+static ThreadTileCache *GetThreadCache(SourceTileCacheRef cache)
+{
+	if (cache == NULL)  return NULL;
+	
+	ThreadTileCache *threadCache = sThreadCache;
+	if (FPM_EXPECT_NOT(threadCache == NULL))
+	{
+		threadCache = malloc(sizeof *threadCache);
+		if (threadCache == NULL)  return NULL;
+		threadCache->identity = 0;
+		sThreadCache = threadCache;
+	}
+	
+	if (FPM_EXPECT_NOT(threadCache->identity != cache->identity))
+	{
+		// Tiles from a different image, throw them all out.
+		memset(threadCache->tags, 0, sizeof threadCache->tags);
+		threadCache->identity = cache->identity;
+	}
+	
+	return threadCache;
+}
+
+
+FPM_INLINE void FillTileFormat(const FPMStorageInfo *info, FPMPixelFormat format, FPMColor *tile, size_t left, size_t top, size_t width, size_t height)
+{
+	size_t x, y;
+	for (y = 0; y < height; y++)
+	{
+		FPMColor *dst = tile + (y << kTileShift);
+		for (x = 0; x < width; x++)
+		{
+			dst[x] = FPMDecodePixel(info, format, left + x, top + y);
+		}
+	}
+}
+
+
+static void FillTile(SourceTileCacheRef cache, FPMColor *tile, size_t tileX, size_t tileY)
+{
+	assert(cache != NULL && tile != NULL);
+	
+	size_t left = tileX << kTileShift;
+	size_t top = tileY << kTileShift;
+	size_t width = cache->width - left;
+	size_t height = cache->height - top;
+	if (width > kTileSize)  width = kTileSize;
+	if (height > kTileSize)  height = kTileSize;
+	
+	// Separate instantiations so the format tests are hoisted out of the loops.
+	switch (cache->storage.format)
+	{
+		case kFPMFormatRGBAFloat:
+			FillTileFormat(&cache->storage, kFPMFormatRGBAFloat, tile, left, top, width, height);
+			break;
+			
+		case kFPMFormatRGBA8:
+			FillTileFormat(&cache->storage, kFPMFormatRGBA8, tile, left, top, width, height);
+			break;
+			
+		case kFPMFormatRGBA16:
+			FillTileFormat(&cache->storage, kFPMFormatRGBA16, tile, left, top, width, height);
+			break;
+			
+		case kFPMFormatRGBAHalf:
+			FillTileFormat(&cache->storage, kFPMFormatRGBAHalf, tile, left, top, width, height);
+			break;
+	}
+}
@@ -0,0 +1,75 @@
+/*
+	SourceTileCache.h
+	planettool
+	
+	Compact source image storage, expanded to floats a tile at a time.
+	
+	
+	Copyright © 2013 Jens Ayton
+
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef INCLUDED_SourceTileCache_h
+#define INCLUDED_SourceTileCache_h
+
+#include "SphericalPixelSource.h"
+#include "FPMImageOperations.h"
+
+FPM_BEGIN_EXTERN_C
+
+
+/*	A SourceTileCache wraps a source image held in a compact pixel format
+	(four or eight bytes per pixel rather than sixteen; see FPMCreateWithFormat())
+	and converts it to floating point one tile at a time as it's sampled. The
+	converted tiles are kept in small per-thread caches, so sampling is
+	lock-free and memory use stays bounded however large the source is.
+*/
+typedef struct SourceTileCache *SourceTileCacheRef;
+
+
+/*	SourceTileCacheCreate()
+	Create a tile cache for a pixmap of any format, which is retained. The
+	pixmap must not be modified while the cache exists.
+*/
+SourceTileCacheRef SourceTileCacheCreate(FloatPixMapRef pm);
+
+SourceTileCacheRef SourceTileCacheRetain(SourceTileCacheRef cache);
+void SourceTileCacheRelease(SourceTileCacheRef *cache);
+
+FPMSize SourceTileCacheGetSize(SourceTileCacheRef cache);
+
+
+/*	SourceTileCacheGetPixel()
+	SourceTileCacheSampleLinear()
+	Equivalent to FPMGetPixel() and FPMSampleLinear() on the floating-point
+	version of the image.
+*/
+FPMColor SourceTileCacheGetPixel(SourceTileCacheRef cache, FPMCoordinate x, FPMCoordinate y);
+FPMColor SourceTileCacheSampleLinear(SourceTileCacheRef cache, float x, float y, FPMWrapMode wrapx, FPMWrapMode wrapy);
+
+
+/*	Constructor type for sources that can read from a SourceTileCache instead
+	of a FloatPixMap.
+*/
+typedef bool (*SphericalPixelTiledSourceConstructorFunction)(SourceTileCacheRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context);
+
+
+FPM_END_EXTERN_C
+#endif	/* INCLUDED_SourceTileCache_h */
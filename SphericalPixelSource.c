@@ -25,8 +25,11 @@
 */
 
 #include "SphericalPixelSource.h"
+#include "PlanetToolScheduler.h"
+#include "ResamplingMap.h"
 #include <assert.h>
 #include <stdarg.h>
+#include <string.h>
 
 
 Vector VectorFromCoordsRad(float latitude, float longitude)
@@ -97,6 +100,126 @@ void VectorToCoordsDeg(Vector v, float *latitude, float *longitude)
 }
 
 
+void SampleBatchWithScalarSource(SphericalPixelSourceFunction source, const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context)
+{
+	assert(source != NULL && (count == 0 || (where != NULL && colors != NULL)));
+	
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		colors[i] = source(where[i], flags, context);
+	}
+}
+
+
+/*	The probe is a 3×3 subset of the grid: the middle row and column, and
+	those half way from the middle to the edges. Samples are compared in
+	approximately perceptual terms, by their square roots, so that the
+	threshold means about the same error in light and dark areas; in linear
+	terms, a variance that is small next to a bright colour can be several
+	8-bit steps in a dark one. A probe which passes is filtered with the
+	sink's weights for its positions; otherwise its samples are kept, and
+	only the rest of the grid is sampled.
+*/
+bool SampleAdaptiveProbe(SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, const Coordinates *grid, const float *weights, unsigned sampleGridSize, RenderFlags flags, float threshold, FPMColor *samples, FPMColor *result)
+{
+	assert(grid != NULL && weights != NULL && samples != NULL && result != NULL && sampleGridSize > 1);
+	
+	unsigned sampleCount = sampleGridSize * sampleGridSize;
+	
+	// A probe of a 3×3 grid would be the whole grid, so there's nothing to save.
+	if (sampleGridSize <= 3)
+	{
+		SampleSourceBatch(source, batchSource, sourceContext, grid, samples, sampleCount, flags);
+		return false;
+	}
+	
+	unsigned middle = (sampleGridSize - 1) / 2;
+	unsigned positions[3] = { middle / 2, middle, sampleGridSize - 1 - middle / 2 };
+	unsigned probeIndices[9];
+	Coordinates probe[9];
+	FPMColor probeSamples[9];
+	unsigned i, j;
+	
+	for (i = 0; i < 3; i++)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			probeIndices[i * 3 + j] = positions[i] * sampleGridSize + positions[j];
+			probe[i * 3 + j] = grid[probeIndices[i * 3 + j]];
+		}
+	}
+	SampleSourceBatch(source, batchSource, sourceContext, probe, probeSamples, 9, flags);
+	
+	FPMColor perceptual[9];
+	FPMColor mean = kFPMColorClear;
+	for (i = 0; i < 9; i++)
+	{
+		FPMColor c = probeSamples[i];
+		perceptual[i] = FPMMakeColor(sqrtf(fmaxf(c.r, 0.0f)), sqrtf(fmaxf(c.g, 0.0f)), sqrtf(fmaxf(c.b, 0.0f)), c.a);
+		mean = FPMColorAdd(mean, perceptual[i]);
+	}
+	mean = FPMColorMultiply(mean, 1.0f / 9.0f);
+	
+	FPMColor variance = kFPMColorClear;
+	for (i = 0; i < 9; i++)
+	{
+		float dr = perceptual[i].r - mean.r, dg = perceptual[i].g - mean.g, db = perceptual[i].b - mean.b, da = perceptual[i].a - mean.a;
+		variance = FPMColorAdd(variance, FPMMakeColor(dr * dr, dg * dg, db * db, da * da));
+	}
+	variance = FPMColorMultiply(variance, 1.0f / 9.0f);
+	
+	if (variance.r <= threshold && variance.g <= threshold && variance.b <= threshold && variance.a <= threshold)
+	{
+		FPMColor accum = kFPMColorClear;
+		float totalWeight = 0.0f;
+		for (i = 0; i < 3; i++)
+		{
+			for (j = 0; j < 3; j++)
+			{
+				float weight = weights[positions[i]] * weights[positions[j]];
+				accum = FPMColorAdd(FPMColorMultiply(probeSamples[i * 3 + j], weight), accum);
+				totalWeight += weight;
+			}
+		}
+		*result = FPMColorMultiply(accum, 1.0f / totalWeight);
+		return true;
+	}
+	
+	// Sample the rest of the grid, then slot the probe samples back into place.
+	bool probed[sampleCount];
+	Coordinates rest[sampleCount - 9];
+	FPMColor restSamples[sampleCount - 9];
+	unsigned restCount = 0;
+	
+	memset(probed, 0, sizeof probed);
+	for (i = 0; i < 9; i++)  probed[probeIndices[i]] = true;
+	for (i = 0; i < sampleCount; i++)
+	{
+		if (!probed[i])  rest[restCount++] = grid[i];
+	}
+	SampleSourceBatch(source, batchSource, sourceContext, rest, restSamples, restCount, flags);
+	
+	restCount = 0;
+	for (i = 0; i < sampleCount; i++)
+	{
+		if (!probed[i])  samples[i] = restSamples[restCount++];
+	}
+	for (i = 0; i < 9; i++)  samples[probeIndices[i]] = probeSamples[i];
+	
+	return false;
+}
+
+
+void RenderStatisticsAdd(RenderStatistics *statistics, uintmax_t pixelCount, uintmax_t refinedPixelCount)
+{
+	if (statistics == NULL)  return;
+	
+	__sync_fetch_and_add(&statistics->pixelCount, pixelCount);
+	__sync_fetch_and_add(&statistics->refinedPixelCount, refinedPixelCount);
+}
+
+
 #define GAUSS_WIDTH			2.2f
 
 void BuildGaussTable(unsigned size, float *table)
@@ -173,12 +296,12 @@ void CallErrorCallbackWithFormat(ErrorCallbackFunction callback, void *cbContext
 }
 
 
-FloatPixMapRef ValidateAndCreatePixMap(uintmax_t nominalSize, uintmax_t width, uintmax_t height, ErrorCallbackFunction errorCB, void *cbContext)
+bool ValidatePixMapSize(uintmax_t nominalSize, uintmax_t width, uintmax_t height, ErrorCallbackFunction errorCB, void *cbContext)
 {
 	if (nominalSize < 1)
 	{
 		CallErrorCallbackWithFormat(errorCB, cbContext, "Size must be non-zero.\n");
-		return NULL;
+		return false;
 	}
 	
 	if (width > FPM_DIMENSION_MAX || height > FPM_DIMENSION_MAX)
@@ -188,9 +311,17 @@ FloatPixMapRef ValidateAndCreatePixMap(uintmax_t nominalSize, uintmax_t width, u
 		else  maxSize = FPM_DIMENSION_MAX / (height / nominalSize);
 		
 		CallErrorCallbackWithFormat(errorCB, cbContext, "Size must be no greater than %zu.\n", maxSize);
-		return NULL;
+		return false;
 	}
 	
+	return true;
+}
+
+
+FloatPixMapRef ValidateAndCreatePixMap(uintmax_t nominalSize, uintmax_t width, uintmax_t height, ErrorCallbackFunction errorCB, void *cbContext)
+{
+	if (!ValidatePixMapSize(nominalSize, width, height, errorCB, cbContext))  return NULL;
+	
 	FloatPixMapRef pm = FPMCreateC(width, height);
 	if (pm == NULL)
 	{
@@ -200,3 +331,145 @@ FloatPixMapRef ValidateAndCreatePixMap(uintmax_t nominalSize, uintmax_t width, u
 	
 	return pm;
 }
+
+
+typedef struct BandProgressContext
+{
+	ProgressCallbackFunction	progress;
+	void						*cbContext;
+	size_t						rowsDone;
+	size_t						bandRows;
+	size_t						totalRows;
+} BandProgressContext;
+
+
+/*	In streaming mode, RenderInBands() renders bands on the calling thread
+	and passes them to rowOutput on a writer thread which lives for the
+	whole image, using SchedulePipeline() with two buffers used in turn.
+*/
+typedef struct
+{
+	const RenderOptions			*options;
+	RenderBandFunction			renderBand;
+	void						*context;
+	FPMSize						imageSize;
+	size_t						bandRows;
+	FloatPixMapRef				buffers[2];
+	FloatPixMapRef				bands[2];		// The band last rendered in each buffer; a sub-pixmap of it for a short last band.
+	BandProgressContext			progress;
+} BandPipeline;
+
+
+static bool RenderPipelineBand(size_t index, void *context);
+static bool OutputPipelineBand(size_t index, void *context);
+
+
+/*	Set all pixels to zero. Unlike FPMFill(), this works on bands left full
+	of packed integer data (and so possibly NaNs) by the row output callback.
+*/
+static void ClearPixMap(FloatPixMapRef pm)
+{
+	FPMDimension y, height = FPMGetHeight(pm);
+	for (y = 0; y < height; y++)
+	{
+		memset(FPMGetPixelPointerC(pm, 0, y), 0, FPMGetWidth(pm) * sizeof (FPMColor));
+	}
+}
+
+
+//	Translate progress within a band to progress over the whole output.
+static bool BandProgress(size_t numerator, size_t denominator, void *vcontext)
+{
+	BandProgressContext *context = vcontext;
+	if (denominator == 0)  return true;
+	
+	return context->progress(context->rowsDone * denominator + numerator * context->bandRows, context->totalRows * denominator, context->cbContext);
+}
+
+
+FloatPixMapRef RenderInBands(uintmax_t nominalSize, uintmax_t width, uintmax_t height, const RenderOptions *options, RenderBandFunction renderBand, void *context, ProgressCallbackFunction progress, ErrorCallbackFunction errorCB, void *cbContext)
+{
+	if (options != NULL && options->mapRecorder != NULL)
+	{
+		if (!ValidatePixMapSize(nominalSize, width, height, errorCB, cbContext))  return NULL;
+		if (!ResamplingMapRecorderBegin(options->mapRecorder, FPMMakeSize(width, height)))
+		{
+			CallErrorCallbackWithFormat(errorCB, cbContext, "Not enough memory to record a resampling map.\n");
+			return NULL;
+		}
+	}
+	
+	if (options == NULL || options->rowOutput == NULL)
+	{
+		FloatPixMapRef pm = ValidateAndCreatePixMap(nominalSize, width, height, errorCB, cbContext);
+		if (pm == NULL)  return NULL;
+		
+		if (!renderBand(pm, 0, progress, cbContext, context))
+		{
+			FPMRelease(&pm);
+		}
+		return pm;
+	}
+	
+	if (!ValidatePixMapSize(nominalSize, width, height, errorCB, cbContext))  return NULL;
+	
+	size_t bandRows = (options->streamRows != 0) ? options->streamRows : kDefaultStreamRows;
+	if (bandRows > height)  bandRows = height;
+	
+	FloatPixMapRef buffers[2] = { FPMCreateC(width, bandRows), FPMCreateC(width, bandRows) };
+	if (buffers[0] == NULL || buffers[1] == NULL)
+	{
+		CallErrorCallbackWithFormat(errorCB, cbContext, "Could not create a %llu by %llu pixel pixmap.\n", (unsigned long long)width, (unsigned long long)bandRows);
+		FPMRelease(&buffers[0]);
+		FPMRelease(&buffers[1]);
+		return NULL;
+	}
+	
+	BandPipeline pipeline =
+	{
+		.options = options,
+		.renderBand = renderBand,
+		.context = context,
+		.imageSize = { width, height },
+		.bandRows = bandRows,
+		.buffers = { buffers[0], buffers[1] },
+		.progress = { progress, cbContext, 0, 0, height }
+	};
+	
+	bool OK = SchedulePipeline(RenderPipelineBand, OutputPipelineBand, &pipeline, (height + bandRows - 1) / bandRows, 2);
+	
+	FPMRelease(&pipeline.bands[0]);
+	FPMRelease(&pipeline.bands[1]);
+	FPMRelease(&buffers[1]);
+	if (!OK)  FPMRelease(&buffers[0]);
+	return buffers[0];
+}
+
+
+static bool RenderPipelineBand(size_t index, void *vcontext)
+{
+	BandPipeline *pipeline = vcontext;
+	size_t firstRow = index * pipeline->bandRows;
+	size_t rowCount = pipeline->imageSize.height - firstRow;
+	if (rowCount > pipeline->bandRows)  rowCount = pipeline->bandRows;
+	
+	// SchedulePipeline() guarantees that the band previously in this buffer has been output.
+	FloatPixMapRef buffer = pipeline->buffers[index % 2];
+	FloatPixMapRef *band = &pipeline->bands[index % 2];
+	FPMRelease(band);
+	if (rowCount < pipeline->bandRows)  *band = FPMCreateSubC(buffer, 0, 0, pipeline->imageSize.width, rowCount);
+	else  *band = FPMRetain(buffer);
+	if (*band == NULL)  return false;
+	
+	pipeline->progress.rowsDone = firstRow;
+	pipeline->progress.bandRows = rowCount;
+	ClearPixMap(*band);
+	return pipeline->renderBand(*band, firstRow, (pipeline->progress.progress != NULL) ? BandProgress : NULL, &pipeline->progress, pipeline->context);
+}
+
+
+static bool OutputPipelineBand(size_t index, void *vcontext)
+{
+	BandPipeline *pipeline = vcontext;
+	return pipeline->options->rowOutput(pipeline->bands[index % 2], index * pipeline->bandRows, pipeline->imageSize, pipeline->options->rowOutputContext);
+}
@@ -79,6 +79,7 @@ typedef struct Coordinates
 	{
 		kCoordsVector, kCoordsLLRad, kCoordsLLDeg
 	}					type;
+	float				footprint;
 } Coordinates;
 
 FPM_INLINE Coordinates MakeCoordsVector(Vector v) FPM_PURE;
@@ -87,6 +88,7 @@ FPM_INLINE Coordinates MakeCoordsVector(Vector v)
 	Coordinates result;
 	result.d.v = v;
 	result.type = kCoordsVector;
+	result.footprint = 0.0f;
 	return result;
 }
 
@@ -96,6 +98,7 @@ FPM_INLINE Coordinates MakeCoordsLatLongRad(float lat, float lon)
 	result.d.l.lat = lat;
 	result.d.l.lon = lon;
 	result.type = kCoordsLLRad;
+	result.footprint = 0.0f;
 	return result;
 }
 
@@ -105,9 +108,53 @@ FPM_INLINE Coordinates MakeCoordsLatLongDeg(float lat, float lon)
 	result.d.l.lat = lat;
 	result.d.l.lon = lon;
 	result.type = kCoordsLLDeg;
+	result.footprint = 0.0f;
 	return result;
 }
 
+/*	CoordsWithFootprint()
+	CoordsGetFootprint()
+	Coordinates also carry a footprint: the angle in radians between the
+	sample they describe and its neighbours, which sources use to filter
+	the sample with kRenderPrefiltered. Sinks set it, and filters which
+	transform coordinates pass it through. It is 0 (unknown, so sources
+	don't filter) for coordinates made with the functions above.
+*/
+FPM_INLINE Coordinates CoordsWithFootprint(Coordinates c, float footprint) FPM_PURE;
+FPM_INLINE Coordinates CoordsWithFootprint(Coordinates c, float footprint)
+{
+	c.footprint = footprint;
+	return c;
+}
+
+FPM_INLINE float CoordsGetFootprint(Coordinates c) FPM_PURE;
+FPM_INLINE float CoordsGetFootprint(Coordinates c)
+{
+	return c.footprint;
+}
+
+/*	LatLongSampleFootprint()
+	Footprint of samples spaced latStep and lonStep radians apart around
+	latitude lat: the square root of the solid angle each covers.
+*/
+FPM_INLINE float LatLongSampleFootprint(float lat, float latStep, float lonStep) FPM_CONST;
+FPM_INLINE float LatLongSampleFootprint(float lat, float latStep, float lonStep)
+{
+	return sqrtf(fabsf(latStep * lonStep * cosf(lat)));
+}
+
+/*	CubeFaceSampleFootprint()
+	Footprint of samples spaced spacing apart on a cube face (the plane
+	z = 1) around (u, v). With r = √(1 + u² + v²), the spacing shrinks as r²
+	radially and as r tangentially; r^1.5 is used as a compromise.
+*/
+FPM_INLINE float CubeFaceSampleFootprint(float u, float v, float spacing) FPM_CONST;
+FPM_INLINE float CubeFaceSampleFootprint(float u, float v, float spacing)
+{
+	float r = sqrtf(1.0f + u * u + v * v);
+	return spacing / (r * sqrtf(r));
+}
+
 FPM_INLINE Vector CoordsGetVector(Coordinates c) FPM_PURE;
 FPM_INLINE Vector CoordsGetVector(Coordinates c)
 {
@@ -127,7 +174,8 @@ FPM_INLINE void CoordsGetLatLongRad(Coordinates c, float *lat, float *lon)
 	{
 		case kCoordsLLRad:  *lat = c.d.l.lat; *lon = c.d.l.lon; break;
 		case kCoordsLLDeg:  *lat = c.d.l.lat * kDegToRad; *lon = c.d.l.lon * kDegToRad; break;
-		case kCoordsVector:  VectorToCoordsRad(c.d.v, lat, lon); break;
+	//	case kCoordsVector:
+		default:  VectorToCoordsRad(c.d.v, lat, lon); break;
 	}
 }
 
@@ -138,19 +186,82 @@ FPM_INLINE void CoordsGetLatLongDeg(Coordinates c, float *lat, float *lon)
 	{
 		case kCoordsLLDeg:  *lat = c.d.l.lat; *lon = c.d.l.lon; break;
 		case kCoordsLLRad:  *lat = c.d.l.lat * kRadToDeg; *lon = c.d.l.lon * kRadToDeg; break;
-		case kCoordsVector:  VectorToCoordsDeg(c.d.v, lat, lon); break;
+	//	case kCoordsVector:
+		default:  VectorToCoordsDeg(c.d.v, lat, lon); break;
 	}
 }
 
 
 enum
 {
-	kRenderFast		= 0x00000001,
-	kRenderJitter	= 0x00000002
+	kRenderFast				= 0x00000001,
+	kRenderJitter			= 0x00000002,
+	kRenderSharedSamples	= 0x00000004,	// Allow sinks to reuse samples between neighbouring pixels; not bit-identical.
+	kRenderAdaptive			= 0x00000008,	// Only supersample pixels whose probe samples vary; see RenderOptions.
+	kRenderPrefiltered		= 0x00000010	// Sources filter each sample over its footprint, and sinks take fewer samples; see kPrefilteredSampleGridSize.
 };
 typedef uint32_t RenderFlags;
 
 
+/*	Statistics gathered by a sink while rendering. Sinks add to the counts,
+	so the caller should zero the struct first.
+*/
+typedef struct RenderStatistics
+{
+	uintmax_t			pixelCount;			// Pixels rendered.
+	uintmax_t			refinedPixelCount;	// Pixels sampled with the full grid under kRenderAdaptive.
+} RenderStatistics;
+
+
+/*	Row output callback for streaming sinks (see RenderOptions). rows holds
+	the next FPMGetHeight(rows) rows of the output, starting at firstRow, and
+	imageSize is the size of the whole output. The callback may modify rows.
+	If it returns false, rendering is stopped.
+*/
+typedef bool (*RenderRowOutputFunction)(FloatPixMapRef rows, FPMCoordinate firstRow, FPMSize imageSize, void *context);
+
+
+enum
+{
+	kDefaultStreamRows		= 64
+};
+
+
+/*	Additional parameters for sinks. May be passed as NULL to use defaults.
+*/
+typedef struct RenderOptions
+{
+	/*	With kRenderAdaptive, each pixel is first sampled with a 3×3 probe;
+		if the variance of the probe samples' square roots (in the channel
+		where it is largest) is no greater than adaptiveThreshold, the probe
+		is filtered and used, and the full sample grid is skipped. See
+		SampleAdaptiveProbe().
+	*/
+	float				adaptiveThreshold;
+	
+	RenderStatistics	*statistics;		// If not NULL, updated by the sink.
+	
+	/*	If rowOutput is not NULL, the sink renders in bands of streamRows
+		rows (kDefaultStreamRows if 0), alternating between two buffers, and
+		passes them to rowOutput from top to bottom instead of keeping the
+		whole image. Rows within a band may be rendered in any order. Each
+		band is passed to rowOutput while the next is being rendered, so
+		rowOutput may be called on another thread, but calls never overlap.
+		The sink then returns a band buffer to indicate success; its contents
+		are undefined.
+	*/
+	RenderRowOutputFunction	rowOutput;
+	void				*rowOutputContext;
+	size_t				streamRows;
+	
+	/*	If mapRecorder is not NULL, sinks record the samples of each pixel in
+		it as well as rendering (see ResamplingMap.h). Not supported with
+		kRenderJitter, kRenderAdaptive or kRenderSharedSamples.
+	*/
+	struct ResamplingMapRecorder	*mapRecorder;
+} RenderOptions;
+
+
 /*	Progress callback: called at unspecified intervals during rendering; if
 	it returns false, rendering is stopped.
 */
@@ -167,10 +278,78 @@ typedef void (*ErrorCallbackFunction)(const char *message, void *cbContext);
 */
 typedef FPMColor (*SphericalPixelSourceFunction)(Coordinates where, RenderFlags flags, void *context);
 
-typedef bool (*SphericalPixelSourceConstructorFunction)(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, void **context);
+/*	Batched equivalent of SphericalPixelSourceFunction: samples count
+	coordinates in one call, writing the results to colors (which must have
+	room for count elements). For any given set of coordinates, the results
+	should match calling the corresponding SphericalPixelSourceFunction for
+	each element in turn. Sources which interpolate may convert coordinates
+	with the functions in CoordsBatch.h, whose results differ slightly from
+	the scalar conversions (see CoordsBatch.h); sources whose output is not
+	continuous in position, such as nearest-pixel sampling with kRenderFast,
+	must use the scalar conversions so that they match exactly.
+	
+	Sinks make one batched call per output pixel (or more), so sources which
+	wrap other sources should pass batches through rather than splitting them
+	up again.
+*/
+typedef void (*SphericalPixelBatchSourceFunction)(const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context);
+
+/*	With kRenderPrefiltered, sources which read images build prefiltered
+	copies at lower resolutions, and average each sample over an area the
+	size of its footprint (see CoordsWithFootprint()). Sinks then use a
+	grid of kPrefilteredSampleGridSize² samples per pixel.
+*/
+enum
+{
+	kPrefilteredSampleGridSize	= 3
+};
+
+/*	Source constructors must set *source. They should also set *batchSource,
+	but may set it to NULL if they only implement the scalar interface, in
+	which case SampleSourceBatch() falls back to calling *source repeatedly.
+*/
+typedef bool (*SphericalPixelSourceConstructorFunction)(FloatPixMapRef sourceImage, RenderFlags flags, SphericalPixelSourceFunction *source, SphericalPixelBatchSourceFunction *batchSource, void **context);
 typedef void (*SphericalPixelSourceDestructorFunction)(void *context);
 
-typedef FloatPixMapRef (*SphericalPixelSinkFunction)(uintmax_t size, RenderFlags flags, SphericalPixelSourceFunction source, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+typedef FloatPixMapRef (*SphericalPixelSinkFunction)(uintmax_t size, RenderFlags flags, const RenderOptions *options, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, ProgressCallbackFunction progress, ErrorCallbackFunction error, void *cbContext);
+
+
+/*	Fallback adapter for sources with no batch function: sample each
+	coordinate using the scalar source function.
+*/
+void SampleBatchWithScalarSource(SphericalPixelSourceFunction source, const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags, void *context);
+
+//	Sample a batch of coordinates, using batchSource if available and source otherwise.
+FPM_INLINE void SampleSourceBatch(SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *context, const Coordinates *where, FPMColor *colors, size_t count, RenderFlags flags)
+{
+	if (batchSource != NULL)  batchSource(where, colors, count, flags, context);
+	else  SampleBatchWithScalarSource(source, where, colors, count, flags, context);
+}
+
+/*	Largest batch filters should build on the stack when transforming or
+	splitting up their own sampling work.
+*/
+enum
+{
+	kMaxSourceBatchSize		= 256
+};
+
+
+/*	Adaptive supersampling support for sinks. grid is the full
+	sampleGridSize x sampleGridSize set of sample coordinates for a pixel, in
+	row-major order, and weights the sink's filter weights for each row and
+	column. A 3×3 probe spread across the grid is sampled; if the variance of
+	the square roots of its samples does not exceed threshold in any channel,
+	*result is set to the probe filtered with weights, and true is returned.
+	Otherwise, samples (which must have room for the full grid) is filled
+	with samples for the whole grid, reusing the probe's, and false is
+	returned; the sink should then filter them as usual. Grids of 3×3 or
+	smaller are sampled in full without a probe.
+*/
+bool SampleAdaptiveProbe(SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *sourceContext, const Coordinates *grid, const float *weights, unsigned sampleGridSize, RenderFlags flags, float threshold, FPMColor *samples, FPMColor *result);
+
+//	Thread-safe update of RenderStatistics, intended to be called once per line or span. statistics may be NULL.
+void RenderStatisticsAdd(RenderStatistics *statistics, uintmax_t pixelCount, uintmax_t refinedPixelCount);
 
 
 //	Build a lookup table of Gauss distribution numbers.
@@ -185,10 +364,24 @@ bool DummyProgressCallback(size_t numerator, size_t denominator, void *context);
 void PrintToStdErrErrorCallback(char *message, void *cbContext);	// Prints message to stderr.
 
 
-// Shared set-up and error checking function for all sinks.
+// Shared set-up and error checking functions for all sinks.
+bool ValidatePixMapSize(uintmax_t nominalSize, uintmax_t width, uintmax_t height, ErrorCallbackFunction errorCB, void *cbContext);
 FloatPixMapRef ValidateAndCreatePixMap(uintmax_t nominalSize, uintmax_t width, uintmax_t height, ErrorCallbackFunction errorCB, void *cbContext);
 
 
+/*	Shared rendering driver for sinks, implementing RenderOptions.rowOutput.
+	renderBand must render rows [firstRow, firstRow + FPMGetHeight(band)) of
+	the output into band, which is as wide as the output and initially
+	clear, reporting progress through the callback it is given.
+	
+	Without streaming, the whole output is created with
+	ValidateAndCreatePixMap() and rendered as a single band.
+*/
+typedef bool (*RenderBandFunction)(FloatPixMapRef band, FPMCoordinate firstRow, ProgressCallbackFunction progress, void *progressContext, void *context);
+
+FloatPixMapRef RenderInBands(uintmax_t nominalSize, uintmax_t width, uintmax_t height, const RenderOptions *options, RenderBandFunction renderBand, void *context, ProgressCallbackFunction progress, ErrorCallbackFunction errorCB, void *cbContext);
+
+
 // Printf()-style call for ErrroCallbackFunctions.
 void CallErrorCallbackWithFormat(ErrorCallbackFunction callback, void *cbContext, const char *format, ...)
 #if __GNUC__
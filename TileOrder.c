@@ -0,0 +1,87 @@
+/*
+	TileOrder.c
+	planettool
+	
+	
+	Copyright © 2013 Jens Ayton
+
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include "TileOrder.h"
+#include <assert.h>
+
+
+//	Convert distance along a Hilbert curve filling a side x side square to coordinates.
+static void HilbertPoint(uint32_t side, uint64_t distance, uint32_t *outX, uint32_t *outY)
+{
+	uint32_t x = 0, y = 0, s;
+	
+	for (s = 1; s < side; s *= 2)
+	{
+		uint32_t rx = 1 & (uint32_t)(distance / 2);
+		uint32_t ry = 1 & (uint32_t)(distance ^ rx);
+		
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			uint32_t t = x;
+			x = y;
+			y = t;
+		}
+		
+		x += s * rx;
+		y += s * ry;
+		distance /= 4;
+	}
+	
+	*outX = x;
+	*outY = y;
+}
+
+
+void BuildHilbertTileOrder(uint32_t tilesAcross, uint32_t tilesDown, uint32_t *order)
+{
+	assert(order != NULL || tilesAcross == 0 || tilesDown == 0);
+	
+	uint32_t side = 1;
+	while (side < tilesAcross || side < tilesDown)  side *= 2;
+	
+	/*	Walk the curve over the smallest power-of-two square covering the grid,
+		skipping points outside it. The remaining points are still visited
+		in a locality-preserving order, although not always adjacent ones.
+	*/
+	uint64_t distance, end = (uint64_t)side * side;
+	size_t count = 0;
+	for (distance = 0; distance < end; distance++)
+	{
+		uint32_t x, y;
+		HilbertPoint(side, distance, &x, &y);
+		if (x < tilesAcross && y < tilesDown)
+		{
+			order[count++] = y * tilesAcross + x;
+		}
+	}
+	
+	assert(count == (size_t)tilesAcross * tilesDown);
+}
@@ -0,0 +1,48 @@
+/*
+	TileOrder.h
+	planettool
+	
+	Space-filling curve ordering of render tiles.
+	
+	
+	Copyright © 2013 Jens Ayton
+
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef INCLUDED_TileOrder_h
+#define INCLUDED_TileOrder_h
+
+#include "FPMBasics.h"
+
+FPM_BEGIN_EXTERN_C
+
+
+/*	Fill order with the row-major indices of a tilesAcross by tilesDown grid
+	of tiles, in the order they're visited by a Hilbert curve. Any run of
+	consecutive tiles covers a compact area, so a thread working through a
+	run of them reads a compact area of the source.
+	
+	order must have room for tilesAcross * tilesDown entries.
+*/
+void BuildHilbertTileOrder(uint32_t tilesAcross, uint32_t tilesDown, uint32_t *order);
+
+
+FPM_END_EXTERN_C
+#endif	/* INCLUDED_TileOrder_h */
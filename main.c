@@ -28,10 +28,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <sys/time.h>
 
 #include "FPMPNG.h"
+#include "FPMNative.h"
+#include "SourceDiskCache.h"
 #include "SphericalPixelSource.h"
 #include "PTPowerManagement.h"
+#include "PlanetToolScheduler.h"
+#include "ResamplingMap.h"
+#include "DirectResample.h"
 
 // Sources
 #include "LatLongGridGenerator.h"
@@ -63,6 +72,9 @@ typedef struct
 	FilterEntryBase					keys;
 	SphericalPixelSourceConstructorFunction	constructor;
 	SphericalPixelSourceDestructorFunction	destructor;
+	SphericalPixelTiledSourceConstructorFunction	tiledConstructor;
+	SphericalPixelSourceTapsFunction	getTaps;		// For --save-map.
+	DirectResampleLayout			directLayout;
 } SourceEntry;
 
 
@@ -71,35 +83,153 @@ typedef struct
 	FilterEntryBase					keys;
 	SphericalPixelSinkFunction		sink;
 	size_t							defaultSize;
+	DirectResampleSupportedFunction	directSupported;
+	DirectResampleSinkFunction		directSink;
 } SinkEntry;
 
 
 typedef struct
 {
-	RenderFlags						flags;
-	const SourceEntry				*source;
 	const SinkEntry					*sink;
+	const char						*path;
 	size_t							size;
-	size_t							defaultSize;
+} OutputSettings;
+
+
+enum
+{
+	kMaxOutputs						= 16,
+	kMapKeyLength					= 512
+};
+
+
+typedef struct
+{
+	RenderFlags						flags;
+	const SourceEntry				*source;
+	OutputSettings					outputs[kMaxOutputs];
+	unsigned						outputCount;
+	size_t							size;		// --size given before any --output.
 	OOMatrix						transform;
 	double							cosBlurBackFactor;
 	double							cosBlurFrontFactor;
+	double							adaptiveThreshold;
+	unsigned						threadCount;
+	bool							pinThreads;
 	bool							showHelp;
 	bool							showVersion;
 	bool							quiet;
 	bool							sixteenBit;
+	bool							stream;
+	bool							tiledInput;
+	bool							haveInputFormat;
+	FPMPixelFormat					inputFormat;
+	const char						*cacheSourcePath;
+	const char						*sourceCacheDirectory;
+	uintmax_t						sourceCacheLimit;
 	bool							cosBlur;
+	bool							noDirect;
+	bool							directCube;
 	const char						*sourcePath;
-	const char						*sinkPath;
+	const char						*batchPath;
+	const char						*saveMapPath;
+	const char						*useMapPath;
+	bool							timing;
+	bool							havePNGCompression;
+	unsigned						pngCompression;
 } Settings;
 
 
 static bool InterpretArguments(int argc, const char * argv[], Settings *settings);
+static bool RunJob(const Settings *settings);
+static bool RunBatch(const Settings *defaults);
+static FloatPixMapRef LoadSource(const Settings *settings, bool tiledInput);
+static void MapKey(const Settings *settings, char key[kMapKeyLength]);
 
 
 static bool PrintProgress(size_t numerator, size_t denominator, void *context);
 
 
+//	Wall-clock interval of a phase of a job, for --timing. busy excludes time spent waiting for other phases.
+typedef struct
+{
+	double							start;
+	double							end;
+	double							busy;
+} PhaseTiming;
+
+static double CurrentTime(void);
+
+static bool ScheduleFPMWork(FPMWorkFunction work, void *workContext, size_t count, void *context);
+
+
+typedef struct
+{
+	const char						*path;
+	FPMWritePNGFlags				flags;
+	FPMPNGWriterRef					writer;
+	PhaseTiming						*timing;
+} StreamOutputContext;
+
+static bool StreamOutputRows(FloatPixMapRef rows, FPMCoordinate firstRow, FPMSize imageSize, void *context);
+
+
+/*	Outputs are rendered concurrently from one source chain, which is torn
+	down by whichever output finishes rendering last.
+*/
+typedef struct OutputTask OutputTask;
+
+typedef struct
+{
+	const Settings					*settings;
+	SphericalPixelSourceFunction	source;
+	SphericalPixelBatchSourceFunction batchSource;
+	SphericalPixelSourceDestructorFunction destructor;
+	void							*sourceContext;
+	FloatPixMapRef					sourcePM;
+	SourceTileCacheRef				sourceTiles;
+	unsigned						renderingCount;		// Accessed atomically.
+	
+	// With --use-map, outputs are gathered through map instead of rendered from the source chain.
+	ResamplingMapRef				map;
+	ResamplingMapRecorderRef		mapRecorder;		// With --save-map.
+	char							mapKey[kMapKeyLength];
+	
+	// Whether outputs whose geometry allows it may be resampled directly from sourcePM; see DirectResample.h.
+	bool							allowDirect;
+	
+	RenderStatistics				statistics;
+	OutputTask						*tasks;
+	unsigned						outputCount;
+	unsigned						progressPercentage;	// Last printed; accessed atomically.
+	
+	double							startTime;
+	PhaseTiming						readTiming;
+} SharedRenderState;
+
+struct OutputTask
+{
+	const OutputSettings			*output;
+	SharedRenderState				*shared;
+	unsigned						progress;			// Parts per kOutputProgressScale; accessed atomically.
+	PhaseTiming						renderTiming;
+	PhaseTiming						writeTiming;
+};
+
+enum
+{
+	kOutputProgressScale			= 10000
+};
+
+static bool RenderOutput(void *context);
+static bool OutputProgress(size_t numerator, size_t denominator, void *context);
+static void FinishedRendering(SharedRenderState *shared);
+static void PrintTiming(const SharedRenderState *shared);
+
+
+enum { kDefaultSourceCacheLimitMiB = 4096 };
+
+
 int main (int argc, const char * argv[])
 {
 	FPMInit();
@@ -110,100 +240,762 @@ int main (int argc, const char * argv[])
 	Settings settings;
 	memset(&settings, 0, sizeof settings);
 	settings.transform = kIdentityMatrix;
+	settings.sourceCacheLimit = (uintmax_t)kDefaultSourceCacheLimitMiB << 20;
 	
 	if (!InterpretArguments(argc, argv, &settings))
 	{
 		return (settings.showHelp || settings.showVersion) ? 0 : EXIT_FAILURE;
 	}
-	assert(settings.source != NULL && settings.sink != NULL);
+	assert(settings.batchPath != NULL || (settings.source != NULL && (settings.outputCount != 0 || settings.cacheSourcePath != NULL)));
+	
+	SchedulerSetThreadCount(settings.threadCount);
+	SchedulerSetThreadPinning(settings.pinThreads);
+	if (!SchedulerInit())  return EXIT_FAILURE;
+	FPMSetParallelFunction(ScheduleFPMWork, NULL);
+	
+	if (settings.batchPath != NULL)  return RunBatch(&settings) ? 0 : EXIT_FAILURE;
+	return RunJob(&settings) ? 0 : EXIT_FAILURE;
+}
+
+
+/*	RunJob()
+	Load the source, set up the filter chain and render every output of one
+	set of settings.
+*/
+static bool RunJob(const Settings *settings)
+{
+	double startTime = CurrentTime();
+	PhaseTiming readTiming = { 0 };
 	
 	// Read input file, if any.
 	FloatPixMapRef sourcePM = NULL;
-	if (settings.sourcePath != NULL)
+	SourceTileCacheRef sourceTiles = NULL;
+	ResamplingMapRef map = NULL;
+	ResamplingMapRecorderRef mapRecorder = NULL;
+	bool tiledInput = settings->tiledInput && settings->source->tiledConstructor != NULL;
+	if (settings->sourcePath != NULL)
 	{
-		if (!settings.quiet)  printf("Reading...\n");
-		sourcePM = FPMCreateWithPNG(settings.sourcePath, kFPMGammaLinear, NULL, NULL, NULL);
+		if (!settings->quiet)  printf("Reading...\n");
+		sourcePM = LoadSource(settings, tiledInput);
+		double readEnd = CurrentTime();
+		readTiming = (PhaseTiming){ startTime, readEnd, readEnd - startTime };
 		
-		if (sourcePM == NULL)
+		if (sourcePM != NULL && settings->cacheSourcePath != NULL)
 		{
-			fprintf(stderr, "Could not load %s\n", settings.sourcePath);
-			return EXIT_FAILURE;
+			if (!settings->quiet)  printf("Writing source cache...\n");
+			bool OK = FPMWriteNative(sourcePM, settings->cacheSourcePath, LoadErrorHandler, NULL);
+			if (!OK || settings->outputCount == 0)
+			{
+				FPMRelease(&sourcePM);
+				if (OK && !settings->quiet)  printf("Done.\n");
+				return OK;
+			}
+		}
+		
+		if (sourcePM != NULL && tiledInput)
+		{
+			sourceTiles = SourceTileCacheCreate(sourcePM);
+			FPMRelease(&sourcePM);
+		}
+		
+		if (sourcePM == NULL && sourceTiles == NULL)
+		{
+			fprintf(stderr, "Could not load %s\n", settings->sourcePath);
+			return false;
+		}
+	}
+	
+	char mapKey[kMapKeyLength] = "";
+	if (settings->saveMapPath != NULL || settings->useMapPath != NULL)  MapKey(settings, mapKey);
+	
+	// With --use-map, the map replaces the whole source chain.
+	if (settings->useMapPath != NULL)
+	{
+		map = ResamplingMapOpen(settings->useMapPath, RenderErrorHandler, NULL);
+		if (map != NULL && strcmp(ResamplingMapGetKey(map), mapKey) != 0)
+		{
+			fprintf(stderr, "Resampling map %s was made for different settings (%s).\n", settings->useMapPath, ResamplingMapGetKey(map));
+			ResamplingMapClose(&map);
+		}
+		if (map == NULL)
+		{
+			FPMRelease(&sourcePM);
+			return false;
 		}
 	}
 	
 	// Run source constructor.
 	void *sourceContext = NULL;
 	SphericalPixelSourceFunction source = NULL;
-	if (settings.source->constructor != NULL)
+	SphericalPixelBatchSourceFunction batchSource = NULL;
+	if (tiledInput)
+	{
+		if (!settings->source->tiledConstructor(sourceTiles, settings->flags, &source, &batchSource, &sourceContext))
+		{
+			SourceTileCacheRelease(&sourceTiles);
+			return false;
+		}
+	}
+	else if (settings->source->constructor != NULL && map == NULL)
+	{
+		if (!settings->source->constructor(sourcePM, settings->flags, &source, &batchSource, &sourceContext))
+		{
+			FPMRelease(&sourcePM);
+			return false;
+		}
+	}
+	SphericalPixelSourceDestructorFunction destructor = (map == NULL) ? settings->source->destructor : NULL;
+	
+	// With --save-map, the sink records what it samples. The recorder reads the source directly, applying the transform itself.
+	if (settings->saveMapPath != NULL)
 	{
-		if (!settings.source->constructor(sourcePM, settings.flags, &source, &sourceContext))
+		assert(settings->source->getTaps != NULL && sourcePM != NULL);
+		bool transformed = !OOMatrixIsIdentity(settings->transform);
+		mapRecorder = ResamplingMapRecorderCreate(settings->source->getTaps, sourceContext, FPMGetSize(sourcePM), transformed ? &settings->transform : NULL);
+		if (mapRecorder == NULL)
 		{
-			return EXIT_FAILURE;
+			fprintf(stderr, "Not enough memory to record a resampling map.\n");
+			goto FAIL;
 		}
 	}
-	SphericalPixelSourceDestructorFunction destructor = settings.source->destructor;
 	
 	// Set up matrix filter if necessary.
-	if (!OOMatrixIsIdentity(settings.transform))
+	if (!OOMatrixIsIdentity(settings->transform) && map == NULL)
 	{
 		void *transformContext = NULL;
-		if (!MatrixTransformerSetUp(source, destructor, sourceContext, settings.transform, &transformContext))
+		if (!MatrixTransformerSetUp(source, batchSource, destructor, sourceContext, settings->transform, &transformContext))
 		{
-			return EXIT_FAILURE;
+			goto FAIL;
 		}
 		
 		source = MatrixTransformer;
+		batchSource = MatrixTransformerBatch;
 		destructor = MatrixTransformerDestructor;
 		sourceContext = transformContext;
 	}
 	
 	// Set up cos blur filter if requested.
-	if (settings.cosBlur)
+	if (settings->cosBlur)
+	{
+		void *cosBlurContext = NULL;
+		// The blur is shared by all outputs, so it's done at the resolution of the largest.
+		size_t blurSize = 0;
+		unsigned i;
+		for (i = 0; i < settings->outputCount; i++)
+		{
+			if (settings->outputs[i].size > blurSize)  blurSize = settings->outputs[i].size;
+		}
+		
+		if (!CosineBlurFilterSetUp(source, batchSource, destructor, sourceContext, blurSize, settings->cosBlurBackFactor, settings->cosBlurFrontFactor, &cosBlurContext))
+		{
+			goto FAIL;
+		}
+		
+		source = CosineBlurFilter;
+		batchSource = CosineBlurFilterBatch;
+		destructor = CosineBlurFilterDestructor;
+		sourceContext = cosBlurContext;
+	}
+	
+	/*	Direct rendering reads the source image itself, so it's only used when
+		nothing but the transform comes between it and the sinks. Cube sources
+		only qualify with --direct-cube, since their face edges come out
+		visibly different (see DirectResample.h).
+	*/
+	bool allowDirect = !settings->noDirect &&
+					   sourcePM != NULL &&
+					   map == NULL &&
+					   mapRecorder == NULL &&
+					   !settings->cosBlur &&
+					   settings->source->directLayout != kDirectLayoutNone &&
+					   (settings->source->directLayout == kDirectLayoutLatLong || settings->directCube) &&
+					   !(settings->flags & (kRenderJitter | kRenderAdaptive | kRenderPrefiltered));
+	
+	// Render.
+	if (!settings->quiet)
+	{
+		const char *message = settings->stream ? "Rendering and writing" : "Rendering";
+		if (settings->outputCount == 1)  printf("%s...\n", message);
+		else  printf("%s %u outputs...\n", message, settings->outputCount);
+	}
+	
+	OutputTask tasks[kMaxOutputs];
+	void *taskContexts[kMaxOutputs];
+	SharedRenderState shared =
+	{
+		.settings = settings,
+		.source = source,
+		.batchSource = batchSource,
+		.destructor = destructor,
+		.sourceContext = sourceContext,
+		.sourcePM = sourcePM,
+		.sourceTiles = sourceTiles,
+		.renderingCount = settings->outputCount,
+		.map = map,
+		.mapRecorder = mapRecorder,
+		.allowDirect = allowDirect,
+		.tasks = tasks,
+		.outputCount = settings->outputCount,
+		.startTime = startTime,
+		.readTiming = readTiming
+	};
+	
+	unsigned i;
+	for (i = 0; i < settings->outputCount; i++)
+	{
+		tasks[i] = (OutputTask){ .output = &settings->outputs[i], .shared = &shared };
+		taskContexts[i] = &tasks[i];
+	}
+	strcpy(shared.mapKey, mapKey);
+	
+	if (!ScheduleConcurrentTasks(RenderOutput, taskContexts, settings->outputCount))  return false;
+	
+	if (settings->timing)  PrintTiming(&shared);
+	if (!settings->quiet)  printf("Done.\n");
+	return true;
+	
+FAIL:
+	FPMRelease(&sourcePM);
+	SourceTileCacheRelease(&sourceTiles);
+	ResamplingMapRecorderDestroy(&mapRecorder);
+	if (destructor != NULL)  destructor(sourceContext);
+	return false;
+}
+
+
+/*	RenderOutput()
+	Render and write one output; run concurrently for each output.
+*/
+static bool RenderOutput(void *context)
+{
+	OutputTask *task = context;
+	SharedRenderState *shared = task->shared;
+	const Settings *settings = shared->settings;
+	const OutputSettings *output = task->output;
+	
+	FPMWritePNGFlags writeFlags = kFPMWritePNGDither;
+	if (settings->sixteenBit)  writeFlags = kFPMWritePNG16BPC;
+	if (settings->havePNGCompression)  writeFlags |= FPMWritePNGCompressionLevel(settings->pngCompression);
+	
+	RenderOptions options =
+	{
+		.adaptiveThreshold = settings->adaptiveThreshold,
+		.statistics = &shared->statistics,
+		.mapRecorder = shared->mapRecorder
+	};
+	
+	// In streaming mode, the sink hands rows to the PNG writer as it goes.
+	StreamOutputContext streamContext = { output->path, writeFlags, NULL, &task->writeTiming };
+	if (settings->stream)
+	{
+		options.rowOutput = StreamOutputRows;
+		options.rowOutputContext = &streamContext;
+	}
+	
+	ProgressCallbackFunction progressCB = settings->quiet ? NULL : OutputProgress;
+	task->renderTiming.start = CurrentTime();
+	FloatPixMapRef resultPM;
+	const SinkEntry *sink = output->sink;
+	if (shared->map != NULL)  resultPM = ResamplingMapRender(shared->map, shared->sourcePM, &options, progressCB, RenderErrorHandler, task);
+	else if (shared->allowDirect && sink->directSink != NULL && sink->directSupported(settings->source->directLayout, settings->transform))
+	{
+		resultPM = sink->directSink(output->size, settings->flags, &options, shared->sourcePM, settings->source->directLayout, settings->transform, progressCB, RenderErrorHandler, task);
+	}
+	else  resultPM = sink->sink(output->size, settings->flags, &options, shared->source, shared->batchSource, shared->sourceContext, progressCB, RenderErrorHandler, task);
+	task->renderTiming.end = CurrentTime();
+	task->renderTiming.busy = task->renderTiming.end - task->renderTiming.start;
+	FinishedRendering(shared);
+	
+	if (resultPM == NULL)
+	{
+		FPMPNGWriterAbort(streamContext.writer);
+		if (shared->outputCount == 1)  fprintf(stderr, "Rendering failed.\n");
+		else  fprintf(stderr, "Rendering %s failed.\n", output->path);
+		ResamplingMapRecorderDestroy(&shared->mapRecorder);
+		return false;
+	}
+	
+	// --save-map allows only one output, so the map is complete.
+	if (shared->mapRecorder != NULL)
+	{
+		if (!settings->quiet)  printf("Writing resampling map...\n");
+		bool mapOK = ResamplingMapRecorderWrite(shared->mapRecorder, settings->saveMapPath, shared->mapKey, RenderErrorHandler, task);
+		ResamplingMapRecorderDestroy(&shared->mapRecorder);
+		if (!mapOK)
+		{
+			FPMPNGWriterAbort(streamContext.writer);
+			FPMRelease(&resultPM);
+			return false;
+		}
+	}
+	
+	// Write output.
+	bool OK;
+	double writeStart = CurrentTime();
+	if (settings->stream)
+	{
+		FPMRelease(&resultPM);
+		OK = FPMPNGWriterFinish(streamContext.writer);
+	}
+	else
+	{
+		if (!settings->quiet && shared->outputCount == 1)  printf("Writing...\n");
+		OK = FPMWritePNG(resultPM, output->path, writeFlags, kFPMGammaLinear, kFPMGammaSRGB, LoadErrorHandler, NULL, NULL);
+		FPMRelease(&resultPM);
+		task->writeTiming.start = writeStart;
+	}
+	task->writeTiming.end = CurrentTime();
+	task->writeTiming.busy += task->writeTiming.end - writeStart;
+	
+	return OK;
+}
+
+
+static void FinishedRendering(SharedRenderState *shared)
+{
+	if (__atomic_sub_fetch(&shared->renderingCount, 1, __ATOMIC_ACQ_REL) != 0)  return;
+	
+	// This was the last output using the source chain.
+	const Settings *settings = shared->settings;
+	FPMRelease(&shared->sourcePM);
+	SourceTileCacheRelease(&shared->sourceTiles);
+	ResamplingMapClose(&shared->map);
+	if (shared->destructor != NULL)  shared->destructor(shared->sourceContext);
+	
+	if (!settings->quiet)  printf("\n");
+	
+	RenderStatistics *statistics = &shared->statistics;
+	if (!settings->quiet && (settings->flags & kRenderAdaptive) && statistics->pixelCount != 0)
+	{
+		printf("Refined %ju of %ju pixels (%.1f%%).\n", statistics->refinedPixelCount, statistics->pixelCount, 100.0 * (double)statistics->refinedPixelCount / (double)statistics->pixelCount);
+	}
+}
+
+
+//	Progress of each output is recorded, and the mean over all outputs printed.
+static bool OutputProgress(size_t numerator, size_t denominator, void *context)
+{
+	OutputTask *task = context;
+	SharedRenderState *shared = task->shared;
+	if (denominator == 0)  return true;
+	
+	__atomic_store_n(&task->progress, (unsigned)((uint64_t)numerator * kOutputProgressScale / denominator), __ATOMIC_RELAXED);
+	
+	size_t i, total = 0;
+	for (i = 0; i < shared->outputCount; i++)
+	{
+		total += __atomic_load_n(&shared->tasks[i].progress, __ATOMIC_RELAXED);
+	}
+	
+	return PrintProgress(total, (size_t)shared->outputCount * kOutputProgressScale, &shared->progressPercentage);
+}
+
+
+/*	Batch mode.
+	
+	Jobs run kBatchPipelineDepth at a time, each on a task of its own, so
+	that while one job is rendering, the next is reading its input and the
+	previous one is writing its outputs. Rendering uses the shared thread
+	pool a job set at a time, so jobs don't compete for the render threads.
+*/
+enum
+{
+	kBatchPipelineDepth				= 3
+};
+
+
+typedef struct
+{
+	Settings						settings;
+	const char						**arguments;
+	unsigned						lineNumber;
+	bool							succeeded;
+} BatchJob;
+
+
+typedef struct
+{
+	const char						*path;
+	BatchJob						*jobs;
+	unsigned						jobCount;
+	unsigned						nextJob;		// Accessed atomically.
+	unsigned						finishedCount;	// Accessed atomically.
+	bool							quiet;
+} BatchState;
+
+
+static char *ReadBatchFile(const char *path);
+static int SplitBatchLine(char *line, const char **arguments);
+static bool RunBatchJobs(void *context);
+
+
+static bool RunBatch(const Settings *defaults)
+{
+	char *text = ReadBatchFile(defaults->batchPath);
+	if (text == NULL)
+	{
+		fprintf(stderr, "Could not read batch file %s.\n", defaults->batchPath);
+		return false;
+	}
+	
+	BatchState state = { .path = defaults->batchPath, .quiet = defaults->quiet };
+	unsigned capacity = 0, lineNumber = 0;
+	bool OK = true;
+	
+	// Parse every job up front, so that mistakes are reported before anything is rendered.
+	char *line, *next;
+	for (line = text; line != NULL && OK; line = next)
+	{
+		next = strchr(line, '\n');
+		if (next != NULL)  *next++ = '\0';
+		lineNumber++;
+		
+		const char *start = line + strspn(line, " \t\r");
+		if (*start == '\0' || *start == '#')  continue;
+		
+		if (state.jobCount == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 16;
+			BatchJob *jobs = realloc(state.jobs, capacity * sizeof *jobs);
+			if (jobs == NULL)
+			{
+				fprintf(stderr, "Out of memory reading batch file.\n");
+				OK = false;
+				break;
+			}
+			state.jobs = jobs;
+		}
+		
+		// No more arguments than half the line's length, plus the program name.
+		const char **arguments = malloc((strlen(line) / 2 + 2) * sizeof *arguments);
+		if (arguments == NULL)
+		{
+			fprintf(stderr, "Out of memory reading batch file.\n");
+			OK = false;
+			break;
+		}
+		
+		BatchJob *job = &state.jobs[state.jobCount++];
+		job->arguments = arguments;
+		job->lineNumber = lineNumber;
+		job->succeeded = false;
+		job->settings = *defaults;
+		job->settings.batchPath = NULL;
+		job->settings.quiet = true;
+		
+		arguments[0] = "planettool";
+		int argumentCount = SplitBatchLine(line, arguments + 1);
+		if (argumentCount < 0)
+		{
+			fprintf(stderr, "Unterminated quote.\n");
+			OK = false;
+		}
+		else
+		{
+			OK = InterpretArguments(argumentCount + 1, arguments, &job->settings);
+			if (OK && job->settings.batchPath != NULL)
+			{
+				fprintf(stderr, "Batch files can't contain --batch.\n");
+				OK = false;
+			}
+		}
+		
+		if (!OK)  fprintf(stderr, "Could not interpret line %u of batch file %s.\n", lineNumber, state.path);
+	}
+	
+	if (OK && state.jobCount == 0)
+	{
+		fprintf(stderr, "Batch file %s contains no jobs.\n", state.path);
+		OK = false;
+	}
+	
+	if (OK)
+	{
+		if (!state.quiet)  printf("Running %u jobs...\n", state.jobCount);
+		
+		void *lanes[kBatchPipelineDepth];
+		unsigned i, laneCount = (state.jobCount < kBatchPipelineDepth) ? state.jobCount : kBatchPipelineDepth;
+		for (i = 0; i < laneCount; i++)  lanes[i] = &state;
+		ScheduleConcurrentTasks(RunBatchJobs, lanes, laneCount);
+		
+		unsigned failedCount = 0;
+		for (i = 0; i < state.jobCount; i++)
+		{
+			if (!state.jobs[i].succeeded)  failedCount++;
+		}
+		
+		if (failedCount != 0)
+		{
+			fprintf(stderr, "%u of %u jobs failed.\n", failedCount, state.jobCount);
+			OK = false;
+		}
+		else if (!state.quiet)  printf("Done.\n");
+	}
+	
+	unsigned i;
+	for (i = 0; i < state.jobCount; i++)
+	{
+		free(state.jobs[i].arguments);
+	}
+	free(state.jobs);
+	free(text);
+	
+	return OK;
+}
+
+
+/*	RunBatchJobs()
+	One stage of the batch pipeline: takes jobs in order until there are none
+	left.
+*/
+static bool RunBatchJobs(void *context)
+{
+	BatchState *state = context;
+	
+	for (;;)
+	{
+		unsigned index = __atomic_fetch_add(&state->nextJob, 1, __ATOMIC_RELAXED);
+		if (index >= state->jobCount)  break;
+		
+		BatchJob *job = &state->jobs[index];
+		job->succeeded = RunJob(&job->settings);
+		
+		unsigned finished = __atomic_add_fetch(&state->finishedCount, 1, __ATOMIC_RELAXED);
+		const Settings *settings = &job->settings;
+		const char *name = (settings->outputCount != 0) ? settings->outputs[0].path : settings->cacheSourcePath;
+		
+		if (!job->succeeded)
+		{
+			fprintf(stderr, "Job on line %u of %s (%s) failed.\n", job->lineNumber, state->path, name);
+		}
+		else if (!state->quiet)
+		{
+			printf("[%u/%u] %s\n", finished, state->jobCount, name);
+			fflush(stdout);
+		}
+	}
+	
+	return true;
+}
+
+
+static char *ReadBatchFile(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL)  return NULL;
+	
+	size_t length = 0, capacity = 4096;
+	char *text = malloc(capacity);
+	
+	while (text != NULL)
+	{
+		length += fread(text + length, 1, capacity - length - 1, file);
+		if (length < capacity - 1)  break;
+		
+		capacity *= 2;
+		char *newText = realloc(text, capacity);
+		if (newText == NULL)  free(text);
+		text = newText;
+	}
+	
+	if (text != NULL)
+	{
+		text[length] = '\0';
+		if (ferror(file))
+		{
+			free(text);
+			text = NULL;
+		}
+	}
+	
+	fclose(file);
+	return text;
+}
+
+
+/*	SplitBatchLine()
+	Split a line into whitespace-separated arguments in place. Double or
+	single quotes group characters, including spaces, into one argument.
+	Returns the argument count, or -1 if a quote is unterminated.
+*/
+static int SplitBatchLine(char *line, const char **arguments)
+{
+	char *read = line, *write = line;
+	int count = 0;
+	
+	for (;;)
+	{
+		while (isspace((unsigned char)*read))  read++;
+		if (*read == '\0')  break;
+		
+		arguments[count++] = write;
+		char quote = '\0';
+		while (*read != '\0' && (quote != '\0' || !isspace((unsigned char)*read)))
+		{
+			if (quote == '\0' && (*read == '"' || *read == '\''))  quote = *read;
+			else if (*read == quote)  quote = '\0';
+			else  *write++ = *read;
+			read++;
+		}
+		if (quote != '\0')  return -1;
+		
+		bool atEnd = (*read == '\0');
+		*write++ = '\0';
+		if (atEnd)  break;
+		read++;
+	}
+	
+	return count;
+}
+
+
+/*	LoadSource()
+	Read the input file, which may be a native file written by --cache-source
+	or a PNG. PNGs are looked up in the source disk cache first, if enabled.
+*/
+static FloatPixMapRef LoadSource(const Settings *settings, bool tiledInput)
+{
+	if (FPMIsNativeFile(settings->sourcePath))
+	{
+		// Used in whatever format it was stored in.
+		return FPMCreateWithNative(settings->sourcePath, kFPMNativeVerifyChecksum, LoadErrorHandler, NULL);
+	}
+	
+	FPMPNGReaderRef reader = FPMPNGReaderCreate(settings->sourcePath, kFPMGammaLinear, NULL, NULL, NULL);
+	if (reader == NULL)  return NULL;
+	
+	/*	By default, tiled input keeps the file's own depth, and everything
+		else is expanded to floats up front.
+	*/
+	FPMPixelFormat format = kFPMFormatRGBAFloat;
+	if (settings->haveInputFormat)  format = settings->inputFormat;
+	else if (tiledInput)  format = (FPMPNGReaderGetBitsPerChannel(reader) == 16) ? kFPMFormatRGBA16 : kFPMFormatRGBA8;
+	
+	SourceDiskCacheKey cacheKey;
+	bool useCache = settings->sourceCacheDirectory != NULL && SourceDiskCacheMakeKey(settings->sourcePath, format, kFPMGammaLinear, &cacheKey);
+	if (useCache)
+	{
+		FloatPixMapRef cached = SourceDiskCacheLookUp(settings->sourceCacheDirectory, &cacheKey);
+		if (!settings->quiet)  printf("Source cache %s.\n", (cached != NULL) ? "hit" : "miss");
+		if (cached != NULL)
+		{
+			FPMPNGReaderAbort(reader);
+			return cached;
+		}
+	}
+	
+	FloatPixMapRef result = FPMCreateWithPNGReader(reader, format);
+	
+	if (result != NULL && useCache)
+	{
+		SourceDiskCacheStoreResult storeResult;
+		if (SourceDiskCacheStore(settings->sourceCacheDirectory, settings->sourceCacheLimit, &cacheKey, result, &storeResult))
+		{
+			if (!settings->quiet)  printf("Stored decoded source in cache (evicted %u entries, %ju MiB; cache now holds %ju MiB).\n", storeResult.evictedCount, storeResult.evictedBytes >> 20, storeResult.totalBytes >> 20);
+		}
+		else
+		{
+			fprintf(stderr, "WARNING: could not write to source cache %s.\n", settings->sourceCacheDirectory);
+		}
+	}
+	
+	return result;
+}
+
+
+/*	MapKey()
+	Describe the settings a resampling map depends on, other than the sizes
+	of the input and output images, which are stored in the map itself.
+*/
+static void MapKey(const Settings *settings, char key[kMapKeyLength])
+{
+	const OutputSettings *output = &settings->outputs[0];
+	int length = snprintf(key, kMapKeyLength, "%s to %s %zu,", settings->source->keys.name, output->sink->keys.name, output->size);
+	
+	unsigned i, j;
+	for (i = 0; i < 4; i++)
 	{
-		void *cosBlurContext = NULL;
-		if (!CosineBlurFilterSetUp(source, destructor, sourceContext, settings.size, settings.cosBlurBackFactor, settings.cosBlurFrontFactor, &cosBlurContext))
+		for (j = 0; j < 4 && length < kMapKeyLength; j++)
 		{
-			return EXIT_FAILURE;
+			length += snprintf(key + length, kMapKeyLength - length, " %.9g", settings->transform.m[i][j]);
 		}
-		
-		source = CosineBlurFilter;
-		destructor = CosineBlurFilterDestructor;
-		sourceContext = cosBlurContext;
 	}
+}
+
+
+static bool StreamOutputRows(FloatPixMapRef rows, FPMCoordinate firstRow, FPMSize imageSize, void *vcontext)
+{
+	StreamOutputContext *context = vcontext;
+	double start = CurrentTime();
 	
-	// Render.
-	ProgressCallbackFunction progressCB = NULL;
-	unsigned progressCtxt = 0;
-	if (!settings.quiet)
+	if (context->writer == NULL)
 	{
-		printf("Rendering...\n");
-		progressCB = PrintProgress;
+		context->timing->start = start;
+		context->writer = FPMPNGWriterCreate(context->path, imageSize, context->flags, kFPMGammaLinear, kFPMGammaSRGB, LoadErrorHandler, NULL, NULL);
+		if (context->writer == NULL)  return false;
 	}
 	
-	FloatPixMapRef resultPM = settings.sink->sink(settings.size, settings.flags, source, sourceContext, progressCB, RenderErrorHandler, &progressCtxt);
-	FPMRelease(&sourcePM);
-	if (!settings.quiet)  printf("\n");
+	bool OK = FPMPNGWriterAppendRows(context->writer, rows);
+	context->timing->busy += CurrentTime() - start;
+	return OK;
+}
+
+
+/*	PrintTiming()
+	Print the interval of each phase of a job, relative to its start, and how
+	much writing was done while rendering was still under way.
+*/
+static void PrintPhaseTiming(const char *phase, const char *name, const PhaseTiming *timing, double origin)
+{
+	printf("  %-7s%8.3f -%8.3f s", phase, timing->start - origin, timing->end - origin);
+	if (timing->busy != timing->end - timing->start)  printf("  (busy%8.3f s)", timing->busy);
+	printf("  %s\n", name);
+}
+
+
+static void PrintTiming(const SharedRenderState *shared)
+{
+	double origin = shared->startTime, end = origin, overlap = 0.0;
+	unsigned i;
 	
-	if (resultPM == NULL)
+	printf("Timing:\n");
+	if (shared->readTiming.end != 0.0)
 	{
-		fprintf(stderr, "Rendering failed.\n");
-		return EXIT_FAILURE;
+		PrintPhaseTiming("read", shared->settings->sourcePath, &shared->readTiming, origin);
+		end = shared->readTiming.end;
 	}
 	
-	// Destructimacate.
-	if (destructor != NULL)  destructor(sourceContext);
-	
-	// Write output.
-	if (!settings.quiet)  printf("Writing...\n");
-	FPMWritePNGFlags flags = kFPMWritePNGDither;
-	if (settings.sixteenBit)  flags = kFPMWritePNG16BPC;
-	if (!FPMWritePNG(resultPM, settings.sinkPath, flags, kFPMGammaLinear, kFPMGammaSRGB, LoadErrorHandler, NULL, NULL))
+	for (i = 0; i < shared->outputCount; i++)
 	{
-		return EXIT_FAILURE;
+		const OutputTask *task = &shared->tasks[i];
+		PrintPhaseTiming("render", task->output->path, &task->renderTiming, origin);
+		PrintPhaseTiming("write", task->output->path, &task->writeTiming, origin);
+		
+		// Everything after rendering finished counts as busy, so the rest of the busy time overlapped it.
+		double writeOverlap = task->writeTiming.busy - (task->writeTiming.end - task->renderTiming.end);
+		if (writeOverlap > 0.0)  overlap += writeOverlap;
+		if (task->writeTiming.end > end)  end = task->writeTiming.end;
 	}
 	
-	if (!settings.quiet)  printf("Done.\n");
-	return 0;
+	printf("  total %9.3f s; %.3f s of writing overlapped rendering\n", end - origin, overlap);
+}
+
+
+/*	FloatPixMap bulk operations, such as PNG strip compression, run on the
+	render threads when they are free. With --stream, they don't wait for
+	the band being rendered alongside them.
+*/
+static bool ScheduleFPMWork(FPMWorkFunction work, void *workContext, size_t count, void *context)
+{
+	return ScheduleSideWork(work, workContext, count);
+}
+
+
+static double CurrentTime(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (double)now.tv_sec + (double)now.tv_usec * 1e-6;
 }
 
 
@@ -231,18 +1023,36 @@ static bool ParseOutput(int argc, const char *argv[], int *consumedArgs, Setting
 static bool ParseSize(int argc, const char *argv[], int *consumedArgs, Settings *settings);
 static bool ParseFast(int argc, const char *argv[], int *consumedArgs, Settings *settings);
 static bool ParseJitter(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseSharedSamples(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParsePrefilter(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseAdaptive(int argc, const char *argv[], int *consumedArgs, Settings *settings);
 static bool ParseSixteenBit(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseStream(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseTiledInput(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseInputFormat(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseCacheSource(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseSourceCache(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseSourceCacheLimit(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseThreads(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParsePinThreads(int argc, const char *argv[], int *consumedArgs, Settings *settings);
 static bool ParseRotate(int argc, const char *argv[], int *consumedArgs, Settings *settings);
 static bool ParseCosBlur(int argc, const char *argv[], int *consumedArgs, Settings *settings);
 static bool ParseFlip(int argc, const char *argv[], int *consumedArgs, Settings *settings);
 static bool ParseHelp(int argc, const char *argv[], int *consumedArgs, Settings *settings);
 static bool ParseVersion(int argc, const char *argv[], int *consumedArgs, Settings *settings);
 static bool ParseQuiet(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseBatch(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseTiming(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParsePNGCompression(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseSaveMap(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseUseMap(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseNoDirect(int argc, const char *argv[], int *consumedArgs, Settings *settings);
+static bool ParseDirectCube(int argc, const char *argv[], int *consumedArgs, Settings *settings);
 
 
 static const SourceEntry sGenerators[] =
 {
-	{{ "grid1",				'g', },	LatLongGridGeneratorConstructor, NULL }
+	{{ "grid1",				'g', },	LatLongGridGeneratorConstructor, NULL, NULL, NULL, kDirectLayoutNone }
 };
 
 enum { sGeneratorCount = sizeof sGenerators / sizeof sGenerators[0] };
@@ -250,9 +1060,9 @@ enum { sGeneratorCount = sizeof sGenerators / sizeof sGenerators[0] };
 
 static const SourceEntry sReaders[] =
 {
-	{{ "latlong",			'l', },	ReadLatLongConstructor, ReadLatLongDestructor },
-	{{ "cube",				'c', },	ReadCubeConstructor, ReadCubeDestructor },
-	{{ "cubex",				'x', },	ReadCubeCrossConstructor, ReadCubeDestructor },
+	{{ "latlong",			'l', },	ReadLatLongConstructor, ReadLatLongDestructor, ReadLatLongTiledConstructor, ReadLatLongGetTaps, kDirectLayoutLatLong },
+	{{ "cube",				'c', },	ReadCubeConstructor, ReadCubeDestructor, ReadCubeTiledConstructor, ReadCubeGetTaps, kDirectLayoutCube },
+	{{ "cubex",				'x', },	ReadCubeCrossConstructor, ReadCubeDestructor, ReadCubeCrossTiledConstructor, ReadCubeGetTaps, kDirectLayoutCubeCross },
 };
 
 enum { sReaderCount = sizeof sReaders / sizeof sReaders[0] };
@@ -260,11 +1070,11 @@ enum { sReaderCount = sizeof sReaders / sizeof sReaders[0] };
 
 static const SinkEntry sSinks[] =
 {
-	{{ "latlong",			'l', },	RenderToLatLong, 2048 },
-	{{ "cube",				'c', },	RenderToCube, 1024 },
-	{{ "cubex",				'x', },	RenderToCubeCross, 1024 },
-	{{ "mercator",			'm', },	RenderToMercator, 2048 },
-	{{ "gall-peters",		'g', },	RenderToGallPeters, 2048 }
+	{{ "latlong",			'l', },	RenderToLatLong, 2048, CanRenderToLatLongDirect, RenderToLatLongDirect },
+	{{ "cube",				'c', },	RenderToCube, 1024, CanRenderToCubeDirect, RenderToCubeDirect },
+	{{ "cubex",				'x', },	RenderToCubeCross, 1024, CanRenderToCubeDirect, RenderToCubeCrossDirect },
+	{{ "mercator",			'm', },	RenderToMercator, 2048, NULL, NULL },
+	{{ "gall-peters",		'g', },	RenderToGallPeters, 2048, NULL, NULL }
 };
 
 enum { sSinkCount = sizeof sSinks / sizeof sSinks[0] };
@@ -292,7 +1102,7 @@ static const ArgumentHandler sHandlers[] =
 {
 	{
 		"output",		'o', 2, ParseOutput,
-		"<outType> <outFile>", true, false, "Type and name of output file. Type must be one of: ", (FilterEntryBase *)sSinks, sizeof(*sSinks), sSinkCount
+		"<outType> <outFile>", true, false, "Type and name of output file. May be repeated to render several outputs from one source. Type must be one of: ", (FilterEntryBase *)sSinks, sizeof(*sSinks), sSinkCount
 	},
 	{
 		"input",		'i', 2, ParseInput,
@@ -302,9 +1112,13 @@ static const ArgumentHandler sHandlers[] =
 		"generate",		'g', 1, ParseGenerate,
 		"<generator>", false, false, "Type and name of generator. Type must be one of: ", (FilterEntryBase *)sGenerators, sizeof(*sGenerators), sGeneratorCount
 	},
+	{
+		"batch",		0, 1, ParseBatch,
+		"<batchFile>", false, false, "Run each job listed in batchFile, one per line. A job is written as arguments on the command line would be, such as --input, --output, --size and --rotate, with \" or ' quoting arguments containing spaces; lines starting with # are ignored. Other options given along with --batch apply to every job. Jobs are pipelined, so that loading, rendering and writing of different jobs overlap.", NULL, 0, 0
+	},
 	{
 		"size",			'S', 1, ParseSize,
-		"<size>", false, false, "Size of output, in pixels. Interpretation depends on output type.", NULL, 0, 0
+		"<size>", false, false, "Size of output, in pixels. Interpretation depends on output type. Applies to the preceding --output, or to all outputs if given before any.", NULL, 0, 0
 	},
 	{
 		"fast",			'F', 0, ParseFast,
@@ -314,10 +1128,74 @@ static const ArgumentHandler sHandlers[] =
 		"jitter",		'J', 0, ParseJitter,
 		NULL, false, false, "Use jittering for slower, slightly noisy rendering which may look better in some cases.", NULL, 0, 0
 	},
+	{
+		"shared-samples",	0, 0, ParseSharedSamples,
+		NULL, false, false, "Share supersamples between neighbouring pixels where the output type supports it (currently latlong). Faster, but results differ very slightly.", NULL, 0, 0
+	},
+	{
+		"prefilter",	0, 0, ParsePrefilter,
+		NULL, false, false, "Build reduced, prefiltered copies of the input image and sample them according to the output's pixel size, taking 9 instead of 121 samples per pixel. Much faster, and free of aliasing when the output has less detail than the input; results differ slightly. Uses a third more memory for the input. Ignored with --fast; not available with --tiled-input.", NULL, 0, 0
+	},
+	{
+		"adaptive",		0, 1, ParseAdaptive,
+		"<threshold>", false, false, "Probe each pixel with nine samples, and only use full supersampling where their variance exceeds threshold (measured on the square roots of the colour values, so that dark areas are treated like light ones). 0.0001 is a reasonable starting point: smooth areas then come out within one or two eight-bit steps of full rendering, but pixels with detail finer than the probe's spacing, such as thin lines, may be off by up to about 35 steps.", NULL, 0, 0
+	},
 	{
 		"sixteen-bit",	0, 0, ParseSixteenBit,
 		NULL, false, false, "Save in sixteen bit per channel format (instead of eight-bit-per-channel format).", NULL, 0, 0
 	},
+	{
+		"png-compression",	0, 1, ParsePNGCompression,
+		"<level>", false, false, "zlib compression level for output files, from 0 (fastest) to 9 (smallest). Defaults to 6.", NULL, 0, 0
+	},
+	{
+		"stream",		0, 0, ParseStream,
+		NULL, false, false, "Write the output file while rendering, a band of rows at a time, instead of keeping the whole image in memory.", NULL, 0, 0
+	},
+	{
+		"tiled-input",	0, 0, ParseTiledInput,
+		NULL, false, false, "Keep the input image in its compact eight- or sixteen-bit form, converting it a tile at a time as it's sampled. Uses a quarter or half of the memory, but is somewhat slower.", NULL, 0, 0
+	},
+	{
+		"input-format",	0, 1, ParseInputFormat,
+		"<format>", false, false, "Storage format for the input image: float (the default), rgba8, rgba16 or half. The compact formats use a quarter or half of the memory; rgba8 loses precision for sixteen-bit images. With --tiled-input, the default is the file's own depth.", NULL, 0, 0
+	},
+	{
+		"cache-source",	0, 1, ParseCacheSource,
+		"<cacheFile>", false, false, "Write the loaded input image to cacheFile in native format (with the storage format chosen by --input-format). A cache file can be given to --input instead of a PNG; it is mapped into memory directly, with no decoding. If no output is specified, planettool stops after writing the cache.", NULL, 0, 0
+	},
+	{
+		"source-cache",	0, 1, ParseSourceCache,
+		"<directory>", false, false, "Keep decoded input images in directory, keyed by the input file's contents and --input-format, and reuse them on later runs instead of decoding the PNG again.", NULL, 0, 0
+	},
+	{
+		"source-cache-limit",	0, 1, ParseSourceCacheLimit,
+		"<megabytes>", false, false, "Maximum total size of the --source-cache directory; the least recently used entries are deleted to stay within it. Defaults to 4096.", NULL, 0, 0
+	},
+	{
+		"save-map",		0, 1, ParseSaveMap,
+		"<mapFile>", false, false, "Record which input pixels make up each output pixel, and with what weights, in mapFile. Other images of the same size can then be converted with the same settings using --use-map. Requires an input file and exactly one output; can't be combined with --fast, --jitter, --shared-samples, --prefilter, --adaptive or --tiled-input. Map files are large: about six bytes per input pixel sampled by each output pixel.", NULL, 0, 0
+	},
+	{
+		"use-map",		0, 1, ParseUseMap,
+		"<mapFile>", false, false, "Convert the input by gathering input pixels as recorded in mapFile by --save-map, which is much faster than rendering. The input type and size, output type and size, and --rotate and --flip settings must be the same as when the map was saved. May be given along with --batch.", NULL, 0, 0
+	},
+	{
+		"no-direct",	0, 0, ParseNoDirect,
+		NULL, false, false, "Always render through the full sampling pipeline. By default, latlong to latlong conversions which only turn the planet around its axis or flip it are resampled directly, which is much faster; results may differ from full rendering by one or two eight-bit steps near the poles.", NULL, 0, 0
+	},
+	{
+		"direct-cube",	0, 0, ParseDirectCube,
+		NULL, false, false, "Also resample conversions between cube and cubex images directly when they only swap axes by multiples of 90 degrees or flip. This is much faster, but each face is filtered on its own, so pixels next to face edges may differ from full rendering by tens of eight-bit steps. Ignored with --no-direct.", NULL, 0, 0
+	},
+	{
+		"threads",		0, 1, ParseThreads,
+		"<count>", false, false, "Number of rendering threads. Defaults to the PLANETTOOL_THREADS environment variable if set, otherwise the number of available processors; never more than the available processors.", NULL, 0, 0
+	},
+	{
+		"pin-threads",	0, 0, ParsePinThreads,
+		NULL, false, false, "Bind each rendering thread to one processor, keeping output memory local to it on NUMA systems.", NULL, 0, 0
+	},
 	{
 		"flip",			'L', 0, ParseFlip,
 		NULL, false, false, "Mirror the texture in 3D space (through the YZ plane) while rendering. This produces an \"inside-out\" texture.", NULL, 0, 0
@@ -342,6 +1220,10 @@ static const ArgumentHandler sHandlers[] =
 		"quiet",		'Q', 0, ParseQuiet,
 		NULL, false, false, "Don't print progress information.", NULL, 0, 0
 	},
+	{
+		"timing",		0, 0, ParseTiming,
+		NULL, false, false, "Print when reading the input and rendering and writing each output started and finished, and how much of that work overlapped. Writing overlaps rendering with --stream.", NULL, 0, 0
+	},
 };
 
 static const unsigned sHandlerCount = sizeof sHandlers / sizeof sHandlers[0];
@@ -423,18 +1305,68 @@ static bool InterpretArguments(int argc, const char * argv[], Settings *settings
 		ShowVersion();
 	}
 	
+	if (!error && settings->batchPath != NULL)
+	{
+		// Inputs and outputs come from the batch file.
+		if (settings->source != NULL || settings->outputCount != 0 || settings->cacheSourcePath != NULL || settings->saveMapPath != NULL)
+		{
+			fprintf(stderr, "--batch can't be combined with --input, --generate, --output, --cache-source or --save-map.\n");
+			error = true;
+		}
+		return !error;
+	}
+	
 	if (!error && settings->source == NULL)
 	{
 		if (!settings->showHelp || settings->showVersion)  fprintf(stderr, "No %s specified. Try planettool --help for help.\n", "input");
 		error = true;
 	}
-	if (!error && settings->sink == NULL)
+	if (!error && settings->cacheSourcePath != NULL && settings->sourcePath == NULL)
+	{
+		fprintf(stderr, "--cache-source requires an input file.\n");
+		error = true;
+	}
+	if (!error && settings->outputCount == 0 && settings->cacheSourcePath == NULL)
 	{
 		if (!settings->showHelp || settings->showVersion)  fprintf(stderr, "No %s specified. Try planettool --help for help.\n", "output");
 		error = true;
 	}
+	if (!error && (settings->flags & kRenderPrefiltered) && settings->tiledInput)
+	{
+		fprintf(stderr, "--prefilter can't be combined with --tiled-input.\n");
+		error = true;
+	}
+	
+	const char *mapOption = (settings->saveMapPath != NULL) ? "--save-map" : "--use-map";
+	bool usingMap = settings->saveMapPath != NULL || settings->useMapPath != NULL;
+	if (!error && settings->saveMapPath != NULL && settings->useMapPath != NULL)
+	{
+		fprintf(stderr, "--save-map can't be combined with --use-map.\n");
+		error = true;
+	}
+	if (!error && usingMap && (settings->sourcePath == NULL || settings->outputCount != 1))
+	{
+		fprintf(stderr, "%s requires an input file and exactly one output.\n", mapOption);
+		error = true;
+	}
+	if (!error && usingMap && (settings->tiledInput || settings->cosBlur))
+	{
+		fprintf(stderr, "%s can't be combined with --tiled-input or --cosblur.\n", mapOption);
+		error = true;
+	}
+	if (!error && settings->saveMapPath != NULL && (settings->flags & (kRenderFast | kRenderJitter | kRenderSharedSamples | kRenderAdaptive | kRenderPrefiltered)))
+	{
+		fprintf(stderr, "--save-map can't be combined with --fast, --jitter, --shared-samples, --adaptive or --prefilter.\n");
+		error = true;
+	}
 	
-	if (settings->size == 0)  settings->size = settings->defaultSize;
+	unsigned i;
+	for (i = 0; i < settings->outputCount; i++)
+	{
+		OutputSettings *output = &settings->outputs[i];
+		if (output->size == 0)  output->size = settings->size;
+		if (output->size == 0)  output->size = output->sink->defaultSize;
+	}
 	
 	return !error;
 }
@@ -535,9 +1467,12 @@ static bool ParseOutput(int argc, const char *argv[], int *consumedArgs, Setting
 		
 		if (match)
 		{
-			settings->sink = sink;
-			settings->sinkPath = outputPath;
-			settings->defaultSize = sink->defaultSize;
+			if (settings->outputCount == kMaxOutputs)
+			{
+				fprintf(stderr, "Too many outputs; at most %u may be specified.\n", kMaxOutputs);
+				return false;
+			}
+			settings->outputs[settings->outputCount++] = (OutputSettings){ sink, outputPath, 0 };
 			break;
 		}
 	}
@@ -569,7 +1504,9 @@ static bool ParseSize(int argc, const char *argv[], int *consumedArgs, Settings
 		return false;
 	}
 	
-	settings->size = size;
+	// --size applies to the preceding --output, or to all outputs if it comes first.
+	if (settings->outputCount != 0)  settings->outputs[settings->outputCount - 1].size = size;
+	else  settings->size = size;
 	return true;
 }
 
@@ -588,6 +1525,20 @@ static bool ParseJitter(int argc, const char *argv[], int *consumedArgs, Setting
 }
 
 
+static bool ParseSharedSamples(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->flags |= kRenderSharedSamples;
+	return true;
+}
+
+
+static bool ParsePrefilter(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->flags |= kRenderPrefiltered;
+	return true;
+}
+
+
 static bool ParseSixteenBit(int argc, const char *argv[], int *consumedArgs, Settings *settings)
 {
 	settings->sixteenBit = true;
@@ -595,6 +1546,151 @@ static bool ParseSixteenBit(int argc, const char *argv[], int *consumedArgs, Set
 }
 
 
+static bool ParseStream(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->stream = true;
+	return true;
+}
+
+
+static bool ParseTiledInput(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->tiledInput = true;
+	return true;
+}
+
+
+static bool ParseInputFormat(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	*consumedArgs += 1;
+	
+	if (strcmp(argv[0], "float") == 0)  settings->inputFormat = kFPMFormatRGBAFloat;
+	else if (strcmp(argv[0], "rgba8") == 0)  settings->inputFormat = kFPMFormatRGBA8;
+	else if (strcmp(argv[0], "rgba16") == 0)  settings->inputFormat = kFPMFormatRGBA16;
+	else if (strcmp(argv[0], "half") == 0)  settings->inputFormat = kFPMFormatRGBAHalf;
+	else
+	{
+		fprintf(stderr, "Unknown input format \"%s\"; must be float, rgba8, rgba16 or half.\n", argv[0]);
+		return false;
+	}
+	
+	settings->haveInputFormat = true;
+	return true;
+}
+
+
+static bool ParseCacheSource(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->cacheSourcePath = argv[0];
+	*consumedArgs += 1;
+	return true;
+}
+
+
+static bool ParseSourceCache(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->sourceCacheDirectory = argv[0];
+	*consumedArgs += 1;
+	return true;
+}
+
+
+static bool ParseSourceCacheLimit(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	char *end = NULL;
+	errno = 0;
+	uintmax_t megabytes = strtoumax(argv[0], &end, 10);
+	*consumedArgs += 1;
+	
+	if (*end != '\0' || errno == ERANGE || errno == EINVAL || megabytes > (UINTMAX_MAX >> 20))
+	{
+		fprintf(stderr, "Could not interpret source cache limit argument \"%s\" as a positive integer.\n", argv[0]);
+		return false;
+	}
+	
+	settings->sourceCacheLimit = megabytes << 20;
+	return true;
+}
+
+
+static bool ParseThreads(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	char *end = NULL;
+	unsigned long count = strtoul(argv[0], &end, 10);
+	*consumedArgs += 1;
+	
+	if (*end != '\0' || errno == ERANGE || errno == EINVAL || count > UINT_MAX)
+	{
+		fprintf(stderr, "Could not interpret thread count argument \"%s\" as a positive integer.\n", argv[0]);
+		return false;
+	}
+	
+	if (count < 1)
+	{
+		fprintf(stderr, "Thread count may not be zero.\n");
+		return false;
+	}
+	
+	settings->threadCount = count;
+	return true;
+}
+
+
+static bool ParseSaveMap(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->saveMapPath = argv[0];
+	*consumedArgs += 1;
+	return true;
+}
+
+
+static bool ParseUseMap(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->useMapPath = argv[0];
+	*consumedArgs += 1;
+	return true;
+}
+
+
+static bool ParseNoDirect(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->noDirect = true;
+	return true;
+}
+
+
+static bool ParseDirectCube(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->directCube = true;
+	return true;
+}
+
+
+static bool ParsePNGCompression(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	char *end = NULL;
+	unsigned long level = strtoul(argv[0], &end, 10);
+	*consumedArgs += 1;
+	
+	if (*end != '\0' || errno == ERANGE || errno == EINVAL || level > 9)
+	{
+		fprintf(stderr, "Could not interpret PNG compression level \"%s\" as an integer from 0 to 9.\n", argv[0]);
+		return false;
+	}
+	
+	settings->havePNGCompression = true;
+	settings->pngCompression = level;
+	return true;
+}
+
+
+static bool ParsePinThreads(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->pinThreads = true;
+	return true;
+}
+
+
 static bool ParseOneFloat(const char *string, double *value)
 {
 	assert(string != NULL && value != NULL);
@@ -642,6 +1738,20 @@ static bool ParseCosBlur(int argc, const char *argv[], int *consumedArgs, Settin
 }
 
 
+static bool ParseAdaptive(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	*consumedArgs += 1;
+	if (!ParseOneFloat(argv[0], &settings->adaptiveThreshold))  return false;
+	if (settings->adaptiveThreshold < 0.0)
+	{
+		fprintf(stderr, "Adaptive threshold may not be negative.\n");
+		return false;
+	}
+	settings->flags |= kRenderAdaptive;
+	return true;
+}
+
+
 static bool ParseFlip(int argc, const char *argv[], int *consumedArgs, Settings *settings)
 {
 	settings->transform = OOMatrixScale(settings->transform, -1, 1, 1);
@@ -670,6 +1780,35 @@ static bool ParseQuiet(int argc, const char *argv[], int *consumedArgs, Settings
 }
 
 
+static bool ParseTiming(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->timing = true;
+	return true;
+}
+
+
+static bool ParseBatch(int argc, const char *argv[], int *consumedArgs, Settings *settings)
+{
+	settings->batchPath = argv[0];
+	*consumedArgs = 1;
+	return true;
+}
+
+
+//	Write the label for a handler’s description in the help, returning its length.
+static int GetHelpLabel(const ArgumentHandler *handler, char *label, size_t size)
+{
+	if (handler->shortcut != '\0')
+	{
+		return snprintf(label, size, "--%s, -%c", handler->keyword, handler->shortcut);
+	}
+	else
+	{
+		return snprintf(label, size, "--%s", handler->keyword);
+	}
+}
+
+
 static void ShowHelp(bool showHidden)
 {
 	printf("Planettool version %s\nplanettool", PLANETTOOL_VERSION);
@@ -701,23 +1840,25 @@ static void ShowHelp(bool showHidden)
 	printf("\n\n");
 	
 	// ACT II: the Descriptions. Dramatis personae: several Description Strings, divers DescTypes; also Peasblossom, a Faerie.
+	#define LABEL_SIZE 64
+	char label[LABEL_SIZE];
+	int labelWidth = 0;
 	for (i = 0; i < sHandlerCount; i++)
 	{
 		handler = &sHandlers[i];
 		if (handler->hidden && !showHidden)  continue;
 		
-		#define LABEL_SIZE 16
-		char label[LABEL_SIZE];
-		if (handler->shortcut != '\0')
-		{
-			snprintf(label, LABEL_SIZE, "--%s, -%c", handler->keyword, handler->shortcut);
-		}
-		else
-		{
-			snprintf(label, LABEL_SIZE, "--%s", handler->keyword);
-		}
+		int length = GetHelpLabel(handler, label, LABEL_SIZE);
+		if (length > labelWidth)  labelWidth = length;
+	}
+	
+	for (i = 0; i < sHandlerCount; i++)
+	{
+		handler = &sHandlers[i];
+		if (handler->hidden && !showHidden)  continue;
 		
-		printf("%*s:  %s", LABEL_SIZE, label, handler->description);
+		GetHelpLabel(handler, label, LABEL_SIZE);
+		printf("%*s:  %s", labelWidth, label, handler->description);
 		
 		if (handler->descTypes != NULL)
 		{
@@ -794,11 +1935,16 @@ static bool PrintProgress(size_t numerator, size_t denominator, void *context)
 	size_t percentage = (numerator * 100) / denominator;
 	unsigned *last = context;
 	
-	if (percentage > *last)
+	// May be called for several outputs at once; only one caller prints each new percentage.
+	unsigned previous = __atomic_load_n(last, __ATOMIC_RELAXED);
+	while (percentage > previous)
 	{
-		printf("\r%zu %%", percentage);
-		fflush(stdout);
-		*last = percentage;
+		if (__atomic_compare_exchange_n(last, &previous, percentage, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		{
+			printf("\r%zu %%", percentage);
+			fflush(stdout);
+			break;
+		}
 	}
 	
 	return true;
@@ -0,0 +1,284 @@
+/*
+	CoordsBatchTest.c
+	planettool
+	
+	Checks the batch coordinate conversions in CoordsBatch.h against libm,
+	and batched sources against the scalar sources they must match.
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "CoordsBatch.h"
+#include "ReadLatLong.h"
+#include "ReadCube.h"
+
+
+// Not a multiple of any vector width, so that the scalar remainder is covered too.
+#define TEST_COUNT				1003
+
+// Documented in CoordsBatch.h, with a little room.
+#define MAX_LATITUDE_ERROR		4e-7
+#define MAX_LONGITUDE_ERROR		5e-7
+#define MAX_COMPONENT_ERROR		3e-7
+
+/*	Largest colour difference allowed between interpolating batch and scalar
+	sources. They are only compared away from the poles, where the scalar
+	VectorToCoordsRad() loses precision (see CoordsBatch.h).
+*/
+#define MAX_INTERPOLATED_ERROR	1e-3f
+#define MAX_INTERPOLATED_Y		0.97f		// About 76° of latitude.
+
+
+static unsigned sFailures;
+
+
+static float RandomIn(float min, float max)
+{
+	return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+
+/*	Random directions, not normalized, with the axes and the poles (where
+	longitude is defined as 0) first.
+*/
+static void MakeTestVectors(float *x, float *y, float *z, size_t count)
+{
+	static const float special[][3] =
+	{
+		{ 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 },
+		{ 1, 1, 1 }, { -1, -1, -1 }, { 1e-4f, 1, 0 }, { 0, -1, 1e-4f }, { -1, 0, -1e-6f }
+	};
+	size_t i;
+	
+	for (i = 0; i < count; i++)
+	{
+		if (i < sizeof special / sizeof *special)
+		{
+			x[i] = special[i][0];
+			y[i] = special[i][1];
+			z[i] = special[i][2];
+		}
+		else
+		{
+			x[i] = RandomIn(-2.0f, 2.0f);
+			y[i] = RandomIn(-2.0f, 2.0f);
+			z[i] = RandomIn(-2.0f, 2.0f);
+		}
+	}
+}
+
+
+static double AngleDifference(double a, double b)
+{
+	double d = fabs(a - b);
+	return fmin(d, fabs(d - 2.0 * M_PI));
+}
+
+
+static void TestVectorsToCoords(void)
+{
+	float x[TEST_COUNT], y[TEST_COUNT], z[TEST_COUNT], lat[TEST_COUNT], lon[TEST_COUNT];
+	MakeTestVectors(x, y, z, TEST_COUNT);
+	VectorsToCoordsRad(x, y, z, lat, lon, TEST_COUNT);
+	
+	double maxLatError = 0.0, maxLonError = 0.0;
+	size_t i;
+	for (i = 0; i < TEST_COUNT; i++)
+	{
+		double h = hypot(x[i], z[i]);
+		double latError = fabs(lat[i] - atan2(y[i], h));
+		double lonError = AngleDifference(lon[i], atan2(x[i], z[i]));
+	
+		maxLatError = fmax(maxLatError, latError);
+		maxLonError = fmax(maxLonError, lonError);
+		if (latError > MAX_LATITUDE_ERROR || lonError > MAX_LONGITUDE_ERROR)
+		{
+			fprintf(stderr, "FAIL: VectorsToCoordsRad(%g, %g, %g) gave (%g, %g), expected (%g, %g).\n", x[i], y[i], z[i], lat[i], lon[i], atan2(y[i], h), atan2(x[i], z[i]));
+			sFailures++;
+		}
+	}
+	
+	printf("VectorsToCoordsRad: maximum error %.3g in latitude, %.3g in longitude.\n", maxLatError, maxLonError);
+}
+
+
+static void TestVectorsFromCoords(void)
+{
+	float lat[TEST_COUNT], lon[TEST_COUNT], x[TEST_COUNT], y[TEST_COUNT], z[TEST_COUNT];
+	size_t i;
+	for (i = 0; i < TEST_COUNT; i++)
+	{
+		lat[i] = RandomIn(-M_PI / 2.0, M_PI / 2.0);
+		lon[i] = RandomIn(-2.0 * M_PI, 2.0 * M_PI);
+	}
+	lat[0] = M_PI / 2.0;
+	lat[1] = -M_PI / 2.0;
+	lon[2] = M_PI;
+	lon[3] = -M_PI;
+	
+	VectorsFromCoordsRad(lat, lon, x, y, z, TEST_COUNT);
+	
+	double maxError = 0.0;
+	for (i = 0; i < TEST_COUNT; i++)
+	{
+		double ex = sin(lon[i]) * cos(lat[i]), ey = sin(lat[i]), ez = cos(lon[i]) * cos(lat[i]);
+		double error = fmax(fabs(x[i] - ex), fmax(fabs(y[i] - ey), fabs(z[i] - ez)));
+	
+		maxError = fmax(maxError, error);
+		if (error > MAX_COMPONENT_ERROR)
+		{
+			fprintf(stderr, "FAIL: VectorsFromCoordsRad(%g, %g) gave (%g, %g, %g), expected (%g, %g, %g).\n", lat[i], lon[i], x[i], y[i], z[i], ex, ey, ez);
+			sFailures++;
+		}
+	}
+	
+	printf("VectorsFromCoordsRad: maximum error %.3g.\n", maxError);
+}
+
+
+static float ColorDifference(FPMColor a, FPMColor b)
+{
+	return fmaxf(fmaxf(fabsf(a.r - b.r), fabsf(a.g - b.g)), fmaxf(fabsf(a.b - b.b), fabsf(a.a - b.a)));
+}
+
+
+/*	Compare a batch source with its scalar source at the same coordinates.
+	If tolerance is 0, they must match exactly.
+*/
+static void CompareSource(const char *name, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *context, RenderFlags flags, const Coordinates *coords, size_t count, float tolerance)
+{
+	FPMColor batch[TEST_COUNT];
+	batchSource(coords, batch, count, flags, context);
+	
+	float maxError = 0.0f;
+	size_t i, mismatches = 0;
+	for (i = 0; i < count; i++)
+	{
+		float error = ColorDifference(batch[i], source(coords[i], flags, context));
+		maxError = fmaxf(maxError, error);
+		if (error > tolerance)  mismatches++;
+	}
+	
+	if (mismatches != 0)
+	{
+		fprintf(stderr, "FAIL: %s: %zu of %zu batch samples differ from scalar samples, by up to %g.\n", name, mismatches, count, maxError);
+		sFailures++;
+	}
+	else
+	{
+		printf("%s: batch matches scalar (maximum difference %g).\n", name, maxError);
+	}
+}
+
+
+/*	A smooth image, continuous across the date line of a latlong map, with
+	pixel-sized detail in one channel for the nearest-pixel tests.
+*/
+static FloatPixMapRef MakeTestImage(FPMDimension width, FPMDimension height)
+{
+	FloatPixMapRef pm = FPMCreateC(width, height);
+	if (pm == NULL)  return NULL;
+	
+	FPMDimension x, y;
+	for (y = 0; y < height; y++)
+	{
+		for (x = 0; x < width; x++)
+		{
+			float fx = (float)x / width, fy = (float)y / height;
+			FPMSetPixelCV(pm, x, y, 0.5f + 0.5f * sinf(fx * 2.0f * kPiF), fy, ((x ^ y) & 1) ? 1.0f : 0.0f, 1.0f);
+		}
+	}
+	
+	return pm;
+}
+
+
+static void TestSource(const char *name, FloatPixMapRef pm, SphericalPixelSourceConstructorFunction constructor, SphericalPixelSourceDestructorFunction destructor, RenderFlags flags, float tolerance)
+{
+	SphericalPixelSourceFunction source;
+	SphericalPixelBatchSourceFunction batchSource = NULL;
+	void *context = NULL;
+	if (!constructor(pm, flags, &source, &batchSource, &context) || batchSource == NULL)
+	{
+		fprintf(stderr, "FAIL: %s: could not set up source.\n", name);
+		sFailures++;
+		return;
+	}
+	
+	float x[TEST_COUNT], y[TEST_COUNT], z[TEST_COUNT];
+	MakeTestVectors(x, y, z, TEST_COUNT);
+	
+	Coordinates vectors[TEST_COUNT], latLongs[TEST_COUNT];
+	size_t i, vectorCount = 0;
+	for (i = 0; i < TEST_COUNT; i++)
+	{
+		Vector v = make_vector(x[i], y[i], z[i]);
+		if (tolerance == 0.0f || fabsf(v.y) < MAX_INTERPOLATED_Y * magnitude(v))
+		{
+			vectors[vectorCount++] = MakeCoordsVector(v);
+		}
+		latLongs[i] = MakeCoordsLatLongRad(RandomIn(-kPiF / 2.0f, kPiF / 2.0f), RandomIn(-kPiF, kPiF));
+	}
+	
+	char label[128];
+	snprintf(label, sizeof label, "%s, vectors", name);
+	CompareSource(label, source, batchSource, context, flags, vectors, vectorCount, tolerance);
+	snprintf(label, sizeof label, "%s, latitude/longitude", name);
+	CompareSource(label, source, batchSource, context, flags, latLongs, TEST_COUNT, tolerance);
+	
+	destructor(context);
+}
+
+
+int main(int argc, const char *argv[])
+{
+	FPMInit();
+	srand(1);
+	
+	TestVectorsToCoords();
+	TestVectorsFromCoords();
+	
+	FloatPixMapRef latLong = MakeTestImage(256, 128);
+	FloatPixMapRef cube = MakeTestImage(64, 64 * 6);
+	if (latLong == NULL || cube == NULL)
+	{
+		fprintf(stderr, "FAIL: could not create test images.\n");
+		return EXIT_FAILURE;
+	}
+	
+	TestSource("ReadLatLong", latLong, ReadLatLongConstructor, ReadLatLongDestructor, 0, MAX_INTERPOLATED_ERROR);
+	TestSource("ReadLatLong (fast)", latLong, ReadLatLongConstructor, ReadLatLongDestructor, kRenderFast, 0.0f);
+	TestSource("ReadCube", cube, ReadCubeConstructor, ReadCubeDestructor, 0, MAX_INTERPOLATED_ERROR);
+	
+	FPMRelease(&latLong);
+	FPMRelease(&cube);
+	
+	if (sFailures != 0)
+	{
+		fprintf(stderr, "%u CoordsBatch tests failed.\n", sFailures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
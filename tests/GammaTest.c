@@ -0,0 +1,206 @@
+/*
+	GammaTest.c
+	planettool
+	
+	Checks the gamma kernels in FPMGamma.c against powf(), including the
+	special values powf() defines results for, and the sRGB kernels against
+	the exact sRGB curves.
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "FPMGamma.h"
+
+
+// Documented in FPMGamma.c, for inputs in -1..1.
+#define MAX_RELATIVE_ERROR		4e-6f
+#define MAX_ABSOLUTE_ERROR		2.5e-7f
+
+// Documented in FPMGamma.c, for the sRGB curves over 0..1.
+#define MAX_SRGB_ERROR			3.5e-7
+#define SRGB_SWEEP_STEPS		(1 << 20)
+
+/*	Each value is put in every lane of a four-pixel vector and in the pixel
+	after it, so that with SSE2 both the vector and scalar kernels see it.
+*/
+#define PIXELS_PER_VALUE		5
+
+
+static unsigned sFailures;
+
+
+/*	Infinities and NaNs are built from bits, and looked for by testing bits,
+	because -ffast-math lets the compiler assume there are none.
+*/
+static float FloatFromBits(uint32_t bits)
+{
+	float result;
+	memcpy(&result, &bits, sizeof result);
+	return result;
+}
+
+
+static uint32_t BitsFromFloat(float value)
+{
+	uint32_t result;
+	memcpy(&result, &value, sizeof result);
+	return result;
+}
+
+
+static bool IsNaN(float value)
+{
+	return (BitsFromFloat(value) & 0x7FFFFFFF) > 0x7F800000;
+}
+
+
+static bool IsInfinite(float value)
+{
+	return (BitsFromFloat(value) & 0x7FFFFFFF) == 0x7F800000;
+}
+
+
+static bool Matches(float actual, float expected)
+{
+	if (IsNaN(expected))  return IsNaN(actual);
+	if (IsNaN(actual))  return false;
+	if (IsInfinite(expected) || IsInfinite(actual))  return BitsFromFloat(actual) == BitsFromFloat(expected);
+	
+	float error = fabsf(actual - expected);
+	return error <= MAX_ABSOLUTE_ERROR || error <= MAX_RELATIVE_ERROR * fabsf(expected);
+}
+
+
+static void TestGamma(float gamma, const float *values, size_t count)
+{
+	FPMColor pixels[PIXELS_PER_VALUE];
+	size_t i, j;
+	unsigned failures = sFailures;
+	
+	for (i = 0; i < count; i++)
+	{
+		for (j = 0; j < PIXELS_PER_VALUE; j++)  pixels[j] = FPMMakeColor(values[i], values[i], values[i], 0.5f);
+		FPMApplyGammaToPixels(pixels, PIXELS_PER_VALUE, gamma);
+		
+		float expected = powf(values[i], gamma);
+		for (j = 0; j < PIXELS_PER_VALUE; j++)
+		{
+			if (!Matches(pixels[j].r, expected) || !Matches(pixels[j].g, expected) || !Matches(pixels[j].b, expected) || pixels[j].a != 0.5f)
+			{
+				fprintf(stderr, "FAIL: %s gamma %g applied to %g gave %g, expected %g (powf).\n", (j < 4) ? "Vector" : "Scalar", gamma, values[i], pixels[j].r, expected);
+				sFailures++;
+				break;
+			}
+		}
+	}
+	
+	if (sFailures == failures)  printf("Gamma %g: matches powf().\n", gamma);
+}
+
+
+static double ExactLinearToSRGB(double value)
+{
+	return (value <= 0.0031308) ? value * 12.92 : 1.055 * pow(value, 1.0 / 2.4) - 0.055;
+}
+
+
+static double ExactSRGBToLinear(double value)
+{
+	return (value <= 0.04045) ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+}
+
+
+/*	Apply an sRGB kernel to SRGB_SWEEP_STEPS + 1 values evenly spread over
+	0..1, in batches of PIXELS_PER_VALUE pixels each holding one value, and
+	check the results against the exact curve in double precision.
+*/
+static void TestSRGB(const char *name, void (*kernel)(FPMColor *pixels, size_t count), double (*exact)(double value))
+{
+	FPMColor pixels[PIXELS_PER_VALUE];
+	double worst = 0.0;
+	float worstValue = 0.0f;
+	size_t i, j;
+	
+	for (i = 0; i <= SRGB_SWEEP_STEPS; i++)
+	{
+		float value = (float)i / SRGB_SWEEP_STEPS;
+		for (j = 0; j < PIXELS_PER_VALUE; j++)  pixels[j] = FPMMakeColor(value, value, value, 0.5f);
+		kernel(pixels, PIXELS_PER_VALUE);
+		
+		double expected = exact(value);
+		for (j = 0; j < PIXELS_PER_VALUE; j++)
+		{
+			double error = fmax(fabs(pixels[j].r - expected), fmax(fabs(pixels[j].g - expected), fabs(pixels[j].b - expected)));
+			if (!(error <= worst))
+			{
+				worst = error;
+				worstValue = value;
+			}
+			if (pixels[j].a != 0.5f)  worst = INFINITY;
+		}
+	}
+	
+	if (!(worst <= MAX_SRGB_ERROR))
+	{
+		fprintf(stderr, "FAIL: %s is off the exact curve by up to %g (at %g; no more than %g allowed).\n", name, worst, worstValue, MAX_SRGB_ERROR);
+		sFailures++;
+	}
+	else
+	{
+		printf("%s: within %g of the exact curve.\n", name, worst);
+	}
+}
+
+
+int main(int argc, const char *argv[])
+{
+	FPMInit();
+	
+	const float values[] =
+	{
+		0.0f, -0.0f, 1.0f, 0.5f, 0.25f, 1e-3f, 1e-30f,
+		-1.0f, -0.5f, -1e-3f,
+		FloatFromBits(0x7F800000), FloatFromBits(0xFF800000),
+		FloatFromBits(0x7FC00000), FloatFromBits(0xFFC00000)
+	};
+	const float gammas[] = { 1.0f / 2.2f, 2.2f, 1.8f / 2.2f, 2.4f, 2.0f, 3.0f, 0.5f };
+	size_t i;
+	
+	for (i = 0; i < sizeof gammas / sizeof *gammas; i++)
+	{
+		TestGamma(gammas[i], values, sizeof values / sizeof *values);
+	}
+	
+	TestSRGB("Linear to sRGB", FPMLinearToSRGBPixels, ExactLinearToSRGB);
+	TestSRGB("sRGB to linear", FPMSRGBToLinearPixels, ExactSRGBToLinear);
+	
+	if (sFailures != 0)
+	{
+		fprintf(stderr, "%u gamma tests failed.\n", sFailures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
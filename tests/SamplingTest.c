@@ -0,0 +1,359 @@
+/*
+	SamplingTest.c
+	planettool
+	
+	Checks that the sampling shortcuts sinks offer stay close to full
+	rendering.
+	
+	
+	Copyright © 2013 Jens Ayton
+ 
+	Permission is hereby granted, free of charge, to any person obtaining a
+	copy of this software and associated documentation files (the “Software”),
+	to deal in the Software without restriction, including without limitation
+	the rights to use, copy, modify, merge, publish, distribute, sublicense,
+	and/or sell copies of the Software, and to permit persons to whom the
+	Software is furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+	THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+	FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+	DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "ReadLatLong.h"
+#include "MatrixTransformer.h"
+#include "RenderToLatLong.h"
+
+
+#define SOURCE_WIDTH			512
+#define OUTPUT_SIZE				128
+
+// Largest difference allowed from full rendering with kRenderSharedSamples, in eight-bit sRGB steps.
+#define MAX_SHARED_ERROR		1.0f
+
+/*	With kRenderAdaptive at the threshold suggested by --help, most pixels
+	must be within two steps; the rest, where detail is finer than the
+	probe, within the bound the help text gives.
+*/
+#define ADAPTIVE_THRESHOLD		0.0001f
+#define ADAPTIVE_ERROR			2.0f
+#define MIN_ADAPTIVE_FRACTION	0.99f
+#define MAX_ADAPTIVE_ERROR		35.0f
+
+/*	kRenderPrefiltered filters differently from full rendering, so the
+	images are not compared pixel by pixel. Instead, a grating of light and
+	dark bands is rendered both ways; filtering may soften the bands but
+	must not move them, so the prefiltered bands must line up with the full
+	ones to within MAX_PREFILTER_SHIFT output pixels. The output is small so
+	that the coarse levels of the mipmap are used.
+*/
+#define GRATING_SOURCE_WIDTH	2048
+#define GRATING_OUTPUT_SIZE		32
+#define GRATING_PERIOD			8		// In output pixels.
+#define MAX_PREFILTER_SHIFT		0.05f
+
+static unsigned sFailures;
+
+
+static float Hash(unsigned x, unsigned y, unsigned seed)
+{
+	unsigned n = x * 374761393u + y * 668265263u + seed * 2246822519u;
+	n = (n ^ (n >> 13)) * 1274126177u;
+	return (float)((n ^ (n >> 16)) & 0xFFFFFF) / (float)0xFFFFFF;
+}
+
+
+//	Smoothly interpolated noise, repeating every period cells horizontally.
+static float ValueNoise(float x, float y, unsigned seed, unsigned period)
+{
+	float fx = floorf(x), fy = floorf(y);
+	unsigned x0 = (unsigned)fx % period, x1 = (x0 + 1) % period, y0 = fy;
+	float ax = x - fx, ay = y - fy;
+	ax = ax * ax * (3.0f - 2.0f * ax);
+	ay = ay * ay * (3.0f - 2.0f * ay);
+	
+	float top = Hash(x0, y0, seed) * (1.0f - ax) + Hash(x1, y0, seed) * ax;
+	float bottom = Hash(x0, y0 + 1, seed) * (1.0f - ax) + Hash(x1, y0 + 1, seed) * ax;
+	return top * (1.0f - ay) + bottom * ay;
+}
+
+
+/*	A latlong map looking roughly like a planet: fractal noise with detail
+	down to the pixel level, with dark seas and lighter land.
+*/
+static FloatPixMapRef MakePlanetImage(FPMDimension width)
+{
+	FPMDimension height = width / 2;
+	FloatPixMapRef pm = FPMCreateC(width, height);
+	if (pm == NULL)  return NULL;
+	
+	FPMDimension x, y;
+	for (y = 0; y < height; y++)
+	{
+		for (x = 0; x < width; x++)
+		{
+			float fx = (float)x / width * 8.0f, fy = (float)y / height * 4.0f;
+			float value = 0.0f, amplitude = 0.5f;
+			unsigned octave, period = 8;
+			for (octave = 0; (period >> 1) < width; octave++)
+			{
+				value += amplitude * ValueNoise(fx, fy, octave, period);
+				fx *= 2.0f;
+				fy *= 2.0f;
+				period *= 2;
+				amplitude *= 0.5f;
+			}
+	
+			if (value < 0.5f)  FPMSetPixelCV(pm, x, y, 0.02f + 0.1f * value, 0.05f + 0.2f * value, 0.2f + 0.6f * value, 1.0f);
+			else  FPMSetPixelCV(pm, x, y, 0.2f + 0.7f * (value - 0.5f), 0.3f + 0.4f * (value - 0.5f), 0.1f + 0.2f * (value - 0.5f), 1.0f);
+		}
+	}
+	
+	return pm;
+}
+
+
+/*	Smooth bands along both axes, repeating every GRATING_PERIOD pixels
+	once the image is reduced to GRATING_OUTPUT_SIZE rows.
+*/
+static FloatPixMapRef MakeGratingImage(FPMDimension width)
+{
+	FPMDimension height = width / 2;
+	FloatPixMapRef pm = FPMCreateC(width, height);
+	if (pm == NULL)  return NULL;
+	
+	float frequency = 2.0f * kPiF * GRATING_OUTPUT_SIZE / (height * GRATING_PERIOD);
+	FPMDimension x, y;
+	for (y = 0; y < height; y++)
+	{
+		for (x = 0; x < width; x++)
+		{
+			float value = 0.45f + 0.2f * cosf(((float)x + 0.5f) * frequency) + 0.2f * cosf(((float)y + 0.5f) * frequency);
+			FPMSetPixelCV(pm, x, y, value, value, value, 1.0f);
+		}
+	}
+	
+	return pm;
+}
+
+
+static float ToSRGBSteps(float value)
+{
+	value = fminf(fmaxf(value, 0.0f), 1.0f);
+	value = (value <= 0.0031308f) ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+	return value * 255.0f;
+}
+
+
+/*	Largest difference between two images, in eight-bit sRGB steps. If
+	closeFraction is not NULL, it is set to the fraction of pixels which
+	differ by no more than closeLimit.
+*/
+static float ImageDifference(FloatPixMapRef a, FloatPixMapRef b, float closeLimit, float *closeFraction)
+{
+	float result = 0.0f;
+	size_t closeCount = 0;
+	FPMDimension x, y;
+	for (y = 0; y < FPMGetHeight(a); y++)
+	{
+		for (x = 0; x < FPMGetWidth(a); x++)
+		{
+			FPMColor ca = FPMGetPixelC(a, x, y), cb = FPMGetPixelC(b, x, y);
+			float difference = fabsf(ToSRGBSteps(ca.r) - ToSRGBSteps(cb.r));
+			difference = fmaxf(difference, fabsf(ToSRGBSteps(ca.g) - ToSRGBSteps(cb.g)));
+			difference = fmaxf(difference, fabsf(ToSRGBSteps(ca.b) - ToSRGBSteps(cb.b)));
+			difference = fmaxf(difference, fabsf(ca.a - cb.a) * 255.0f);
+			
+			result = fmaxf(result, difference);
+			if (difference <= closeLimit)  closeCount++;
+		}
+	}
+	
+	if (closeFraction != NULL)  *closeFraction = (float)closeCount / ((float)FPMGetWidth(a) * FPMGetHeight(a));
+	return result;
+}
+
+
+/*	The position of the grating in pm along x (vertical == false) or y, in
+	pixels, modulo GRATING_PERIOD: the phase of the brightness along that
+	axis at the grating's frequency. Only the middle half of the rows is
+	used, away from the poles.
+*/
+static float GetGratingPosition(FloatPixMapRef pm, bool vertical)
+{
+	FPMCoordinate width = FPMGetWidth(pm), height = FPMGetHeight(pm);
+	FPMCoordinate x, y;
+	double sumCos = 0.0, sumSin = 0.0;
+	
+	for (y = height / 4; y < height * 3 / 4; y++)
+	{
+		for (x = 0; x < width; x++)
+		{
+			FPMColor c = FPMGetPixelC(pm, x, y);
+			double angle = 2.0 * M_PI * ((vertical ? y : x) + 0.5) / GRATING_PERIOD;
+			sumCos += (c.r + c.g + c.b) * cos(angle);
+			sumSin += (c.r + c.g + c.b) * sin(angle);
+		}
+	}
+	
+	return atan2(sumSin, sumCos) * GRATING_PERIOD / (2.0 * M_PI);
+}
+
+
+//	How far the grating in a is displaced from that in b, in pixels.
+static float EstimateShift(FloatPixMapRef a, FloatPixMapRef b, bool vertical)
+{
+	float shift = GetGratingPosition(a, vertical) - GetGratingPosition(b, vertical);
+	if (shift > GRATING_PERIOD * 0.5f)  shift -= GRATING_PERIOD;
+	if (shift < GRATING_PERIOD * -0.5f)  shift += GRATING_PERIOD;
+	return shift;
+}
+
+
+static void ReportError(const char *message, void *context)
+{
+	fprintf(stderr, "%s\n", message);
+}
+
+
+/*	Render the source to latlong with and without extraFlags, and check
+	that the results differ by no more than tolerance, and that at least
+	minCloseFraction of the pixels differ by no more than closeTolerance.
+*/
+static void CompareLatLong(const char *name, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *context, RenderFlags extraFlags, const RenderOptions *options, float tolerance, float closeTolerance, float minCloseFraction)
+{
+	FloatPixMapRef full = RenderToLatLong(OUTPUT_SIZE, 0, NULL, source, batchSource, context, NULL, ReportError, NULL);
+	FloatPixMapRef shortcut = RenderToLatLong(OUTPUT_SIZE, extraFlags, options, source, batchSource, context, NULL, ReportError, NULL);
+	
+	if (full == NULL || shortcut == NULL)
+	{
+		fprintf(stderr, "FAIL: %s: rendering failed.\n", name);
+		sFailures++;
+	}
+	else
+	{
+		float closeFraction;
+		float difference = ImageDifference(full, shortcut, closeTolerance, &closeFraction);
+		if (difference > tolerance)
+		{
+			fprintf(stderr, "FAIL: %s: differs from full rendering by up to %g eight-bit steps (no more than %g allowed).\n", name, difference, tolerance);
+			sFailures++;
+		}
+		else if (closeFraction < minCloseFraction)
+		{
+			fprintf(stderr, "FAIL: %s: only %.2f%% of pixels are within %g eight-bit steps of full rendering (at least %.2f%% required).\n", name, closeFraction * 100.0f, closeTolerance, minCloseFraction * 100.0f);
+			sFailures++;
+		}
+		else
+		{
+			printf("%s: differs from full rendering by up to %g eight-bit steps; %.2f%% of pixels within %g.\n", name, difference, closeFraction * 100.0f, closeTolerance);
+		}
+	}
+	
+	FPMRelease(&full);
+	FPMRelease(&shortcut);
+}
+
+
+/*	Render the grating at full rate from source and with kRenderPrefiltered from
+	prefilteredSource, a reader for the same image set up with
+	kRenderPrefiltered, and check that the two line up.
+*/
+static void ComparePrefiltered(const char *name, SphericalPixelSourceFunction source, SphericalPixelBatchSourceFunction batchSource, void *context, SphericalPixelSourceFunction prefilteredSource, SphericalPixelBatchSourceFunction prefilteredBatchSource, void *prefilteredContext)
+{
+	FloatPixMapRef full = RenderToLatLong(GRATING_OUTPUT_SIZE, 0, NULL, source, batchSource, context, NULL, ReportError, NULL);
+	FloatPixMapRef prefiltered = RenderToLatLong(GRATING_OUTPUT_SIZE, kRenderPrefiltered, NULL, prefilteredSource, prefilteredBatchSource, prefilteredContext, NULL, ReportError, NULL);
+	
+	if (full == NULL || prefiltered == NULL)
+	{
+		fprintf(stderr, "FAIL: %s: rendering failed.\n", name);
+		sFailures++;
+	}
+	else
+	{
+		float shiftX = EstimateShift(prefiltered, full, false);
+		float shiftY = EstimateShift(prefiltered, full, true);
+		if (fabsf(shiftX) > MAX_PREFILTER_SHIFT || fabsf(shiftY) > MAX_PREFILTER_SHIFT)
+		{
+			fprintf(stderr, "FAIL: %s: displaced from full rendering by (%g, %g) pixels (no more than %g allowed).\n", name, shiftX, shiftY, MAX_PREFILTER_SHIFT);
+			sFailures++;
+		}
+		else
+		{
+			printf("%s: displaced from full rendering by (%g, %g) pixels.\n", name, shiftX, shiftY);
+		}
+	}
+	
+	FPMRelease(&full);
+	FPMRelease(&prefiltered);
+}
+
+
+int main(int argc, const char *argv[])
+{
+	FPMInit();
+	
+	FloatPixMapRef image = MakePlanetImage(SOURCE_WIDTH);
+	SphericalPixelSourceFunction source;
+	SphericalPixelBatchSourceFunction batchSource = NULL;
+	void *context = NULL;
+	if (image == NULL || !ReadLatLongConstructor(image, 0, &source, &batchSource, &context))
+	{
+		fprintf(stderr, "FAIL: could not set up source.\n");
+		return EXIT_FAILURE;
+	}
+	
+	OOMatrix transform = OOMatrixRotateZ(OOMatrixRotateX(kIdentityMatrix, 0.3f), 0.5f);
+	SphericalPixelSourceFunction rotatedSource = MatrixTransformer;
+	SphericalPixelBatchSourceFunction rotatedBatchSource = MatrixTransformerBatch;
+	void *rotatedContext = NULL;
+	if (!MatrixTransformerSetUp(source, batchSource, NULL, context, transform, &rotatedContext))
+	{
+		fprintf(stderr, "FAIL: could not set up rotation.\n");
+		return EXIT_FAILURE;
+	}
+	
+	CompareLatLong("Shared samples", source, batchSource, context, kRenderSharedSamples, NULL, MAX_SHARED_ERROR, MAX_SHARED_ERROR, 1.0f);
+	CompareLatLong("Shared samples, rotated", rotatedSource, rotatedBatchSource, rotatedContext, kRenderSharedSamples, NULL, MAX_SHARED_ERROR, MAX_SHARED_ERROR, 1.0f);
+	
+	RenderOptions adaptiveOptions = { .adaptiveThreshold = ADAPTIVE_THRESHOLD };
+	CompareLatLong("Adaptive", source, batchSource, context, kRenderAdaptive, &adaptiveOptions, MAX_ADAPTIVE_ERROR, ADAPTIVE_ERROR, MIN_ADAPTIVE_FRACTION);
+	CompareLatLong("Adaptive, rotated", rotatedSource, rotatedBatchSource, rotatedContext, kRenderAdaptive, &adaptiveOptions, MAX_ADAPTIVE_ERROR, ADAPTIVE_ERROR, MIN_ADAPTIVE_FRACTION);
+	
+	MatrixTransformerDestructor(rotatedContext);
+	ReadLatLongDestructor(context);
+	FPMRelease(&image);
+	
+	FloatPixMapRef grating = MakeGratingImage(GRATING_SOURCE_WIDTH);
+	void *gratingContext = NULL, *prefilteredGratingContext = NULL;
+	SphericalPixelSourceFunction prefilteredSource;
+	SphericalPixelBatchSourceFunction prefilteredBatchSource = NULL;
+	if (grating == NULL || !ReadLatLongConstructor(grating, 0, &source, &batchSource, &gratingContext) || !ReadLatLongConstructor(grating, kRenderPrefiltered, &prefilteredSource, &prefilteredBatchSource, &prefilteredGratingContext))
+	{
+		fprintf(stderr, "FAIL: could not set up grating source.\n");
+		return EXIT_FAILURE;
+	}
+	
+	ComparePrefiltered("Prefiltered", source, batchSource, gratingContext, prefilteredSource, prefilteredBatchSource, prefilteredGratingContext);
+	
+	ReadLatLongDestructor(gratingContext);
+	ReadLatLongDestructor(prefilteredGratingContext);
+	FPMRelease(&grating);
+	
+	if (sFailures != 0)
+	{
+		fprintf(stderr, "%u sampling tests failed.\n", sFailures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}